@@ -0,0 +1,451 @@
+#!/usr/bin/env python3
+
+import os
+import sys
+import json
+import time
+import subprocess
+from datetime import datetime
+
+tab  = '\t'
+endl = '\n'
+arg = sys.argv[1:]
+
+usage = 'python ' + __file__ + ' ' + '<stages.tsv> <threads> <memory_gb (0: total memory of this node)> [clean_reads_basic_info.txt]'
+argc  = 3
+
+TimeFormat = '%m/%d/%Y %H:%M:%S'
+
+# Runs the stages listed in stages.tsv (written by nextsv3.py) as their
+# dependencies allow. A table with an unknown dependency or a dependency cycle is
+# rejected before anything runs. The free cores are split among the stages that are ready,
+# within the thread range of each, and a stage is only started if its estimated
+# memory fits next to the running ones. A stage gets its thread count in
+# NEXTSV_THREADS and writes its output to stage_logs/<name>.log. After a stage
+# succeeds, the size and mtime of its outputs are recorded in
+# stage_status/<name>.done; on a rerun it is skipped if they are unchanged and
+# none of the stages it depends on was run again. The start, end and wall time
+# of each stage go to stage_timing.tsv.
+#
+# While a stage runs, its process tree is sampled from /proc every second: CPU
+# time, threads, resident memory and bytes read from and written to storage.
+# When it ends, its CPU time, largest process and I/O are taken from wait4(),
+# which counts every process of the tree. stage_reports/<name>.json holds these
+# numbers with a timeline of the samples, and stage_reports/run_summary.json
+# holds them for the whole run. If the QC file of the clean reads is given, the
+# throughput of each stage is given in bases per second of wall time.
+
+timeline_interval = 5 # seconds between two points of the timeline of a stage
+clock_ticks = os.sysconf('SC_CLK_TCK')
+page_size   = os.sysconf('SC_PAGE_SIZE')
+
+class Stage:
+    def __init__(self, fields):
+        self.name            = fields[0]
+        self.shell_file      = fields[1]
+        self.dependency_list = [] if fields[2] == '.' else fields[2].split(',')
+        self.output_list     = fields[3].split(',')
+        self.min_threads     = int(fields[4])
+        self.max_threads     = int(fields[5])
+        self.memory_gb       = float(fields[6])
+        self.memory_gb_per_thread = float(fields[7])
+
+        self.status    = 'waiting' # waiting, running, done, skipped, failed
+        self.threads   = 0
+        self.process   = None
+        self.log_fp    = None
+        self.start_time = None
+        self.end_time   = None
+
+        self.rusage      = None
+        self.peak_rss_gb = 0.0 # largest sum of the resident memory of the process tree
+        self.last_point  = (0.0, 0.0) # seconds since start and CPU seconds at the last timeline point
+        self.timeline    = []
+
+    def memory(self, threads):
+        return self.memory_gb + self.memory_gb_per_thread * threads
+
+def main():
+    if len(arg) < argc:
+        print (usage)
+        sys.exit(1)
+
+    stage_table_file = os.path.abspath(arg.pop(0))
+    total_threads = max(1, int(arg.pop(0)))
+    total_memory = float(arg.pop(0))
+    if total_memory <= 0:
+        total_memory = node_memory_gb()
+    qc_file = os.path.abspath(arg.pop(0)) if len(arg) > 0 else None
+
+    work_dir   = os.path.split(stage_table_file)[0]
+    status_dir = os.path.join(work_dir, 'stage_status')
+    log_dir    = os.path.join(work_dir, 'stage_logs')
+    report_dir = os.path.join(work_dir, 'stage_reports')
+    os.makedirs(status_dir, exist_ok=True)
+    os.makedirs(log_dir, exist_ok=True)
+    os.makedirs(report_dir, exist_ok=True)
+
+    stage_list = []
+    for line in open(stage_table_file):
+        if line[0] == '#' or line.strip() == '':
+            continue
+        stage_list.append(Stage(line.rstrip(endl).split(tab)))
+    stage_dict = dict([(stage.name, stage) for stage in stage_list])
+    check_stage_table(stage_list, stage_dict, stage_table_file)
+
+    timing_fp = open(os.path.join(work_dir, 'stage_timing.tsv'), 'w')
+    timing_fp.write(tab.join(['#stage', 'status', 'threads', 'start', 'end', 'wall_seconds', 'cpu_seconds', 'thread_utilization', 'peak_rss_gb', 'read_gb', 'write_gb', 'bases_per_second']) + endl)
+    myprint(f'NOTICE: running {len(stage_list)} stages with {total_threads} threads and {total_memory:.1f} GB memory')
+
+    run_start_time = datetime.now()
+    run_peak_rss_gb = 0.0
+    has_failed = False
+    while True:
+        running_list = [stage for stage in stage_list if stage.status == 'running']
+        if len(running_list) > 0:
+            process_dict = read_process_table()
+            now = datetime.now()
+            run_peak_rss_gb = max(run_peak_rss_gb, sum([sample_stage(stage, process_dict, now) for stage in running_list]))
+
+        for stage in running_list:
+            pid, wait_status, rusage = os.wait4(stage.process.pid, os.WNOHANG)
+            if pid == 0:
+                continue
+            stage.process.returncode = exit_code(wait_status)
+            stage.rusage = rusage
+            finish_stage(stage, status_dir)
+            write_report(stage, report_dir, total_bases(qc_file))
+            write_timing(timing_fp, stage, total_bases(qc_file))
+            if stage.status == 'failed':
+                has_failed = True
+
+        running_list = [stage for stage in stage_list if stage.status == 'running']
+        if has_failed:
+            if len(running_list) == 0:
+                break
+            time.sleep(1)
+            continue
+
+        # a stage whose dependencies all were skipped may be skipped too
+        ready_list = []
+        for stage in stage_list:
+            if stage.status != 'waiting':
+                continue
+            dependency_status_list = [stage_dict[name].status for name in stage.dependency_list]
+            if len([status for status in dependency_status_list if status not in ['done', 'skipped']]) > 0:
+                continue
+            if 'done' not in dependency_status_list and outputs_are_unchanged(stage, status_dir):
+                stage.status = 'skipped'
+                myprint(f'NOTICE: skipping stage {stage.name}: its outputs are up to date')
+                write_timing(timing_fp, stage, None)
+                continue
+            ready_list.append(stage)
+
+        if len(ready_list) == 0 and len(running_list) == 0:
+            break
+
+        free_threads = total_threads - sum([stage.threads for stage in running_list])
+        free_memory  = total_memory - sum([stage.memory(stage.threads) for stage in running_list])
+        for i in range(0, len(ready_list)):
+            stage = ready_list[i]
+            max_threads = stage.max_threads if stage.max_threads > 0 else total_threads
+            threads = min(max_threads, max(stage.min_threads, free_threads // (len(ready_list) - i)))
+            threads = min(threads, total_threads)
+            is_idle = len(running_list) == 0
+            if not is_idle and (threads > free_threads or stage.memory(threads) > free_memory):
+                continue
+            if is_idle and stage.memory(threads) > free_memory:
+                myprint(f'WARNING: stage {stage.name} may need {stage.memory(threads):.1f} GB memory, more than {total_memory:.1f} GB')
+            start_stage(stage, threads, status_dir, log_dir)
+            running_list.append(stage)
+            free_threads -= threads
+            free_memory  -= stage.memory(threads)
+
+        time.sleep(1)
+
+    waiting_list = [stage.name for stage in stage_list if stage.status == 'waiting']
+    if not has_failed and len(waiting_list) > 0: # should not happen after check_stage_table()
+        myprint(f'ERROR: stage(s) never became ready: {", ".join(waiting_list)}')
+        has_failed = True
+
+    timing_fp.close()
+    write_run_summary(stage_list, run_start_time, run_peak_rss_gb, total_threads, total_bases(qc_file), report_dir)
+
+    if has_failed:
+        failed_list = [stage.name for stage in stage_list if stage.status == 'failed']
+        myprint(f'ERROR: stage(s) failed: {", ".join(failed_list)}. Please check the logs in {log_dir}')
+        sys.exit(1)
+
+    myprint('NOTICE: all stages are done')
+    return
+
+def check_stage_table(stage_list, stage_dict, stage_table_file):
+
+    # every dependency must be a stage of the table, and the dependencies must not form a cycle
+    error_list = []
+    if len(stage_dict) < len(stage_list):
+        error_list.append('a stage name is used more than once')
+    for stage in stage_list:
+        for name in stage.dependency_list:
+            if name not in stage_dict:
+                error_list.append(f'stage {stage.name} depends on unknown stage {name}')
+
+    state_dict = {} # name -> 1: being visited, 2: done
+    for stage in stage_list:
+        path = [(stage.name, iter(stage.dependency_list))]
+        while len(path) > 0 and state_dict.get(stage.name) != 2:
+            name, dependency_iter = path[-1]
+            state_dict[name] = 1
+            dependency = next(dependency_iter, None)
+            if dependency is None:
+                state_dict[name] = 2
+                path.pop()
+            elif dependency not in stage_dict or state_dict.get(dependency) == 2:
+                continue
+            elif state_dict.get(dependency) == 1:
+                cycle = [item[0] for item in path]
+                cycle = cycle[cycle.index(dependency):] + [dependency]
+                error_list.append(f'dependency cycle: {" -> ".join(cycle)}')
+                break
+            else:
+                path.append((dependency, iter(stage_dict[dependency].dependency_list)))
+        if len(error_list) > 0:
+            break
+
+    if len(error_list) > 0:
+        for error in error_list:
+            myprint(f'ERROR: {stage_table_file}: {error}')
+        sys.exit(1)
+
+    return
+
+def exit_code(wait_status):
+
+    # as subprocess sets returncode: the exit status, or minus the signal that killed the process
+    if os.WIFSIGNALED(wait_status):
+        return -os.WTERMSIG(wait_status)
+
+    return os.WEXITSTATUS(wait_status)
+
+def node_memory_gb():
+
+    for line in open('/proc/meminfo'):
+        if line.startswith('MemTotal:'):
+            return int(line.split()[1]) / 1e6
+    return 0.0
+
+def output_signature(output_file):
+
+    output_stat = os.stat(output_file)
+    return f'{output_file}{tab}{output_stat.st_size}{tab}{output_stat.st_mtime_ns}'
+
+def outputs_are_unchanged(stage, status_dir):
+
+    done_file = os.path.join(status_dir, f'{stage.name}.done')
+    if not os.path.exists(done_file):
+        return False
+    signature_list = [line.rstrip(endl) for line in open(done_file)]
+    for output_file in stage.output_list:
+        if not os.path.exists(output_file) or output_signature(output_file) not in signature_list:
+            return False
+
+    return True
+
+def start_stage(stage, threads, status_dir, log_dir):
+
+    done_file = os.path.join(status_dir, f'{stage.name}.done')
+    if os.path.exists(done_file):
+        os.remove(done_file)
+
+    env = dict(os.environ)
+    env['NEXTSV_THREADS'] = str(threads)
+    stage.log_fp = open(os.path.join(log_dir, f'{stage.name}.log'), 'w')
+    stage.threads = threads
+    stage.start_time = datetime.now()
+    stage.process = subprocess.Popen(['bash', stage.shell_file], stdout=stage.log_fp, stderr=subprocess.STDOUT, env=env)
+    stage.status = 'running'
+    myprint(f'NOTICE: started stage {stage.name} with {threads} threads')
+
+    return
+
+def finish_stage(stage, status_dir):
+
+    stage.end_time = datetime.now()
+    stage.log_fp.close()
+    wall_seconds = (stage.end_time - stage.start_time).total_seconds()
+    missing_output_list = [output_file for output_file in stage.output_list if not os.path.exists(output_file) or os.path.getsize(output_file) == 0]
+
+    if stage.process.returncode != 0:
+        stage.status = 'failed'
+        myprint(f'ERROR: stage {stage.name} failed with exit code {stage.process.returncode} after {wall_seconds:.0f} seconds')
+    elif len(missing_output_list) > 0:
+        stage.status = 'failed'
+        myprint(f'ERROR: stage {stage.name} did not write {", ".join(missing_output_list)}')
+    else:
+        stage.status = 'done'
+        done_fp = open(os.path.join(status_dir, f'{stage.name}.done'), 'w')
+        for output_file in stage.output_list:
+            done_fp.write(output_signature(output_file) + endl)
+        done_fp.close()
+        myprint(f'NOTICE: finished stage {stage.name} in {wall_seconds:.0f} seconds')
+
+    return
+
+def write_timing(timing_fp, stage, bases):
+
+    if stage.start_time is None:
+        timing_fp.write(tab.join([stage.name, stage.status, '0', '.', '.', '0', '0', '.', '0', '0', '0', '.']) + endl)
+    else:
+        usage = stage_usage(stage, bases)
+        bases_per_second = '.' if usage['bases_per_second'] is None else f'{usage["bases_per_second"]:.0f}'
+        timing_fp.write(tab.join([stage.name, stage.status, str(stage.threads), usage['start'], usage['end'], f'{usage["wall_seconds"]:.1f}', f'{usage["cpu_seconds"]:.1f}',
+                                  f'{usage["thread_utilization"]:.2f}', f'{usage["peak_rss_gb"]:.2f}', f'{usage["read_gb"]:.2f}', f'{usage["write_gb"]:.2f}', bases_per_second]) + endl)
+    timing_fp.flush()
+
+    return
+
+def read_process_table():
+
+    # pid -> (parent pid, CPU seconds of the process and of its children it has reaped, threads, resident bytes)
+    process_dict = {}
+    for entry in os.listdir('/proc'):
+        if not entry.isdigit():
+            continue
+        try:
+            stat = open(f'/proc/{entry}/stat').read()
+        except OSError: # the process has exited
+            continue
+        fields = stat[stat.rfind(')') + 2:].split() # fields from the state on; the command name may hold spaces
+        cpu_seconds = sum([int(ticks) for ticks in fields[11:15]]) / clock_ticks # utime, stime, cutime, cstime
+        process_dict[int(entry)] = (int(fields[1]), cpu_seconds, int(fields[17]), int(fields[21]) * page_size)
+
+    return process_dict
+
+def read_io_bytes(pid):
+
+    # storage bytes read and written by the process and by its children it has reaped
+    io_dict = {}
+    try:
+        for line in open(f'/proc/{pid}/io'):
+            key, value = line.split(':')
+            io_dict[key] = int(value)
+    except (OSError, ValueError):
+        pass
+
+    return io_dict.get('read_bytes', 0), io_dict.get('write_bytes', 0)
+
+def sample_stage(stage, process_dict, now):
+
+    # A process that has exited is counted in its parent once reaped, so summing
+    # the live processes of the tree counts each one once.
+    children_dict = {}
+    for pid in process_dict:
+        children_dict.setdefault(process_dict[pid][0], []).append(pid)
+    pid_list = [stage.process.pid] if stage.process.pid in process_dict else []
+    i = 0
+    while i < len(pid_list):
+        pid_list += children_dict.get(pid_list[i], [])
+        i += 1
+    if len(pid_list) == 0:
+        return 0.0
+
+    cpu_seconds = sum([process_dict[pid][1] for pid in pid_list])
+    threads     = sum([process_dict[pid][2] for pid in pid_list])
+    rss_gb      = sum([process_dict[pid][3] for pid in pid_list]) / 1e9
+    stage.peak_rss_gb = max(stage.peak_rss_gb, rss_gb)
+
+    elapsed = (now - stage.start_time).total_seconds()
+    if elapsed - stage.last_point[0] >= timeline_interval:
+        io_list = [read_io_bytes(pid) for pid in pid_list]
+        cpu_cores = max(0.0, (cpu_seconds - stage.last_point[1]) / (elapsed - stage.last_point[0]))
+        stage.timeline.append([round(elapsed, 1), len(pid_list), threads, round(cpu_cores, 2), round(rss_gb, 3),
+                               round(sum([io[0] for io in io_list]) / 1e9, 3), round(sum([io[1] for io in io_list]) / 1e9, 3)])
+        stage.last_point = (elapsed, cpu_seconds)
+
+    return rss_gb
+
+def total_bases(qc_file):
+
+    if qc_file is None or not os.path.exists(qc_file):
+        return None
+    for line in open(qc_file):
+        fields = line.rstrip(endl).split(tab)
+        if len(fields) == 2 and fields[0] == 'total number of bases':
+            return int(fields[1])
+
+    return None
+
+def stage_usage(stage, bases):
+
+    wall_seconds = (stage.end_time - stage.start_time).total_seconds()
+    cpu_seconds  = stage.rusage.ru_utime + stage.rusage.ru_stime
+    max_process_rss_gb = stage.rusage.ru_maxrss * 1024 / 1e9
+    usage = {
+        'stage':                stage.name,
+        'status':               stage.status,
+        'threads':              stage.threads,
+        'start':                stage.start_time.strftime(TimeFormat),
+        'end':                  stage.end_time.strftime(TimeFormat),
+        'wall_seconds':         round(wall_seconds, 1),
+        'cpu_seconds':          round(cpu_seconds, 1),
+        'user_cpu_seconds':     round(stage.rusage.ru_utime, 1),
+        'system_cpu_seconds':   round(stage.rusage.ru_stime, 1),
+        'thread_utilization':   round(cpu_seconds / max(wall_seconds, 0.1) / stage.threads, 3), # CPU time over wall time of the threads given
+        'peak_rss_gb':          round(max(stage.peak_rss_gb, max_process_rss_gb), 3),
+        'max_process_rss_gb':   round(max_process_rss_gb, 3),
+        'estimated_memory_gb':  round(stage.memory(stage.threads), 3),
+        'read_gb':              round(stage.rusage.ru_inblock * 512 / 1e9, 3),
+        'write_gb':             round(stage.rusage.ru_oublock * 512 / 1e9, 3),
+        'bases':                bases,
+        'bases_per_second':     None if bases is None else round(bases / max(wall_seconds, 0.1)),
+    }
+
+    return usage
+
+def write_report(stage, report_dir, bases):
+
+    report = stage_usage(stage, bases)
+    report['timeline_columns'] = ['seconds', 'processes', 'threads', 'cpu_cores', 'rss_gb', 'read_gb', 'write_gb']
+    report['timeline'] = stage.timeline
+    report_fp = open(os.path.join(report_dir, f'{stage.name}.json'), 'w')
+    json.dump(report, report_fp, indent=1)
+    report_fp.write(endl)
+    report_fp.close()
+
+    return
+
+def write_run_summary(stage_list, run_start_time, run_peak_rss_gb, total_threads, bases, report_dir):
+
+    run_end_time = datetime.now()
+    wall_seconds = (run_end_time - run_start_time).total_seconds()
+    usage_list = [stage_usage(stage, bases) for stage in stage_list if stage.rusage is not None]
+    cpu_seconds = sum([usage['cpu_seconds'] for usage in usage_list])
+    summary = {
+        'status':             'failed' if 'failed' in [stage.status for stage in stage_list] else 'done',
+        'threads':            total_threads,
+        'start':              run_start_time.strftime(TimeFormat),
+        'end':                run_end_time.strftime(TimeFormat),
+        'wall_seconds':       round(wall_seconds, 1),
+        'cpu_seconds':        round(cpu_seconds, 1),
+        'thread_utilization': round(cpu_seconds / max(wall_seconds, 0.1) / total_threads, 3),
+        'peak_rss_gb':        round(max([run_peak_rss_gb] + [usage['peak_rss_gb'] for usage in usage_list]), 3), # largest sum over the stages running together
+        'read_gb':            round(sum([usage['read_gb'] for usage in usage_list]), 3),
+        'write_gb':           round(sum([usage['write_gb'] for usage in usage_list]), 3),
+        'bases':              bases,
+        'bases_per_second':   None if bases is None else round(bases / max(wall_seconds, 0.1)),
+        'skipped_stages':     [stage.name for stage in stage_list if stage.status == 'skipped'],
+        'stages':             [dict([(key, usage[key]) for key in ['stage', 'status', 'threads', 'wall_seconds', 'cpu_seconds', 'thread_utilization', 'peak_rss_gb', 'read_gb', 'write_gb', 'bases_per_second']]) for usage in usage_list],
+    }
+    summary_fp = open(os.path.join(report_dir, 'run_summary.json'), 'w')
+    json.dump(summary, summary_fp, indent=1)
+    summary_fp.write(endl)
+    summary_fp.close()
+
+    return
+
+def myprint(string):
+    print ('[' + datetime.now().strftime(TimeFormat) + '] ' + string, flush=True)
+    return
+
+if __name__ == '__main__':
+    main()
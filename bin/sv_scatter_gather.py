@@ -0,0 +1,291 @@
+#!/usr/bin/env python3
+
+import os
+import re
+import sys
+import subprocess
+
+tab  = '\t'
+endl = '\n'
+arg = sys.argv[1:]
+
+usage  = 'python ' + __file__ + ' scatter <sorted.bam> <samtools> <num_shards> <padding> <shard_prefix>' + endl
+usage += 'python ' + __file__ + ' gather <num_shards> <shard_prefix> <svcaller_name> <out.vcf>'
+
+# scatter: cuts the genome into num_shards regions with about the same number of
+# mapped reads, taken from the BAM index (samtools idxstats) and assumed to be
+# spread evenly along each contig. A region may span several contigs or part of
+# one. It writes <shard_prefix>_<i>.bed with the region of shard i and
+# <shard_prefix>_<i>.padded.bed with the region extended by padding on either
+# side, from which the alignments of the shard are extracted.
+#
+# gather: merges <shard_prefix>_<i>.<svcaller_name>.vcf of all shards. A call is
+# kept from the shard whose region holds its POS, so calls made twice from the
+# padding are dropped. A breakend whose mate is in another shard may be reported
+# by both shards, one from each end: the copy from the shard holding the first
+# end in genome order is kept, and the other copy only if the first shard has no
+# breakend within bnd_tolerance of the same two ends. A breakend reported as two
+# records linked by MATEID is kept or dropped with the record of its first end.
+# IDs are made unique, MATEID and EVENT follow the renamed IDs of their shard,
+# and the records are sorted in the contig order of the BAM.
+
+bnd_tolerance = 1000
+
+def main():
+    if len(arg) < 1 or arg[0] not in ['scatter', 'gather']:
+        print (usage)
+        sys.exit(1)
+
+    command = arg.pop(0)
+    if command == 'scatter' and len(arg) == 5:
+        scatter(os.path.abspath(arg[0]), arg[1], int(arg[2]), int(arg[3]), arg[4])
+    elif command == 'gather' and len(arg) == 4:
+        gather(int(arg[0]), arg[1], arg[2], arg[3])
+    else:
+        print (usage)
+        sys.exit(1)
+
+    return
+
+def scatter(bam_file, samtools, num_shards, padding, shard_prefix):
+
+    contig_list = [] # (name, length, number of mapped reads)
+    ret = subprocess.check_output([samtools, 'idxstats', bam_file]).decode()
+    for line in ret.strip().split(endl):
+        fields = line.split(tab)
+        if len(fields) < 4 or fields[0] == '*' or int(fields[1]) == 0:
+            continue
+        contig_list.append((fields[0], int(fields[1]), int(fields[2])))
+
+    if sum([mapped for name, length, mapped in contig_list]) == 0: # nothing mapped: balance by length
+        contig_list = [(name, length, length) for name, length, mapped in contig_list]
+
+    total_weight = sum([mapped for name, length, mapped in contig_list])
+    shard_weight = total_weight / num_shards
+    region_list = [[] for i in range(0, num_shards)] # (contig, start, end, contig length), 0-based half-open
+    shard_idx = 0
+    weight = 0.0 # weight of the regions given to shards so far
+    for name, length, mapped in contig_list:
+        start = 0
+        while start < length:
+            end = length
+            if mapped > 0 and shard_idx < num_shards - 1:
+                room = shard_weight * (shard_idx + 1) - weight
+                if room <= 0:
+                    shard_idx += 1
+                    continue
+                if mapped * (length - start) / length > room:
+                    end = min(length, start + max(1, int(room / mapped * length)))
+            region_list[shard_idx].append((name, start, end, length))
+            weight += mapped * (end - start) / length
+            if end < length: # cut inside the contig: the shard is full
+                shard_idx += 1
+            start = end
+
+    for shard_idx in range(0, num_shards):
+        bed_fp = open(f'{shard_prefix}_{shard_idx}.bed', 'w')
+        padded_bed_fp = open(f'{shard_prefix}_{shard_idx}.padded.bed', 'w')
+        padded_region_list = []
+        for name, start, end, length in region_list[shard_idx]:
+            bed_fp.write(f'{name}{tab}{start}{tab}{end}{endl}')
+            start = max(0, start - padding)
+            end = min(length, end + padding)
+            if len(padded_region_list) > 0 and padded_region_list[-1][0] == name and padded_region_list[-1][2] >= start:
+                padded_region_list[-1][2] = max(padded_region_list[-1][2], end)
+            else:
+                padded_region_list.append([name, start, end])
+        for name, start, end in padded_region_list:
+            padded_bed_fp.write(f'{name}{tab}{start}{tab}{end}{endl}')
+        bed_fp.close()
+        padded_bed_fp.close()
+        sys.stderr.write(f'shard {shard_idx}: {len(region_list[shard_idx])} region(s){endl}')
+
+    return
+
+def read_bed(bed_file):
+
+    region_dict = {}
+    for line in open(bed_file):
+        fields = line.rstrip(endl).split(tab)
+        if len(fields) < 3:
+            continue
+        region_dict.setdefault(fields[0], []).append((int(fields[1]), int(fields[2])))
+
+    return region_dict
+
+def shard_of(shard_region_list, chrom, pos):
+
+    for shard_idx in range(0, len(shard_region_list)):
+        for start, end in shard_region_list[shard_idx].get(chrom, []):
+            if start < pos <= end:
+                return shard_idx
+
+    return None
+
+def parse_info(fields):
+
+    return dict([item.split('=', 1) for item in fields[7].split(';') if '=' in item])
+
+def rename_info_ids(info, shard_idx, new_id_dict):
+
+    # MATEID and EVENT hold IDs of the shard VCF: they are given the IDs of the
+    # merged VCF, and a MATEID whose record was not kept is removed
+    item_list = []
+    for item in info.split(';'):
+        key, sep, value = item.partition('=')
+        if sep != '' and key in ['MATEID', 'EVENT']:
+            value_list = [new_id_dict.get((shard_idx, old_id), None if key == 'MATEID' else old_id) for old_id in value.split(',')]
+            value_list = [new_id for new_id in value_list if new_id is not None]
+            if len(value_list) == 0:
+                continue
+            item = key + '=' + ','.join(value_list)
+        item_list.append(item)
+
+    return ';'.join(item_list)
+
+def breakend_mate(fields):
+
+    # the other end of a breakend: from the ALT in bracket notation, or CHR2/END of a translocation
+    match = re.search(r'[\[\]]([^\[\]:]+):(\d+)[\[\]]', fields[4])
+    if match:
+        return match.group(1), int(match.group(2))
+    info_dict = parse_info(fields)
+    if info_dict.get('SVTYPE') in ['BND', 'TRA'] and 'CHR2' in info_dict and 'END' in info_dict:
+        return info_dict['CHR2'], int(info_dict['END'])
+
+    return None
+
+def header_key(line):
+
+    match = re.match(r'##([^=]+)=<ID=([^,>]+)', line)
+    if match:
+        return (match.group(1), match.group(2))
+
+    return line.split('=', 1)[0]
+
+def gather(num_shards, shard_prefix, svcaller_name, out_vcf_file):
+
+    contig_rank_dict = {}
+    shard_region_list = []
+    for shard_idx in range(0, num_shards):
+        region_dict = read_bed(f'{shard_prefix}_{shard_idx}.bed')
+        shard_region_list.append(region_dict)
+        for line in open(f'{shard_prefix}_{shard_idx}.bed'):
+            contig_rank_dict.setdefault(line.split(tab)[0], len(contig_rank_dict))
+
+    def genome_key(chrom, pos):
+        return (contig_rank_dict.setdefault(chrom, len(contig_rank_dict)), pos)
+
+    header_line_list = []
+    header_key_set = set()
+    column_line = None
+    record_list = []    # (chrom, pos, shard index, fields)
+    secondary_list = [] # (chrom, pos, mate chrom, mate pos, shard index, fields of the breakend and of its MATEID record)
+    n_padding = 0
+    for shard_idx in range(0, num_shards):
+        shard_vcf_file = f'{shard_prefix}_{shard_idx}.{svcaller_name}.vcf'
+        if not os.path.exists(shard_vcf_file):
+            sys.stderr.write(f'ERROR! {shard_vcf_file} does not exist{endl}')
+            sys.exit(1)
+        shard_record_list = []
+        for line in open(shard_vcf_file):
+            if line.startswith('##'):
+                key = header_key(line)
+                if key not in header_key_set:
+                    header_key_set.add(key)
+                    header_line_list.append(line)
+                continue
+            if line.startswith('#'):
+                if column_line is None:
+                    column_line = line
+                continue
+            fields = line.rstrip(endl).split(tab)
+            if len(fields) < 8:
+                continue
+            shard_record_list.append(fields)
+
+        # a breakend reported as two records linked by MATEID is kept or dropped
+        # as a whole, as the record of its first end in genome order
+        id_dict = {}
+        for fields in shard_record_list:
+            if fields[2] != '.':
+                id_dict.setdefault(fields[2], fields)
+        second_end_dict = {} # id() of the first-end record -> fields of the second-end record
+        paired_set = set()   # id() of the records of these pairs
+        for fields in shard_record_list:
+            mate_fields = id_dict.get(parse_info(fields).get('MATEID'))
+            if mate_fields is None or mate_fields is fields or id(fields) in paired_set or id(mate_fields) in paired_set:
+                continue
+            if genome_key(mate_fields[0], int(mate_fields[1])) < genome_key(fields[0], int(fields[1])):
+                fields, mate_fields = mate_fields, fields
+            second_end_dict[id(fields)] = mate_fields
+            paired_set.update([id(fields), id(mate_fields)])
+
+        for fields in shard_record_list:
+            if id(fields) in paired_set and id(fields) not in second_end_dict:
+                continue
+            chrom = fields[0]
+            pos = int(fields[1])
+            unit = [fields]
+            if id(fields) in second_end_dict:
+                unit.append(second_end_dict[id(fields)])
+            pos_shard_idx = shard_of(shard_region_list, chrom, pos)
+            if pos_shard_idx != shard_idx:
+                # the first end is in an earlier shard and the second end here
+                if len(unit) == 2 and pos_shard_idx is not None and shard_of(shard_region_list, unit[1][0], int(unit[1][1])) == shard_idx:
+                    secondary_list.append((unit[1][0], int(unit[1][1]), chrom, pos, shard_idx, unit))
+                else:
+                    n_padding += len(unit)
+                continue
+            mate = breakend_mate(fields)
+            if mate is not None and shard_of(shard_region_list, mate[0], mate[1]) not in [None, shard_idx] and genome_key(*mate) < genome_key(chrom, pos):
+                secondary_list.append((chrom, pos, mate[0], mate[1], shard_idx, unit))
+                continue
+            record_list += [(record[0], int(record[1]), shard_idx, record) for record in unit]
+
+    primary_bnd_dict = {} # (chrom, mate chrom) -> [(pos, mate pos)]
+    for chrom, pos, shard_idx, fields in record_list:
+        mate = breakend_mate(fields)
+        if mate is not None:
+            primary_bnd_dict.setdefault((chrom, mate[0]), []).append((pos, mate[1]))
+    n_duplicated_bnd = 0
+    for chrom, pos, mate_chrom, mate_pos, shard_idx, unit in secondary_list:
+        is_duplicated = False
+        for primary_pos, primary_mate_pos in primary_bnd_dict.get((mate_chrom, chrom), []):
+            if abs(primary_pos - mate_pos) <= bnd_tolerance and abs(primary_mate_pos - pos) <= bnd_tolerance:
+                is_duplicated = True
+                break
+        if is_duplicated:
+            n_duplicated_bnd += 1
+        else:
+            record_list += [(record[0], int(record[1]), shard_idx, record) for record in unit]
+
+    record_list.sort(key = lambda record: genome_key(record[0], record[1]))
+    id_set = set()
+    new_id_dict = {} # (shard index, ID in the shard VCF) -> ID in the merged VCF
+    for chrom, pos, shard_idx, fields in record_list:
+        if fields[2] != '.':
+            sv_id = fields[2]
+            suffix = 1
+            while sv_id in id_set:
+                sv_id = f'{fields[2]}_{suffix}'
+                suffix += 1
+            id_set.add(sv_id)
+            new_id_dict.setdefault((shard_idx, fields[2]), sv_id)
+            fields[2] = sv_id
+    out_vcf_fp = open(out_vcf_file, 'w')
+    for line in header_line_list:
+        out_vcf_fp.write(line)
+    if column_line is not None:
+        out_vcf_fp.write(column_line)
+    for chrom, pos, shard_idx, fields in record_list:
+        fields[7] = rename_info_ids(fields[7], shard_idx, new_id_dict)
+        out_vcf_fp.write(tab.join(fields) + endl)
+    out_vcf_fp.close()
+
+    sys.stderr.write(f'{len(record_list)} calls merged from {num_shards} shards; {n_padding} calls outside the shard regions and {n_duplicated_bnd} breakends reported from both ends were dropped{endl}')
+
+    return
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <zlib.h>
+#include "mmpriv.h"
+
+/*
+ * Index server (--idx-serve) and its clients (--idx-socket). The server builds
+ * or loads the index once and writes it in the flat layout (see
+ * mm_idx_dump_flat()) to a POSIX shared-memory segment, which is unlinked right
+ * away so that it goes with the server. A client connects to the Unix socket
+ * and sends a message
+ *
+ *   magic  crc  size  kmer_bloom
+ *
+ * with the CRC32 and the size of the reference file followed by the -W list of
+ * down-weighted k-mers it was given, and its --kmer-bloom. If they match the
+ * server's, the server replies with the same message and passes a read-only
+ * descriptor of the segment with SCM_RIGHTS, which the client maps as it would
+ * map a flat index file. Clients on a node thus share one copy of the index and
+ * none of them builds or reads it. Otherwise the server replies with its own
+ * key and no descriptor, and the client loads the index itself.
+ */
+
+#define SRV_MAGIC "WMS\1"
+
+typedef struct {
+	char magic[4];
+	uint32_t crc;
+	uint64_t size;
+	int32_t kmer_bloom, dummy;
+} srv_msg_t;
+
+static int srv_key(const char *fn, const char *fn_kmer, const mm_idxopt_t *opt, srv_msg_t *m) // CRC32 and size of files fn and fn_kmer
+{
+	FILE *fp;
+	uint8_t *buf;
+	size_t l;
+	int i;
+	uLong crc = crc32(0L, Z_NULL, 0);
+	memset(m, 0, sizeof(srv_msg_t));
+	memcpy(m->magic, SRV_MAGIC, 4);
+	m->kmer_bloom = opt->kmer_bloom;
+	buf = (uint8_t*)malloc(1<<20);
+	for (i = 0; i < 2; ++i) {
+		const char *f = i == 0? fn : fn_kmer;
+		if (f == 0) continue;
+		if ((fp = fopen(f, "rb")) == 0) {
+			free(buf);
+			return -1;
+		}
+		while ((l = fread(buf, 1, 1<<20, fp)) > 0)
+			crc = crc32(crc, buf, l), m->size += l;
+		fclose(fp);
+	}
+	free(buf);
+	m->crc = crc;
+	return 0;
+}
+
+static int srv_send(int fd, const srv_msg_t *m, int fd_pass) // send a message and, if fd_pass >= 0, a descriptor
+{
+	struct msghdr msg;
+	struct iovec iov;
+	union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(int))]; } u;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void*)m, iov.iov_len = sizeof(srv_msg_t);
+	msg.msg_iov = &iov, msg.msg_iovlen = 1;
+	if (fd_pass >= 0) {
+		struct cmsghdr *c;
+		memset(&u, 0, sizeof(u));
+		msg.msg_control = u.buf, msg.msg_controllen = sizeof(u.buf);
+		c = CMSG_FIRSTHDR(&msg);
+		c->cmsg_level = SOL_SOCKET, c->cmsg_type = SCM_RIGHTS, c->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(c), &fd_pass, sizeof(int));
+	}
+	return sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(srv_msg_t)? 0 : -1;
+}
+
+static int srv_recv(int fd, srv_msg_t *m, int *fd_pass) // receive a message and the descriptor that comes with it, if any
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *c;
+	union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(int))]; } u;
+	ssize_t l;
+	if (fd_pass) *fd_pass = -1;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = m, iov.iov_len = sizeof(srv_msg_t);
+	msg.msg_iov = &iov, msg.msg_iovlen = 1;
+	msg.msg_control = u.buf, msg.msg_controllen = sizeof(u.buf);
+	l = recvmsg(fd, &msg, MSG_WAITALL);
+	for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+			int x;
+			memcpy(&x, CMSG_DATA(c), sizeof(int));
+			if (fd_pass && *fd_pass < 0) *fd_pass = x;
+			else close(x);
+		}
+	}
+	if (l != (ssize_t)sizeof(srv_msg_t) || strncmp(m->magic, SRV_MAGIC, 4) != 0) {
+		if (fd_pass && *fd_pass >= 0) close(*fd_pass), *fd_pass = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static int srv_open(const char *sock_fn, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if (strlen(sock_fn) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr->sun_path, sock_fn);
+	return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+static volatile sig_atomic_t srv_stop = 0;
+
+static void srv_signal(int sig)
+{
+	srv_stop = 1;
+}
+
+int mm_idx_serve(const char *sock_fn, const char *fn, const char *fn_kmer, const mm_idxopt_t *opt, int n_threads)
+{
+	mm_idx_reader_t *r;
+	mm_idx_t *mi;
+	srv_msg_t key;
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	char name[64];
+	int fd_rw, fd_ro, fd_sock;
+	uint32_t n_seq;
+	int64_t n_served = 0;
+	FILE *fp;
+
+	if (srv_key(fn, fn_kmer, opt, &key) < 0) {
+		fprintf(stderr, "[ERROR] failed to open file '%s'%s%s: %s\n", fn, fn_kmer? " or " : "", fn_kmer? fn_kmer : "", strerror(errno));
+		return 1;
+	}
+	if ((r = mm_idx_reader_open(fn, opt, 0)) == 0) {
+		fprintf(stderr, "[ERROR] failed to open file '%s': %s\n", fn, strerror(errno));
+		return 1;
+	}
+	mi = mm_idx_reader_read(r, n_threads, fn_kmer);
+	if (mi == 0 || !mm_idx_reader_eof(r)) {
+		if (mi) fprintf(stderr, "[ERROR] only a single-part index can be served; please increase -I\n");
+		else fprintf(stderr, "[ERROR] failed to read or build the index from '%s'\n", fn);
+		mm_idx_destroy(mi);
+		mm_idx_reader_close(r);
+		return 1;
+	}
+	mm_idx_reader_close(r);
+
+	// write the flat index to a segment that only we and the clients hold
+	snprintf(name, sizeof(name), "/winnowmap-idx-%ld-%08x", (long)getpid(), key.crc);
+	fd_rw = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+	fd_ro = fd_rw >= 0? shm_open(name, O_RDONLY, 0) : -1;
+	if (fd_rw >= 0) shm_unlink(name);
+	if (fd_ro < 0) {
+		fprintf(stderr, "[ERROR] failed to create a shared-memory segment: %s\n", strerror(errno));
+		if (fd_rw >= 0) close(fd_rw);
+		mm_idx_destroy(mi);
+		return 1;
+	}
+	fp = fdopen(fd_rw, "wb");
+	mm_idx_dump_flat(fp, mi);
+	if (ferror(fp) || fclose(fp) != 0) {
+		fprintf(stderr, "[ERROR] failed to write the index to shared memory: %s\n", strerror(errno));
+		close(fd_ro);
+		mm_idx_destroy(mi);
+		return 1;
+	}
+	n_seq = mi->n_seq;
+	mm_idx_destroy(mi);
+
+	if ((fd_sock = srv_open(sock_fn, &addr)) < 0) {
+		fprintf(stderr, "[ERROR] failed to create socket '%s': %s\n", sock_fn, strerror(errno));
+		close(fd_ro);
+		return 1;
+	}
+	unlink(sock_fn); // left by a server that was killed
+	if (bind(fd_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd_sock, 64) < 0) {
+		fprintf(stderr, "[ERROR] failed to listen on socket '%s': %s\n", sock_fn, strerror(errno));
+		close(fd_sock); close(fd_ro);
+		return 1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = srv_signal; // no SA_RESTART, so that accept() returns
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+	sigaction(SIGHUP, &sa, 0);
+	if (mm_verbose >= 3)
+		fprintf(stderr, "[M::%s::%.3f*%.2f] serving the index of %d target sequence(s) from '%s' (CRC32 %08x, %lld bytes) on '%s'\n",
+				__func__, realtime() - mm_realtime0, cputime() / (realtime() - mm_realtime0), n_seq, fn, key.crc, (long long)key.size, sock_fn);
+
+	while (!srv_stop) {
+		srv_msg_t m;
+		struct timeval tv;
+		int fd, ok;
+		if ((fd = accept(fd_sock, 0, 0)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			fprintf(stderr, "[ERROR] failed to accept a connection: %s\n", strerror(errno));
+			break;
+		}
+		tv.tv_sec = 10, tv.tv_usec = 0; // don't let a stuck client hold up the others
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		if (srv_recv(fd, &m, 0) == 0) {
+			ok = (m.crc == key.crc && m.size == key.size && m.kmer_bloom == key.kmer_bloom);
+			if (srv_send(fd, &key, ok? fd_ro : -1) == 0 && ok) ++n_served;
+		}
+		close(fd);
+	}
+	unlink(sock_fn);
+	close(fd_sock);
+	close(fd_ro);
+	if (mm_verbose >= 3)
+		fprintf(stderr, "[M::%s] stopped after serving %lld client(s)\n", __func__, (long long)n_served);
+	return 0;
+}
+
+int mm_idx_reader_attach(mm_idx_reader_t *r, const char *fn, const char *fn_kmer, const char *sock_fn)
+{
+	srv_msg_t key, m;
+	struct sockaddr_un addr;
+	int fd, fd_idx;
+	mm_idx_t *mi;
+
+	if (srv_key(fn, fn_kmer, &r->opt, &key) < 0) return -1;
+	if ((fd = srv_open(sock_fn, &addr)) < 0) return -1;
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || srv_send(fd, &key, -1) < 0 || srv_recv(fd, &m, &fd_idx) < 0) {
+		if (mm_verbose >= 2)
+			fprintf(stderr, "[WARNING]\033[1;31m failed to get the index from server '%s': %s\033[0m\n", sock_fn, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	if (fd_idx < 0) {
+		if (mm_verbose >= 2)
+			fprintf(stderr, "[WARNING]\033[1;31m server '%s' has a different reference, -W list or --kmer-bloom (CRC32 %08x, %lld bytes, %d; here %08x, %lld bytes, %d)\033[0m\n",
+					sock_fn, m.crc, (long long)m.size, m.kmer_bloom, key.crc, (long long)key.size, key.kmer_bloom);
+		return -1;
+	}
+	mi = mm_idx_map_flat(fd_idx);
+	close(fd_idx); // the mapping stays
+	if (mi == 0) return -1;
+	if (mi->k != r->opt.k || mi->w != r->opt.w || (mi->flag&MM_I_HPC) != (r->opt.flag&MM_I_HPC)) {
+		if (!r->is_idx) { // built from the same sequences, but not for these options
+			if (mm_verbose >= 2)
+				fprintf(stderr, "[WARNING]\033[1;31m server '%s' has an index built with different -k, -w or -H\033[0m\n", sock_fn);
+			mm_idx_destroy(mi);
+			return -1;
+		} else if (mm_verbose >= 2)
+			fprintf(stderr, "[WARNING]\033[1;31m Indexing parameters (-k, -w or -H) overridden by parameters used in the prebuilt index.\033[0m\n");
+	}
+	r->is_srv = 1, r->srv = mi;
+	return 0;
+}
@@ -4,8 +4,10 @@
 #include <io.h> // for open(2)
 #else
 #include <unistd.h>
+#include <sys/mman.h>
 #endif
 #include <fcntl.h>
+#include <errno.h>
 #include <stdio.h>
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
@@ -16,6 +18,7 @@
 #include "mmpriv.h"
 #include "kvec.h"
 #include "khash.h"
+#include "kset.h"
 #include <fstream>
 #include <iostream>
 #include <sstream>
@@ -35,6 +38,8 @@ typedef struct mm_idx_bucket_s {
 	int32_t n;   // size of the _p_ array
 	uint64_t *p; // position array for minimizers appearing >1 times
 	void *h;     // hash table indexing _p_ and minimizers appearing once
+	uint32_t n_key;     // number of (key, value) pairs in _kv_
+	const uint64_t *kv; // attached index only: (key, value) pairs sorted by key; replaces _h_
 } mm_idx_bucket_t;
 
 typedef struct {
@@ -64,7 +69,7 @@ void mm_idx_destroy(mm_idx_t *mi)
 	uint32_t i;
 	if (mi == 0) return;
 	if (mi->h) kh_destroy(str, (khash_t(str)*)mi->h);
-	if (mi->B) {
+	if (mi->B && !mi->map) {
 		for (i = 0; i < 1U<<mi->b; ++i) {
 			free(mi->B[i].p);
 			free(mi->B[i].a.a);
@@ -77,11 +82,18 @@ void mm_idx_destroy(mm_idx_t *mi)
 		free(mi->I);
 	}
 	if (!mi->km) {
-		for (i = 0; i < mi->n_seq; ++i)
+		for (i = 0; i < mi->n_seq && !mi->map; ++i)
 			free(mi->seq[i].name);
 		free(mi->seq);
 	} else km_destroy(mi->km);
-	delete mi->downFilter;
+	if (mi->map) {
+#if !defined(WIN32) && !defined(_WIN32)
+		munmap(mi->map, mi->map_len);
+#endif
+		free(mi->downFilter); // its blocks are in the mapping
+		mi->downFilter = 0, mi->S = 0;
+	}
+	mm_kset_destroy(mi->downFilter);
 	free(mi->B); free(mi->S); free(mi);
 }
 
@@ -92,6 +104,24 @@ const uint64_t *mm_idx_get(const mm_idx_t *mi, uint64_t minier, int *n)
 	mm_idx_bucket_t *b = &mi->B[minier&mask];
 	idxhash_t *h = (idxhash_t*)b->h;
 	*n = 0;
+	if (b->kv) { // attached index: binary search in the sorted keys
+		const uint64_t *kv = b->kv, x = minier>>mi->b;
+		uint32_t lo = 0, hi = b->n_key;
+		while (lo < hi) {
+			uint32_t mid = lo + ((hi - lo) >> 1);
+			if (kv[mid<<1]>>1 < x) lo = mid + 1;
+			else hi = mid;
+		}
+		if (lo == b->n_key || kv[lo<<1]>>1 != x) return 0;
+		kv += lo<<1;
+		if (kv[0]&1) {
+			*n = 1;
+			return &kv[1];
+		} else {
+			*n = (uint32_t)kv[1];
+			return &b->p[kv[1]>>32];
+		}
+	}
 	if (h == 0) return 0;
 	k = kh_get(idx, h, minier>>mi->b<<1);
 	if (k == kh_end(h)) return 0;
@@ -116,9 +146,15 @@ void mm_idx_stat(const mm_idx_t *mi)
 		len += mi->seq[i].len;
 	for (i = 0; i < 1U<<mi->b; ++i)
 		if (mi->B[i].h) n += kh_size((idxhash_t*)mi->B[i].h);
+		else n += mi->B[i].n_key;
 	for (i = 0; i < 1U<<mi->b; ++i) {
 		idxhash_t *h = (idxhash_t*)mi->B[i].h;
+		const uint64_t *kv = mi->B[i].kv;
 		khint_t k;
+		for (k = 0; kv && k < mi->B[i].n_key; ++k) {
+			sum += kv[k<<1]&1? 1 : (uint32_t)kv[k<<1|1];
+			if (kv[k<<1]&1) ++n1;
+		}
 		if (h == 0) continue;
 		for (k = 0; k < kh_end(h); ++k)
 			if (kh_exist(h, k)) {
@@ -179,9 +215,13 @@ int32_t mm_idx_cal_max_occ(const mm_idx_t *mi, float f)
 	if (f <= 0.) return INT32_MAX;
 	for (i = 0; i < 1<<mi->b; ++i)
 		if (mi->B[i].h) n += kh_size((idxhash_t*)mi->B[i].h);
+		else n += mi->B[i].n_key;
 	a = (uint32_t*)malloc(n * 4);
 	for (i = n = 0; i < 1<<mi->b; ++i) {
 		idxhash_t *h = (idxhash_t*)mi->B[i].h;
+		const uint64_t *kv = mi->B[i].kv;
+		for (k = 0; kv && k < mi->B[i].n_key; ++k)
+			a[n++] = kv[k<<1]&1? 1 : (uint32_t)kv[k<<1|1];
 		if (h == 0) continue;
 		for (k = 0; k < kh_end(h); ++k) {
 			if (!kh_exist(h, k)) continue;
@@ -375,21 +415,22 @@ uint64_t encodeKmer(const std::string &str)
 	return kmer[0] < kmer[1]? kmer[0] : kmer[1];
 }
 
-mm_idx_t *mm_idx_gen(mm_bseq_file_t *fp, int w, int k, int b, int flag, int mini_batch_size, int n_threads, uint64_t batch_size, const char *kmer_freq_filename)
+static mm_kset_t *new_kset(uint64_t cnt, int kmer_bloom) //set up the set of k-mers, one cache line per lookup
 {
-	pipeline_t pl;
-	if (fp == 0 || mm_bseq_eof(fp)) return 0;
-	memset(&pl, 0, sizeof(pipeline_t));
-	pl.mini_batch_size = (uint64_t)mini_batch_size < batch_size? mini_batch_size : batch_size;
-	pl.batch_size = batch_size;
-	pl.fp = fp;
-	pl.mi = mm_idx_init(w, k, b, flag);
-
-	//Read kmer frequency file
-	/*------------------------*/
-	std::ifstream idt (kmer_freq_filename);
+	mm_kset_t *s = mm_kset_init(cnt, kmer_bloom);
+	if (s == 0)
+	{
+		fprintf(stderr, "ERROR: failed to allocate the set of downweighted kmers\n");
+		exit(1);
+	}
+	return s;
+}
 
-	fprintf(stderr, "[M::%s::%.3f*%.2f] reading downweighted kmers\n", __func__, realtime() - mm_realtime0, cputime() / (realtime() - mm_realtime0));
+//text list: "kmer count" per line
+static mm_kset_t *read_kmers_text(const char *fn, int k, int kmer_bloom, uint64_t *_cnt)
+{
+	std::ifstream idt;
+	if (fn) idt.open(fn);
 
 	std::string kmer;
 	uint64_t cnt = 0;
@@ -407,34 +448,78 @@ mm_idx_t *mm_idx_gen(mm_bseq_file_t *fp, int w, int k, int b, int flag, int mini
 		}
 	}
 
-	//set up bloom filter
-	bloom_parameters parameters;
-	parameters.projected_element_count = std::max(cnt, (uint64_t)1000);
-	parameters.false_positive_probability = 0.001; 
-	parameters.maximum_number_of_hashes = 2;
-
-	if (!parameters)
-	{
-		std::cout << "Error - Invalid set of bloom filter parameters!" << std::endl;
-		exit(1);
-	}
-
-	parameters.compute_optimal_parameters();
-	pl.mi->downFilter = new bloom_filter(parameters);
-
+	mm_kset_t *s = new_kset(cnt, kmer_bloom);
 
 	//read the file again
 	idt.clear();
 	idt.seekg(0);
 	while(idt >> kmer >> freq)
 	{
-		pl.mi->downFilter->insert(encodeKmer(kmer));
+		mm_kset_add(s, encodeKmer(kmer));
+	}
+	*_cnt = cnt;
+	return s;
+}
+
+//binary list written by 'meryl ... export'; $fp is just past the magic
+//  char[4] MM_KMB_MAGIC, uint32_t k, uint64_t n, uint64_t kmers[n] (encodeKmer() encoding, sorted)
+static mm_kset_t *read_kmers_bin(FILE *fp, int k, int kmer_bloom, uint64_t *cnt)
+{
+	uint32_t kb;
+	uint64_t i, n, *a;
+	if (fread(&kb, 4, 1, fp) != 1 || fread(&n, 8, 1, fp) != 1)
+	{
+		fprintf(stderr, "ERROR: truncated binary list of k-mers\n");
+		abort();
 	}
+	if (n > 0 && kb != (uint32_t)k)
+	{
+		fprintf(stderr, "ERROR: input list of k-mers and winnowmap parameter k are inconsistent\n");
+		abort();
+	}
+	a = (uint64_t*)malloc(n * 8);
+	if (fread(a, 8, n, fp) != n)
+	{
+		fprintf(stderr, "ERROR: truncated binary list of k-mers\n");
+		abort();
+	}
+	mm_kset_t *s = new_kset(n, kmer_bloom);
+	for (i = 0; i < n; ++i)
+		mm_kset_add(s, a[i]);
+	free(a);
+	*cnt = n;
+	return s;
+}
 
-	assert(cnt == pl.mi->downFilter->element_count());
+mm_idx_t *mm_idx_gen(mm_bseq_file_t *fp, int w, int k, int b, int flag, int mini_batch_size, int n_threads, uint64_t batch_size, const char *kmer_freq_filename, int kmer_bloom)
+{
+	pipeline_t pl;
+	if (fp == 0 || mm_bseq_eof(fp)) return 0;
+	memset(&pl, 0, sizeof(pipeline_t));
+	pl.mini_batch_size = (uint64_t)mini_batch_size < batch_size? mini_batch_size : batch_size;
+	pl.batch_size = batch_size;
+	pl.fp = fp;
+	pl.mi = mm_idx_init(w, k, b, flag);
+
+	//Read the list of downweighted kmers: binary from 'meryl ... export', or text from 'meryl print'
+	/*------------------------*/
+	fprintf(stderr, "[M::%s::%.3f*%.2f] reading downweighted kmers\n", __func__, realtime() - mm_realtime0, cputime() / (realtime() - mm_realtime0));
+
+	uint64_t cnt = 0;
+	FILE *kfp = kmer_freq_filename? fopen(kmer_freq_filename, "rb") : 0;
+	char magic[4];
+	if (kfp && fread(magic, 1, 4, kfp) == 4 && memcmp(magic, MM_KMB_MAGIC, 4) == 0)
+		pl.mi->downFilter = read_kmers_bin(kfp, k, kmer_bloom, &cnt);
+	else pl.mi->downFilter = read_kmers_text(kmer_freq_filename, k, kmer_bloom, &cnt);
+	if (kfp) fclose(kfp);
 
 	fprintf(stderr, "[M::%s::%.3f*%.2f] collected downweighted kmers, no. of kmers read=%" PRIu64"\n", __func__, realtime() - mm_realtime0, cputime() / (realtime() - mm_realtime0), cnt);
-	fprintf(stderr, "[M::%s::%.3f*%.2f] saved the kmers in a bloom filter: hash functions=%u and size=%llu \n", __func__, realtime() - mm_realtime0, cputime() / (realtime() - mm_realtime0), parameters.optimal_parameters.number_of_hashes, parameters.optimal_parameters.table_size);
+	if (kmer_bloom > 0)
+		fprintf(stderr, "[M::%s::%.3f*%.2f] saved the kmers in a blocked bloom filter: hash functions=%d, size=%.2f MB, estimated false positive rate=%.3g\n", __func__, realtime() - mm_realtime0, cputime() / (realtime() - mm_realtime0),
+				pl.mi->downFilter->bloom, pl.mi->downFilter->n_blk * 64.0 / 1048576, mm_kset_fpr(pl.mi->downFilter));
+	else
+		fprintf(stderr, "[M::%s::%.3f*%.2f] saved %" PRIu64 " distinct kmers in an exact set: size=%.2f MB\n", __func__, realtime() - mm_realtime0, cputime() / (realtime() - mm_realtime0),
+				pl.mi->downFilter->n, pl.mi->downFilter->n_blk * 64.0 / 1048576);
 	/*------------------------*/
 
 	kt_pipeline(n_threads < 3? n_threads : 3, worker_pipeline, &pl, 3);
@@ -454,7 +539,7 @@ mm_idx_t *mm_idx_build(const char *fn, int w, int k, int flag, int n_threads) //
 	mm_idx_t *mi;
 	fp = mm_bseq_open(fn);
 	if (fp == 0) return 0;
-	mi = mm_idx_gen(fp, w, k, 14, flag, 1<<18, n_threads, UINT64_MAX, NULL);
+	mi = mm_idx_gen(fp, w, k, 14, flag, 1<<18, n_threads, UINT64_MAX, NULL, 0);
 	mm_bseq_close(fp);
 	return mi;
 }
@@ -607,6 +692,188 @@ mm_idx_t *mm_idx_load(FILE *fp)
 	return mi;
 }
 
+/********************************
+ * Flat index in shared memory *
+ ********************************/
+
+/* An index served with --idx-serve is laid out as follows, with all offsets
+ * relative to the start of the segment:
+ *
+ *   header         mm_idx_flat_hdr_t
+ *   seq table      n_seq * mm_idx_flat_seq_t
+ *   names          NUL-terminated sequence names
+ *   bucket table   ((1<<b) + 1) * {start in kv[], start in p[]}
+ *   kv[]           n_key * {key, value}, sorted by key within each bucket; same encoding as the hash table
+ *   p[]            n_p positions; same as mm_idx_bucket_t::p concatenated
+ *   kset blocks    kset_n_blk 64-byte blocks of mm_idx_t::downFilter; absent without -W
+ *   S[]            4-bit packed sequence, aligned to MM_IDX_FLAT_ALIGN; absent with MM_I_NO_SEQ
+ *
+ * so that a client uses it in place after a single mmap(); nothing is rebuilt.
+ */
+
+#define MM_IDX_FLAT_ALIGN 0x10000
+
+typedef struct {
+	char magic[4];
+	uint32_t w, k, b, n_seq, flag;
+	uint64_t size;                  // size of the segment, padding included
+	uint64_t sum_len, n_key, n_p;
+	uint64_t off_seq, off_name, off_bkt, off_kv, off_p, off_S;
+	uint64_t kset_n, kset_n_blk, off_kset; // off_kset is 0 if there is no downFilter
+	int32_t kset_bloom;
+} mm_idx_flat_hdr_t;
+
+typedef struct {
+	uint64_t offset;
+	uint32_t len, name; // name: offset in the name section, or UINT32_MAX if absent
+} mm_idx_flat_seq_t;
+
+#define flat_roundup(x, a) (((x) + (a) - 1) / (a) * (a))
+
+static void flat_write(FILE *fp, uint64_t *pos, uint64_t off, const void *data, size_t len)
+{
+	static const char zero[64] = {0};
+	assert(*pos <= off);
+	while (*pos < off) {
+		size_t l = off - *pos < 64? off - *pos : 64;
+		fwrite(zero, 1, l, fp);
+		*pos += l;
+	}
+	if (len) fwrite(data, 1, len, fp);
+	*pos += len;
+}
+
+void mm_idx_dump_flat(FILE *fp, const mm_idx_t *mi)
+{
+	mm_idx_flat_hdr_t hdr;
+	uint64_t pos = 0, n_name = 0, *bkt;
+	uint32_t i, max_n = 0;
+	mm128_t *a;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MM_IDX_FLAT_MAGIC, 4);
+	hdr.w = mi->w, hdr.k = mi->k, hdr.b = mi->b, hdr.n_seq = mi->n_seq, hdr.flag = mi->flag;
+	for (i = 0; i < mi->n_seq; ++i) {
+		hdr.sum_len += mi->seq[i].len;
+		if (mi->seq[i].name) n_name += strlen(mi->seq[i].name) + 1;
+	}
+	bkt = (uint64_t*)calloc(((1U<<mi->b) + 1) * 2, 8);
+	for (i = 0; i < 1U<<mi->b; ++i) {
+		const mm_idx_bucket_t *b = &mi->B[i];
+		uint32_t n = b->h? kh_size((idxhash_t*)b->h) : b->n_key;
+		bkt[i<<1] = hdr.n_key, bkt[i<<1|1] = hdr.n_p;
+		hdr.n_key += n, hdr.n_p += b->n;
+		max_n = max_n > n? max_n : n;
+	}
+	bkt[i<<1] = hdr.n_key, bkt[i<<1|1] = hdr.n_p;
+	hdr.off_seq  = flat_roundup(sizeof(hdr), 64);
+	hdr.off_name = flat_roundup(hdr.off_seq + mi->n_seq * sizeof(mm_idx_flat_seq_t), 64);
+	hdr.off_bkt  = flat_roundup(hdr.off_name + n_name, 64);
+	hdr.off_kv   = flat_roundup(hdr.off_bkt + ((1ULL<<mi->b) + 1) * 16, 64);
+	hdr.off_p    = flat_roundup(hdr.off_kv + hdr.n_key * 16, 64);
+	hdr.size     = hdr.off_p + hdr.n_p * 8;
+	if (mi->downFilter) {
+		hdr.kset_bloom = mi->downFilter->bloom, hdr.kset_n = mi->downFilter->n, hdr.kset_n_blk = mi->downFilter->n_blk;
+		hdr.off_kset = flat_roundup(hdr.size, 64);
+		hdr.size = hdr.off_kset + hdr.kset_n_blk * 64;
+	}
+	if (!(mi->flag & MM_I_NO_SEQ)) {
+		hdr.off_S = flat_roundup(hdr.size, MM_IDX_FLAT_ALIGN);
+		hdr.size = hdr.off_S + (hdr.sum_len + 7) / 8 * 4;
+	}
+	hdr.size = flat_roundup(hdr.size, MM_IDX_FLAT_ALIGN);
+
+	flat_write(fp, &pos, 0, &hdr, sizeof(hdr));
+	for (i = 0, n_name = 0; i < mi->n_seq; ++i) {
+		mm_idx_flat_seq_t s;
+		s.offset = mi->seq[i].offset, s.len = mi->seq[i].len;
+		s.name = mi->seq[i].name? n_name : UINT32_MAX;
+		if (mi->seq[i].name) n_name += strlen(mi->seq[i].name) + 1;
+		flat_write(fp, &pos, hdr.off_seq + i * sizeof(s), &s, sizeof(s));
+	}
+	for (i = 0, n_name = 0; i < mi->n_seq; ++i) {
+		if (mi->seq[i].name == 0) continue;
+		flat_write(fp, &pos, hdr.off_name + n_name, mi->seq[i].name, strlen(mi->seq[i].name) + 1);
+		n_name += strlen(mi->seq[i].name) + 1;
+	}
+	flat_write(fp, &pos, hdr.off_bkt, bkt, ((1ULL<<mi->b) + 1) * 16);
+	a = (mm128_t*)malloc((size_t)max_n * sizeof(mm128_t));
+	for (i = 0; i < 1U<<mi->b; ++i) {
+		const mm_idx_bucket_t *b = &mi->B[i];
+		idxhash_t *h = (idxhash_t*)b->h;
+		khint_t k;
+		size_t n = 0;
+		if (h == 0) {
+			flat_write(fp, &pos, hdr.off_kv + bkt[i<<1] * 16, b->kv, (size_t)b->n_key * 16);
+			continue;
+		}
+		for (k = 0; k < kh_end(h); ++k)
+			if (kh_exist(h, k))
+				a[n].x = kh_key(h, k), a[n++].y = kh_val(h, k);
+		radix_sort_128x(a, a + n); // keys in a bucket are unique, so this sorts by minimizer
+		flat_write(fp, &pos, hdr.off_kv + bkt[i<<1] * 16, a, n * 16);
+	}
+	free(a);
+	for (i = 0; i < 1U<<mi->b; ++i)
+		flat_write(fp, &pos, hdr.off_p + bkt[i<<1|1] * 8, mi->B[i].p, (size_t)mi->B[i].n * 8);
+	if (mi->downFilter)
+		flat_write(fp, &pos, hdr.off_kset, mi->downFilter->b, hdr.kset_n_blk * 64);
+	if (!(mi->flag & MM_I_NO_SEQ))
+		flat_write(fp, &pos, hdr.off_S, mi->S, (hdr.sum_len + 7) / 8 * 4);
+	flat_write(fp, &pos, hdr.size, 0, 0);
+	free(bkt);
+	fflush(fp);
+}
+
+#if !defined(WIN32) && !defined(_WIN32)
+mm_idx_t *mm_idx_map_flat(int fd)
+{
+	mm_idx_flat_hdr_t hdr;
+	uint8_t *base;
+	const uint64_t *bkt, *kv, *p;
+	const mm_idx_flat_seq_t *s;
+	mm_idx_t *mi;
+	uint32_t i;
+
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) return 0;
+	if (strncmp(hdr.magic, MM_IDX_FLAT_MAGIC, 4) != 0 || hdr.size < sizeof(hdr)) return 0;
+	base = (uint8_t*)mmap(0, hdr.size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == (uint8_t*)MAP_FAILED) {
+		if (mm_verbose >= 1)
+			fprintf(stderr, "[E::%s] failed to map the index: %s\n", __func__, strerror(errno));
+		return 0;
+	}
+	mi = mm_idx_init(hdr.w, hdr.k, hdr.b, hdr.flag);
+	mi->map = base, mi->map_len = hdr.size;
+	mi->n_seq = hdr.n_seq;
+	mi->seq = (mm_idx_seq_t*)kcalloc(mi->km, mi->n_seq, sizeof(mm_idx_seq_t));
+	s = (const mm_idx_flat_seq_t*)(base + hdr.off_seq);
+	for (i = 0; i < mi->n_seq; ++i) {
+		mi->seq[i].name = s[i].name == UINT32_MAX? 0 : (char*)base + hdr.off_name + s[i].name;
+		mi->seq[i].offset = s[i].offset;
+		mi->seq[i].len = s[i].len;
+	}
+	bkt = (const uint64_t*)(base + hdr.off_bkt);
+	kv = (const uint64_t*)(base + hdr.off_kv);
+	p = (const uint64_t*)(base + hdr.off_p);
+	for (i = 0; i < 1U<<mi->b; ++i) {
+		mm_idx_bucket_t *b = &mi->B[i];
+		b->n_key = bkt[(i+1)<<1] - bkt[i<<1];
+		b->kv = b->n_key? kv + (bkt[i<<1]<<1) : 0;
+		b->n = bkt[(i+1)<<1|1] - bkt[i<<1|1];
+		b->p = (uint64_t*)(p + bkt[i<<1|1]);
+	}
+	if (hdr.off_kset) { // the blocks stay in the mapping; see mm_idx_destroy()
+		mi->downFilter = (mm_kset_t*)calloc(1, sizeof(mm_kset_t));
+		mi->downFilter->bloom = hdr.kset_bloom, mi->downFilter->n = hdr.kset_n, mi->downFilter->n_blk = hdr.kset_n_blk;
+		mi->downFilter->b = (uint64_t*)(base + hdr.off_kset);
+	}
+	if (!(mi->flag & MM_I_NO_SEQ))
+		mi->S = (uint32_t*)(base + hdr.off_S);
+	return mi;
+}
+#endif
+
 int64_t mm_idx_is_idx(const char *fn)
 {
 	int fd, is_idx = 0;
@@ -654,18 +921,24 @@ void mm_idx_reader_close(mm_idx_reader_t *r)
 	if (r->is_idx) fclose(r->fp.idx);
 	else mm_bseq_close(r->fp.seq);
 	if (r->fp_out) fclose(r->fp_out);
+	mm_idx_destroy(r->srv);
 	free(r);
 }
 
 mm_idx_t *mm_idx_reader_read(mm_idx_reader_t *r, int n_threads, const char *kmer_freq_filename)
 {
 	mm_idx_t *mi;
+	if (r->is_srv) { // the whole index, as a single part
+		mi = r->srv, r->srv = 0;
+		if (mi) mi->index = r->n_parts++;
+		return mi;
+	}
 	if (r->is_idx) {
 		mi = mm_idx_load(r->fp.idx);
 		if (mi && mm_verbose >= 2 && (mi->k != r->opt.k || mi->w != r->opt.w || (mi->flag&MM_I_HPC) != (r->opt.flag&MM_I_HPC)))
 			fprintf(stderr, "[WARNING]\033[1;31m Indexing parameters (-k, -w or -H) overridden by parameters used in the prebuilt index.\033[0m\n");
 	} else
-		mi = mm_idx_gen(r->fp.seq, r->opt.w, r->opt.k, r->opt.bucket_bits, r->opt.flag, r->opt.mini_batch_size, n_threads, r->opt.batch_size, kmer_freq_filename);
+		mi = mm_idx_gen(r->fp.seq, r->opt.w, r->opt.k, r->opt.bucket_bits, r->opt.flag, r->opt.mini_batch_size, n_threads, r->opt.batch_size, kmer_freq_filename, r->opt.kmer_bloom);
 	if (mi) {
 		if (r->fp_out) mm_idx_dump(r->fp_out, mi);
 		mi->index = r->n_parts++;
@@ -675,6 +948,7 @@ mm_idx_t *mm_idx_reader_read(mm_idx_reader_t *r, int n_threads, const char *kmer
 
 int mm_idx_reader_eof(const mm_idx_reader_t *r) // TODO: in extremely rare cases, mm_bseq_eof() might not work
 {
+	if (r->is_srv) return r->srv == 0;
 	return r->is_idx? (feof(r->fp.idx) || ftell(r->fp.idx) == r->idx_size) : mm_bseq_eof(r->fp.seq);
 }
 
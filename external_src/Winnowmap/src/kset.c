@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "kset.h"
+
+mm_kset_t *mm_kset_init(uint64_t n, int bits)
+{
+	mm_kset_t *s;
+	void *b;
+	s = (mm_kset_t*)calloc(1, sizeof(mm_kset_t));
+	if (s == 0) return 0;
+	if (bits > 0) {
+		s->bloom = (int)(bits * M_LN2 + .499);
+		s->bloom = s->bloom < 1? 1 : s->bloom > 7? 7 : s->bloom; // 7 bit positions from a 64-bit hash
+		s->n_blk = (n * bits + 511) / 512;
+	} else s->n_blk = (n * 2 + 6) / 7; // half full on average
+	if (s->n_blk == 0) s->n_blk = 1;
+	if (posix_memalign(&b, 64, s->n_blk * 64) != 0) {
+		free(s);
+		return 0;
+	}
+	s->b = (uint64_t*)b;
+	if (s->bloom == 0) {
+		uint64_t i;
+		for (i = 0; i < s->n_blk; ++i) {
+			memset(&s->b[i<<3], 0xff, 56); // all slots MM_KSET_EMPTY
+			s->b[i<<3|7] = 0;
+		}
+	} else memset(s->b, 0, s->n_blk * 64);
+	return s;
+}
+
+void mm_kset_add(mm_kset_t *s, uint64_t x)
+{
+	uint64_t h = mm_kset_hash(x), i = (h >> 32) * s->n_blk >> 32;
+	uint64_t *p = &s->b[i<<3];
+	int j;
+	if (s->bloom) {
+		uint64_t g = mm_kset_hash(h);
+		for (j = 0; j < s->bloom; ++j, g >>= 9)
+			p[g>>6&7] |= 1ULL << (g&63);
+		++s->n;
+		return;
+	}
+	assert(x != MM_KSET_EMPTY && s->n < s->n_blk * 7 - 1); // keep an empty slot for mm_kset_has() to stop at
+	p[7] |= mm_kset_mask(h); // the summary of the home block, even if x spills
+	for (;;) {
+		for (j = 0; j < 7; ++j) {
+			if (p[j] == x) return; // already present
+			if (p[j] == MM_KSET_EMPTY) {
+				p[j] = x, ++s->n;
+				return;
+			}
+		}
+		i = i + 1 == s->n_blk? 0 : i + 1;
+		p = &s->b[i<<3];
+	}
+}
+
+void mm_kset_destroy(mm_kset_t *s)
+{
+	if (s == 0) return;
+	free(s->b); free(s);
+}
+
+double mm_kset_fpr(const mm_kset_t *s)
+{
+	double lambda, pois, fpr = 0.0;
+	int i;
+	if (s->bloom == 0) return 0.0;
+	lambda = (double)s->n / s->n_blk; // the number of k-mers in a block is ~Poisson(lambda)
+	for (i = 0, pois = exp(-lambda); i < 1000 && (i <= lambda || pois > 1e-12); ++i) {
+		fpr += pois * pow(1.0 - pow(1.0 - 1.0 / 512, (double)s->bloom * i), s->bloom);
+		pois *= lambda / (i + 1);
+	}
+	return fpr;
+}
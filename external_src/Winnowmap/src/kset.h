@@ -0,0 +1,85 @@
+#ifndef MM_KSET_H
+#define MM_KSET_H
+
+#include <stdint.h>
+
+/*
+ * Set of down-weighted k-mers, queried for every k-mer of the reference and
+ * the reads. The k-mers are hashed to 64-byte blocks, so that a lookup
+ * usually touches one cache line. By default, the set is exact: a block holds
+ * up to seven k-mers (a full block spills to the next one) and a 64-bit
+ * summary in which each k-mer hashed to the block sets two bits, such that
+ * most absent k-mers are rejected without scanning the block. With bloom>0,
+ * the block is instead a 512-bit Bloom filter in which each k-mer sets bloom
+ * (<=7) bits.
+ */
+
+#define MM_KSET_EMPTY UINT64_MAX // never a 2-bit encoded k-mer
+
+#define MM_KMB_MAGIC "KMB\1" // binary list of k-mers from 'meryl ... export'
+
+typedef struct mm_kset_s {
+	int bloom;      // 0 for the exact set; otherwise the number of bits set per k-mer
+	uint64_t n;     // number of k-mers added
+	uint64_t n_blk; // number of 64-byte blocks
+	uint64_t *b;    // n_blk*8 words, aligned to 64 bytes
+} mm_kset_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Initialize a set of down-weighted k-mers
+ *
+ * @param n       expected number of k-mers
+ * @param bits    0 for the exact set; otherwise bits per k-mer of the Bloom filter
+ *
+ * @return the set; NULL on memory failure
+ */
+mm_kset_t *mm_kset_init(uint64_t n, int bits);
+void mm_kset_add(mm_kset_t *s, uint64_t x);
+void mm_kset_destroy(mm_kset_t *s);
+
+// expected false positive rate; 0 for the exact set
+double mm_kset_fpr(const mm_kset_t *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+static inline uint64_t mm_kset_hash(uint64_t x) // the splitmix64 finalizer
+{
+	x = (x ^ x >> 30) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ x >> 27) * 0x94d049bb133111ebULL;
+	return x ^ x >> 31;
+}
+
+static inline uint64_t mm_kset_mask(uint64_t h) // bits in the block summary
+{
+	return 1ULL << (h & 63) | 1ULL << (h >> 6 & 63);
+}
+
+static inline int mm_kset_has(const mm_kset_t *s, uint64_t x)
+{
+	uint64_t h = mm_kset_hash(x), i = (h >> 32) * s->n_blk >> 32;
+	const uint64_t *p = &s->b[i<<3];
+	int j;
+	if (s->bloom) {
+		uint64_t g = mm_kset_hash(h), y = 1; // bit positions in the block: 9 bits of g each
+		for (j = 0; j < s->bloom; ++j, g >>= 9)
+			y &= p[g>>6&7] >> (g&63);
+		return (int)y;
+	}
+	if ((p[7] & mm_kset_mask(h)) != mm_kset_mask(h)) return 0;
+	for (;;) { // scan the whole block without branches; move on only if it is full
+		int hit = 0, full = 1;
+		for (j = 0; j < 7; ++j)
+			hit |= (p[j] == x), full &= (p[j] != MM_KSET_EMPTY);
+		if (hit || !full) return hit;
+		i = i + 1 == s->n_blk? 0 : i + 1;
+		p = &s->b[i<<3];
+	}
+}
+
+#endif
@@ -0,0 +1,166 @@
+// Benchmark of the sets of down-weighted k-mers.
+//
+// The k-mers are read from a -W list ("kmer count" per line) or, without a
+// file, drawn from a seeded PRNG. The exact set, blocked Bloom filters of a few
+// sizes and the generic Bloom filter used before (ext/bloom; FPR 0.001 with at
+// most two hashes) are built on them and queried with the listed k-mers and
+// with random k-mers, which are mostly absent, as in sketching. The false
+// positive rate is measured against the exact set.
+// Usage: kset-bench [-k 15] [-n 1000000] [-q 20000000] [list.txt]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <algorithm>
+#include "kset.h"
+#include "../ext/bloom/bloom_filter.hpp"
+
+static uint64_t bench_rand(uint64_t *x) // splitmix64
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static double realtime(void)
+{
+	struct timeval tp;
+	gettimeofday(&tp, 0);
+	return tp.tv_sec + tp.tv_usec * 1e-6;
+}
+
+static uint64_t canonical(uint64_t x, int k) // the smaller of the k-mer and its reverse complement, as encodeKmer() in index.c
+{
+	uint64_t y = 0, z = x;
+	int i;
+	for (i = 0; i < k; ++i, z >>= 2)
+		y = y << 2 | (3 ^ (z & 3));
+	return x < y? x : y;
+}
+
+static uint64_t *read_list(const char *fn, int *k, int64_t *n)
+{
+	static const int nt4[4] = { 0, 1, 3, 2 }; // A, C, T, G by (c>>1&3)
+	FILE *fp;
+	char buf[1024];
+	int64_t m = 0;
+	uint64_t *a = 0;
+	if ((fp = fopen(fn, "r")) == 0) return 0;
+	*n = 0;
+	while (fgets(buf, sizeof(buf), fp)) {
+		uint64_t x = 0;
+		int l;
+		for (l = 0; buf[l] && strchr("ACGTacgt", buf[l]); ++l)
+			x = x << 2 | nt4[buf[l]>>1&3];
+		if (l == 0) continue;
+		*k = l;
+		if (*n == m) {
+			m = m? m<<1 : 1024;
+			a = (uint64_t*)realloc(a, m * sizeof(uint64_t));
+		}
+		a[(*n)++] = canonical(x, l);
+	}
+	fclose(fp);
+	return a;
+}
+
+typedef struct {
+	const char *name;
+	mm_kset_t *s;
+	bloom_filter *bf;
+	double mb;
+} set_t;
+
+static inline int set_has(const set_t *t, uint64_t x)
+{
+	return t->s? mm_kset_has(t->s, x) : t->bf->contains(x);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, c, k = 15, n_set = 0;
+	int64_t j, n = 1000000, n_q = 20000000;
+	uint64_t x = 11, mask, *a, *q;
+	set_t set[5];
+	static const int bits[] = { 8, 12, 16 };
+	char names[3][32];
+
+	while ((c = getopt(argc, argv, "k:n:q:s:")) >= 0) {
+		if (c == 'k') k = atoi(optarg);
+		else if (c == 'n') n = atol(optarg);
+		else if (c == 'q') n_q = atol(optarg);
+		else if (c == 's') x = strtoull(optarg, 0, 10);
+	}
+	if (optind < argc) {
+		if ((a = read_list(argv[optind], &k, &n)) == 0) {
+			fprintf(stderr, "ERROR: failed to read the k-mer list '%s'\n", argv[optind]);
+			return 1;
+		}
+	} else {
+		a = (uint64_t*)malloc(n * sizeof(uint64_t));
+		for (j = 0; j < n; ++j)
+			a[j] = canonical(bench_rand(&x) & ((1ULL<<2*k) - 1), k);
+	}
+	mask = (1ULL<<2*k) - 1;
+	q = (uint64_t*)malloc(n_q * sizeof(uint64_t));
+	printf("k=%d\tn=%lld\tqueries=%lld\n", k, (long long)n, (long long)n_q);
+
+	// build
+	set[n_set].name = "exact", set[n_set].s = mm_kset_init(n, 0), set[n_set].bf = 0, ++n_set;
+	for (i = 0; i < 3; ++i) {
+		sprintf(names[i], "blocked-bloom-%d", bits[i]);
+		set[n_set].name = names[i], set[n_set].s = mm_kset_init(n, bits[i]), set[n_set].bf = 0, ++n_set;
+	}
+	{
+		bloom_parameters bp;
+		bp.projected_element_count = std::max((uint64_t)n, (uint64_t)1000);
+		bp.false_positive_probability = 0.001;
+		bp.maximum_number_of_hashes = 2;
+		bp.compute_optimal_parameters();
+		set[n_set].name = "generic-bloom", set[n_set].s = 0, set[n_set].bf = new bloom_filter(bp), ++n_set;
+	}
+	for (i = 0; i < n_set; ++i) {
+		double t = realtime();
+		for (j = 0; j < n; ++j) {
+			if (set[i].s) mm_kset_add(set[i].s, a[j]);
+			else set[i].bf->insert(a[j]);
+		}
+		set[i].mb = set[i].s? set[i].s->n_blk * 64.0 / 1048576 : set[i].bf->size() / 8.0 / 1048576;
+		fprintf(stderr, "[M::%s] built %s in %.3f sec\n", __func__, set[i].name, realtime() - t);
+	}
+
+	// query
+	printf("set\tMB\texpected_FPR\tmeasured_FPR\tMlookups/s(random)\tMlookups/s(listed)\n");
+	for (i = 0; i < n_set; ++i) {
+		int64_t n_fp = 0, n_neg = 0, n_hit = 0;
+		double t_rand, t_list;
+		uint64_t y = x;
+		for (j = 0; j < n_q; ++j) q[j] = canonical(bench_rand(&y) & mask, k);
+		t_rand = realtime();
+		for (j = 0; j < n_q; ++j) n_hit += set_has(&set[i], q[j]);
+		t_rand = realtime() - t_rand;
+		for (j = 0; j < n_q; ++j) {
+			if (mm_kset_has(set[0].s, q[j])) continue;
+			++n_neg;
+			if (set_has(&set[i], q[j])) ++n_fp;
+		}
+		for (j = 0; j < n_q; ++j) q[j] = a[bench_rand(&y) % n];
+		t_list = realtime();
+		for (j = 0; j < n_q; ++j) n_hit += set_has(&set[i], q[j]);
+		t_list = realtime() - t_list;
+		if (set[i].s) printf("%s\t%.2f\t%.3g", set[i].name, set[i].mb, mm_kset_fpr(set[i].s));
+		else printf("%s\t%.2f\t%.3g", set[i].name, set[i].mb, set[i].bf->effective_fpp());
+		printf("\t%.3g\t%.1f\t%.1f\n", n_neg? (double)n_fp / n_neg : 0.0, n_q / t_rand * 1e-6, n_q / t_list * 1e-6);
+		if (n_hit < 0) return 1; // keep the lookups
+	}
+
+	for (i = 0; i < n_set; ++i) {
+		if (set[i].s) mm_kset_destroy(set[i].s);
+		else delete set[i].bf;
+	}
+	free(a); free(q);
+	return 0;
+}
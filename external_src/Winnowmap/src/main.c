@@ -7,6 +7,7 @@
 #include "mmpriv.h"
 #include "ketopt.h"
 #include <thread>
+#include <algorithm>
 
 #define MM_VERSION "2.03"
 
@@ -70,6 +71,9 @@ static ko_longopt_t long_options[] = {
 	{ "junc-bonus",     ko_required_argument, 341 },
 	{ "sam-hit-only",   ko_no_argument,       342 },
 	{ "sv-off",         ko_no_argument,       343 },
+	{ "kmer-bloom",     ko_required_argument, 344 },
+	{ "idx-serve",      ko_required_argument, 345 },
+	{ "idx-socket",     ko_required_argument, 346 },
 	{ "help",           ko_no_argument,       'h' },
 	{ "max-intron-len", ko_required_argument, 'G' },
 	{ "version",        ko_no_argument,       'V' },
@@ -112,10 +116,9 @@ int main(int argc, char *argv[])
 	ketopt_t o = KETOPT_INIT;
 	mm_mapopt_t opt;
 	mm_idxopt_t ipt;
-	int i, c, n_threads = std::max(3, (int) std::thread::hardware_concurrency()/2), n_parts, old_best_n = -1;
-	bool n_threads_override = false;
-	//by default, we set pthread count to half of hardware supported threads
-	char *fnw = 0, *rg = 0, *junc_bed = 0, *s;
+	int i, c, n_threads = std::max(3, (int) std::thread::hardware_concurrency()), n_parts, old_best_n = -1;
+	//by default, we set pthread count to the number of hardware supported threads; the SV-aware probes run on the same threads
+	char *fnw = 0, *rg = 0, *junc_bed = 0, *s, *fn_serve = 0, *fn_socket = 0;
 	FILE *fp_help = stderr;
 	mm_idx_reader_t *idx_rdr;
 	mm_idx_t *mi;
@@ -148,7 +151,7 @@ int main(int argc, char *argv[])
 		else if (c == 'H') ipt.flag |= MM_I_HPC;
 		/*else if (c == 'd') fnw = o.arg; // the above are indexing related options, except -I*/
 		else if (c == 'r') opt.bw = (int)mm_parse_num(o.arg);
-		else if (c == 't') {n_threads = atoi(o.arg); n_threads_override = true;}
+		else if (c == 't') n_threads = atoi(o.arg);
 		else if (c == 'v') mm_verbose = atoi(o.arg);
 		else if (c == 'g') opt.max_gap = (int)mm_parse_num(o.arg);
 		else if (c == 'G') mm_mapopt_max_intron_len(&opt, (int)mm_parse_num(o.arg));
@@ -218,11 +221,10 @@ int main(int argc, char *argv[])
 		else if (c == 338) opt.max_qlen = mm_parse_num(o.arg); // --max-qlen
 		else if (c == 340) junc_bed = o.arg; // --junc-bed
 		else if (c == 342) opt.flag |= MM_F_SAM_HIT_ONLY; // --sam-hit-only
-		else if (c == 343) {
-			opt.SVaware = false; // --sv-off (defaults back to ISMB'20 version)
-			if (n_threads_override == false) // --adjust thread count as openmp is not used
-				n_threads = std::max(3, (int) std::thread::hardware_concurrency());
-		}
+		else if (c == 344) ipt.kmer_bloom = atoi(o.arg); // --kmer-bloom
+		else if (c == 345) fn_serve = o.arg; // --idx-serve
+		else if (c == 346) fn_socket = o.arg; // --idx-socket
+		else if (c == 343) opt.SVaware = false; // --sv-off (defaults back to ISMB'20 version)
 		else if (c == 314) { // --frag
 			yes_or_no(&opt, MM_F_FRAG_MODE, o.longidx, o.arg, 1);
 		} else if (c == 315) { // --secondary
@@ -282,7 +284,7 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "[ERROR]\033[1;31m --splice and --frag should not be specified at the same time.\033[0m\n");
 		return 1;
 	}
-	if (!fnw && !(opt.flag&MM_F_CIGAR))
+	if (!fnw && !fn_serve && !(opt.flag&MM_F_CIGAR))
 		ipt.flag |= MM_I_NO_SEQ;
 	if (mm_check_opt(&ipt, &opt) < 0)
 		return 1;
@@ -300,6 +302,10 @@ int main(int argc, char *argv[])
 		fprintf(fp_help, "    -k INT       k-mer size (no larger than 28) [%d]\n", ipt.k);
 		fprintf(fp_help, "    -w INT       minimizer window size [%d]\n", ipt.w);
 		fprintf(fp_help, "    -W FILE      input file containing list of high frequency k-mers []\n");
+		fprintf(fp_help, "    --kmer-bloom INT\n");
+		fprintf(fp_help, "                 keep -W k-mers in a Bloom filter of INT bits per k-mer instead of an exact set [0]\n");
+		fprintf(fp_help, "    --idx-serve SOCK   serve the index in shared memory to --idx-socket SOCK until killed\n");
+		fprintf(fp_help, "    --idx-socket SOCK  attach the index from server SOCK if it has the same target and -W files\n");
 		fprintf(fp_help, "  Mapping:\n");
 		fprintf(fp_help, "    -f FLOAT     filter out top FLOAT (<1) fraction of repetitive minimizers [0.0]\n");
 		fprintf(fp_help, "    -g NUM       stop chain enlongation if there are no minimizers in INT-bp [%d]\n", opt.max_gap);
@@ -349,11 +355,15 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "[ERROR] incorrect input: in the sr mode, please specify no more than two query files.\n");
 		return 1;
 	}
+	if (fn_serve)
+		return mm_idx_serve(fn_serve, argv[o.ind], opt.kmer_freq_filename, &ipt, n_threads);
 	idx_rdr = mm_idx_reader_open(argv[o.ind], &ipt, fnw);
 	if (idx_rdr == 0) {
 		fprintf(stderr, "[ERROR] failed to open file '%s': %s\n", argv[o.ind], strerror(errno));
 		return 1;
 	}
+	if (fn_socket && mm_idx_reader_attach(idx_rdr, argv[o.ind], opt.kmer_freq_filename, fn_socket) == 0 && mm_verbose >= 3)
+		fprintf(stderr, "[M::%s::%.3f*%.2f] attached the index from server '%s'\n", __func__, realtime() - mm_realtime0, cputime() / (realtime() - mm_realtime0), fn_socket);
 	if (!idx_rdr->is_idx && fnw == 0 && argc - o.ind < 2) {
 		fprintf(stderr, "[ERROR] missing input: please specify a query file to map\n");
 		mm_idx_reader_close(idx_rdr);
@@ -414,7 +424,7 @@ int main(int argc, char *argv[])
 	}
 
 	if (mm_verbose >= 3) {
-		fprintf(stderr, "[M::%s] Version: %s, pthreads=%d, omp_threads=%d\n", __func__, MM_VERSION, n_threads, OMP_PER_READ_THREADS);
+		fprintf(stderr, "[M::%s] Version: %s, threads=%d\n", __func__, MM_VERSION, n_threads);
 		fprintf(stderr, "[M::%s] CMD:", __func__);
 		for (i = 0; i < argc; ++i)
 			fprintf(stderr, " %s", argv[i]);
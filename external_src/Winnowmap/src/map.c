@@ -5,7 +5,8 @@
 #include <cinttypes>
 #include <algorithm>
 #include <tuple>
-#include <omp.h>
+#include <vector>
+#include <cmath>
 #include <iostream>
 #include "kthread.h"
 #include "kvec.h"
@@ -83,6 +84,16 @@ static void collect_minimizers(void *km, const mm_mapopt_t *opt, const mm_idx_t
 	}
 }
 
+// minimizers of seq=c->seq[st,st+len) for the probes of the SV-aware mode; same as collect_minimizers() on seq
+static void collect_sub_minimizers(void *km, const mm_mapopt_t *opt, const mm_idx_t *mi, const mm_sketch_cache_t *c, int st, int len, const char *seq, mm128_v *mv)
+{
+	mv->n = 0;
+	if (c->seq) mm_sketch_sub(km, c, st, st + len, mv, mi);
+	else mm_sketch(km, seq, len, mi->w, mi->k, 0, mi->flag&MM_I_HPC, mv, mi);
+	if (opt->sdust_thres > 0)
+		mv->n = mm_dust_minier(km, mv->n, mv->a, len, seq, opt->sdust_thres);
+}
+
 #include "ksort.h"
 #define heap_lt(a, b) ((a).x > (b).x)
 KSORT_INIT(heap, mm128_t, heap_lt)
@@ -276,9 +287,47 @@ static mm_reg1_t *align_regs(const mm_mapopt_t *opt, const mm_idx_t *mi, void *k
 	return regs;
 }
 
-void mm_map_frag(const mm_idx_t *mi, int n_segs, const int *qlens, const char **seqs, int *n_regs, mm_reg1_t **regs, mm_tbuf_t *b, const mm_mapopt_t *opt, const char *qname)
+typedef struct { // stage 1 of the SV-aware mode on one read
+	int n_pos;             // number of starting positions of the substring probes
+	mm_sketch_cache_t skc; // minimizers of the whole read
+	int64_t *n_a;          // n_a[i]: number of anchors on the MCAS found from the i-th starting position, or 0
+	mm128_t **a;           // a[i]: these anchors, in read coordinates
+	int32_t *st, *en;      // [st[i],en[i]): the read substring the MCAS was found on
+} mm_probe_t;
+
+// prepare stage 1 of mm_map_frag(); return the number of substring probes to run with probe_run()
+static int probe_init(mm_probe_t *pr, const mm_idx_t *mi, const mm_mapopt_t *opt, int n_segs, const int *qlens, const char **seqs)
 {
-	int i, j, rep_len, qlen_sum, n_regs0, n_mini_pos;
+	memset(pr, 0, sizeof(mm_probe_t));
+
+	//check if SVaware mode enabled and query length is sufficient
+	if (!opt->SVaware || n_segs != 1 || qlens[0] < opt->SVawareMinReadLength) return 0;
+
+	pr->n_pos = 1 + std::ceil(qlens[0] * 1.0 / opt->suffixSampleOffset);
+	pr->n_a = (int64_t*)calloc(pr->n_pos, sizeof(int64_t));
+	pr->a = (mm128_t**)calloc(pr->n_pos, sizeof(mm128_t*));
+	pr->st = (int32_t*)calloc(pr->n_pos * 2, sizeof(int32_t));
+	pr->en = pr->st + pr->n_pos;
+
+	//sketch the read once; the probes take their minimizers from it
+	mm_sketch_cache_init(0, &pr->skc, seqs[0], qlens[0], mi->w, mi->k, 0, mi->flag&MM_I_HPC, mi);
+	return (qlens[0] + opt->suffixSampleOffset - 2) / opt->suffixSampleOffset + 1; // sub_begin = 0, offset, ..., up to qlens[0]-1
+}
+
+static void probe_destroy(mm_probe_t *pr)
+{
+	int i;
+	for (i = 0; i < pr->n_pos; i++)
+		free(pr->a[i]);
+	free(pr->a); free(pr->n_a); free(pr->st);
+	mm_sketch_cache_destroy(0, &pr->skc);
+	memset(pr, 0, sizeof(mm_probe_t));
+}
+
+// find an MCAS on the shortest substring to the right or the left of the $suffix_id-th starting position
+static void probe_run(mm_probe_t *pr, const mm_idx_t *mi, const int *qlens, const char **seqs, mm_tbuf_t *b, const mm_mapopt_t *opt, const char *qname, int suffix_id)
+{
+	int i, j, rep_len, qlen_sum, n_regs0, n_mini_pos, n_segs = 1;
 	int max_chain_gap_qry, max_chain_gap_ref, min_chain_gap_ref, is_splice = !!(opt->flag & MM_F_SPLICE), is_sr = !!(opt->flag & MM_F_SR);
 	uint32_t hash;
 	int64_t n_a;
@@ -286,419 +335,378 @@ void mm_map_frag(const mm_idx_t *mi, int n_segs, const int *qlens, const char **
 	mm128_t *a;
 	mm128_v mv = {0,0,0};
 	mm_reg1_t *regs0;
-	km_stat_t kmst;
+	int sub_qlens[1], n_regs[1];
+	const char *sub_seqs[1];
+	mm_reg1_t *regs[1];
 
-	//TODO: generalize this to n_segs > 1
-	assert (n_segs == 1);		//deal with long reads (or asm contigs) only
-	mm128_t **collect_a;
-	int64_t *collect_n_a;
-	mm_tbuf_t *b_master = b; //buffer for main thread entering this function
-
-	//stage1: Pre-compute confident read alignments of substrings of input read
 	//define new set of options for first stage
 	//generate many candidate alignments to improve mapq estimation
 	mm_mapopt_t opt2 = *opt;
 	mm_mapopt_t *opt_2 = &opt2;
 	opt_2->best_n = std::max(5, opt_2->best_n); //set minimum
 
-	int countStartingPositions = 1 + std::ceil(qlens[0] * 1.0 / opt_2->suffixSampleOffset);
-	collect_a = (mm128_t**)kmalloc(b->km, countStartingPositions * sizeof(mm128_t*)); 
-	collect_n_a = (int64_t *)kmalloc(b->km, countStartingPositions * sizeof(int64_t));
-	memset(collect_n_a, 0, countStartingPositions * sizeof(int64_t));
+	int sub_begin = suffix_id * opt_2->suffixSampleOffset;
+	bool mappingFound = false;
+	int max_mapq_currentPos = 0;
+	if (sub_begin >= qlens[0]) sub_begin = qlens[0]-1; //for last iter
+	assert (sub_begin >= 0 && sub_begin < qlens[0]);
 
-	//create a boolean vector to indicate what portion of read were mapped using MCASs
-	int8_t* seqMapped = (int8_t *)kmalloc(b->km, qlens[0] * sizeof(int8_t));
-	memset(seqMapped, 0, qlens[0] * sizeof(int8_t));
-
-	//check if SVaware mode enabled and query length is sufficient
-	if (opt_2->SVaware && qlens[0] >= opt_2->SVawareMinReadLength)
+	for (int sub_len = opt_2->minPrefixLength; sub_len <= opt_2->maxPrefixLength; sub_len *= opt_2->prefixIncrementFactor)
 	{
-		//parallelize single read alignment further for better load balance
-#pragma omp parallel num_threads(OMP_PER_READ_THREADS)
+		//consider 'sub_len' bases to the right
+		if (sub_begin + sub_len <= qlens[0])	//check substring end boundary limit
 		{
-			//make all these variables private to openmp thread by redefining them
-			int i, j, rep_len, qlen_sum, n_regs0, n_mini_pos;
-			uint32_t hash;
-			int64_t n_a;
-			uint64_t *u, *mini_pos;
-			mm128_t *a;
-			mm128_v mv = {0,0,0};
-			mm_reg1_t *regs0;
-			mm_tbuf_t *b = (mm_tbuf_t*)calloc(1, sizeof(mm_tbuf_t)); //omp thread local buffer
-			b->km = km_init();
-			int* sub_qlens = (int *)kmalloc(b->km, 1 * sizeof(int));
-			char **sub_seqs = (char **) kmalloc(b->km, 1 * sizeof(char*));
-			sub_seqs[0] = (char *)kmalloc(b->km, qlens[0] * sizeof(char));
+			mv = {0,0,0};
+			sub_qlens[0] = sub_len;
+			sub_seqs[0] = &seqs[0][sub_begin];
 
-#pragma omp for schedule(dynamic)
-			for (int sub_begin = 0; sub_begin < qlens[0] + opt_2->suffixSampleOffset - 1; sub_begin += opt_2->suffixSampleOffset)
-			{
-				int suffix_id = sub_begin / opt_2->suffixSampleOffset;	//id for this string end-point
+			for (i = 0, qlen_sum = 0; i < n_segs; ++i)
+				qlen_sum += sub_qlens[i], n_regs[i] = 0, regs[i] = 0, n_regs0 = 0;
+
+			if (qlen_sum == 0 || n_segs <= 0 || n_segs > MM_MAX_SEG) break;
+			if (opt_2->max_qlen > 0 && qlen_sum > opt_2->max_qlen) break;
 
-				bool mappingFound = false;
-				int max_mapq_currentPos = 0;
-				if (sub_begin >= qlens[0]) sub_begin = qlens[0]-1; //for last iter
-				assert (sub_begin >= 0 && sub_begin < qlens[0]);
+			hash  = qname? __ac_X31_hash_string(qname) : 0;
+			hash ^= __ac_Wang_hash(qlen_sum) + __ac_Wang_hash(opt_2->seed);
+			hash  = __ac_Wang_hash(hash);
 
-				for (int sub_len = opt_2->minPrefixLength; sub_len <= opt_2->maxPrefixLength; sub_len *= opt_2->prefixIncrementFactor)
+			collect_sub_minimizers(b->km, opt_2, mi, &pr->skc, sub_begin, sub_len, sub_seqs[0], &mv);
+			if (opt_2->flag & MM_F_HEAP_SORT) a = collect_seed_hits_heap(b->km, opt_2, opt_2->mid_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
+			else a = collect_seed_hits(b->km, opt_2, opt_2->mid_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
+
+			if (mm_dbg_flag & MM_DBG_PRINT_SEED) {
+				fprintf(stderr, "RS\t%d\n", rep_len);
+				for (i = 0; i < n_a; ++i)
+					fprintf(stderr, "SD\t%s\t%d\t%c\t%d\t%d\t%d\n", mi->seq[a[i].x<<1>>33].name, (int32_t)a[i].x, "+-"[a[i].x>>63], (int32_t)a[i].y, (int32_t)(a[i].y>>32&0xff),
+							i == 0? 0 : ((int32_t)a[i].y - (int32_t)a[i-1].y) - ((int32_t)a[i].x - (int32_t)a[i-1].x));
+			}
+
+			// set max chaining gap on the query and the reference sequence
+			if (is_sr)
+				max_chain_gap_qry = qlen_sum > opt_2->max_gap? qlen_sum : opt_2->max_gap;
+			else max_chain_gap_qry = opt_2->max_gap;
+
+			if (opt_2->max_gap_ref > 0) {
+				max_chain_gap_ref = opt_2->max_gap_ref; // always honor mm_mapopt_2_t::max_gap_ref if set
+			} else if (opt_2->max_frag_len > 0) {
+				max_chain_gap_ref = opt_2->max_frag_len - qlen_sum;
+				if (max_chain_gap_ref < opt_2->max_gap) max_chain_gap_ref = opt_2->max_gap;
+			} else max_chain_gap_ref = opt_2->max_gap;
+
+			if (opt_2->min_gap_ref < max_chain_gap_ref)
+				min_chain_gap_ref = opt_2->min_gap_ref;
+			else min_chain_gap_ref = max_chain_gap_ref;
+
+			a = mm_chain_dp(max_chain_gap_ref, min_chain_gap_ref, max_chain_gap_qry, opt_2->bw, opt_2->max_chain_skip, opt_2->max_chain_iter, opt_2->min_cnt, opt_2->min_chain_score, opt_2->chain_gap_scale, is_splice, n_segs, n_a, a, &n_regs0, &u, b->km);
+
+			if (opt_2->max_occ > opt_2->mid_occ && rep_len > 0) {
+				int rechain = 0;
+				if (n_regs0 > 0) { // test if the best chain has all the segments
+					int n_chained_segs = 1, max = 0, max_i = -1, max_off = -1, off = 0;
+					for (i = 0; i < n_regs0; ++i) { // find the best chain
+						if (max < (int)(u[i]>>32)) max = u[i]>>32, max_i = i, max_off = off;
+						off += (uint32_t)u[i];
+					}
+					for (i = 1; i < (int32_t)u[max_i]; ++i) // count the number of segments in the best chain
+						if ((a[max_off+i].y&MM_SEED_SEG_MASK) != (a[max_off+i-1].y&MM_SEED_SEG_MASK))
+							++n_chained_segs;
+					if (n_chained_segs < n_segs)
+						rechain = 1;
+				} else rechain = 1;
+				if (rechain) { // redo chaining with a higher max_occ threshold
+					kfree(b->km, a);
+					kfree(b->km, u);
+					kfree(b->km, mini_pos);
+					if (opt_2->flag & MM_F_HEAP_SORT) a = collect_seed_hits_heap(b->km, opt_2, opt_2->max_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
+					else a = collect_seed_hits(b->km, opt_2, opt_2->max_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
+					a = mm_chain_dp(max_chain_gap_ref, min_chain_gap_ref, max_chain_gap_qry, opt_2->bw, opt_2->max_chain_skip, opt_2->max_chain_iter, opt_2->min_cnt, opt_2->min_chain_score, opt_2->chain_gap_scale, is_splice, n_segs, n_a, a, &n_regs0, &u, b->km);
+				}
+			}
+			b->frag_gap = max_chain_gap_ref;
+			b->rep_len = rep_len;
+
+			regs0 = mm_gen_regs(b->km, hash, qlen_sum, n_regs0, u, a);
+
+			if (mm_dbg_flag & MM_DBG_PRINT_SEED)
+				for (j = 0; j < n_regs0; ++j)
+					for (i = regs0[j].as; i < regs0[j].as + regs0[j].cnt; ++i)
+						fprintf(stderr, "CN\t%d\t%s\t%d\t%c\t%d\t%d\t%d\n", j, mi->seq[a[i].x<<1>>33].name, (int32_t)a[i].x, "+-"[a[i].x>>63], (int32_t)a[i].y, (int32_t)(a[i].y>>32&0xff),
+								i == regs0[j].as? 0 : ((int32_t)a[i].y - (int32_t)a[i-1].y) - ((int32_t)a[i].x - (int32_t)a[i-1].x));
+
+			chain_post(opt_2, max_chain_gap_ref, mi, b->km, qlen_sum, n_segs, qlens, &n_regs0, regs0, a);
+			if (!is_sr) mm_est_err(mi, qlen_sum, n_regs0, regs0, a, n_mini_pos, mini_pos);
+
+			if (n_segs == 1) { // uni-segment
+				regs0 = align_regs(opt_2, mi, b->km, sub_qlens[0], sub_seqs[0], &n_regs0, regs0, a);
+				mm_set_mapq(b->km, n_regs0, regs0, opt_2->min_chain_score, opt_2->a, rep_len, is_sr);
+				n_regs[0] = n_regs0, regs[0] = regs0;
+			} else { // multi-segment
+				mm_seg_t *seg;
+				seg = mm_seg_gen(b->km, hash, n_segs, qlens, n_regs0, regs0, n_regs, regs, a); // split fragment chain to separate segment chains
+				free(regs0);
+				for (i = 0; i < n_segs; ++i) {
+					mm_set_parent(b->km, opt_2->mask_level, opt_2->mask_len, n_regs[i], regs[i], opt_2->a * 2 + opt_2->b, opt_2->flag&MM_F_HARD_MLEVEL, opt_2->alt_drop); // update mm_reg1_t::parent
+					regs[i] = align_regs(opt_2, mi, b->km, qlens[i], seqs[i], &n_regs[i], regs[i], seg[i].a);
+					mm_set_mapq(b->km, n_regs[i], regs[i], opt_2->min_chain_score, opt_2->a, rep_len, is_sr);
+				}
+				mm_seg_free(b->km, n_segs, seg);
+				if (n_segs == 2 && opt_2->pe_ori >= 0 && (opt_2->flag&MM_F_CIGAR))
+					mm_pair(b->km, max_chain_gap_ref, opt_2->pe_bonus, opt_2->a * 2 + opt_2->b, opt_2->a, qlens, n_regs, regs); // pairing
+			}
+
+			int mostPromisingMapping = -1;
+			int max_mapq_fragment = 0;
+
+			//For valid mapping, save anchors 
+			for (j = 0; j < n_regs0; ++j)
+			{
+				max_mapq_fragment = std::max ((int32_t)regs0[j].mapq, max_mapq_fragment);
+				max_mapq_currentPos = std::max (max_mapq_fragment, max_mapq_currentPos);
+
+				//Check for high confidence (mapq), length
+				if (regs0[j].mapq >= opt_2->min_mapq && regs0[j].blen >= opt_2->min_qcov * sub_len && regs0[j].cnt > 0)
 				{
-					//consider 'sub_len' bases to the right
-					if (sub_begin + sub_len <= qlens[0])	//check substring end boundary limit
-					{
-						mv = {0,0,0};
-						sub_qlens[0] = sub_len;
-						memcpy (sub_seqs[0], &(seqs[0][sub_begin]), sub_len);
+					mappingFound = true;
+					mostPromisingMapping = j;
+					pr->n_a[suffix_id] = regs0[j].cnt;
 
-						for (i = 0, qlen_sum = 0; i < n_segs; ++i)
-							qlen_sum += sub_qlens[i], n_regs[i] = 0, regs[i] = 0, n_regs0 = 0;
+					if (mm_dbg_flag & MM_DBG_POLISH)
+					{
+						//print MCAS information in paf-like  format, helpful for debugging & dot-plotting MCAS alignments
+						fprintf(stderr, "PO\t%s %d %d %d %c %s %d %d %d %d %d %d %d [FOUND] \n", qname, qlens[0], sub_begin + regs0[j].qs, sub_begin + regs0[j].qe, "+-"[regs0[j].rev] , mi->seq[regs0[j].rid].name, mi->seq[regs0[j].rid].len, regs0[j].rs, regs0[j].re, regs0[j].mapq, suffix_id, sub_begin, sub_len);
+					}
 
-						if (qlen_sum == 0 || n_segs <= 0 || n_segs > MM_MAX_SEG) break;
-						if (opt_2->max_qlen > 0 && qlen_sum > opt_2->max_qlen) break;
+					break;		
+				}
+			}
 
-						hash  = qname? __ac_X31_hash_string(qname) : 0;
-						hash ^= __ac_Wang_hash(qlen_sum) + __ac_Wang_hash(opt_2->seed);
-						hash  = __ac_Wang_hash(hash);
+			if ((mm_dbg_flag & MM_DBG_POLISH) && !mappingFound)
+				fprintf(stderr, "PO\tqname:%s, suffid:%d, begin:%d, len:%d, max_mapq:%d, n_regs0:%d [NONE FOUND] \n", qname, suffix_id, sub_begin, sub_len, max_mapq_fragment, n_regs0);
 
-						collect_minimizers(b->km, opt_2, mi, n_segs, sub_qlens, sub_seqs, &mv);
-						if (opt_2->flag & MM_F_HEAP_SORT) a = collect_seed_hits_heap(b->km, opt_2, opt_2->mid_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
-						else a = collect_seed_hits(b->km, opt_2, opt_2->mid_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
+			if (mappingFound)
+			{
+				assert (pr->n_a[suffix_id] > 0);
+				assert (mostPromisingMapping >= 0);
 
-						if (mm_dbg_flag & MM_DBG_PRINT_SEED) {
-							fprintf(stderr, "RS\t%d\n", rep_len);
-							for (i = 0; i < n_a; ++i)
-								fprintf(stderr, "SD\t%s\t%d\t%c\t%d\t%d\t%d\n", mi->seq[a[i].x<<1>>33].name, (int32_t)a[i].x, "+-"[a[i].x>>63], (int32_t)a[i].y, (int32_t)(a[i].y>>32&0xff),
-										i == 0? 0 : ((int32_t)a[i].y - (int32_t)a[i-1].y) - ((int32_t)a[i].x - (int32_t)a[i-1].x));
-						}
+				pr->a[suffix_id] = (mm128_t*)malloc(pr->n_a[suffix_id] * sizeof(mm128_t));
+				j = mostPromisingMapping;
 
-						// set max chaining gap on the query and the reference sequence
-						if (is_sr)
-							max_chain_gap_qry = qlen_sum > opt_2->max_gap? qlen_sum : opt_2->max_gap;
-						else max_chain_gap_qry = opt_2->max_gap;
-
-						if (opt_2->max_gap_ref > 0) {
-							max_chain_gap_ref = opt_2->max_gap_ref; // always honor mm_mapopt_2_t::max_gap_ref if set
-						} else if (opt_2->max_frag_len > 0) {
-							max_chain_gap_ref = opt_2->max_frag_len - qlen_sum;
-							if (max_chain_gap_ref < opt_2->max_gap) max_chain_gap_ref = opt_2->max_gap;
-						} else max_chain_gap_ref = opt_2->max_gap;
-
-						if (opt_2->min_gap_ref < max_chain_gap_ref)
-							min_chain_gap_ref = opt_2->min_gap_ref;
-						else min_chain_gap_ref = max_chain_gap_ref;
-
-						a = mm_chain_dp(max_chain_gap_ref, min_chain_gap_ref, max_chain_gap_qry, opt_2->bw, opt_2->max_chain_skip, opt_2->max_chain_iter, opt_2->min_cnt, opt_2->min_chain_score, opt->chain_gap_scale, is_splice, n_segs, n_a, a, &n_regs0, &u, b->km);
-
-						if (opt_2->max_occ > opt_2->mid_occ && rep_len > 0) {
-							int rechain = 0;
-							if (n_regs0 > 0) { // test if the best chain has all the segments
-								int n_chained_segs = 1, max = 0, max_i = -1, max_off = -1, off = 0;
-								for (i = 0; i < n_regs0; ++i) { // find the best chain
-									if (max < (int)(u[i]>>32)) max = u[i]>>32, max_i = i, max_off = off;
-									off += (uint32_t)u[i];
-								}
-								for (i = 1; i < (int32_t)u[max_i]; ++i) // count the number of segments in the best chain
-									if ((a[max_off+i].y&MM_SEED_SEG_MASK) != (a[max_off+i-1].y&MM_SEED_SEG_MASK))
-										++n_chained_segs;
-								if (n_chained_segs < n_segs)
-									rechain = 1;
-							} else rechain = 1;
-							if (rechain) { // redo chaining with a higher max_occ threshold
-								kfree(b->km, a);
-								kfree(b->km, u);
-								kfree(b->km, mini_pos);
-								if (opt_2->flag & MM_F_HEAP_SORT) a = collect_seed_hits_heap(b->km, opt_2, opt_2->max_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
-								else a = collect_seed_hits(b->km, opt_2, opt_2->max_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
-								a = mm_chain_dp(max_chain_gap_ref, min_chain_gap_ref, max_chain_gap_qry, opt_2->bw, opt_2->max_chain_skip, opt_2->max_chain_iter, opt_2->min_cnt, opt_2->min_chain_score, opt->chain_gap_scale, is_splice, n_segs, n_a, a, &n_regs0, &u, b->km);
-							}
-						}
-						b->frag_gap = max_chain_gap_ref;
-						b->rep_len = rep_len;
-
-						regs0 = mm_gen_regs(b->km, hash, qlen_sum, n_regs0, u, a);
-
-						if (mm_dbg_flag & MM_DBG_PRINT_SEED)
-							for (j = 0; j < n_regs0; ++j)
-								for (i = regs0[j].as; i < regs0[j].as + regs0[j].cnt; ++i)
-									fprintf(stderr, "CN\t%d\t%s\t%d\t%c\t%d\t%d\t%d\n", j, mi->seq[a[i].x<<1>>33].name, (int32_t)a[i].x, "+-"[a[i].x>>63], (int32_t)a[i].y, (int32_t)(a[i].y>>32&0xff),
-											i == regs0[j].as? 0 : ((int32_t)a[i].y - (int32_t)a[i-1].y) - ((int32_t)a[i].x - (int32_t)a[i-1].x));
-
-						chain_post(opt_2, max_chain_gap_ref, mi, b->km, qlen_sum, n_segs, qlens, &n_regs0, regs0, a);
-						if (!is_sr) mm_est_err(mi, qlen_sum, n_regs0, regs0, a, n_mini_pos, mini_pos);
-
-						if (n_segs == 1) { // uni-segment
-							regs0 = align_regs(opt_2, mi, b->km, sub_qlens[0], sub_seqs[0], &n_regs0, regs0, a);
-							mm_set_mapq(b->km, n_regs0, regs0, opt_2->min_chain_score, opt_2->a, rep_len, is_sr);
-							n_regs[0] = n_regs0, regs[0] = regs0;
-						} else { // multi-segment
-							mm_seg_t *seg;
-							seg = mm_seg_gen(b->km, hash, n_segs, qlens, n_regs0, regs0, n_regs, regs, a); // split fragment chain to separate segment chains
-							free(regs0);
-							for (i = 0; i < n_segs; ++i) {
-								mm_set_parent(b->km, opt_2->mask_level, opt_2->mask_len, n_regs[i], regs[i], opt_2->a * 2 + opt_2->b, opt_2->flag&MM_F_HARD_MLEVEL, opt_2->alt_drop); // update mm_reg1_t::parent
-								regs[i] = align_regs(opt_2, mi, b->km, qlens[i], seqs[i], &n_regs[i], regs[i], seg[i].a);
-								mm_set_mapq(b->km, n_regs[i], regs[i], opt_2->min_chain_score, opt_2->a, rep_len, is_sr);
-							}
-							mm_seg_free(b->km, n_segs, seg);
-							if (n_segs == 2 && opt_2->pe_ori >= 0 && (opt_2->flag&MM_F_CIGAR))
-								mm_pair(b->km, max_chain_gap_ref, opt_2->pe_bonus, opt_2->a * 2 + opt_2->b, opt_2->a, qlens, n_regs, regs); // pairing
-						}
+				for (i = 0; i < regs0[j].cnt; ++i)
+				{
+					mm128_t _a_ = a[i + regs0[j].as];
 
-						int mostPromisingMapping = -1;
-						int max_mapq_fragment = 0;
-
-						//For valid mapping, save anchors 
-						for (j = 0; j < n_regs0; ++j)
-						{
-							max_mapq_fragment = std::max ((int32_t)regs0[j].mapq, max_mapq_fragment);
-							max_mapq_currentPos = std::max (max_mapq_fragment, max_mapq_currentPos);
-
-							//Check for high confidence (mapq), length
-							if (regs0[j].mapq >= opt_2->min_mapq && regs0[j].blen >= opt_2->min_qcov * sub_len && regs0[j].cnt > 0)
-							{
-								mappingFound = true;
-								mostPromisingMapping = j;
-								collect_n_a[suffix_id] = regs0[j].cnt;
-
-								if (mm_dbg_flag & MM_DBG_POLISH)
-								{
-									//print MCAS information in paf-like  format, helpful for debugging & dot-plotting MCAS alignments
-									fprintf(stderr, "PO\t%s %d %d %d %c %s %d %d %d %d %d %d %d [FOUND] \n", qname, qlens[0], sub_begin + regs0[j].qs, sub_begin + regs0[j].qe, "+-"[regs0[j].rev] , mi->seq[regs0[j].rid].name, mi->seq[regs0[j].rid].len, regs0[j].rs, regs0[j].re, regs0[j].mapq, suffix_id, sub_begin, sub_len);
-								}
-
-								break;		
-							}
-						}
+					//correct coordinates of each anchor while storing
+					if (_a_.x >> 63) //reverse strand 
+						_a_.y += (qlens[0] - sub_begin - sub_len);
+					else
+						_a_.y += sub_begin;
+					pr->a[suffix_id][i] = _a_;					
+				}
 
-						if ((mm_dbg_flag & MM_DBG_POLISH) && !mappingFound)
-							fprintf(stderr, "PO\tqname:%s, suffid:%d, begin:%d, len:%d, max_mapq:%d, n_regs0:%d [NONE FOUND] \n", qname, suffix_id, sub_begin, sub_len, max_mapq_fragment, n_regs0);
-
-						if (mappingFound)
-						{
-							assert (collect_n_a[suffix_id] > 0);
-							assert (mostPromisingMapping >= 0);
-
-#pragma omp critical
-							{
-								collect_a[suffix_id] = (mm128_t*)kmalloc(b_master->km, collect_n_a[suffix_id] * sizeof(mm128_t));
-							}
-							j = mostPromisingMapping;
-
-							for (i = 0; i < regs0[j].cnt; ++i)
-							{
-								mm128_t _a_ = a[i + regs0[j].as];
-
-								//correct coordinates of each anchor while storing
-								if (_a_.x >> 63) //reverse strand 
-									_a_.y += (qlens[0] - sub_begin - sub_len);
-								else
-									_a_.y += sub_begin;
-								collect_a[suffix_id][i] = _a_;					
-							}
-
-							//mark mapped interval in boolean vector
-#pragma omp critical
-							{
-								for(i = sub_begin; i < sub_begin + sub_len; i++)
-									seqMapped[i] = 1;
-							}
-						}
+				//mapped interval, marked in seqMapped by map_frag_mcas()
+				pr->st[suffix_id] = sub_begin, pr->en[suffix_id] = sub_begin + sub_len;
+			}
 
-						for (j = 0; j < n_regs0; ++j) {free (regs0[j].p);}
-						free (regs0);
-						kfree(b->km, mv.a);
-						kfree(b->km, a);
-						kfree(b->km, u);
-						kfree(b->km, mini_pos);
+			for (j = 0; j < n_regs0; ++j) {free (regs0[j].p);}
+			free (regs0);
+			kfree(b->km, mv.a);
+			kfree(b->km, a);
+			kfree(b->km, u);
+			kfree(b->km, mini_pos);
 
-						if (mappingFound || !n_regs0)
-							break;		// mappingFound-> found shortest prefix; !n_regs0-> no candidate
-					}
+			if (mappingFound || !n_regs0)
+				break;		// mappingFound-> found shortest prefix; !n_regs0-> no candidate
+		}
 
-					//consider 'sub_len' bases to the left
-					if (sub_begin - sub_len + 1 >= 0)			//check substring start boundary limit
-					{
-						mv = {0,0,0};
-						sub_qlens[0] = sub_len;
-						memcpy (sub_seqs[0], &(seqs[0][sub_begin - sub_len +1]), sub_len);
+		//consider 'sub_len' bases to the left
+		if (sub_begin - sub_len + 1 >= 0)			//check substring start boundary limit
+		{
+			mv = {0,0,0};
+			sub_qlens[0] = sub_len;
+			sub_seqs[0] = &seqs[0][sub_begin - sub_len + 1];
 
-						for (i = 0, qlen_sum = 0; i < n_segs; ++i)
-							qlen_sum += sub_qlens[i], n_regs[i] = 0, regs[i] = 0, n_regs0 = 0;
+			for (i = 0, qlen_sum = 0; i < n_segs; ++i)
+				qlen_sum += sub_qlens[i], n_regs[i] = 0, regs[i] = 0, n_regs0 = 0;
 
-						if (qlen_sum == 0 || n_segs <= 0 || n_segs > MM_MAX_SEG) break;
-						if (opt_2->max_qlen > 0 && qlen_sum > opt_2->max_qlen) break;
+			if (qlen_sum == 0 || n_segs <= 0 || n_segs > MM_MAX_SEG) break;
+			if (opt_2->max_qlen > 0 && qlen_sum > opt_2->max_qlen) break;
 
-						hash  = qname? __ac_X31_hash_string(qname) : 0;
-						hash ^= __ac_Wang_hash(qlen_sum) + __ac_Wang_hash(opt_2->seed);
-						hash  = __ac_Wang_hash(hash);
+			hash  = qname? __ac_X31_hash_string(qname) : 0;
+			hash ^= __ac_Wang_hash(qlen_sum) + __ac_Wang_hash(opt_2->seed);
+			hash  = __ac_Wang_hash(hash);
 
-						collect_minimizers(b->km, opt_2, mi, n_segs, sub_qlens, sub_seqs, &mv);
-						if (opt_2->flag & MM_F_HEAP_SORT) a = collect_seed_hits_heap(b->km, opt_2, opt_2->mid_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
-						else a = collect_seed_hits(b->km, opt_2, opt_2->mid_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
+			collect_sub_minimizers(b->km, opt_2, mi, &pr->skc, sub_begin - sub_len + 1, sub_len, sub_seqs[0], &mv);
+			if (opt_2->flag & MM_F_HEAP_SORT) a = collect_seed_hits_heap(b->km, opt_2, opt_2->mid_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
+			else a = collect_seed_hits(b->km, opt_2, opt_2->mid_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
 
-						if (mm_dbg_flag & MM_DBG_PRINT_SEED) {
-							fprintf(stderr, "RS\t%d\n", rep_len);
-							for (i = 0; i < n_a; ++i)
-								fprintf(stderr, "SD\t%s\t%d\t%c\t%d\t%d\t%d\n", mi->seq[a[i].x<<1>>33].name, (int32_t)a[i].x, "+-"[a[i].x>>63], (int32_t)a[i].y, (int32_t)(a[i].y>>32&0xff),
-										i == 0? 0 : ((int32_t)a[i].y - (int32_t)a[i-1].y) - ((int32_t)a[i].x - (int32_t)a[i-1].x));
-						}
+			if (mm_dbg_flag & MM_DBG_PRINT_SEED) {
+				fprintf(stderr, "RS\t%d\n", rep_len);
+				for (i = 0; i < n_a; ++i)
+					fprintf(stderr, "SD\t%s\t%d\t%c\t%d\t%d\t%d\n", mi->seq[a[i].x<<1>>33].name, (int32_t)a[i].x, "+-"[a[i].x>>63], (int32_t)a[i].y, (int32_t)(a[i].y>>32&0xff),
+							i == 0? 0 : ((int32_t)a[i].y - (int32_t)a[i-1].y) - ((int32_t)a[i].x - (int32_t)a[i-1].x));
+			}
 
-						// set max chaining gap on the query and the reference sequence
-						if (is_sr)
-							max_chain_gap_qry = qlen_sum > opt_2->max_gap? qlen_sum : opt_2->max_gap;
-						else max_chain_gap_qry = opt_2->max_gap;
-
-						if (opt_2->max_gap_ref > 0) {
-							max_chain_gap_ref = opt_2->max_gap_ref; // always honor mm_mapopt_2_t::max_gap_ref if set
-						} else if (opt_2->max_frag_len > 0) {
-							max_chain_gap_ref = opt_2->max_frag_len - qlen_sum;
-							if (max_chain_gap_ref < opt_2->max_gap) max_chain_gap_ref = opt_2->max_gap;
-						} else max_chain_gap_ref = opt_2->max_gap;
-
-						if (opt_2->min_gap_ref < max_chain_gap_ref)
-							min_chain_gap_ref = opt_2->min_gap_ref;
-						else min_chain_gap_ref = max_chain_gap_ref;
-
-						a = mm_chain_dp(max_chain_gap_ref, min_chain_gap_ref, max_chain_gap_qry, opt_2->bw, opt_2->max_chain_skip, opt_2->max_chain_iter, opt_2->min_cnt, opt_2->min_chain_score, opt->chain_gap_scale, is_splice, n_segs, n_a, a, &n_regs0, &u, b->km);
-
-						if (opt_2->max_occ > opt_2->mid_occ && rep_len > 0) {
-							int rechain = 0;
-							if (n_regs0 > 0) { // test if the best chain has all the segments
-								int n_chained_segs = 1, max = 0, max_i = -1, max_off = -1, off = 0;
-								for (i = 0; i < n_regs0; ++i) { // find the best chain
-									if (max < (int)(u[i]>>32)) max = u[i]>>32, max_i = i, max_off = off;
-									off += (uint32_t)u[i];
-								}
-								for (i = 1; i < (int32_t)u[max_i]; ++i) // count the number of segments in the best chain
-									if ((a[max_off+i].y&MM_SEED_SEG_MASK) != (a[max_off+i-1].y&MM_SEED_SEG_MASK))
-										++n_chained_segs;
-								if (n_chained_segs < n_segs)
-									rechain = 1;
-							} else rechain = 1;
-							if (rechain) { // redo chaining with a higher max_occ threshold
-								kfree(b->km, a);
-								kfree(b->km, u);
-								kfree(b->km, mini_pos);
-								if (opt_2->flag & MM_F_HEAP_SORT) a = collect_seed_hits_heap(b->km, opt_2, opt_2->max_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
-								else a = collect_seed_hits(b->km, opt_2, opt_2->max_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
-								a = mm_chain_dp(max_chain_gap_ref, min_chain_gap_ref, max_chain_gap_qry, opt_2->bw, opt_2->max_chain_skip, opt_2->max_chain_iter, opt_2->min_cnt, opt_2->min_chain_score, opt->chain_gap_scale, is_splice, n_segs, n_a, a, &n_regs0, &u, b->km);
-							}
-						}
-						b->frag_gap = max_chain_gap_ref;
-						b->rep_len = rep_len;
-
-						regs0 = mm_gen_regs(b->km, hash, qlen_sum, n_regs0, u, a);
-
-						if (mm_dbg_flag & MM_DBG_PRINT_SEED)
-							for (j = 0; j < n_regs0; ++j)
-								for (i = regs0[j].as; i < regs0[j].as + regs0[j].cnt; ++i)
-									fprintf(stderr, "CN\t%d\t%s\t%d\t%c\t%d\t%d\t%d\n", j, mi->seq[a[i].x<<1>>33].name, (int32_t)a[i].x, "+-"[a[i].x>>63], (int32_t)a[i].y, (int32_t)(a[i].y>>32&0xff),
-											i == regs0[j].as? 0 : ((int32_t)a[i].y - (int32_t)a[i-1].y) - ((int32_t)a[i].x - (int32_t)a[i-1].x));
-
-						chain_post(opt_2, max_chain_gap_ref, mi, b->km, qlen_sum, n_segs, qlens, &n_regs0, regs0, a);
-						if (!is_sr) mm_est_err(mi, qlen_sum, n_regs0, regs0, a, n_mini_pos, mini_pos);
-
-						if (n_segs == 1) { // uni-segment
-							regs0 = align_regs(opt_2, mi, b->km, sub_qlens[0], sub_seqs[0], &n_regs0, regs0, a);
-							mm_set_mapq(b->km, n_regs0, regs0, opt_2->min_chain_score, opt_2->a, rep_len, is_sr);
-							n_regs[0] = n_regs0, regs[0] = regs0;
-						} else { // multi-segment
-							mm_seg_t *seg;
-							seg = mm_seg_gen(b->km, hash, n_segs, qlens, n_regs0, regs0, n_regs, regs, a); // split fragment chain to separate segment chains
-							free(regs0);
-							for (i = 0; i < n_segs; ++i) {
-								mm_set_parent(b->km, opt->mask_level, opt->mask_len, n_regs[i], regs[i], opt->a * 2 + opt->b, opt->flag&MM_F_HARD_MLEVEL, opt->alt_drop); // update mm_reg1_t::parent
-								regs[i] = align_regs(opt_2, mi, b->km, qlens[i], seqs[i], &n_regs[i], regs[i], seg[i].a);
-								mm_set_mapq(b->km, n_regs[i], regs[i], opt_2->min_chain_score, opt_2->a, rep_len, is_sr);
-							}
-							mm_seg_free(b->km, n_segs, seg);
-							if (n_segs == 2 && opt_2->pe_ori >= 0 && (opt_2->flag&MM_F_CIGAR))
-								mm_pair(b->km, max_chain_gap_ref, opt_2->pe_bonus, opt_2->a * 2 + opt_2->b, opt_2->a, qlens, n_regs, regs); // pairing
-						}
+			// set max chaining gap on the query and the reference sequence
+			if (is_sr)
+				max_chain_gap_qry = qlen_sum > opt_2->max_gap? qlen_sum : opt_2->max_gap;
+			else max_chain_gap_qry = opt_2->max_gap;
+
+			if (opt_2->max_gap_ref > 0) {
+				max_chain_gap_ref = opt_2->max_gap_ref; // always honor mm_mapopt_2_t::max_gap_ref if set
+			} else if (opt_2->max_frag_len > 0) {
+				max_chain_gap_ref = opt_2->max_frag_len - qlen_sum;
+				if (max_chain_gap_ref < opt_2->max_gap) max_chain_gap_ref = opt_2->max_gap;
+			} else max_chain_gap_ref = opt_2->max_gap;
+
+			if (opt_2->min_gap_ref < max_chain_gap_ref)
+				min_chain_gap_ref = opt_2->min_gap_ref;
+			else min_chain_gap_ref = max_chain_gap_ref;
+
+			a = mm_chain_dp(max_chain_gap_ref, min_chain_gap_ref, max_chain_gap_qry, opt_2->bw, opt_2->max_chain_skip, opt_2->max_chain_iter, opt_2->min_cnt, opt_2->min_chain_score, opt_2->chain_gap_scale, is_splice, n_segs, n_a, a, &n_regs0, &u, b->km);
+
+			if (opt_2->max_occ > opt_2->mid_occ && rep_len > 0) {
+				int rechain = 0;
+				if (n_regs0 > 0) { // test if the best chain has all the segments
+					int n_chained_segs = 1, max = 0, max_i = -1, max_off = -1, off = 0;
+					for (i = 0; i < n_regs0; ++i) { // find the best chain
+						if (max < (int)(u[i]>>32)) max = u[i]>>32, max_i = i, max_off = off;
+						off += (uint32_t)u[i];
+					}
+					for (i = 1; i < (int32_t)u[max_i]; ++i) // count the number of segments in the best chain
+						if ((a[max_off+i].y&MM_SEED_SEG_MASK) != (a[max_off+i-1].y&MM_SEED_SEG_MASK))
+							++n_chained_segs;
+					if (n_chained_segs < n_segs)
+						rechain = 1;
+				} else rechain = 1;
+				if (rechain) { // redo chaining with a higher max_occ threshold
+					kfree(b->km, a);
+					kfree(b->km, u);
+					kfree(b->km, mini_pos);
+					if (opt_2->flag & MM_F_HEAP_SORT) a = collect_seed_hits_heap(b->km, opt_2, opt_2->max_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
+					else a = collect_seed_hits(b->km, opt_2, opt_2->max_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
+					a = mm_chain_dp(max_chain_gap_ref, min_chain_gap_ref, max_chain_gap_qry, opt_2->bw, opt_2->max_chain_skip, opt_2->max_chain_iter, opt_2->min_cnt, opt_2->min_chain_score, opt_2->chain_gap_scale, is_splice, n_segs, n_a, a, &n_regs0, &u, b->km);
+				}
+			}
+			b->frag_gap = max_chain_gap_ref;
+			b->rep_len = rep_len;
+
+			regs0 = mm_gen_regs(b->km, hash, qlen_sum, n_regs0, u, a);
+
+			if (mm_dbg_flag & MM_DBG_PRINT_SEED)
+				for (j = 0; j < n_regs0; ++j)
+					for (i = regs0[j].as; i < regs0[j].as + regs0[j].cnt; ++i)
+						fprintf(stderr, "CN\t%d\t%s\t%d\t%c\t%d\t%d\t%d\n", j, mi->seq[a[i].x<<1>>33].name, (int32_t)a[i].x, "+-"[a[i].x>>63], (int32_t)a[i].y, (int32_t)(a[i].y>>32&0xff),
+								i == regs0[j].as? 0 : ((int32_t)a[i].y - (int32_t)a[i-1].y) - ((int32_t)a[i].x - (int32_t)a[i-1].x));
+
+			chain_post(opt_2, max_chain_gap_ref, mi, b->km, qlen_sum, n_segs, qlens, &n_regs0, regs0, a);
+			if (!is_sr) mm_est_err(mi, qlen_sum, n_regs0, regs0, a, n_mini_pos, mini_pos);
+
+			if (n_segs == 1) { // uni-segment
+				regs0 = align_regs(opt_2, mi, b->km, sub_qlens[0], sub_seqs[0], &n_regs0, regs0, a);
+				mm_set_mapq(b->km, n_regs0, regs0, opt_2->min_chain_score, opt_2->a, rep_len, is_sr);
+				n_regs[0] = n_regs0, regs[0] = regs0;
+			} else { // multi-segment
+				mm_seg_t *seg;
+				seg = mm_seg_gen(b->km, hash, n_segs, qlens, n_regs0, regs0, n_regs, regs, a); // split fragment chain to separate segment chains
+				free(regs0);
+				for (i = 0; i < n_segs; ++i) {
+					mm_set_parent(b->km, opt->mask_level, opt->mask_len, n_regs[i], regs[i], opt->a * 2 + opt->b, opt->flag&MM_F_HARD_MLEVEL, opt->alt_drop); // update mm_reg1_t::parent
+					regs[i] = align_regs(opt_2, mi, b->km, qlens[i], seqs[i], &n_regs[i], regs[i], seg[i].a);
+					mm_set_mapq(b->km, n_regs[i], regs[i], opt_2->min_chain_score, opt_2->a, rep_len, is_sr);
+				}
+				mm_seg_free(b->km, n_segs, seg);
+				if (n_segs == 2 && opt_2->pe_ori >= 0 && (opt_2->flag&MM_F_CIGAR))
+					mm_pair(b->km, max_chain_gap_ref, opt_2->pe_bonus, opt_2->a * 2 + opt_2->b, opt_2->a, qlens, n_regs, regs); // pairing
+			}
 
-						int mostPromisingMapping = -1;
-						int max_mapq_fragment = 0;
-
-						//For valid mapping, save anchors 
-						for (j = 0; j < n_regs0; ++j)
-						{
-							max_mapq_fragment = std::max ((int32_t)regs0[j].mapq, max_mapq_fragment);
-							max_mapq_currentPos = std::max (max_mapq_fragment, max_mapq_currentPos);
-
-							//Check for high confidence (mapq), length
-							if (regs0[j].mapq >= opt_2->min_mapq && regs0[j].blen >= opt_2->min_qcov * sub_len && regs0[j].cnt > 0)
-							{
-								mappingFound = true;
-								mostPromisingMapping = j;
-								collect_n_a[suffix_id] = regs0[j].cnt;
-
-								if (mm_dbg_flag & MM_DBG_POLISH)
-								{
-									//print MCAS information in paf-like  format, helpful for debugging & dot-plotting MCAS alignments
-									fprintf(stderr, "PO\t%s %d %d %d %c %s %d %d %d %d %d %d %d [FOUND] \n", qname, qlens[0], sub_begin - sub_len + regs0[j].qs, sub_begin - sub_len + regs0[j].qe, "+-"[regs0[j].rev] , mi->seq[regs0[j].rid].name, mi->seq[regs0[j].rid].len, regs0[j].rs, regs0[j].re, regs0[j].mapq, suffix_id, sub_begin, -1 * sub_len);
-								}
-
-								break;	
-							}
-						}
+			int mostPromisingMapping = -1;
+			int max_mapq_fragment = 0;
 
-						if ((mm_dbg_flag & MM_DBG_POLISH) && !mappingFound)
-							fprintf(stderr, "PO\tqname:%s, suffid:%d, begin:%d, len:%d, max_mapq:%d, n_regs0:%d [NONE FOUND] \n", qname, suffix_id, sub_begin, -1 * sub_len, max_mapq_fragment, n_regs0);
-
-						if (mappingFound)
-						{
-							assert (collect_n_a[suffix_id] > 0);
-							assert (mostPromisingMapping >= 0);
-
-#pragma omp critical
-							{
-								collect_a[suffix_id] = (mm128_t*)kmalloc(b_master->km, collect_n_a[suffix_id] * sizeof(mm128_t));
-							}
-							j = mostPromisingMapping;
-
-							for (i = 0; i < regs0[j].cnt; ++i)
-							{
-								mm128_t _a_ = a[i + regs0[j].as];
-
-								//correct coordinates of each anchor while storing
-								if (_a_.x >> 63) //reverse strand 
-									_a_.y += (qlens[0]-1) - sub_begin;  
-								else
-									_a_.y += sub_begin - sub_len + 1;		//offset of first base of substring
-								collect_a[suffix_id][i] = _a_;					
-							}
-
-							//mark mapped interval in boolean vector
-#pragma omp critical
-							{
-								for(i = sub_begin - sub_len +1; i <= sub_begin; i++)
-									seqMapped[i] = 1;
-							}
-						}
+			//For valid mapping, save anchors 
+			for (j = 0; j < n_regs0; ++j)
+			{
+				max_mapq_fragment = std::max ((int32_t)regs0[j].mapq, max_mapq_fragment);
+				max_mapq_currentPos = std::max (max_mapq_fragment, max_mapq_currentPos);
 
-						for (j = 0; j < n_regs0; ++j) {free (regs0[j].p);}
-						free (regs0);
-						kfree(b->km, mv.a);
-						kfree(b->km, a);
-						kfree(b->km, u);
-						kfree(b->km, mini_pos);
+				//Check for high confidence (mapq), length
+				if (regs0[j].mapq >= opt_2->min_mapq && regs0[j].blen >= opt_2->min_qcov * sub_len && regs0[j].cnt > 0)
+				{
+					mappingFound = true;
+					mostPromisingMapping = j;
+					pr->n_a[suffix_id] = regs0[j].cnt;
 
-						if (mappingFound || !n_regs0)
-							break;		// mappingFound-> found shortest prefix; !n_regs0-> no candidate
+					if (mm_dbg_flag & MM_DBG_POLISH)
+					{
+						//print MCAS information in paf-like  format, helpful for debugging & dot-plotting MCAS alignments
+						fprintf(stderr, "PO\t%s %d %d %d %c %s %d %d %d %d %d %d %d [FOUND] \n", qname, qlens[0], sub_begin - sub_len + regs0[j].qs, sub_begin - sub_len + regs0[j].qe, "+-"[regs0[j].rev] , mi->seq[regs0[j].rid].name, mi->seq[regs0[j].rid].len, regs0[j].rs, regs0[j].re, regs0[j].mapq, suffix_id, sub_begin, -1 * sub_len);
 					}
+
+					break;	
+				}
+			}
+
+			if ((mm_dbg_flag & MM_DBG_POLISH) && !mappingFound)
+				fprintf(stderr, "PO\tqname:%s, suffid:%d, begin:%d, len:%d, max_mapq:%d, n_regs0:%d [NONE FOUND] \n", qname, suffix_id, sub_begin, -1 * sub_len, max_mapq_fragment, n_regs0);
+
+			if (mappingFound)
+			{
+				assert (pr->n_a[suffix_id] > 0);
+				assert (mostPromisingMapping >= 0);
+
+				pr->a[suffix_id] = (mm128_t*)malloc(pr->n_a[suffix_id] * sizeof(mm128_t));
+				j = mostPromisingMapping;
+
+				for (i = 0; i < regs0[j].cnt; ++i)
+				{
+					mm128_t _a_ = a[i + regs0[j].as];
+
+					//correct coordinates of each anchor while storing
+					if (_a_.x >> 63) //reverse strand 
+						_a_.y += (qlens[0]-1) - sub_begin;  
+					else
+						_a_.y += sub_begin - sub_len + 1;		//offset of first base of substring
+					pr->a[suffix_id][i] = _a_;					
 				}
 
-				if ((mm_dbg_flag & MM_DBG_POLISH) && !mappingFound)
-					fprintf(stderr, "PO\tqname:%s, begin:%d, max_mapq_currentPos:%d [NONE FOUND] \n", qname, sub_begin, max_mapq_currentPos);
+				//mapped interval, marked in seqMapped by map_frag_mcas()
+				pr->st[suffix_id] = sub_begin - sub_len + 1, pr->en[suffix_id] = sub_begin + 1;
 			}
 
-			//free openmp thread specific memory
-			kfree(b->km, sub_qlens);
-			kfree(b->km, sub_seqs[0]);
-			kfree(b->km, sub_seqs);
-			mm_tbuf_destroy(b);
+			for (j = 0; j < n_regs0; ++j) {free (regs0[j].p);}
+			free (regs0);
+			kfree(b->km, mv.a);
+			kfree(b->km, a);
+			kfree(b->km, u);
+			kfree(b->km, mini_pos);
+
+			if (mappingFound || !n_regs0)
+				break;		// mappingFound-> found shortest prefix; !n_regs0-> no candidate
 		}
 	}
 
+	if ((mm_dbg_flag & MM_DBG_POLISH) && !mappingFound)
+		fprintf(stderr, "PO\tqname:%s, begin:%d, max_mapq_currentPos:%d [NONE FOUND] \n", qname, sub_begin, max_mapq_currentPos);
+}
+
+static void map_frag_mcas(const mm_idx_t *mi, int n_segs, const int *qlens, const char **seqs, int *n_regs, mm_reg1_t **regs, mm_tbuf_t *b, const mm_mapopt_t *opt, const char *qname, const mm_probe_t *pr)
+{
+	int i, j, rep_len = 0, qlen_sum, n_regs0, n_mini_pos; // rep_len stays 0 if the MCASs cover the whole read
+	int max_chain_gap_qry, max_chain_gap_ref, min_chain_gap_ref, is_splice = !!(opt->flag & MM_F_SPLICE), is_sr = !!(opt->flag & MM_F_SR);
+	uint32_t hash;
+	int64_t n_a;
+	uint64_t *u, *mini_pos;
+	mm128_t *a;
+	mm128_v mv = {0,0,0};
+	mm_reg1_t *regs0;
+	km_stat_t kmst;
+
+	//create a boolean vector to indicate what portion of read were mapped using MCASs
+	int8_t* seqMapped = (int8_t *)kmalloc(b->km, qlens[0] * sizeof(int8_t));
+	memset(seqMapped, 0, qlens[0] * sizeof(int8_t));
+	for (i = 0; i < pr->n_pos; i++)
+		if (pr->n_a[i] > 0)
+			memset(&seqMapped[pr->st[i]], 1, pr->en[i] - pr->st[i]);
+
 	if (mm_dbg_flag & MM_DBG_POLISH)
 	{
 		int mappedcnt = 0;
@@ -730,8 +738,8 @@ void mm_map_frag(const mm_idx_t *mi, int n_segs, const int *qlens, const char **
 
 		//Use anchors from our own analysis
 		n_a = 0;
-		for (i = 0; i < countStartingPositions; i++)
-			n_a += collect_n_a[i];
+		for (i = 0; i < pr->n_pos; i++)
+			n_a += pr->n_a[i];
 
 		if ((mm_dbg_flag & MM_DBG_POLISH) && opt->SVaware)
 			fprintf(stderr, "PO\tqname:%s, n_a (before filtering and checking for duplicates) :%" PRId64 "\n", qname, n_a);
@@ -743,9 +751,9 @@ void mm_map_frag(const mm_idx_t *mi, int n_segs, const int *qlens, const char **
 
 			//set values of anchors
 			int64_t n_a_counter = 0;
-			for (i = 0; i < countStartingPositions; i++)
-				for (j=0; j<collect_n_a[i]; j++)
-					a[n_a_counter++] = collect_a[i][j];		
+			for (i = 0; i < pr->n_pos; i++)
+				for (j=0; j<pr->n_a[i]; j++)
+					a[n_a_counter++] = pr->a[i][j];		
 
 			//discard duplicate entries
 			int64_t n_a_unique = 0;
@@ -856,7 +864,13 @@ void mm_map_frag(const mm_idx_t *mi, int n_segs, const int *qlens, const char **
 			*opt_3 = *opt;
 
 			mv = {0,0,0};
-			collect_minimizers(b->km, opt_3, mi, n_segs, qlens, seqs, &mv);
+			if (pr->skc.seq) { // the whole read has been sketched in stage 1
+				kv_resize(mm128_t, b->km, mv, pr->skc.mv.n);
+				memcpy(mv.a, pr->skc.mv.a, pr->skc.mv.n * sizeof(mm128_t));
+				mv.n = pr->skc.mv.n;
+				if (opt_3->sdust_thres > 0)
+					mv.n = mm_dust_minier(b->km, mv.n, mv.a, qlens[0], seqs[0], opt_3->sdust_thres);
+			} else collect_minimizers(b->km, opt_3, mi, n_segs, qlens, seqs, &mv);
 			if (opt_3->flag & MM_F_HEAP_SORT) a = collect_seed_hits_heap(b->km, opt_3, opt_3->mid_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
 			else a = collect_seed_hits(b->km, opt_3, opt_3->mid_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
 
@@ -953,12 +967,6 @@ void mm_map_frag(const mm_idx_t *mi, int n_segs, const int *qlens, const char **
 		/*kfree(b->km, mv.a);*/
 	}
 
-	for (i = 0; i < countStartingPositions; i++)
-		if (collect_n_a[i] > 0)
-			kfree(b->km, collect_a[i]);
-
-	kfree(b->km, collect_a);
-	kfree(b->km, collect_n_a);
 	kfree(b->km, seqMapped);
 
 	if (b->km) {
@@ -973,6 +981,23 @@ void mm_map_frag(const mm_idx_t *mi, int n_segs, const int *qlens, const char **
 	}
 }
 
+void mm_map_frag(const mm_idx_t *mi, int n_segs, const int *qlens, const char **seqs, int *n_regs, mm_reg1_t **regs, mm_tbuf_t *b, const mm_mapopt_t *opt, const char *qname)
+{
+	int i, n_probes;
+	mm_probe_t pr;
+
+	//TODO: generalize this to n_segs > 1
+	assert (n_segs == 1);		//deal with long reads (or asm contigs) only
+
+	//stage1: Pre-compute confident read alignments of substrings of input read
+	n_probes = probe_init(&pr, mi, opt, n_segs, qlens, seqs);
+	for (i = 0; i < n_probes; ++i)
+		probe_run(&pr, mi, qlens, seqs, b, opt, qname, i);
+
+	map_frag_mcas(mi, n_segs, qlens, seqs, n_regs, regs, b, opt, qname, &pr);
+	probe_destroy(&pr);
+}
+
 mm_reg1_t *mm_map(const mm_idx_t *mi, int qlen, const char *seq, int *n_regs, mm_tbuf_t *b, const mm_mapopt_t *opt, const char *qname)
 {
 	mm_reg1_t *regs;
@@ -1003,6 +1028,9 @@ typedef struct {
 	int *n_reg, *seg_off, *n_seg, *rep_len, *frag_gap;
 	mm_reg1_t **reg;
 	mm_tbuf_t **buf;
+	mm_probe_t *probe; // stage 1 of the SV-aware reads
+	int *n_probe;      // number of substring probes of each fragment; 0 if not in the SV-aware mode
+	uint64_t *task;
 } step_t;
 
 static void worker_for(void *_data, long i, int tid) // kt_for() callback
@@ -1020,7 +1048,12 @@ static void worker_for(void *_data, long i, int tid) // kt_for() callback
 		qlens[j] = s->seq[off + j].l_seq;
 		qseqs[j] = s->seq[off + j].seq;
 	}
-	if (s->p->opt->flag & MM_F_INDEPEND_SEG) {
+	if (s->n_probe && s->n_probe[i] > 0) { // stage 1 has been run by worker_task()
+		map_frag_mcas(s->p->mi, 1, qlens, qseqs, &s->n_reg[off], &s->reg[off], b, s->p->opt, s->seq[off].name, &s->probe[i]);
+		probe_destroy(&s->probe[i]);
+		s->rep_len[off] = b->rep_len;
+		s->frag_gap[off] = b->frag_gap;
+	} else if (s->p->opt->flag & MM_F_INDEPEND_SEG) {
 		for (j = 0; j < s->n_seg[i]; ++j) {
 			mm_map_frag(s->p->mi, 1, &qlens[j], &qseqs[j], &s->n_reg[off+j], &s->reg[off+j], b, s->p->opt, s->seq[off+j].name);
 			s->rep_len[off + j] = b->rep_len;
@@ -1047,6 +1080,88 @@ static void worker_for(void *_data, long i, int tid) // kt_for() callback
 		}
 }
 
+static void worker_probe_init(void *_data, long i, int tid) // kt_for() callback
+{
+	step_t *s = (step_t*)_data;
+	long f = s->task[i];
+	int off = s->seg_off[f];
+	const char *qseq = s->seq[off].seq;
+	s->n_probe[f] = probe_init(&s->probe[f], s->p->mi, s->p->opt, s->n_seg[f], &s->seq[off].l_seq, &qseq);
+}
+
+static void worker_task(void *_data, long i, int tid) // kt_for() callback
+{
+	step_t *s = (step_t*)_data;
+	long f = s->task[i] >> 32;
+	int j = (uint32_t)s->task[i], off = s->seg_off[f];
+	const char *qseq = s->seq[off].seq;
+	if (j > 0) probe_run(&s->probe[f], s->p->mi, &s->seq[off].l_seq, &qseq, s->buf[tid], s->p->opt, s->seq[off].name, j - 1);
+	else worker_for(_data, f, tid);
+}
+
+static void worker_probed(void *_data, long i, int tid) // kt_for() callback
+{
+	step_t *s = (step_t*)_data;
+	worker_for(_data, s->task[i], tid);
+}
+
+#define MM_PROBE_CHUNK 4000000 // bases per thread in one round of map_batch(); bounds the sketch caches and MCASs held at once
+
+/*
+ * The substring probes of the SV-aware reads (stage 1 of mm_map_frag()) are
+ * tasks of their own on the kt_for() workers, next to whole reads not in the
+ * SV-aware mode; each worker keeps its kalloc buffer across tasks. Once all
+ * the probes are done, the SV-aware reads are finished from their MCASs.
+ * The batch goes through these phases in chunks of fragments of about
+ * MM_PROBE_CHUNK bases per thread, so that the memory of stage 1 doesn't grow
+ * with the batch size.
+ */
+static void map_batch(step_t *s)
+{
+	const pipeline_t *p = s->p;
+	long i, j, f0, f1, n_task, m_task = 0;
+	int64_t l, max_len = (int64_t)MM_PROBE_CHUNK * p->n_threads;
+	if (!p->opt->SVaware) {
+		kt_for(p->n_threads, worker_for, s, s->n_frag);
+		return;
+	}
+	s->probe = (mm_probe_t*)calloc(s->n_frag, sizeof(mm_probe_t));
+	s->n_probe = (int*)calloc(s->n_frag, sizeof(int));
+	s->task = 0;
+	for (f0 = 0; f0 < s->n_frag; f0 = f1) {
+		for (f1 = f0, l = 0; f1 < s->n_frag && (f1 == f0 || l < max_len); ++f1)
+			for (j = 0; j < s->n_seg[f1]; ++j)
+				l += s->seq[s->seg_off[f1] + j].l_seq;
+		if (f1 - f0 > m_task) {
+			m_task = f1 - f0;
+			s->task = (uint64_t*)realloc(s->task, m_task * sizeof(uint64_t));
+		}
+		for (i = f0; i < f1; ++i) s->task[i - f0] = i;
+		kt_for(p->n_threads, worker_probe_init, s, f1 - f0);
+		for (i = f0, n_task = 0; i < f1; ++i)
+			n_task += s->n_probe[i] > 0? s->n_probe[i] : 1;
+		if (n_task > m_task) {
+			m_task = n_task;
+			s->task = (uint64_t*)realloc(s->task, m_task * sizeof(uint64_t));
+		}
+		for (i = f0, n_task = 0; i < f1; ++i) { // the probes of a read are next to each other, in fragment order
+			if (s->n_probe[i] > 0) {
+				for (j = 0; j < s->n_probe[i]; ++j)
+					s->task[n_task++] = (uint64_t)i << 32 | (j + 1);
+			} else s->task[n_task++] = (uint64_t)i << 32;
+		}
+		kt_for(p->n_threads, worker_task, s, n_task);
+		for (i = f0, n_task = 0; i < f1; ++i)
+			if (s->n_probe[i] > 0) {
+				mm_sketch_cache_trim(0, &s->probe[i].skc); // stage 3 only needs the minimizers of the whole read
+				s->task[n_task++] = i;
+			}
+		kt_for(p->n_threads, worker_probed, s, n_task);
+	}
+	free(s->task); free(s->n_probe); free(s->probe);
+	s->task = 0, s->n_probe = 0, s->probe = 0;
+}
+
 static void merge_hits(step_t *s)
 {
 	int f, i, k0, k, max_seg = 0, *n_reg_part, *rep_len_part, *frag_gap_part, *qlens;
@@ -1161,7 +1276,7 @@ static void *worker_pipeline(void *shared, int step, void *in)
 		} else free(s);
 	} else if (step == 1) { // step 1: map
 		if (p->n_parts > 0) merge_hits((step_t*)in);
-		else kt_for(p->n_threads, worker_for, in, ((step_t*)in)->n_frag);
+		else map_batch((step_t*)in);
 		return in;
 	} else if (step == 2) { // step 2: output
 		void *km = 0;
@@ -4,7 +4,6 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/types.h>
-#include "../ext/bloom/bloom_filter.hpp"
 
 #define MM_F_NO_DIAG       0x001 // no exact diagonal hit
 #define MM_F_NO_DUAL       0x002 // skip pairs where query name is lexicographically larger than target name
@@ -43,11 +42,10 @@
 #define MM_I_NO_NAME      0x4
 
 #define MM_IDX_MAGIC   "MMI\2"
+#define MM_IDX_FLAT_MAGIC "WMI\3" // index laid out for a single mmap(); see mm_idx_dump_flat()
 
 #define MM_MAX_SEG       255
 
-#define OMP_PER_READ_THREADS 3
-
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -73,8 +71,10 @@ typedef struct {
 	uint32_t *S;               // 4-bit packed sequence
 	struct mm_idx_bucket_s *B; // index (hidden)
 	struct mm_idx_intv_s *I;   // intervals (hidden)
-	bloom_filter* downFilter;  // bloom filter for down-weighted kmers
+	struct mm_kset_s *downFilter; // down-weighted k-mers (hidden)
 	void *km, *h;
+	void *map;                 // memory mapping backing B[]->p, S and downFilter for an attached index (hidden)
+	uint64_t map_len;
 } mm_idx_t;
 
 // minimap2 alignment
@@ -107,6 +107,7 @@ typedef struct {
 typedef struct {
 	short k, w, flag, bucket_bits;
 	int mini_batch_size;
+	int kmer_bloom;  // 0 for the exact set of down-weighted k-mers; otherwise bits per k-mer of a Bloom filter
 	uint64_t batch_size;
 } mm_idxopt_t;
 
@@ -186,6 +187,8 @@ typedef struct {
 		struct mm_bseq_file_s *seq;
 		FILE *idx;
 	} fp;
+	int is_srv;               // the index is attached from an index server (hidden)
+	mm_idx_t *srv;            // the attached index, until returned by mm_idx_reader_read() (hidden)
 } mm_idx_reader_t;
 
 // memory buffer for thread-local storage during mapping
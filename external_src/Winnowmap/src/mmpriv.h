@@ -60,6 +60,25 @@ uint32_t ks_ksmall_uint32_t(size_t n, uint32_t arr[], size_t kk);
 
 void mm_sketch(void *km, const char *str, int len, int w, int k, uint32_t rid, int is_hpc, mm128_v *p, const mm_idx_t *mi);
 
+#define MM_SKC_FULL 0x80000000U
+#define MM_SKC_NONE 0xffffffffU
+
+typedef struct { // minimizers of a whole read, for the substring probes of the SV-aware mode
+	const char *seq;
+	int len, w, k, is_hpc;
+	uint32_t rid;
+	mm128_v mv;    // minimizers of seq
+	int n_emit;    // minimizers written before the end of seq
+	int32_t *emit; // emit[i]: the base at which mv.a[i] was written
+	mm128_v mins;  // successive window minima
+	uint32_t *min; // min[i]: index in mins of the window minimum after base i, MM_SKC_FULL set if the window was full of k-mers
+} mm_sketch_cache_t;
+
+void mm_sketch_cache_init(void *km, mm_sketch_cache_t *c, const char *str, int len, int w, int k, uint32_t rid, int is_hpc, const mm_idx_t *mi);
+void mm_sketch_cache_destroy(void *km, mm_sketch_cache_t *c);
+void mm_sketch_cache_trim(void *km, mm_sketch_cache_t *c);
+void mm_sketch_sub(void *km, const mm_sketch_cache_t *c, int st, int en, mm128_v *p, const mm_idx_t *mi);
+
 int mm_write_sam_hdr(const mm_idx_t *mi, const char *rg, const char *ver, int argc, char *argv[]);
 void mm_write_paf(kstring_t *s, const mm_idx_t *mi, const mm_bseq1_t *t, const mm_reg1_t *r, void *km, int opt_flag);
 void mm_write_paf3(kstring_t *s, const mm_idx_t *mi, const mm_bseq1_t *t, const mm_reg1_t *r, void *km, int opt_flag, int rep_len);
@@ -70,6 +89,10 @@ void mm_write_sam3(kstring_t *s, const mm_idx_t *mi, const mm_bseq1_t *t, int se
 void mm_idxopt_init(mm_idxopt_t *opt);
 const uint64_t *mm_idx_get(const mm_idx_t *mi, uint64_t minier, int *n);
 int32_t mm_idx_cal_max_occ(const mm_idx_t *mi, float f);
+void mm_idx_dump_flat(FILE *fp, const mm_idx_t *mi);
+mm_idx_t *mm_idx_map_flat(int fd);
+int mm_idx_serve(const char *sock_fn, const char *fn, const char *fn_kmer, const mm_idxopt_t *opt, int n_threads);
+int mm_idx_reader_attach(mm_idx_reader_t *r, const char *fn, const char *fn_kmer, const char *sock_fn);
 mm128_t *mm_chain_dp(int max_dist_x, int min_dist_x, int max_dist_y, int bw, int max_skip, int max_iter, int min_cnt, int min_sc, float gap_scale, int is_cdna, int n_segs, int64_t n, mm128_t *a, int *n_u_, uint64_t **_u, void *km);
 mm_reg1_t *mm_align_skeleton(void *km, const mm_mapopt_t *opt, const mm_idx_t *mi, int qlen, const char *qstr, int *n_regs_, mm_reg1_t *regs, mm128_t *a);
 
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <climits>
+#include <cmath>
 #include "mmpriv.h"
 
 void mm_idxopt_init(mm_idxopt_t *opt)
@@ -5,6 +5,7 @@
 #define __STDC_LIMIT_MACROS
 #include "kvec.h"
 #include "mmpriv.h"
+#include "kset.h"
 #include <cmath>
 #include <iostream>
 #include <fstream>
@@ -73,7 +74,7 @@ static inline double applyWeight(uint64_t kmer, const mm_idx_t *mi)
 	double x = hash * 1.0 / UINT64_MAX;  //bring it within [0, 1]
 	//assert (x >= 0.0 && x <= 1.0);
 
-	if (mi->downFilter->contains(kmer))
+	if (mi->downFilter && mm_kset_has(mi->downFilter, kmer)) // no list with a prebuilt index
 	{
 		/* downweigting by a factor of 8 */
 		/* further aggressive downweigting may affect accuracy */
@@ -108,24 +109,9 @@ static inline int tq_shift(tiny_queue_t *q)
 	return x;
 }
 
-/**
- * Find symmetric (w,k)-minimizers on a DNA sequence
- *
- * @param km     thread-local memory pool; using NULL falls back to malloc()
- * @param str    DNA sequence
- * @param len    length of $str
- * @param w      find a minimizer for every $w consecutive k-mers
- * @param k      k-mer size
- * @param rid    reference ID; will be copied to the output $p array
- * @param is_hpc homopolymer-compressed or not
- * @param p      minimizers
- *               p->a[i].x = kMer<<8 | kmerSpan
- *               p->a[i].y = rid<<32 | lastPos<<1 | strand
- *               where lastPos is the position of the last base of the i-th minimizer,
- *               and strand indicates whether the minimizer comes from the top or the bottom strand.
- *               Callers may want to set "p->n = 0"; otherwise results are appended to p
- */
-void mm_sketch(void *km, const char *str, int len, int w, int k, uint32_t rid, int is_hpc, mm128_v *p, const mm_idx_t *mi)
+// the body of mm_sketch(); with $rec, the window minimum after every base is kept as well, and with $sync,
+// the loop stops as soon as the window on $str=sync->seq+st agrees with that on the whole sync->seq
+static inline int sk_run(void *km, const char *str, int len, int w, int k, uint32_t rid, int is_hpc, mm128_v *p, const mm_idx_t *mi, mm_sketch_cache_t *rec, const mm_sketch_cache_t *sync, int st)
 {
 #if WRITE_MINIMIZERS_TO_FILE 
 	std::ofstream outFile ("minimizers.txt", std::ofstream::out | std::ofstream::app);
@@ -163,7 +149,10 @@ void mm_sketch(void *km, const char *str, int len, int w, int k, uint32_t rid, i
 			} else kmer_span = l + 1 < k? l + 1 : k;
 			kmer[0] = (kmer[0] << 2 | c) & mask;           // forward k-mer
 			kmer[1] = (kmer[1] >> 2) | (3ULL^c) << shift1; // reverse k-mer
-			if (kmer[0] == kmer[1]) continue; // skip "symmetric k-mers" as we don't know it strand
+			if (kmer[0] == kmer[1]) { // skip "symmetric k-mers" as we don't know it strand
+				if (rec) rec->min[i] = rec->min[i-1]; // never at i == 0: a single base is not symmetric
+				continue;
+			}
 			z = kmer[0] < kmer[1]? 0 : 1; // strand
 			++l;
 			if (l >= k && kmer_span < 256) {
@@ -185,8 +174,10 @@ void mm_sketch(void *km, const char *str, int len, int w, int k, uint32_t rid, i
 				outFile << (uint32_t)(min.y >> 32) << "\t" << ((uint32_t)min.y >> 1) << "\t" << (uint64_t)(min.x >> 8) << "\n";
 #endif
 				kv_push(mm128_t, km, *p, min);
+				if (rec) rec->emit[rec->n_emit++] = i;
 			}
 			min = info, min_pos = buf_pos, min_order = info_order;
+			if (rec) kv_push(mm128_t, km, rec->mins, min);
 		} 
 		else if (buf_pos == min_pos) // old min has moved outside the window
 		{
@@ -196,14 +187,26 @@ void mm_sketch(void *km, const char *str, int len, int w, int k, uint32_t rid, i
 				outFile << (uint32_t)(min.y >> 32) << "\t" << ((uint32_t)min.y >> 1) << "\t" << (uint64_t)(min.x >> 8) << "\n";
 #endif
 				kv_push(mm128_t, km, *p, min);
+				if (rec) rec->emit[rec->n_emit++] = i;
 			}
 			// the two loops are necessary when there are identical k-mers
 			for (j = buf_pos + 1, min.x = UINT64_MAX, min_order = 2.0; j < w; ++j) 
 				if (min_order >= buf_order[j]) min = buf[j], min_pos = j, min_order = buf_order[j]; // >= is important s.t. min is always the closest k-mer
 			for (j = 0; j <= buf_pos; ++j)
 				if (min_order >= buf_order[j]) min = buf[j], min_pos = j, min_order = buf_order[j];
+			if (rec && min.x != UINT64_MAX) kv_push(mm128_t, km, rec->mins, min);
 		}
 		if (++buf_pos == w) buf_pos = 0;
+		if (rec) rec->min[i] = min.x == UINT64_MAX? MM_SKC_NONE : (l >= w + k? MM_SKC_FULL : 0) | (uint32_t)(rec->mins.n - 1);
+		if (sync) { // the same k-mers in both windows once l >= w+k; the same state if also the same minimum
+			uint32_t f = sync->min[st + i];
+			if (l >= w + k && (f & MM_SKC_FULL) && f != MM_SKC_NONE && min.x != UINT64_MAX && min.y + ((uint64_t)st<<1) == sync->mins.a[f & ~MM_SKC_FULL].y) {
+#if WRITE_MINIMIZERS_TO_FILE 
+				outFile.close();
+#endif
+				return i;
+			}
+		}
 	}
 	if (min.x != UINT64_MAX)
 	{
@@ -216,4 +219,96 @@ void mm_sketch(void *km, const char *str, int len, int w, int k, uint32_t rid, i
 #if WRITE_MINIMIZERS_TO_FILE 
 	outFile.close();
 #endif
+	return -1;
+}
+
+/**
+ * Find symmetric (w,k)-minimizers on a DNA sequence
+ *
+ * @param km     thread-local memory pool; using NULL falls back to malloc()
+ * @param str    DNA sequence
+ * @param len    length of $str
+ * @param w      find a minimizer for every $w consecutive k-mers
+ * @param k      k-mer size
+ * @param rid    reference ID; will be copied to the output $p array
+ * @param is_hpc homopolymer-compressed or not
+ * @param p      minimizers
+ *               p->a[i].x = kMer<<8 | kmerSpan
+ *               p->a[i].y = rid<<32 | lastPos<<1 | strand
+ *               where lastPos is the position of the last base of the i-th minimizer,
+ *               and strand indicates whether the minimizer comes from the top or the bottom strand.
+ *               Callers may want to set "p->n = 0"; otherwise results are appended to p
+ */
+void mm_sketch(void *km, const char *str, int len, int w, int k, uint32_t rid, int is_hpc, mm128_v *p, const mm_idx_t *mi)
+{
+	sk_run(km, str, len, w, k, rid, is_hpc, p, mi, 0, 0, 0);
+}
+
+/**
+ * Sketch a whole read once for the substring probes of the SV-aware mode
+ *
+ * Besides the minimizers, the window minimum after every base and the base at
+ * which each minimizer was written are kept. mm_sketch_sub() only runs the
+ * window over the first bases of a substring, until its state coincides with
+ * that of the whole-read window, and copies the rest from here.
+ */
+void mm_sketch_cache_init(void *km, mm_sketch_cache_t *c, const char *str, int len, int w, int k, uint32_t rid, int is_hpc, const mm_idx_t *mi)
+{
+	memset(c, 0, sizeof(mm_sketch_cache_t));
+	c->seq = str, c->len = len, c->w = w, c->k = k, c->rid = rid, c->is_hpc = is_hpc;
+	if (is_hpc) { // a homopolymer run may cross the substring ends; mm_sketch_sub() falls back to mm_sketch()
+		mm_sketch(km, str, len, w, k, rid, is_hpc, &c->mv, mi);
+		return;
+	}
+	c->min = (uint32_t*)kmalloc(km, len * sizeof(uint32_t));
+	c->emit = (int32_t*)kmalloc(km, len * sizeof(int32_t));
+	sk_run(km, str, len, w, k, rid, 0, &c->mv, mi, c, 0, 0);
+}
+
+void mm_sketch_cache_destroy(void *km, mm_sketch_cache_t *c)
+{
+	kfree(km, c->mv.a); kfree(km, c->mins.a); kfree(km, c->min); kfree(km, c->emit);
+	memset(c, 0, sizeof(mm_sketch_cache_t));
+}
+
+void mm_sketch_cache_trim(void *km, mm_sketch_cache_t *c) // keep c->mv only; mm_sketch_sub() can't be called afterwards
+{
+	kfree(km, c->mins.a); kfree(km, c->min); kfree(km, c->emit);
+	c->mins.n = c->mins.m = 0, c->mins.a = 0, c->min = 0, c->emit = 0, c->n_emit = 0;
+}
+
+/**
+ * Minimizers of c->seq[st,en), identical to mm_sketch() on the substring
+ *
+ * Positions are relative to $st. Once the substring has seen w+k k-mers, its
+ * window holds the same k-mers as the whole-read window; as soon as the two
+ * also agree on the current minimum, the rest of the output is taken from the
+ * cache with the positions shifted.
+ */
+void mm_sketch_sub(void *km, const mm_sketch_cache_t *c, int st, int en, mm128_v *p, const mm_idx_t *mi)
+{
+	int i, lo, hi;
+	uint64_t shift = (uint64_t)st << 1;
+	mm128_t m;
+
+	assert(st >= 0 && st < en && en <= c->len);
+	if (c->is_hpc) {
+		mm_sketch(km, c->seq + st, en - st, c->w, c->k, c->rid, c->is_hpc, p, mi);
+		return;
+	}
+	if ((i = sk_run(km, c->seq + st, en - st, c->w, c->k, c->rid, 0, p, mi, 0, c, st)) < 0)
+		return; // never in sync; the substring is too short
+	for (lo = 0, hi = c->n_emit; lo < hi;) { // the first minimizer written after base st+i
+		int mid = (lo + hi) >> 1;
+		if (c->emit[mid] <= st + i) lo = mid + 1;
+		else hi = mid;
+	}
+	for (; lo < c->n_emit && c->emit[lo] < en; ++lo) {
+		m = c->mv.a[lo], m.y -= shift;
+		kv_push(mm128_t, km, *p, m);
+	}
+	if (c->min[en - 1] != MM_SKC_NONE) {
+		m = c->mins.a[c->min[en - 1] & ~MM_SKC_FULL], m.y -= shift;
+		kv_push(mm128_t, km, *p, m);
+	}
 }
@@ -0,0 +1,824 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "kthread.h"
+#include "kalloc.h"
+#include "kvec.h"
+#include "khash.h"
+#include "minimap.h"
+#include "mmpriv.h"
+#include "bamsort.h"
+
+KHASH_MAP_INIT_STR(s2i, int32_t)
+
+mm_bsort_t *mm_bsort_out = 0;
+
+typedef kvec_t(uint8_t) bytes_v;
+
+static inline uint8_t *bytes_grow(bytes_v *b, size_t l)
+{
+	uint8_t *p;
+	if (b->n + l > b->m) {
+		b->m = b->n + l;
+		b->m += b->m >> 1;
+		b->a = (uint8_t*)realloc(b->a, b->m);
+	}
+	p = b->a + b->n;
+	b->n += l;
+	return p;
+}
+
+static inline void bytes_put(bytes_v *b, const void *data, size_t l) { memcpy(bytes_grow(b, l), data, l); }
+static inline void bytes_put32(bytes_v *b, uint32_t x) { bytes_put(b, &x, 4); } // BAM is little-endian, as are minimap2 indices
+
+static void bsort_die(const char *msg, const char *fn)
+{
+	fprintf(stderr, "[ERROR]\033[1;31m %s '%s'\033[0m: %s\n", msg, fn, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+/***************
+ * BGZF writer *
+ ***************/
+
+#define BGZF_BLOCK  0xff00  // max uncompressed bytes per block, as in htslib
+#define BGZF_MAX    0x10000
+#define BGZF_N_BLK  16      // blocks per thread compressed in one batch
+
+typedef struct {
+	int len, clen;
+	uint8_t raw[BGZF_BLOCK], out[BGZF_MAX];
+} bgzf_blk_t;
+
+typedef struct {
+	FILE *fp;
+	int level, n_threads;
+	int n, m;                  // blk[n] is being filled; m blocks in a batch
+	uint64_t n_done;           // blocks written so far
+	kvec_t(uint64_t) coff;     // coff.a[i]: file offset of block i
+	bgzf_blk_t *blk;
+} bgzf_t;
+
+static void bgzf_deflate1(bgzf_blk_t *b, int level)
+{
+	static const uint8_t hdr[16] = { 31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0 };
+	z_stream zs;
+	uint32_t x;
+	int ret;
+	memset(&zs, 0, sizeof(z_stream));
+	deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	zs.next_in = b->raw, zs.avail_in = b->len;
+	zs.next_out = b->out + 18, zs.avail_out = BGZF_MAX - 26;
+	ret = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	if (ret != Z_STREAM_END) { // incompressible; store it
+		bgzf_deflate1(b, 0);
+		return;
+	}
+	b->clen = 18 + zs.total_out + 8;
+	memcpy(b->out, hdr, 16);
+	b->out[16] = (b->clen - 1) & 0xff, b->out[17] = (b->clen - 1) >> 8;
+	x = crc32(crc32(0L, 0, 0), b->raw, b->len);
+	memcpy(b->out + b->clen - 8, &x, 4);
+	x = b->len;
+	memcpy(b->out + b->clen - 4, &x, 4);
+}
+
+static void bgzf_worker(void *data, long i, int tid)
+{
+	bgzf_t *w = (bgzf_t*)data;
+	bgzf_deflate1(&w->blk[i], w->level);
+}
+
+static bgzf_t *bgzf_open(FILE *fp, int level, int n_threads)
+{
+	bgzf_t *w;
+	w = (bgzf_t*)calloc(1, sizeof(bgzf_t));
+	w->fp = fp, w->level = level, w->n_threads = n_threads > 1? n_threads : 1;
+	w->m = BGZF_N_BLK * w->n_threads;
+	w->blk = (bgzf_blk_t*)malloc(w->m * sizeof(bgzf_blk_t));
+	w->blk[0].len = 0;
+	kv_push(uint64_t, 0, w->coff, 0);
+	return w;
+}
+
+static void bgzf_flush_batch(bgzf_t *w)
+{
+	int i;
+	kt_for(w->n_threads, bgzf_worker, w, w->n);
+	for (i = 0; i < w->n; ++i) {
+		uint64_t off = w->coff.a[w->coff.n - 1] + w->blk[i].clen;
+		if (fwrite(w->blk[i].out, 1, w->blk[i].clen, w->fp) != (size_t)w->blk[i].clen)
+			bsort_die("failed to write BAM", "-");
+		kv_push(uint64_t, 0, w->coff, off);
+	}
+	w->n_done += w->n;
+	w->n = 0, w->blk[0].len = 0;
+}
+
+static void bgzf_write(bgzf_t *w, const uint8_t *p, size_t len)
+{
+	while (len > 0) {
+		bgzf_blk_t *b = &w->blk[w->n];
+		size_t l = BGZF_BLOCK - b->len < len? BGZF_BLOCK - b->len : len;
+		memcpy(b->raw + b->len, p, l);
+		b->len += l, p += l, len -= l;
+		if (b->len == BGZF_BLOCK) {
+			if (++w->n == w->m) bgzf_flush_batch(w);
+			else w->blk[w->n].len = 0;
+		}
+	}
+}
+
+// virtual offset in the (block index, in-block offset) form; see bgzf_voff()
+static inline uint64_t bgzf_tell(const bgzf_t *w) { return (w->n_done + w->n) << 16 | w->blk[w->n].len; }
+static inline uint64_t bgzf_voff(const bgzf_t *w, uint64_t x) { return w->coff.a[x>>16] << 16 | (x & 0xffff); }
+
+static void bgzf_flush(bgzf_t *w) // end the current block
+{
+	if (w->blk[w->n].len > 0) ++w->n;
+	if (w->n > 0) bgzf_flush_batch(w);
+}
+
+static void bgzf_close(bgzf_t *w) // the caller is responsible for fclose() and for freeing w
+{
+	static const uint8_t eof[28] = { 31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	bgzf_flush(w);
+	if (fwrite(eof, 1, 28, w->fp) != 28 || fflush(w->fp) != 0)
+		bsort_die("failed to write BAM", "-");
+	free(w->blk);
+}
+
+/*************
+ * BAM index *
+ *************/
+
+typedef struct { uint64_t u, v; } bidx_pair_t;
+typedef struct { int32_t n, m; bidx_pair_t *a; } bidx_bin_t;
+KHASH_MAP_INIT_INT(bin, bidx_bin_t)
+
+typedef struct {
+	khash_t(bin) *h;
+	kvec_t(uint64_t) lin;      // linear index; (uint64_t)-1 for empty windows
+	uint64_t off_beg, off_end, n_mapped, n_unmapped;
+} bidx_ref_t;
+
+typedef struct {
+	int min_shift, n_lvls, is_csi;
+	int32_t n_ref, last_tid;
+	uint32_t save_bin;
+	uint64_t save_off, last_off, n_no_coor;
+	bidx_ref_t *ref;
+} bidx_t;
+
+static inline int bidx_reg2bin(int64_t beg, int64_t end, int min_shift, int n_lvls) // hts_reg2bin()
+{
+	int l, s = min_shift, t = ((1<<((n_lvls<<1) + n_lvls)) - 1) / 7;
+	for (--end, l = n_lvls; l > 0; --l, s += 3, t -= 1<<((l<<1)+l))
+		if (beg>>s == end>>s) return t + (beg>>s);
+	return 0;
+}
+
+static bidx_t *bidx_init(int32_t n_ref, const int64_t *len)
+{
+	bidx_t *x;
+	int64_t max_len = 0;
+	int32_t i;
+	x = (bidx_t*)calloc(1, sizeof(bidx_t));
+	x->min_shift = 14, x->n_lvls = 5;
+	for (i = 0; i < n_ref; ++i)
+		max_len = max_len > len[i]? max_len : len[i];
+	while (max_len > 1LL << (x->min_shift + x->n_lvls * 3)) // .bai is limited to 2^29 bp
+		++x->n_lvls, x->is_csi = 1;
+	x->n_ref = n_ref, x->last_tid = -1;
+	x->ref = (bidx_ref_t*)calloc(n_ref, sizeof(bidx_ref_t));
+	return x;
+}
+
+static void bidx_save_chunk(bidx_t *x)
+{
+	bidx_bin_t *b;
+	khint_t k;
+	int absent;
+	if (x->last_tid < 0) return;
+	k = kh_put(bin, x->ref[x->last_tid].h, x->save_bin, &absent);
+	b = &kh_val(x->ref[x->last_tid].h, k);
+	if (absent) b->n = b->m = 0, b->a = 0;
+	if (b->n == b->m) {
+		b->m = b->m? b->m << 1 : 1;
+		b->a = (bidx_pair_t*)realloc(b->a, b->m * sizeof(bidx_pair_t));
+	}
+	b->a[b->n].u = x->save_off, b->a[b->n++].v = x->last_off;
+}
+
+// records must come in the coordinate order; off_beg and off_end are in the bgzf_tell() form
+static void bidx_push(bidx_t *x, int32_t tid, int64_t beg, int64_t end, int is_mapped, uint64_t off_beg, uint64_t off_end)
+{
+	bidx_ref_t *r;
+	uint32_t bin;
+	int64_t w;
+	if (tid < 0) {
+		++x->n_no_coor;
+		return;
+	}
+	r = &x->ref[tid];
+	if (tid != x->last_tid) {
+		bidx_save_chunk(x);
+		x->last_tid = tid, x->save_bin = (uint32_t)-1;
+		r->h = kh_init(bin);
+		r->off_beg = off_beg;
+	}
+	if (beg < 0) beg = 0;
+	if (end <= beg) end = beg + 1;
+	for (w = beg >> x->min_shift; w <= (end - 1) >> x->min_shift; ++w) {
+		while ((int64_t)r->lin.n <= w) kv_push(uint64_t, 0, r->lin, (uint64_t)-1);
+		if (r->lin.a[w] == (uint64_t)-1) r->lin.a[w] = off_beg;
+	}
+	bin = bidx_reg2bin(beg, end, x->min_shift, x->n_lvls);
+	if (bin != x->save_bin) {
+		if (x->save_bin != (uint32_t)-1) bidx_save_chunk(x);
+		x->save_bin = bin, x->save_off = off_beg;
+	}
+	x->last_off = r->off_end = off_end;
+	if (is_mapped) ++r->n_mapped;
+	else ++r->n_unmapped;
+}
+
+static void bidx_write(bidx_t *x, const bgzf_t *w, const char *fn)
+{
+	FILE *fp;
+	int32_t i, j, n;
+	uint32_t meta_bin = ((1U<<((x->n_lvls<<1) + x->n_lvls + 3)) - 1) / 7 + 1;
+	uint64_t last;
+	bytes_v b = {0,0,0};
+
+	bidx_save_chunk(x);
+	if (x->is_csi) {
+		int32_t aux[4];
+		aux[0] = x->min_shift, aux[1] = x->n_lvls, aux[2] = 0, aux[3] = x->n_ref;
+		bytes_put(&b, "CSI\1", 4);
+		bytes_put(&b, aux, 16);
+	} else {
+		bytes_put(&b, "BAI\1", 4);
+		bytes_put32(&b, x->n_ref);
+	}
+	for (i = 0; i < x->n_ref; ++i) {
+		bidx_ref_t *r = &x->ref[i];
+		khint_t k;
+		for (j = 0, last = 0; j < (int32_t)r->lin.n; ++j) { // fill empty windows and convert to real offsets
+			if (r->lin.a[j] == (uint64_t)-1) r->lin.a[j] = last;
+			else r->lin.a[j] = last = bgzf_voff(w, r->lin.a[j]);
+		}
+		bytes_put32(&b, r->h? kh_size(r->h) + 1 : 0);
+		for (k = 0; r->h && k < kh_end(r->h); ++k) {
+			bidx_bin_t *p;
+			uint32_t bin;
+			if (!kh_exist(r->h, k)) continue;
+			bin = kh_key(r->h, k), p = &kh_val(r->h, k);
+			for (j = 1, n = 1; j < p->n; ++j) { // merge chunks in the same BGZF block
+				if (p->a[n-1].v >> 16 == p->a[j].u >> 16) p->a[n-1].v = p->a[j].v;
+				else p->a[n++] = p->a[j];
+			}
+			p->n = n;
+			bytes_put32(&b, bin);
+			if (x->is_csi) { // loffset: the linear index at the start of the bin
+				int l, s = 0;
+				uint64_t loff;
+				for (l = 0; l < x->n_lvls && bin >= (uint32_t)(((1<<((l+1)*3)) - 1) / 7); ++l) {}
+				s = x->min_shift + (x->n_lvls - l) * 3;
+				loff = (uint64_t)(bin - ((1<<(l*3)) - 1) / 7) << s >> x->min_shift;
+				loff = r->lin.n == 0? 0 : loff < r->lin.n? r->lin.a[loff] : r->lin.a[r->lin.n - 1];
+				bytes_put(&b, &loff, 8);
+			}
+			bytes_put32(&b, p->n);
+			for (j = 0; j < p->n; ++j) {
+				uint64_t y[2];
+				y[0] = bgzf_voff(w, p->a[j].u), y[1] = bgzf_voff(w, p->a[j].v);
+				bytes_put(&b, y, 16);
+			}
+			free(p->a);
+		}
+		if (r->h) { // the pseudo-bin with the span of the reference and mapped/unmapped counts
+			uint64_t y[4];
+			y[0] = bgzf_voff(w, r->off_beg), y[1] = bgzf_voff(w, r->off_end), y[2] = r->n_mapped, y[3] = r->n_unmapped;
+			bytes_put32(&b, meta_bin);
+			if (x->is_csi) bytes_put(&b, &y[0], 8); // loffset
+			bytes_put32(&b, 2);
+			bytes_put(&b, y, 32);
+			kh_destroy(bin, r->h);
+		}
+		if (!x->is_csi) {
+			bytes_put32(&b, r->lin.n);
+			bytes_put(&b, r->lin.a, r->lin.n * 8);
+		}
+		free(r->lin.a);
+	}
+	bytes_put(&b, &x->n_no_coor, 8);
+	if ((fp = fopen(fn, "wb")) == 0) bsort_die("failed to create index", fn);
+	if (fwrite(b.a, 1, b.n, fp) != b.n || fclose(fp) != 0) bsort_die("failed to write index", fn);
+	free(b.a); free(x->ref); free(x);
+}
+
+/*************************
+ * SAM to BAM conversion *
+ *************************/
+
+struct mm_bsort_s {
+	FILE *fp;
+	char *fn, *tmp_prefix;
+	int n_threads, n_tmp, hdr_done, spilling;
+	int64_t max_mem;
+	uint64_t n_rec;
+	bytes_v hdr, tmp;           // header text; the record being encoded
+	int32_t n_ref;
+	char **name;
+	int64_t *len;
+	khash_t(s2i) *h;
+	bytes_v rec;                // records of the current chunk, each prefixed with block_size
+	mm128_v key;                // x: bsort_key(); y: offset in rec
+	pthread_t tid;
+	struct bsort_chunk_s *chunk; // the chunk being spilled
+};
+
+static const uint8_t bsort_nt16[256] = { // "=ACMGRSVTWYHKDBN"
+	15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15,
+	15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15,  0,15,15,15,
+	15, 1,14, 2, 13,15,15, 4, 11,15,15,12, 15, 3,15,15, 15,15, 5, 6,  8,15, 7, 9, 15,10,15,15, 15,15,15,15,
+	15, 1,14, 2, 13,15,15, 4, 11,15,15,12, 15, 3,15,15, 15,15, 5, 6,  8,15, 7, 9, 15,10,15,15, 15,15,15,15,
+	15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15,
+	15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15,
+	15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15,
+	15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15, 15,15,15,15
+};
+
+static void bsort_parse_hdr(mm_bsort_t *s)
+{
+	char *p, *q;
+	bytes_v t = {0,0,0};
+	int absent;
+	s->hdr_done = 1;
+	s->h = kh_init(s2i);
+	bytes_put(&s->hdr, "", 1);
+	for (p = (char*)s->hdr.a; *p; p = *q? q + 1 : q) {
+		for (q = p; *q && *q != '\n'; ++q) {}
+		if (strncmp(p, "@HD\t", 4) == 0) {
+			bytes_put(&t, "@HD\tVN:1.6\tSO:coordinate\n", 25);
+			continue;
+		}
+		bytes_put(&t, p, q - p);
+		bytes_put(&t, "\n", 1);
+		if (strncmp(p, "@SQ\t", 4) == 0) {
+			char *r, *name = 0;
+			int64_t len = -1;
+			khint_t k;
+			for (r = p + 4; r < q; ++r) {
+				char *e;
+				for (e = r; e < q && *e != '\t'; ++e) {}
+				if (strncmp(r, "SN:", 3) == 0) {
+					name = (char*)malloc(e - r - 2);
+					memcpy(name, r + 3, e - r - 3);
+					name[e - r - 3] = 0;
+				} else if (strncmp(r, "LN:", 3) == 0)
+					len = strtoll(r + 3, 0, 10);
+				r = e;
+			}
+			if (name == 0 || len < 0) continue;
+			s->name = (char**)realloc(s->name, (s->n_ref + 1) * sizeof(char*));
+			s->len = (int64_t*)realloc(s->len, (s->n_ref + 1) * sizeof(int64_t));
+			s->name[s->n_ref] = name, s->len[s->n_ref] = len;
+			k = kh_put(s2i, s->h, name, &absent);
+			kh_val(s->h, k) = s->n_ref;
+			++s->n_ref;
+		}
+	}
+	free(s->hdr.a);
+	s->hdr = t;
+}
+
+static inline int32_t bsort_name2tid(const mm_bsort_t *s, const char *name, int l)
+{
+	char buf[256], *p = l < 256? buf : (char*)malloc(l + 1);
+	khint_t k;
+	memcpy(p, name, l);
+	p[l] = 0;
+	k = kh_get(s2i, s->h, p);
+	if (k == kh_end(s->h)) {
+		fprintf(stderr, "[ERROR]\033[1;31m target '%s' is absent from the header; a multi-part index requires --split-prefix with --sort-bam\033[0m\n", p);
+		exit(EXIT_FAILURE);
+	}
+	if (p != buf) free(p);
+	return kh_val(s->h, k);
+}
+
+static void bsort_put_int(bytes_v *b, int64_t x) // the smallest integer type, as htslib does
+{
+	if (x < 0) {
+		if (x >= -128) { int8_t y = x; bytes_put(b, "c", 1); bytes_put(b, &y, 1); }
+		else if (x >= -32768) { int16_t y = x; bytes_put(b, "s", 1); bytes_put(b, &y, 2); }
+		else { int32_t y = x; bytes_put(b, "i", 1); bytes_put(b, &y, 4); }
+	} else {
+		if (x <= 255) { uint8_t y = x; bytes_put(b, "C", 1); bytes_put(b, &y, 1); }
+		else if (x <= 65535) { uint16_t y = x; bytes_put(b, "S", 1); bytes_put(b, &y, 2); }
+		else { uint32_t y = x; bytes_put(b, "I", 1); bytes_put(b, &y, 4); }
+	}
+}
+
+static void bsort_put_array(bytes_v *b, char type, const char *p, const char *e)
+{
+	int32_t n = 0;
+	const char *r;
+	for (r = p; r < e; ++r)
+		if (*r == ',') ++n;
+	bytes_put(b, &type, 1);
+	bytes_put32(b, n);
+	for (r = p; r < e && *r == ','; ) {
+		char *q;
+		++r;
+		if (type == 'f') { float y = strtof(r, &q); bytes_put(b, &y, 4); }
+		else {
+			long long y = strtoll(r, &q, 10);
+			if (type == 'c' || type == 'C') bytes_put(b, &y, 1); // little-endian
+			else if (type == 's' || type == 'S') bytes_put(b, &y, 2);
+			else bytes_put(b, &y, 4);
+		}
+		r = q;
+	}
+}
+
+// encode one SAM line to s->tmp, with the 4-byte block_size in front
+static void bsort_sam2bam(mm_bsort_t *s, const char *line, int32_t *tid_, int64_t *pos_, int *is_rev)
+{
+	const char *f[11], *p, *q;
+	int i, l_qname, l_seq;
+	int32_t tid, pos, mtid, mpos, tlen;
+	uint32_t n_cigar = 0, *cigar, bin, flag, mapq;
+	int64_t qlen = 0, rlen = 0;
+	bytes_v *b = &s->tmp;
+
+	for (i = 0, p = line; i < 11; ++i) {
+		f[i] = p;
+		for (q = p; *q && *q != '\t'; ++q) {}
+		if (*q == 0 && i < 10) {
+			fprintf(stderr, "[ERROR]\033[1;31m failed to parse SAM line '%s'\033[0m\n", line);
+			exit(EXIT_FAILURE);
+		}
+		p = *q? q + 1 : q;
+	}
+	l_qname = f[1] - f[0] - 1;
+	if (l_qname > 254) {
+		fprintf(stderr, "[ERROR]\033[1;31m query name '%.*s' is too long for BAM\033[0m\n", l_qname, f[0]);
+		exit(EXIT_FAILURE);
+	}
+	flag = strtol(f[1], 0, 10);
+	tid = f[2][0] == '*' && f[2][1] == '\t'? -1 : bsort_name2tid(s, f[2], f[3] - f[2] - 1);
+	pos = strtol(f[3], 0, 10) - 1;
+	mapq = strtol(f[4], 0, 10);
+	mtid = f[6][0] == '*' && f[6][1] == '\t'? -1 : f[6][0] == '=' && f[6][1] == '\t'? tid : bsort_name2tid(s, f[6], f[7] - f[6] - 1);
+	mpos = strtol(f[7], 0, 10) - 1;
+	tlen = strtol(f[8], 0, 10);
+	l_seq = f[9][0] == '*' && f[9][1] == '\t'? 0 : f[10] - f[9] - 1;
+
+	b->n = 0;
+	bytes_grow(b, 36); // block_size and the fixed fields; filled below
+	bytes_put(b, f[0], l_qname);
+	bytes_put(b, "", 1);
+	if (f[5][0] != '*') {
+		for (p = f[5]; *p != '\t'; ++p)
+			if (isalpha(*p) || *p == '=') ++n_cigar;
+		cigar = (uint32_t*)bytes_grow(b, n_cigar * 4);
+		for (i = 0, p = f[5]; *p != '\t'; ++i) {
+			char *r;
+			uint32_t len = strtol(p, &r, 10), op;
+			for (op = 0; op < 10 && MM_CIGAR_STR[op] != *r; ++op) {}
+			cigar = (uint32_t*)(b->a + 36 + l_qname + 1); // b->a may have moved
+			cigar[i] = len << 4 | op;
+			if (op == MM_CIGAR_MATCH || op == MM_CIGAR_INS || op == MM_CIGAR_SOFTCLIP || op == MM_CIGAR_EQ_MATCH || op == MM_CIGAR_X_MISMATCH) qlen += len;
+			if (op == MM_CIGAR_MATCH || op == MM_CIGAR_DEL || op == MM_CIGAR_N_SKIP || op == MM_CIGAR_EQ_MATCH || op == MM_CIGAR_X_MISMATCH) rlen += len;
+			p = r + 1;
+		}
+	}
+	if (n_cigar > 65535) { // move the CIGAR to the CG tag; see the SAM spec
+		uint32_t *tmp = (uint32_t*)malloc(n_cigar * 4);
+		memcpy(tmp, b->a + 36 + l_qname + 1, n_cigar * 4);
+		b->n = 36 + l_qname + 1;
+		bytes_put32(b, (uint32_t)qlen << 4 | MM_CIGAR_SOFTCLIP);
+		bytes_put32(b, (uint32_t)rlen << 4 | MM_CIGAR_N_SKIP);
+		cigar = tmp;
+	} else cigar = 0;
+	if (l_seq > 0) {
+		uint8_t *x = bytes_grow(b, (l_seq + 1) >> 1);
+		for (i = 0; i < l_seq; i += 2)
+			x[i>>1] = bsort_nt16[(uint8_t)f[9][i]] << 4 | (i + 1 < l_seq? bsort_nt16[(uint8_t)f[9][i+1]] : 0);
+		x = bytes_grow(b, l_seq);
+		if (f[10][0] == '*' && (f[10][1] == '\t' || f[10][1] == 0)) memset(x, 0xff, l_seq);
+		else for (i = 0; i < l_seq; ++i) x[i] = f[10][i] - 33;
+	}
+	for (p = f[10]; *p && *p != '\t'; ++p) {}
+	while (*p == '\t') { // optional fields
+		const char *e;
+		++p;
+		for (e = p; *e && *e != '\t'; ++e) {}
+		if (e - p >= 5 && p[2] == ':' && p[4] == ':') {
+			bytes_put(b, p, 2);
+			if (p[3] == 'i') bsort_put_int(b, strtoll(p + 5, 0, 10));
+			else if (p[3] == 'f') { float y = strtof(p + 5, 0); bytes_put(b, "f", 1); bytes_put(b, &y, 4); }
+			else if (p[3] == 'A') bytes_put(b, "A", 1), bytes_put(b, p + 5, 1);
+			else if (p[3] == 'B' && e - p >= 6) bytes_put(b, "B", 1), bsort_put_array(b, p[5], p + 6, e);
+			else bytes_put(b, p + 3, 1), bytes_put(b, p + 5, e - p - 5), bytes_put(b, "", 1); // Z or H
+		}
+		p = e;
+	}
+	if (cigar) {
+		bytes_put(b, "CGBI", 4);
+		bytes_put32(b, n_cigar);
+		bytes_put(b, cigar, n_cigar * 4);
+		free(cigar);
+		n_cigar = 2;
+	}
+	rlen = (flag & 4) || rlen == 0? 1 : rlen;
+	bin = (int64_t)pos + rlen > 1<<29? 4680 : bidx_reg2bin(pos, (int64_t)pos + rlen, 14, 5);
+	{
+		int32_t x[9];
+		x[0] = b->n - 4, x[1] = tid, x[2] = pos;
+		x[3] = bin << 16 | mapq << 8 | (l_qname + 1);
+		x[4] = flag << 16 | n_cigar;
+		x[5] = l_seq, x[6] = mtid, x[7] = mpos, x[8] = tlen;
+		memcpy(b->a, x, 36);
+	}
+	*tid_ = tid, *pos_ = pos, *is_rev = !!(flag & 16);
+}
+
+static inline int64_t bsort_endpos(const uint8_t *p, int32_t *tid, int32_t *pos, int *is_mapped) // p points to block_size
+{
+	int32_t x[9];
+	uint32_t j, n_cigar;
+	int64_t rlen = 0;
+	memcpy(x, p, 36);
+	*tid = x[1], *pos = x[2];
+	n_cigar = x[4] & 0xffff;
+	*is_mapped = !(x[4]>>16 & 4);
+	if (!*is_mapped || n_cigar == 0) return (int64_t)x[2] + 1;
+	for (j = 0; j < n_cigar; ++j) {
+		uint32_t c;
+		memcpy(&c, p + 36 + (x[3] & 0xff) + j * 4, 4);
+		if ((0x18d >> (c & 0xf)) & 1) rlen += c >> 4; // M, D, N, = and X
+	}
+	return (int64_t)x[2] + (rlen > 0? rlen : 1);
+}
+
+/*****************************
+ * Sorting, spill and merge  *
+ *****************************/
+
+static void bsort_radix(mm128_t *a, size_t n) // stable LSD radix sort on mm128_t::x; ties keep the input order
+{
+	size_t i, c[256];
+	mm128_t *b, *src = a, *dst, *t;
+	int s;
+	if (n < 2) return;
+	dst = b = (mm128_t*)malloc(n * sizeof(mm128_t));
+	for (s = 0; s < 64; s += 8) {
+		size_t sum = 0;
+		memset(c, 0, sizeof(c));
+		for (i = 0; i < n; ++i) ++c[src[i].x >> s & 0xff];
+		if (c[src[0].x >> s & 0xff] == n) continue; // all identical at this byte
+		for (i = 0; i < 256; ++i) {
+			size_t x = c[i];
+			c[i] = sum, sum += x;
+		}
+		for (i = 0; i < n; ++i) dst[c[src[i].x >> s & 0xff]++] = src[i];
+		t = src, src = dst, dst = t;
+	}
+	if (src != a) memcpy(a, src, n * sizeof(mm128_t));
+	free(b);
+}
+
+static inline uint64_t bsort_key(int32_t tid, int64_t pos, int is_rev) // the order of samtools sort
+{ // tid takes 31 bits so that pos+1 (up to 2^32-1) does not overflow into it; unmapped (tid=-1) comes last
+	return (uint64_t)((uint32_t)tid & 0x7fffffff) << 33 | (uint64_t)(pos + 1) << 1 | is_rev;
+}
+
+typedef struct bsort_chunk_s {
+	int id;
+	const char *prefix;
+	bytes_v rec;
+	mm128_v key;
+} bsort_chunk_t;
+
+static char *bsort_tmp_name(const char *prefix, int id)
+{
+	char *fn = (char*)malloc(strlen(prefix) + 16);
+	sprintf(fn, "%s.%.4d.tmp", prefix, id);
+	return fn;
+}
+
+static void *bsort_spill(void *data)
+{
+	bsort_chunk_t *c = (bsort_chunk_t*)data;
+	char *fn;
+	gzFile fp;
+	size_t i;
+	double t = realtime();
+	bsort_radix(c->key.a, c->key.n);
+	fn = bsort_tmp_name(c->prefix, c->id);
+	if ((fp = gzopen(fn, "wb1")) == 0) bsort_die("failed to create temporary file", fn);
+	for (i = 0; i < c->key.n; ++i) {
+		const uint8_t *p = c->rec.a + c->key.a[i].y;
+		int32_t l;
+		memcpy(&l, p, 4);
+		if (gzwrite(fp, p, l + 4) != l + 4) bsort_die("failed to write temporary file", fn);
+	}
+	if (gzclose(fp) != Z_OK) bsort_die("failed to write temporary file", fn);
+	if (mm_verbose >= 3)
+		fprintf(stderr, "[M::%s::%.3f] sorted and wrote %ld records to %s\n", __func__, realtime() - t, (long)c->key.n, fn);
+	free(fn);
+	free(c->rec.a); free(c->key.a);
+	return 0;
+}
+
+static void bsort_wait(mm_bsort_t *s)
+{
+	if (!s->spilling) return;
+	pthread_join(s->tid, 0);
+	free(s->chunk);
+	s->chunk = 0, s->spilling = 0;
+}
+
+static void bsort_flush_chunk(mm_bsort_t *s, int in_bg) // hand the current chunk to the spill thread
+{
+	bsort_chunk_t *c;
+	bsort_wait(s);
+	c = (bsort_chunk_t*)calloc(1, sizeof(bsort_chunk_t));
+	c->id = s->n_tmp++, c->prefix = s->tmp_prefix;
+	c->rec = s->rec, c->key = s->key;
+	memset(&s->rec, 0, sizeof(bytes_v));
+	memset(&s->key, 0, sizeof(mm128_v));
+	s->chunk = c;
+	if (in_bg) {
+		pthread_create(&s->tid, 0, bsort_spill, c);
+		s->spilling = 1;
+	} else {
+		bsort_spill(c);
+		free(c);
+		s->chunk = 0;
+	}
+}
+
+mm_bsort_t *mm_bsort_init(FILE *fp, const char *fn, const char *tmp_prefix, int n_threads, int64_t max_mem)
+{
+	mm_bsort_t *s;
+	s = (mm_bsort_t*)calloc(1, sizeof(mm_bsort_t));
+	s->fp = fp, s->n_threads = n_threads;
+	s->max_mem = max_mem > 1<<20? max_mem : 1<<20;
+	s->fn = fn? strdup(fn) : 0;
+	if (tmp_prefix) s->tmp_prefix = strdup(tmp_prefix);
+	else if (fn) {
+		s->tmp_prefix = (char*)malloc(strlen(fn) + 5);
+		sprintf(s->tmp_prefix, "%s.tmp", fn);
+	} else s->tmp_prefix = strdup("minimap2-sort");
+	return s;
+}
+
+void mm_bsort_hdr(mm_bsort_t *s, const char *text)
+{
+	bytes_put(&s->hdr, text, strlen(text));
+	bytes_put(&s->hdr, "\n", 1);
+}
+
+void mm_bsort_add(mm_bsort_t *s, const char *line)
+{
+	int32_t tid;
+	int64_t pos;
+	int is_rev;
+	mm128_t *k;
+	if (!s->hdr_done) bsort_parse_hdr(s);
+	bsort_sam2bam(s, line, &tid, &pos, &is_rev);
+	kv_pushp(mm128_t, 0, s->key, &k);
+	k->x = bsort_key(tid, pos, is_rev);
+	k->y = s->rec.n;
+	bytes_put(&s->rec, s->tmp.a, s->tmp.n);
+	++s->n_rec;
+	if ((int64_t)(s->rec.n + s->key.n * sizeof(mm128_t)) >= s->max_mem)
+		bsort_flush_chunk(s, 1);
+}
+
+typedef struct {
+	gzFile fp;
+	bytes_v rec;
+	uint64_t x, y; // the sorting key of rec, as mm_bsort_t::key; y = run id
+	int err;       // the run is truncated or corrupted
+} bsort_run_t;
+
+static int bsort_run_next(bsort_run_t *r, int id) // 1 for a record, 0 at the end of the run, -1 if the run is truncated
+{
+	int32_t l, x[5];
+	int ret;
+	if ((ret = gzread(r->fp, &l, 4)) != 4) return ret == 0? 0 : (r->err = 1, -1);
+	r->rec.n = 0;
+	bytes_put32(&r->rec, l);
+	if (l < 32 || gzread(r->fp, bytes_grow(&r->rec, l), l) != l) return r->err = 1, -1; // 32: the fixed fields of a BAM record
+	memcpy(x, r->rec.a, 20);
+	r->x = bsort_key(x[1], x[2], x[4] >> 20 & 1);
+	r->y = id;
+	return 1;
+}
+
+static void bsort_write1(bgzf_t *w, bidx_t *idx, const uint8_t *p)
+{
+	int32_t l, tid, pos;
+	int is_mapped;
+	int64_t end;
+	uint64_t off = bgzf_tell(w);
+	memcpy(&l, p, 4);
+	bgzf_write(w, p, l + 4);
+	if (idx) {
+		end = bsort_endpos(p, &tid, &pos, &is_mapped);
+		bidx_push(idx, tid, pos, end, is_mapped, off, bgzf_tell(w));
+	}
+}
+
+int mm_bsort_finish(mm_bsort_t *s)
+{
+	bgzf_t *w;
+	bidx_t *idx = 0;
+	bytes_v b = {0,0,0};
+	int32_t i, ret = 0;
+	size_t j;
+
+	if (!s->hdr_done) bsort_parse_hdr(s);
+	if (s->n_tmp > 0) { // then merge the sorted runs
+		if (s->key.n > 0) bsort_flush_chunk(s, 0);
+		bsort_wait(s);
+	} else bsort_radix(s->key.a, s->key.n);
+
+	w = bgzf_open(s->fp, Z_DEFAULT_COMPRESSION, s->n_threads);
+	bytes_put(&b, "BAM\1", 4);
+	bytes_put32(&b, s->hdr.n);
+	bytes_put(&b, s->hdr.a, s->hdr.n);
+	bytes_put32(&b, s->n_ref);
+	for (i = 0; i < s->n_ref; ++i) {
+		bytes_put32(&b, strlen(s->name[i]) + 1);
+		bytes_put(&b, s->name[i], strlen(s->name[i]) + 1);
+		bytes_put32(&b, s->len[i]);
+	}
+	bgzf_write(w, b.a, b.n);
+	bgzf_flush(w);
+	free(b.a);
+	if (s->fn) idx = bidx_init(s->n_ref, s->len);
+
+	if (s->n_tmp == 0) {
+		for (j = 0; j < s->key.n; ++j)
+			bsort_write1(w, idx, s->rec.a + s->key.a[j].y);
+	} else {
+		bsort_run_t *r;
+		int n_run = s->n_tmp;
+		r = (bsort_run_t*)calloc(n_run, sizeof(bsort_run_t));
+		for (i = 0; i < n_run; ++i) {
+			char *fn = bsort_tmp_name(s->tmp_prefix, i);
+			if ((r[i].fp = gzopen(fn, "rb")) == 0) bsort_die("failed to open temporary file", fn);
+			if (bsort_run_next(&r[i], i) <= 0) r[i].x = (uint64_t)-1, r[i].y = (uint64_t)-1;
+			free(fn);
+		}
+		for (;;) { // the number of runs is small; a linear scan is good enough
+			int min = 0;
+			for (i = 1; i < n_run; ++i)
+				if (r[i].x < r[min].x || (r[i].x == r[min].x && r[i].y < r[min].y)) min = i;
+			if (r[min].x == (uint64_t)-1 && r[min].y == (uint64_t)-1) break;
+			bsort_write1(w, idx, r[min].rec.a);
+			if (bsort_run_next(&r[min], min) <= 0) r[min].x = (uint64_t)-1, r[min].y = (uint64_t)-1;
+		}
+		for (i = 0; i < n_run; ++i) {
+			char *fn = bsort_tmp_name(s->tmp_prefix, i);
+			if (r[i].err) {
+				fprintf(stderr, "[ERROR]\033[1;31m failed to read temporary file '%s'\033[0m\n", fn);
+				ret = -1;
+			}
+			gzclose(r[i].fp);
+			remove(fn);
+			free(fn);
+			free(r[i].rec.a);
+		}
+		free(r);
+	}
+	bgzf_close(w);
+	if (idx) {
+		char *fn = (char*)malloc(strlen(s->fn) + 5);
+		sprintf(fn, "%s.%s", s->fn, idx->is_csi? "csi" : "bai");
+		bidx_write(idx, w, fn);
+		free(fn);
+	}
+	if (mm_verbose >= 3)
+		fprintf(stderr, "[M::%s] wrote %ld sorted records; %d temporary files merged\n", __func__, (long)s->n_rec, s->n_tmp);
+
+	free(w->coff.a); free(w);
+	for (i = 0; i < s->n_ref; ++i) free(s->name[i]);
+	free(s->name); free(s->len);
+	kh_destroy(s2i, s->h);
+	free(s->hdr.a); free(s->tmp.a); free(s->rec.a); free(s->key.a);
+	free(s->fn); free(s->tmp_prefix); free(s);
+	return ret;
+}
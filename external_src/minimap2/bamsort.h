@@ -0,0 +1,34 @@
+#ifndef MM_BAMSORT_H
+#define MM_BAMSORT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mm_bsort_s;
+typedef struct mm_bsort_s mm_bsort_t;
+
+/*
+ * Coordinate-sorted BAM output (--sort-bam). SAM lines produced by the
+ * output step are encoded as BAM records and collected in memory; a chunk
+ * reaching max_mem bytes is sorted and spilled to a temporary file by a
+ * background thread. mm_bsort_finish() merges the spilled runs, writes BGZF
+ * blocks compressed with n_threads threads and builds a .bai index (or a
+ * .csi index if a target is longer than 2^29-1 bp).
+ */
+
+extern mm_bsort_t *mm_bsort_out; // when set, SAM header and records are sent here instead of stdout
+
+mm_bsort_t *mm_bsort_init(FILE *fp, const char *fn, const char *tmp_prefix, int n_threads, int64_t max_mem);
+void mm_bsort_hdr(mm_bsort_t *s, const char *text);
+void mm_bsort_add(mm_bsort_t *s, const char *line);
+int mm_bsort_finish(mm_bsort_t *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -163,6 +163,13 @@ mm_bseq1_t *mm_bseq_read_frag(int n_fp, mm_bseq_file_t **fp, int64_t chunk_size,
 	return mm_bseq_read_frag2(n_fp, fp, chunk_size, with_qual, 0, n_);
 }
 
+int64_t mm_bseq_skip(mm_bseq_file_t *fp, int64_t n) // skip n records; return the number of records actually skipped
+{
+	int64_t i;
+	for (i = 0; i < n && kseq_read(fp->ks) >= 0; ++i) {}
+	return i;
+}
+
 int mm_bseq_eof(mm_bseq_file_t *fp)
 {
 	return (ks_eof(fp->ks->f) && fp->s.seq == 0);
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "mmpriv.h"
+
+/*
+ * Checkpoint/resume (--checkpoint and --resume). After each output batch, the
+ * output is flushed to disk and the checkpoint file is atomically replaced
+ * with a line
+ *
+ *   MMCK  2  key  n_seq  offset  crc  sv_offset  rs_offset
+ *
+ * where key is a CRC32 of the command line (without --resume) and the size and
+ * modification time of the input files, n_seq is the number of query sequences
+ * whose output is complete, offset is the output size in bytes at that point
+ * and crc is the CRC32 of the first offset bytes of the output. sv_offset and
+ * rs_offset are the sizes of the --sv-sig and --read-stats files at that
+ * point, or -1 if they are not written. On resume, the key and the output CRC
+ * are verified, the output and the side files are truncated to their offsets
+ * and the first n_seq query sequences are skipped.
+ */
+
+#define CK_MAGIC "MMCK"
+#define CK_N_SIDE 2 // --sv-sig and --read-stats
+
+char *mm_ckpt_fn = 0;
+
+static struct {
+	char *fn_tmp, *fn_out;
+	int fd_out;       // read-only descriptor of the output, for the CRC
+	uint32_t key, crc;
+	int64_t n_done;   // query sequences written to the output
+	int64_t n_skip;   // query sequences left to skip on resume
+	int64_t off;      // bytes of the output covered by crc
+} ck;
+
+static uint32_t ck_key(int argc, char *argv[], int ind)
+{
+	uLong crc = crc32(0L, Z_NULL, 0);
+	int i;
+	for (i = 0; i < argc; ++i) {
+		if (strcmp(argv[i], "--resume") == 0) continue;
+		crc = crc32(crc, (const Bytef*)argv[i], strlen(argv[i]) + 1);
+	}
+	for (i = ind; i < argc; ++i) { // the index and the query files
+		struct stat st;
+		if (stat(argv[i], &st) == 0 && S_ISREG(st.st_mode)) {
+			int64_t x[2];
+			x[0] = st.st_size, x[1] = st.st_mtime;
+			crc = crc32(crc, (const Bytef*)x, sizeof(x));
+		}
+	}
+	return crc;
+}
+
+static FILE *ck_side_fp(int i)
+{
+	return i == 0? mm_svsig_fp : mm_rstat_fp;
+}
+
+static int ck_crc(int fd, int64_t st, int64_t en, uint32_t *crc) // update *crc with bytes [st,en) of fd
+{
+	uint8_t *buf;
+	uLong c = *crc;
+	int64_t l;
+	buf = (uint8_t*)malloc(1<<20);
+	for (l = 0; st < en; st += l) {
+		l = en - st < 1<<20? en - st : 1<<20;
+		if ((l = pread(fd, buf, l, st)) <= 0) break;
+		c = crc32(c, buf, l);
+	}
+	free(buf);
+	*crc = c;
+	return st == en? 0 : -1;
+}
+
+int mm_ckpt_init(const char *fn, const char *fn_out, const char *fn_side[2], int argc, char *argv[], int ind, int resume)
+{
+	FILE *fp;
+	int i;
+	memset(&ck, 0, sizeof(ck));
+	ck.fd_out = -1;
+	if (fn_out == 0) {
+		fprintf(stderr, "[ERROR] --checkpoint requires the output file to be given with -o\n");
+		return -1;
+	}
+	ck.key = ck_key(argc, argv, ind);
+	ck.crc = crc32(0L, Z_NULL, 0);
+	if (resume && (fp = fopen(fn, "r")) != 0) {
+		char magic[8];
+		int ver, n;
+		unsigned key, crc;
+		long long n_done, off, off_side[CK_N_SIDE] = { -1, -1 };
+		uint32_t c = crc32(0L, Z_NULL, 0);
+		int fd;
+		n = fscanf(fp, "%7s%d%x%lld%lld%x%lld%lld", magic, &ver, &key, &n_done, &off, &crc, &off_side[0], &off_side[1]);
+		fclose(fp);
+		if (n < 6 || strcmp(magic, CK_MAGIC) != 0 || ver < 1 || ver > 2 || (ver == 2 && n != 8)) {
+			fprintf(stderr, "[ERROR] '%s' is not a minimap2 checkpoint\n", fn);
+			return -1;
+		}
+		if (key != ck.key) {
+			fprintf(stderr, "[ERROR] the command line or the input files have changed since checkpoint '%s' was written\n", fn);
+			return -1;
+		}
+		if ((fd = open(fn_out, O_RDONLY)) < 0 || ck_crc(fd, 0, off, &c) < 0 || c != crc) {
+			fprintf(stderr, "[ERROR] the output file '%s' is inconsistent with checkpoint '%s'\n", fn_out, fn);
+			if (fd >= 0) close(fd);
+			return -1;
+		}
+		close(fd);
+		if (truncate(fn_out, off) < 0) {
+			fprintf(stderr, "[ERROR] failed to truncate '%s': %s\n", fn_out, strerror(errno));
+			return -1;
+		}
+		for (i = 0; i < CK_N_SIDE; ++i) { // side files are appended to from where the checkpoint left them
+			struct stat st;
+			if (fn_side[i] == 0) continue;
+			if (off_side[i] < 0 || stat(fn_side[i], &st) < 0 || st.st_size < off_side[i]) {
+				fprintf(stderr, "[ERROR] the file '%s' is inconsistent with checkpoint '%s'\n", fn_side[i], fn);
+				return -1;
+			}
+			if (truncate(fn_side[i], off_side[i]) < 0) {
+				fprintf(stderr, "[ERROR] failed to truncate '%s': %s\n", fn_side[i], strerror(errno));
+				return -1;
+			}
+		}
+		ck.n_done = ck.n_skip = n_done, ck.off = off, ck.crc = crc;
+		if (mm_verbose >= 3)
+			fprintf(stderr, "[M::%s] resuming after %lld sequences and %lld output bytes\n", __func__, n_done, off);
+	} else if (resume && mm_verbose >= 2)
+		fprintf(stderr, "[WARNING]\033[1;31m checkpoint '%s' not found; starting from the beginning\033[0m\n", fn);
+	mm_ckpt_fn = strdup(fn);
+	ck.fn_out = strdup(fn_out);
+	ck.fn_tmp = (char*)malloc(strlen(fn) + 5);
+	sprintf(ck.fn_tmp, "%s.tmp", fn);
+	return 0;
+}
+
+int64_t mm_ckpt_n_skip(void)
+{
+	return ck.n_skip;
+}
+
+int64_t mm_ckpt_skip(int n_fp, mm_bseq_file_t **fp) // skip query sequences already mapped
+{
+	int64_t i, n = 0;
+	if (ck.n_skip == 0) return 0;
+	for (i = 0; i < n_fp; ++i) // with multiple files, each file contributes one sequence per fragment
+		n += mm_bseq_skip(fp[i], ck.n_skip / n_fp);
+	ck.n_skip -= n;
+	if (mm_verbose >= 3)
+		fprintf(stderr, "[M::%s] skipped %lld sequences mapped before the checkpoint\n", __func__, (long long)n);
+	return n;
+}
+
+void mm_ckpt_save(int64_t n_seq)
+{
+	FILE *fp;
+	int64_t off, off_side[CK_N_SIDE];
+	int i;
+	ck.n_done += n_seq;
+	if (fflush(stdout) == EOF || fsync(fileno(stdout)) < 0) {
+		perror("[ERROR] failed to write the results");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < CK_N_SIDE; ++i) {
+		FILE *fp_side = ck_side_fp(i);
+		off_side[i] = -1;
+		if (fp_side == 0) continue;
+		if (fflush(fp_side) == EOF || fsync(fileno(fp_side)) < 0 || (off_side[i] = ftello(fp_side)) < 0) {
+			perror("[ERROR] failed to write the side output");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (ck.fd_out < 0 && (ck.fd_out = open(ck.fn_out, O_RDONLY)) < 0) {
+		perror("[ERROR] failed to read back the output");
+		exit(EXIT_FAILURE);
+	}
+	off = lseek(ck.fd_out, 0, SEEK_END);
+	if (off < ck.off || ck_crc(ck.fd_out, ck.off, off, &ck.crc) < 0) {
+		fprintf(stderr, "[ERROR] failed to read back the output file '%s'\n", ck.fn_out);
+		exit(EXIT_FAILURE);
+	}
+	ck.off = off;
+	if ((fp = fopen(ck.fn_tmp, "w")) == 0) {
+		fprintf(stderr, "[ERROR] failed to write checkpoint '%s': %s\n", ck.fn_tmp, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	fprintf(fp, "%s\t2\t%08x\t%lld\t%lld\t%08x\t%lld\t%lld\n", CK_MAGIC, ck.key, (long long)ck.n_done, (long long)ck.off, ck.crc, (long long)off_side[0], (long long)off_side[1]);
+	if (fflush(fp) == EOF || fsync(fileno(fp)) < 0 || fclose(fp) == EOF || rename(ck.fn_tmp, mm_ckpt_fn) < 0) {
+		fprintf(stderr, "[ERROR] failed to write checkpoint '%s': %s\n", mm_ckpt_fn, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+void mm_ckpt_destroy(void)
+{
+	if (mm_ckpt_fn == 0) return;
+	if (ck.fd_out >= 0) close(ck.fd_out);
+	free(ck.fn_tmp); free(ck.fn_out); free(mm_ckpt_fn);
+	mm_ckpt_fn = 0;
+}
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include "kalloc.h"
 #include "mmpriv.h"
+#include "bamsort.h"
 
 static char mm_rg_id[256];
 
@@ -134,7 +135,8 @@ int mm_write_sam_hdr(const mm_idx_t *idx, const char *rg, const char *ver, int a
 		for (i = 1; i < argc; ++i)
 			mm_sprintf_lite(&str, " %s", argv[i]);
 	}
-	mm_err_puts(str.s);
+	if (mm_bsort_out) mm_bsort_hdr(mm_bsort_out, str.s);
+	else mm_err_puts(str.s);
 	free(str.s);
 	return ret;
 }
@@ -548,6 +550,71 @@ void mm_write_sam3(kstring_t *s, const mm_idx_t *mi, const mm_bseq1_t *t, int se
 	s->s[s->l] = 0; // we always have room for an extra byte (see str_enlarge)
 }
 
+/*
+ * SV signatures (--sv-sig): one line per large indel in the CIGAR, long clip
+ * at an alignment end, or breakpoint between two consecutive (in the read)
+ * primary/supplementary alignments of a query. Columns: qname, type (DEL, INS,
+ * CLIP or BND), contig, 0-based reference position, length, strand, mapq,
+ * 0-based query position and, for BND, the partner "contig:pos:strand" (for
+ * CLIP, the side of the reference the clipped sequence hangs off, L or R).
+ */
+
+FILE *mm_svsig_fp = 0;
+int mm_svsig_min_len = 30;
+
+static void write_svsig1(kstring_t *s, const mm_idx_t *mi, const mm_bseq1_t *t, const char *type, int32_t rid, int32_t pos, int32_t len, int rev, int mapq, int32_t qpos)
+{
+	mm_sprintf_lite(s, "%s\t%s\t%s\t%d\t%d\t%c\t%d\t%d\t", t->name, type, mi->seq[rid].name, pos, len, "+-"[rev], mapq, qpos);
+}
+
+void mm_write_svsig(kstring_t *s, const mm_idx_t *mi, const mm_bseq1_t *t, int n_regs, const mm_reg1_t *regs, void *km)
+{
+	int i, j, n = 0, min_len = mm_svsig_min_len;
+	const mm_reg1_t **a;
+	if (n_regs == 0) return;
+	a = (const mm_reg1_t**)kmalloc(km, n_regs * sizeof(*a));
+	for (i = 0; i < n_regs; ++i) { // collect primary and supplementary alignments, sorted by query start
+		const mm_reg1_t *r = &regs[i];
+		if (r->id != r->parent) continue;
+		for (j = n++; j > 0 && a[j-1]->qs > r->qs; --j)
+			a[j] = a[j-1];
+		a[j] = r;
+	}
+	for (i = 0; i < n; ++i) {
+		const mm_reg1_t *r = a[i];
+		if (r->p) { // indels
+			int32_t x = r->rs, y = 0; // y: query bases consumed in the alignment orientation
+			uint32_t k;
+			for (k = 0; k < r->p->n_cigar; ++k) {
+				int32_t op = r->p->cigar[k]&0xf, len = r->p->cigar[k]>>4;
+				if (op == MM_CIGAR_INS && len >= min_len) {
+					write_svsig1(s, mi, t, "INS", r->rid, x, len, r->rev, r->mapq, r->rev? r->qe - y - len : r->qs + y);
+					mm_sprintf_lite(s, "*\n");
+				} else if (op == MM_CIGAR_DEL && len >= min_len) {
+					write_svsig1(s, mi, t, "DEL", r->rid, x, len, r->rev, r->mapq, r->rev? r->qe - y : r->qs + y);
+					mm_sprintf_lite(s, "*\n");
+				}
+				if (op == MM_CIGAR_MATCH || op == MM_CIGAR_EQ_MATCH || op == MM_CIGAR_X_MISMATCH || op == MM_CIGAR_INS) y += len;
+				if (op == MM_CIGAR_MATCH || op == MM_CIGAR_EQ_MATCH || op == MM_CIGAR_X_MISMATCH || op == MM_CIGAR_DEL || op == MM_CIGAR_N_SKIP) x += len;
+			}
+		}
+		if (r->qs >= min_len) { // clipped at the 5'-end of the read
+			write_svsig1(s, mi, t, "CLIP", r->rid, r->rev? r->re : r->rs, r->qs, r->rev, r->mapq, r->qs);
+			mm_sprintf_lite(s, "%c\n", "LR"[r->rev]);
+		}
+		if (t->l_seq - r->qe >= min_len) { // clipped at the 3'-end
+			write_svsig1(s, mi, t, "CLIP", r->rid, r->rev? r->rs : r->re, t->l_seq - r->qe, r->rev, r->mapq, r->qe);
+			mm_sprintf_lite(s, "%c\n", "RL"[r->rev]);
+		}
+		if (i + 1 < n) { // breakpoint between the end of r and the start of the next alignment on the read
+			const mm_reg1_t *q = a[i+1];
+			write_svsig1(s, mi, t, "BND", r->rid, r->rev? r->rs : r->re, q->qs - r->qe, r->rev, r->mapq < q->mapq? r->mapq : q->mapq, r->qe);
+			mm_sprintf_lite(s, "%s:%d:%c\n", mi->seq[q->rid].name, q->rev? q->re : q->rs, "+-"[q->rev]);
+		}
+	}
+	kfree(km, a);
+}
+
 void mm_write_sam2(kstring_t *s, const mm_idx_t *mi, const mm_bseq1_t *t, int seg_idx, int reg_idx, int n_seg, const int *n_regss, const mm_reg1_t *const* regss, void *km, int64_t opt_flag)
 {
 	mm_write_sam3(s, mi, t, seg_idx, reg_idx, n_seg, n_regss, regss, km, opt_flag, -1);
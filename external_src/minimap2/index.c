@@ -4,8 +4,10 @@
 #include <io.h> // for open(2)
 #else
 #include <unistd.h>
+#include <sys/mman.h>
 #endif
 #include <fcntl.h>
+#include <errno.h>
 #include <stdio.h>
 #define __STDC_LIMIT_MACROS
 #include "kthread.h"
@@ -29,6 +31,8 @@ typedef struct mm_idx_bucket_s {
 	int32_t n;   // size of the _p_ array
 	uint64_t *p; // position array for minimizers appearing >1 times
 	void *h;     // hash table indexing _p_ and minimizers appearing once
+	uint32_t n_key;     // number of (key, value) pairs in _kv_
+	const uint64_t *kv; // flat index only: (key, value) pairs sorted by key; replaces _h_
 } mm_idx_bucket_t;
 
 typedef struct {
@@ -58,7 +62,7 @@ void mm_idx_destroy(mm_idx_t *mi)
 	uint32_t i;
 	if (mi == 0) return;
 	if (mi->h) kh_destroy(str, (khash_t(str)*)mi->h);
-	if (mi->B) {
+	if (mi->B && !mi->map) {
 		for (i = 0; i < 1U<<mi->b; ++i) {
 			free(mi->B[i].p);
 			free(mi->B[i].a.a);
@@ -71,10 +75,18 @@ void mm_idx_destroy(mm_idx_t *mi)
 		free(mi->I);
 	}
 	if (!mi->km) {
-		for (i = 0; i < mi->n_seq; ++i)
+		for (i = 0; i < mi->n_seq && !mi->map; ++i)
 			free(mi->seq[i].name);
 		free(mi->seq);
 	} else km_destroy(mi->km);
+	if (mi->map) {
+#if defined(WIN32) || defined(_WIN32)
+		free(mi->map);
+#else
+		munmap(mi->map, mi->map_len);
+#endif
+		mi->S = 0;
+	}
 	free(mi->B); free(mi->S); free(mi);
 }
 
@@ -85,6 +97,24 @@ const uint64_t *mm_idx_get(const mm_idx_t *mi, uint64_t minier, int *n)
 	mm_idx_bucket_t *b = &mi->B[minier&mask];
 	idxhash_t *h = (idxhash_t*)b->h;
 	*n = 0;
+	if (b->kv) { // flat index: binary search in the sorted keys
+		const uint64_t *kv = b->kv, x = minier>>mi->b;
+		uint32_t lo = 0, hi = b->n_key;
+		while (lo < hi) {
+			uint32_t mid = lo + ((hi - lo) >> 1);
+			if (kv[mid<<1]>>1 < x) lo = mid + 1;
+			else hi = mid;
+		}
+		if (lo == b->n_key || kv[lo<<1]>>1 != x) return 0;
+		kv += lo<<1;
+		if (kv[0]&1) {
+			*n = 1;
+			return &kv[1];
+		} else {
+			*n = (uint32_t)kv[1];
+			return &b->p[kv[1]>>32];
+		}
+	}
 	if (h == 0) return 0;
 	k = kh_get(idx, h, minier>>mi->b<<1);
 	if (k == kh_end(h)) return 0;
@@ -107,9 +137,15 @@ void mm_idx_stat(const mm_idx_t *mi)
 		len += mi->seq[i].len;
 	for (i = 0; i < 1U<<mi->b; ++i)
 		if (mi->B[i].h) n += kh_size((idxhash_t*)mi->B[i].h);
+		else n += mi->B[i].n_key;
 	for (i = 0; i < 1U<<mi->b; ++i) {
 		idxhash_t *h = (idxhash_t*)mi->B[i].h;
+		const uint64_t *kv = mi->B[i].kv;
 		khint_t k;
+		for (k = 0; kv && k < mi->B[i].n_key; ++k) {
+			sum += kv[k<<1]&1? 1 : (uint32_t)kv[k<<1|1];
+			if (kv[k<<1]&1) ++n1;
+		}
 		if (h == 0) continue;
 		for (k = 0; k < kh_end(h); ++k)
 			if (kh_exist(h, k)) {
@@ -192,9 +228,13 @@ int32_t mm_idx_cal_max_occ(const mm_idx_t *mi, float f)
 	if (f <= 0.) return INT32_MAX;
 	for (i = 0; i < 1<<mi->b; ++i)
 		if (mi->B[i].h) n += kh_size((idxhash_t*)mi->B[i].h);
+		else n += mi->B[i].n_key;
 	a = (uint32_t*)malloc(n * 4);
 	for (i = n = 0; i < 1<<mi->b; ++i) {
 		idxhash_t *h = (idxhash_t*)mi->B[i].h;
+		const uint64_t *kv = mi->B[i].kv;
+		for (k = 0; kv && k < mi->B[i].n_key; ++k)
+			a[n++] = kv[k<<1]&1? 1 : (uint32_t)kv[k<<1|1];
 		if (h == 0) continue;
 		for (k = 0; k < kh_end(h); ++k) {
 			if (!kh_exist(h, k)) continue;
@@ -277,11 +317,24 @@ static void mm_idx_post(mm_idx_t *mi, int n_threads)
 #include <zlib.h>
 #include "bseq.h"
 
+typedef struct {
+	uint32_t n, m;
+	uint64_t *a; // merged regions as st<<32|en, sorted
+} mm_idx_tgt1_t;
+
+typedef struct mm_idx_tgt_s { // regions to index with --target-bed
+	khash_t(str) *h; // sequence name -> index in a[]
+	int32_t n, m, n_hit; // n_hit: number of names found in the reference
+	uint64_t n_bp; // bases covered by the merged regions found in the reference
+	mm_idx_tgt1_t *a;
+} mm_idx_tgt_t;
+
 typedef struct {
 	int mini_batch_size;
 	uint64_t batch_size, sum_len;
 	mm_bseq_file_t *fp;
 	mm_idx_t *mi;
+	mm_idx_tgt_t *tgt;
 } pipeline_t;
 
 typedef struct {
@@ -299,6 +352,25 @@ static void mm_idx_add(mm_idx_t *mi, int n, const mm128_t *a)
 	}
 }
 
+static void mm_idx_sketch_tgt(mm_idx_tgt_t *tgt, const mm_idx_t *mi, const mm_bseq1_t *t, mm128_v *a) // sketch the target regions of t only
+{
+	khint_t k;
+	uint32_t i;
+	k = kh_get(str, tgt->h, t->name);
+	if (k == kh_end(tgt->h)) return;
+	++tgt->n_hit;
+	for (i = 0; i < tgt->a[kh_val(tgt->h, k)].n; ++i) {
+		uint64_t x = tgt->a[kh_val(tgt->h, k)].a[i];
+		int32_t st = x>>32, en = (int32_t)x < t->l_seq? (int32_t)x : t->l_seq;
+		size_t j, n0 = a->n;
+		if (st >= en) continue;
+		mm_sketch(0, t->seq + st, en - st, mi->w, mi->k, t->rid, mi->flag&MM_I_HPC, a);
+		for (j = n0; j < a->n; ++j) // shift positions to the whole sequence
+			a->a[j].y += (uint64_t)st << 1;
+		tgt->n_bp += en - st;
+	}
+}
+
 static void *worker_pipeline(void *shared, int step, void *in)
 {
 	int i;
@@ -357,7 +429,9 @@ static void *worker_pipeline(void *shared, int step, void *in)
         step_t *s = (step_t*)in;
 		for (i = 0; i < s->n_seq; ++i) {
 			mm_bseq1_t *t = &s->seq[i];
-			if (t->l_seq > 0)
+			if (t->l_seq > 0 && p->tgt)
+				mm_idx_sketch_tgt(p->tgt, p->mi, t, &s->a);
+			else if (t->l_seq > 0)
 				mm_sketch(0, t->seq, t->l_seq, p->mi->w, p->mi->k, t->rid, p->mi->flag&MM_I_HPC, &s->a);
 			else if (mm_verbose >= 2)
 				fprintf(stderr, "[WARNING] the length database sequence '%s' is 0\n", t->name);
@@ -373,7 +447,7 @@ static void *worker_pipeline(void *shared, int step, void *in)
     return 0;
 }
 
-mm_idx_t *mm_idx_gen(mm_bseq_file_t *fp, int w, int k, int b, int flag, int mini_batch_size, int n_threads, uint64_t batch_size)
+static mm_idx_t *mm_idx_gen_core(mm_bseq_file_t *fp, int w, int k, int b, int flag, int mini_batch_size, int n_threads, uint64_t batch_size, mm_idx_tgt_t *tgt)
 {
 	pipeline_t pl;
 	if (fp == 0 || mm_bseq_eof(fp)) return 0;
@@ -382,10 +456,13 @@ mm_idx_t *mm_idx_gen(mm_bseq_file_t *fp, int w, int k, int b, int flag, int mini
 	pl.batch_size = batch_size;
 	pl.fp = fp;
 	pl.mi = mm_idx_init(w, k, b, flag);
+	pl.tgt = tgt;
 
 	kt_pipeline(n_threads < 3? n_threads : 3, worker_pipeline, &pl, 3);
 	if (mm_verbose >= 3)
 		fprintf(stderr, "[M::%s::%.3f*%.2f] collected minimizers\n", __func__, realtime() - mm_realtime0, cputime() / (realtime() - mm_realtime0));
+	if (tgt && mm_verbose >= 3)
+		fprintf(stderr, "[M::%s] indexed %ld bp in target regions on %d of %d sequences named in the BED\n", __func__, (long)tgt->n_bp, tgt->n_hit, tgt->n);
 
 	mm_idx_post(pl.mi, n_threads);
 	if (mm_verbose >= 3)
@@ -394,6 +471,11 @@ mm_idx_t *mm_idx_gen(mm_bseq_file_t *fp, int w, int k, int b, int flag, int mini
 	return pl.mi;
 }
 
+mm_idx_t *mm_idx_gen(mm_bseq_file_t *fp, int w, int k, int b, int flag, int mini_batch_size, int n_threads, uint64_t batch_size)
+{
+	return mm_idx_gen_core(fp, w, k, b, flag, mini_batch_size, n_threads, batch_size, 0);
+}
+
 mm_idx_t *mm_idx_build(const char *fn, int w, int k, int flag, int n_threads) // a simpler interface; deprecated
 {
 	mm_bseq_file_t *fp;
@@ -483,11 +565,15 @@ void mm_idx_dump(FILE *fp, const mm_idx_t *mi)
 		mm_idx_bucket_t *b = &mi->B[i];
 		khint_t k;
 		idxhash_t *h = (idxhash_t*)b->h;
-		uint32_t size = h? h->size : 0;
+		uint32_t size = h? h->size : b->n_key;
 		fwrite(&b->n, 4, 1, fp);
 		fwrite(b->p, 8, b->n, fp);
 		fwrite(&size, 4, 1, fp);
 		if (size == 0) continue;
+		if (h == 0) { // from a flat index
+			fwrite(b->kv, 16, size, fp);
+			continue;
+		}
 		for (k = 0; k < kh_end(h); ++k) {
 			uint64_t x[2];
 			if (!kh_exist(h, k)) continue;
@@ -500,6 +586,213 @@ void mm_idx_dump(FILE *fp, const mm_idx_t *mi)
 	fflush(fp);
 }
 
+/*********************************
+ * Flat memory-mappable index    *
+ *********************************/
+
+/* Each part of a flat index is laid out as follows, with all offsets relative to
+ * the start of the part, which is aligned to MM_IDX_FLAT_ALIGN in the file:
+ *
+ *   header         mm_idx_flat_hdr_t
+ *   seq table      n_seq * mm_idx_flat_seq_t
+ *   names          NUL-terminated sequence names
+ *   bucket table   ((1<<b) + 1) * {start in kv[], start in p[]}
+ *   kv[]           n_key * {key, value}, sorted by key within each bucket; same encoding as the hash table
+ *   p[]            n_p positions; same as mm_idx_bucket_t::p concatenated
+ *   S[]            4-bit packed sequence, aligned to MM_IDX_FLAT_ALIGN; absent with MM_I_NO_SEQ
+ *
+ * A part is thus used in place after a single mmap(); nothing is rebuilt on load.
+ */
+
+typedef struct {
+	char magic[4];
+	uint32_t w, k, b, n_seq, flag;
+	uint64_t size;                  // size of the part, padding included
+	uint64_t sum_len, n_key, n_p;
+	uint64_t off_seq, off_name, off_bkt, off_kv, off_p, off_S;
+} mm_idx_flat_hdr_t;
+
+typedef struct {
+	uint64_t offset;
+	uint32_t len, name; // name: offset in the name section, or UINT32_MAX if absent
+} mm_idx_flat_seq_t;
+
+#define flat_roundup(x, a) (((x) + (a) - 1) / (a) * (a))
+
+static void flat_write(FILE *fp, uint64_t *pos, uint64_t off, const void *data, size_t len)
+{
+	static const char zero[64] = {0};
+	assert(*pos <= off);
+	while (*pos < off) {
+		size_t l = off - *pos < 64? off - *pos : 64;
+		fwrite(zero, 1, l, fp);
+		*pos += l;
+	}
+	if (len) fwrite(data, 1, len, fp);
+	*pos += len;
+}
+
+void mm_idx_dump_flat(FILE *fp, const mm_idx_t *mi)
+{
+	mm_idx_flat_hdr_t hdr;
+	uint64_t pos = 0, n_name = 0, *bkt;
+	uint32_t i, max_n = 0;
+	mm128_t *a;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MM_IDX_FLAT_MAGIC, 4);
+	hdr.w = mi->w, hdr.k = mi->k, hdr.b = mi->b, hdr.n_seq = mi->n_seq, hdr.flag = mi->flag;
+	for (i = 0; i < mi->n_seq; ++i) {
+		hdr.sum_len += mi->seq[i].len;
+		if (mi->seq[i].name) n_name += strlen(mi->seq[i].name) + 1;
+	}
+	bkt = (uint64_t*)calloc(((1U<<mi->b) + 1) * 2, 8);
+	for (i = 0; i < 1U<<mi->b; ++i) {
+		const mm_idx_bucket_t *b = &mi->B[i];
+		uint32_t n = b->h? kh_size((idxhash_t*)b->h) : b->n_key;
+		bkt[i<<1] = hdr.n_key, bkt[i<<1|1] = hdr.n_p;
+		hdr.n_key += n, hdr.n_p += b->n;
+		max_n = max_n > n? max_n : n;
+	}
+	bkt[i<<1] = hdr.n_key, bkt[i<<1|1] = hdr.n_p;
+	hdr.off_seq  = flat_roundup(sizeof(hdr), 64);
+	hdr.off_name = flat_roundup(hdr.off_seq + mi->n_seq * sizeof(mm_idx_flat_seq_t), 64);
+	hdr.off_bkt  = flat_roundup(hdr.off_name + n_name, 64);
+	hdr.off_kv   = flat_roundup(hdr.off_bkt + ((1ULL<<mi->b) + 1) * 16, 64);
+	hdr.off_p    = flat_roundup(hdr.off_kv + hdr.n_key * 16, 64);
+	hdr.size     = hdr.off_p + hdr.n_p * 8;
+	if (!(mi->flag & MM_I_NO_SEQ)) {
+		hdr.off_S = flat_roundup(hdr.size, MM_IDX_FLAT_ALIGN);
+		hdr.size = hdr.off_S + (hdr.sum_len + 7) / 8 * 4;
+	}
+	hdr.size = flat_roundup(hdr.size, MM_IDX_FLAT_ALIGN);
+
+	flat_write(fp, &pos, 0, &hdr, sizeof(hdr));
+	for (i = 0, n_name = 0; i < mi->n_seq; ++i) {
+		mm_idx_flat_seq_t s;
+		s.offset = mi->seq[i].offset, s.len = mi->seq[i].len;
+		s.name = mi->seq[i].name? n_name : UINT32_MAX;
+		if (mi->seq[i].name) n_name += strlen(mi->seq[i].name) + 1;
+		flat_write(fp, &pos, hdr.off_seq + i * sizeof(s), &s, sizeof(s));
+	}
+	for (i = 0, n_name = 0; i < mi->n_seq; ++i) {
+		if (mi->seq[i].name == 0) continue;
+		flat_write(fp, &pos, hdr.off_name + n_name, mi->seq[i].name, strlen(mi->seq[i].name) + 1);
+		n_name += strlen(mi->seq[i].name) + 1;
+	}
+	flat_write(fp, &pos, hdr.off_bkt, bkt, ((1ULL<<mi->b) + 1) * 16);
+	a = (mm128_t*)malloc((size_t)max_n * sizeof(mm128_t));
+	for (i = 0; i < 1U<<mi->b; ++i) {
+		const mm_idx_bucket_t *b = &mi->B[i];
+		idxhash_t *h = (idxhash_t*)b->h;
+		khint_t k;
+		size_t n = 0;
+		if (h == 0) {
+			flat_write(fp, &pos, hdr.off_kv + bkt[i<<1] * 16, b->kv, (size_t)b->n_key * 16);
+			continue;
+		}
+		for (k = 0; k < kh_end(h); ++k)
+			if (kh_exist(h, k))
+				a[n].x = kh_key(h, k), a[n++].y = kh_val(h, k);
+		radix_sort_128x(a, a + n); // keys in a bucket are unique, so this sorts by minimizer
+		flat_write(fp, &pos, hdr.off_kv + bkt[i<<1] * 16, a, n * 16);
+	}
+	free(a);
+	for (i = 0; i < 1U<<mi->b; ++i)
+		flat_write(fp, &pos, hdr.off_p + bkt[i<<1|1] * 8, mi->B[i].p, (size_t)mi->B[i].n * 8);
+	if (!(mi->flag & MM_I_NO_SEQ))
+		flat_write(fp, &pos, hdr.off_S, mi->S, (hdr.sum_len + 7) / 8 * 4);
+	flat_write(fp, &pos, hdr.size, 0, 0);
+	free(bkt);
+	fflush(fp);
+}
+
+static mm_idx_t *flat_attach(uint8_t *base) // set up an index that points into a mapped part
+{
+	const mm_idx_flat_hdr_t *hdr = (const mm_idx_flat_hdr_t*)base;
+	const uint64_t *bkt, *kv, *p;
+	const mm_idx_flat_seq_t *s;
+	mm_idx_t *mi;
+	uint32_t i;
+
+	mi = mm_idx_init(hdr->w, hdr->k, hdr->b, hdr->flag);
+	mi->map = base, mi->map_len = hdr->size;
+	mi->n_seq = hdr->n_seq;
+	mi->seq = (mm_idx_seq_t*)kcalloc(mi->km, mi->n_seq, sizeof(mm_idx_seq_t));
+	s = (const mm_idx_flat_seq_t*)(base + hdr->off_seq);
+	for (i = 0; i < mi->n_seq; ++i) {
+		mi->seq[i].name = s[i].name == UINT32_MAX? 0 : (char*)base + hdr->off_name + s[i].name;
+		mi->seq[i].offset = s[i].offset;
+		mi->seq[i].len = s[i].len;
+	}
+	bkt = (const uint64_t*)(base + hdr->off_bkt);
+	kv = (const uint64_t*)(base + hdr->off_kv);
+	p = (const uint64_t*)(base + hdr->off_p);
+	for (i = 0; i < 1U<<mi->b; ++i) {
+		mm_idx_bucket_t *b = &mi->B[i];
+		b->n_key = bkt[(i+1)<<1] - bkt[i<<1];
+		b->kv = b->n_key? kv + (bkt[i<<1]<<1) : 0;
+		b->n = bkt[(i+1)<<1|1] - bkt[i<<1|1];
+		b->p = (uint64_t*)(p + bkt[i<<1|1]);
+	}
+	if (!(mi->flag & MM_I_NO_SEQ))
+		mi->S = (uint32_t*)(base + hdr->off_S);
+	return mi;
+}
+
+static mm_idx_t *mm_idx_load_flat(FILE *fp)
+{
+	mm_idx_flat_hdr_t hdr;
+	int64_t off;
+	uint8_t *base;
+
+	off = ftell(fp);
+	if (off < 0 || off % MM_IDX_FLAT_ALIGN != 0) {
+		if (mm_verbose >= 1)
+			fprintf(stderr, "[E::%s] flat index part at misaligned offset %lld\n", __func__, (long long)off);
+		return 0;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1) return 0;
+	if (strncmp(hdr.magic, MM_IDX_FLAT_MAGIC, 4) != 0 || hdr.size < sizeof(hdr)) return 0;
+#if defined(WIN32) || defined(_WIN32)
+	base = (uint8_t*)malloc(hdr.size);
+	fseek(fp, off, SEEK_SET);
+	if (fread(base, 1, hdr.size, fp) != hdr.size) {
+		free(base);
+		return 0;
+	}
+#else
+	base = (uint8_t*)mmap(0, hdr.size, PROT_READ, MAP_SHARED, fileno(fp), off);
+	if (base == (uint8_t*)MAP_FAILED) {
+		if (mm_verbose >= 1)
+			fprintf(stderr, "[E::%s] failed to map the index: %s\n", __func__, strerror(errno));
+		return 0;
+	}
+	if (fseek(fp, off + hdr.size, SEEK_SET) != 0) {
+		munmap(base, hdr.size);
+		return 0;
+	}
+#endif
+	return flat_attach(base);
+}
+
+#if !defined(WIN32) && !defined(_WIN32)
+mm_idx_t *mm_idx_map_flat(int fd)
+{
+	mm_idx_flat_hdr_t hdr;
+	uint8_t *base;
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) return 0;
+	if (strncmp(hdr.magic, MM_IDX_FLAT_MAGIC, 4) != 0 || hdr.size < sizeof(hdr)) return 0;
+	base = (uint8_t*)mmap(0, hdr.size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == (uint8_t*)MAP_FAILED) {
+		if (mm_verbose >= 1)
+			fprintf(stderr, "[E::%s] failed to map the index: %s\n", __func__, strerror(errno));
+		return 0;
+	}
+	return flat_attach(base);
+}
+#endif
+
 mm_idx_t *mm_idx_load(FILE *fp)
 {
 	char magic[4];
@@ -508,6 +801,10 @@ mm_idx_t *mm_idx_load(FILE *fp)
 	mm_idx_t *mi;
 
 	if (fread(magic, 1, 4, fp) != 4) return 0;
+	if (strncmp(magic, MM_IDX_FLAT_MAGIC, 4) == 0) {
+		if (fseek(fp, -4, SEEK_CUR) != 0) return 0;
+		return mm_idx_load_flat(fp);
+	}
 	if (strncmp(magic, MM_IDX_MAGIC, 4) != 0) return 0;
 	if (fread(x, 4, 5, fp) != 5) return 0;
 	mi = mm_idx_init(x[0], x[1], x[2], x[4]);
@@ -572,7 +869,7 @@ int64_t mm_idx_is_idx(const char *fn)
 		lseek(fd, 0, SEEK_SET);
 #endif // WIN32
 		ret = read(fd, magic, 4);
-		if (ret == 4 && strncmp(magic, MM_IDX_MAGIC, 4) == 0)
+		if (ret == 4 && (strncmp(magic, MM_IDX_MAGIC, 4) == 0 || strncmp(magic, MM_IDX_FLAT_MAGIC, 4) == 0))
 			is_idx = 1;
 	}
 	close(fd);
@@ -602,20 +899,35 @@ void mm_idx_reader_close(mm_idx_reader_t *r)
 	if (r->is_idx) fclose(r->fp.idx);
 	else mm_bseq_close(r->fp.seq);
 	if (r->fp_out) fclose(r->fp_out);
+	mm_idx_destroy(r->srv);
+	if (r->tgt) {
+		khint_t k;
+		for (k = 0; k < kh_end(r->tgt->h); ++k)
+			if (kh_exist(r->tgt->h, k)) free((char*)kh_key(r->tgt->h, k));
+		kh_destroy(str, r->tgt->h);
+		for (k = 0; k < (khint_t)r->tgt->n; ++k) free(r->tgt->a[k].a);
+		free(r->tgt->a); free(r->tgt);
+	}
 	free(r);
 }
 
 mm_idx_t *mm_idx_reader_read(mm_idx_reader_t *r, int n_threads)
 {
 	mm_idx_t *mi;
+	if (r->is_srv) { // the whole index, as a single part
+		mi = r->srv, r->srv = 0;
+		if (mi) mi->index = r->n_parts++;
+		return mi;
+	}
 	if (r->is_idx) {
 		mi = mm_idx_load(r->fp.idx);
 		if (mi && mm_verbose >= 2 && (mi->k != r->opt.k || mi->w != r->opt.w || (mi->flag&MM_I_HPC) != (r->opt.flag&MM_I_HPC)))
 			fprintf(stderr, "[WARNING]\033[1;31m Indexing parameters (-k, -w or -H) overridden by parameters used in the prebuilt index.\033[0m\n");
 	} else
-		mi = mm_idx_gen(r->fp.seq, r->opt.w, r->opt.k, r->opt.bucket_bits, r->opt.flag, r->opt.mini_batch_size, n_threads, r->opt.batch_size);
+		mi = mm_idx_gen_core(r->fp.seq, r->opt.w, r->opt.k, r->opt.bucket_bits, r->opt.flag & ~MM_I_FLAT, r->opt.mini_batch_size, n_threads, r->opt.batch_size, r->tgt);
 	if (mi) {
-		if (r->fp_out) mm_idx_dump(r->fp_out, mi);
+		if (r->fp_out && (r->opt.flag & MM_I_FLAT)) mm_idx_dump_flat(r->fp_out, mi);
+		else if (r->fp_out) mm_idx_dump(r->fp_out, mi);
 		mi->index = r->n_parts++;
 	}
 	return mi;
@@ -623,6 +935,7 @@ mm_idx_t *mm_idx_reader_read(mm_idx_reader_t *r, int n_threads)
 
 int mm_idx_reader_eof(const mm_idx_reader_t *r) // TODO: in extremely rare cases, mm_bseq_eof() might not work
 {
+	if (r->is_srv) return r->srv == 0;
 	return r->is_idx? (feof(r->fp.idx) || ftell(r->fp.idx) == r->idx_size) : mm_bseq_eof(r->fp.seq);
 }
 
@@ -773,3 +1086,67 @@ int mm_idx_bed_junc(const mm_idx_t *mi, int32_t ctg, int32_t st, int32_t en, uin
 	}
 	return left;
 }
+
+int mm_idx_reader_set_target(mm_idx_reader_t *r, const char *fn, int64_t flank)
+{
+	gzFile fp;
+	kstream_t *ks;
+	kstring_t str = {0,0,0};
+	mm_idx_tgt_t *tgt;
+	int32_t i;
+	uint32_t j, k;
+
+	if (r->is_idx) return -2; // only works when the index is built from sequences
+	if ((fp = gzopen(fn, "r")) == 0) return -1;
+	tgt = (mm_idx_tgt_t*)calloc(1, sizeof(*tgt));
+	tgt->h = kh_init(str);
+	ks = ks_init(fp);
+	while (ks_getuntil(ks, KS_SEP_LINE, &str, 0) >= 0) {
+		char *p, *q;
+		int64_t st, en;
+		khint_t itr;
+		int absent;
+		if (str.l == 0 || str.s[0] == '#' || strncmp(str.s, "track", 5) == 0 || strncmp(str.s, "browser", 7) == 0) continue;
+		for (p = str.s; *p && *p != '\t'; ++p) {}
+		if (*p == 0) continue;
+		*p++ = 0;
+		st = strtol(p, &q, 10) - flank;
+		if (q == p || *q != '\t') continue;
+		en = strtol(q + 1, &p, 10) + flank;
+		if (p == q + 1) continue;
+		if (st < 0) st = 0;
+		if (en > INT32_MAX) en = INT32_MAX;
+		if (st >= en) continue;
+		itr = kh_put(str, tgt->h, str.s, &absent);
+		if (absent) {
+			kh_key(tgt->h, itr) = strdup(str.s);
+			if (tgt->n == tgt->m) {
+				tgt->m = tgt->m? tgt->m + (tgt->m>>1) : 16;
+				tgt->a = (mm_idx_tgt1_t*)realloc(tgt->a, tgt->m * sizeof(*tgt->a));
+			}
+			memset(&tgt->a[tgt->n], 0, sizeof(*tgt->a));
+			kh_val(tgt->h, itr) = tgt->n++;
+		}
+		i = kh_val(tgt->h, itr);
+		if (tgt->a[i].n == tgt->a[i].m) {
+			tgt->a[i].m = tgt->a[i].m? tgt->a[i].m + (tgt->a[i].m>>1) : 16;
+			tgt->a[i].a = (uint64_t*)realloc(tgt->a[i].a, tgt->a[i].m * 8);
+		}
+		tgt->a[i].a[tgt->a[i].n++] = (uint64_t)st << 32 | en;
+	}
+	free(str.s);
+	ks_destroy(ks);
+	gzclose(fp);
+	for (i = 0; i < tgt->n; ++i) { // sort and merge overlapping regions
+		radix_sort_64(tgt->a[i].a, tgt->a[i].a + tgt->a[i].n);
+		for (j = 1, k = 0; j < tgt->a[i].n; ++j) {
+			uint64_t x = tgt->a[i].a[k], y = tgt->a[i].a[j];
+			if (y>>32 <= (uint32_t)x) { // overlapping or adjacent
+				if ((uint32_t)y > (uint32_t)x) tgt->a[i].a[k] = x>>32<<32 | (uint32_t)y;
+			} else tgt->a[i].a[++k] = y;
+		}
+		if (tgt->a[i].n) tgt->a[i].n = k + 1;
+	}
+	r->tgt = tgt;
+	return 0;
+}
@@ -0,0 +1,136 @@
+#ifndef KSW2_AVX_H
+#define KSW2_AVX_H
+
+/*
+ * Vector primitives shared by the AVX2 and AVX-512 builds of ksw_extz2 and
+ * ksw_extd2. The kernels keep the 16-cell stripe granularity of the SSE
+ * versions: st/en and the backtrack matrix are laid out exactly as in
+ * ksw2_ext[zd]2_sse.c, and a "wide" register simply covers KSW_NB
+ * consecutive 16-byte stripes. Stripes that don't fill a wide register are
+ * processed with the 128-bit k1_* operations. This guarantees that the same
+ * set of cells is computed in every row, so scores and CIGARs are identical
+ * to those of the SSE4.1 kernels.
+ *
+ * k1_shl1(a, c) shifts a one byte towards higher addresses and fills byte 0
+ * with c; k1_last(a) moves the last byte of a to byte 0 and zeros the rest.
+ */
+
+#include <immintrin.h>
+
+typedef __m128i k1_t;
+#define k1_load(p)        _mm_loadu_si128((const __m128i*)(p))
+#define k1_store(p, a)    _mm_storeu_si128((__m128i*)(p), (a))
+#define k1_set1(x)        _mm_set1_epi8(x)
+#define k1_add(a, b)      _mm_add_epi8((a), (b))
+#define k1_sub(a, b)      _mm_sub_epi8((a), (b))
+#define k1_max(a, b)      _mm_max_epi8((a), (b))
+#define k1_min(a, b)      _mm_min_epi8((a), (b))
+#define k1_maxu(a, b)     _mm_max_epu8((a), (b))
+#define k1_minu(a, b)     _mm_min_epu8((a), (b))
+#define k1_and(a, b)      _mm_and_si128((a), (b))
+#define k1_or(a, b)       _mm_or_si128((a), (b))
+#define k1_andnot(a, b)   _mm_andnot_si128((a), (b))
+#define k1_cmpeq(a, b)    _mm_cmpeq_epi8((a), (b))
+#define k1_cmpgt(a, b)    _mm_cmpgt_epi8((a), (b))
+#define k1_blendv(a, b, m) _mm_blendv_epi8((a), (b), (m))
+#define k1_shl1(a, c)     _mm_or_si128(_mm_slli_si128((a), 1), (c))
+#define k1_last(a)        _mm_srli_si128((a), 15)
+
+#if defined(__AVX512BW__)
+
+#define KSW_NB 4 // number of 16-byte stripes in a wide register
+typedef __m512i kw_t;
+#define kw_load(p)        _mm512_loadu_si512((const void*)(p))
+#define kw_store(p, a)    _mm512_storeu_si512((void*)(p), (a))
+#define kw_set1(x)        _mm512_set1_epi8(x)
+#define kw_add(a, b)      _mm512_add_epi8((a), (b))
+#define kw_sub(a, b)      _mm512_sub_epi8((a), (b))
+#define kw_max(a, b)      _mm512_max_epi8((a), (b))
+#define kw_min(a, b)      _mm512_min_epi8((a), (b))
+#define kw_maxu(a, b)     _mm512_max_epu8((a), (b))
+#define kw_minu(a, b)     _mm512_min_epu8((a), (b))
+#define kw_and(a, b)      _mm512_and_si512((a), (b))
+#define kw_or(a, b)       _mm512_or_si512((a), (b))
+#define kw_andnot(a, b)   _mm512_andnot_si512((a), (b))
+#define kw_cmpeq(a, b)    _mm512_movm_epi8(_mm512_cmpeq_epi8_mask((a), (b)))
+#define kw_cmpgt(a, b)    _mm512_movm_epi8(_mm512_cmpgt_epi8_mask((a), (b)))
+#define kw_blendv(a, b, m) _mm512_mask_blend_epi8(_mm512_movepi8_mask(m), (a), (b))
+#define kw_shl1(a, c)     _mm512_or_si512(_mm512_alignr_epi8((a), _mm512_alignr_epi64((a), _mm512_setzero_si512(), 6), 15), (c))
+#define kw_last(a)        _mm512_bsrli_epi128(_mm512_alignr_epi64(_mm512_setzero_si512(), (a), 6), 15)
+#define kw_from1(a)       _mm512_inserti32x4(_mm512_setzero_si512(), (a), 0)
+#define kw_to1(a)         _mm512_castsi512_si128(a)
+
+#else // AVX2
+
+#define KSW_NB 2
+typedef __m256i kw_t;
+#define kw_load(p)        _mm256_loadu_si256((const __m256i*)(p))
+#define kw_store(p, a)    _mm256_storeu_si256((__m256i*)(p), (a))
+#define kw_set1(x)        _mm256_set1_epi8(x)
+#define kw_add(a, b)      _mm256_add_epi8((a), (b))
+#define kw_sub(a, b)      _mm256_sub_epi8((a), (b))
+#define kw_max(a, b)      _mm256_max_epi8((a), (b))
+#define kw_min(a, b)      _mm256_min_epi8((a), (b))
+#define kw_maxu(a, b)     _mm256_max_epu8((a), (b))
+#define kw_minu(a, b)     _mm256_min_epu8((a), (b))
+#define kw_and(a, b)      _mm256_and_si256((a), (b))
+#define kw_or(a, b)       _mm256_or_si256((a), (b))
+#define kw_andnot(a, b)   _mm256_andnot_si256((a), (b))
+#define kw_cmpeq(a, b)    _mm256_cmpeq_epi8((a), (b))
+#define kw_cmpgt(a, b)    _mm256_cmpgt_epi8((a), (b))
+#define kw_blendv(a, b, m) _mm256_blendv_epi8((a), (b), (m))
+#define kw_shl1(a, c)     _mm256_or_si256(_mm256_alignr_epi8((a), _mm256_permute2x128_si256((a), (a), 0x08), 15), (c))
+#define kw_last(a)        _mm256_srli_si256(_mm256_permute2x128_si256((a), (a), 0x81), 15)
+#define kw_from1(a)       _mm256_inserti128_si256(_mm256_setzero_si256(), (a), 0)
+#define kw_to1(a)         _mm256_castsi256_si128(a)
+
+#endif
+
+/*
+ * The exact-max pass over the 32-bit H[] array. The SSE kernels keep four
+ * running (max, first position) lanes, lane i covering t = st0+i (mod 4),
+ * and then pick the first lane with a strictly larger max. We use eight
+ * lanes and fold lanes i and i+4 back into SSE lane i, so that ties are
+ * broken exactly as in the SSE kernels.
+ *
+ * This implements: H[t]+=v8[t]-qe; if(H[t]>max_H) max_H=H[t],max_t=t;
+ * v8[] is int8_t for extd2 and uint8_t for extz2, as in the SSE kernels.
+ */
+static inline void ksw_wide_hmax(int32_t *H, const void *v8, int signed_v8, int32_t qe, int st0, int en1, int32_t init_H, int32_t init_t, int32_t HH[4], int32_t tt[4])
+{
+	int32_t HW[8], tw[8];
+	__m256i max_H_, max_t_, lane_, qe_;
+	int t, i;
+	max_H_ = _mm256_set1_epi32(init_H);
+	max_t_ = _mm256_set1_epi32(init_t);
+	lane_  = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	qe_    = _mm256_set1_epi32(qe);
+	for (t = st0; t + 8 <= en1; t += 8) {
+		__m256i H1, tmp, t_;
+		__m128i v_;
+		v_ = _mm_loadl_epi64((const __m128i*)((const uint8_t*)v8 + t));
+		H1 = _mm256_loadu_si256((__m256i*)&H[t]);
+		t_ = signed_v8? _mm256_cvtepi8_epi32(v_) : _mm256_cvtepu8_epi32(v_);
+		H1 = _mm256_sub_epi32(_mm256_add_epi32(H1, t_), qe_);
+		_mm256_storeu_si256((__m256i*)&H[t], H1);
+		t_ = _mm256_add_epi32(_mm256_set1_epi32(t), lane_);
+		tmp = _mm256_cmpgt_epi32(H1, max_H_);
+		max_H_ = _mm256_blendv_epi8(max_H_, H1, tmp);
+		max_t_ = _mm256_blendv_epi8(max_t_, t_, tmp);
+	}
+	_mm256_storeu_si256((__m256i*)HW, max_H_);
+	_mm256_storeu_si256((__m256i*)tw, max_t_);
+	for (i = 0; i < 4; ++i) {
+		HH[i] = HW[i], tt[i] = tw[i];
+		if (HW[i+4] > HH[i] || (HW[i+4] == HH[i] && tw[i+4] < tt[i]))
+			HH[i] = HW[i+4], tt[i] = tw[i+4];
+	}
+	for (; t < en1; ++t) { // at most four cells left; they belong to SSE lanes 0..3
+		int32_t d = signed_v8? ((const int8_t*)v8)[t] : ((const uint8_t*)v8)[t];
+		i = (t - st0) & 3;
+		H[t] += d - qe;
+		if (H[t] > HH[i]) HH[i] = H[t], tt[i] = t;
+	}
+}
+
+#endif
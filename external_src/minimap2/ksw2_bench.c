@@ -0,0 +1,178 @@
+// Benchmark and cross-check of the CPU-dispatched ksw2 kernels.
+//
+// A fixed set of long-read-like alignment problems is generated from a seeded
+// PRNG (so every run aligns exactly the same pairs); every kernel available on
+// this CPU is run on them with the map-ont/map-hifi scoring, and all results
+// are compared against the SSE4.1 kernel. Usage: ksw2-bench [-n pairs] [-l len]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "ksw2.h"
+
+#ifdef KSW_CPU_DISPATCH
+typedef void (*extd2_f)(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat,
+						int8_t q, int8_t e, int8_t q2, int8_t e2, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
+typedef void (*extz2_f)(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat,
+						int8_t q, int8_t e, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
+
+extern void ksw_extd2_sse2(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat, int8_t q, int8_t e, int8_t q2, int8_t e2, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
+extern void ksw_extd2_sse41(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat, int8_t q, int8_t e, int8_t q2, int8_t e2, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
+extern void ksw_extd2_avx2(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat, int8_t q, int8_t e, int8_t q2, int8_t e2, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
+extern void ksw_extd2_avx512(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat, int8_t q, int8_t e, int8_t q2, int8_t e2, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
+extern void ksw_extz2_sse2(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat, int8_t q, int8_t e, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
+extern void ksw_extz2_sse41(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat, int8_t q, int8_t e, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
+extern void ksw_extz2_avx2(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat, int8_t q, int8_t e, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
+extern void ksw_extz2_avx512(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat, int8_t q, int8_t e, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
+
+typedef struct {
+	const char *name;
+	extd2_f extd2;
+	extz2_f extz2;
+} kernel_t;
+
+static kernel_t kernels[] = {
+	{ "sse4.1", ksw_extd2_sse41,  ksw_extz2_sse41 }, // the reference; must be the first
+	{ "sse2",   ksw_extd2_sse2,   ksw_extz2_sse2 },
+	{ "avx2",   ksw_extd2_avx2,   ksw_extz2_avx2 },
+	{ "avx512", ksw_extd2_avx512, ksw_extz2_avx512 }
+};
+
+typedef struct {
+	int qlen, tlen, w, flag;
+	uint8_t *q, *t;
+} pair_t;
+
+static uint64_t bench_rand(uint64_t *x) // splitmix64
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static double cputime(void)
+{
+	struct timeval tp;
+	gettimeofday(&tp, 0);
+	return tp.tv_sec + tp.tv_usec * 1e-6;
+}
+
+// a noisy long read of the target: ~5% substitutions, ~3% insertions and ~4% deletions,
+// plus an occasional SV-sized indel or an unrelated tail to trigger Z-drop
+static void gen_pair(uint64_t *x, int len, pair_t *p)
+{
+	int i, j, k;
+	p->tlen = len;
+	p->t = (uint8_t*)malloc(len);
+	p->q = (uint8_t*)malloc(len * 2 + 1000);
+	for (i = 0; i < len; ++i)
+		p->t[i] = bench_rand(x) % 1000 == 0? 4 : bench_rand(x) & 3;
+	for (i = j = 0; i < len; ++i) {
+		uint64_t r = bench_rand(x) % 1000;
+		if (r < 40) continue; // deletion
+		if (r < 70) p->q[j++] = bench_rand(x) & 3; // insertion
+		if (r >= 70 && r < 120) p->q[j++] = (p->t[i] + 1 + bench_rand(x) % 3) & 3; // mismatch
+		else p->q[j++] = p->t[i];
+		if (bench_rand(x) % 20000 == 0) { // a large insertion
+			int l = 50 + bench_rand(x) % 300;
+			for (k = 0; k < l; ++k) p->q[j++] = bench_rand(x) & 3;
+		}
+		if (bench_rand(x) % 20000 == 0) i += 50 + bench_rand(x) % 300; // a large deletion
+	}
+	if (bench_rand(x) % 8 == 0) // junk at the end
+		for (k = j / 2; k < j; ++k) p->q[k] = bench_rand(x) & 3;
+	p->qlen = j;
+	p->w = bench_rand(x) % 4 == 0? -1 : 500;
+	p->flag = 0;
+	switch (bench_rand(x) % 8) {
+		case 0: p->flag = KSW_EZ_RIGHT; break;
+		case 1: p->flag = KSW_EZ_SCORE_ONLY; break;
+		case 2: p->flag = KSW_EZ_APPROX_MAX | KSW_EZ_APPROX_DROP; break;
+		case 3: p->flag = KSW_EZ_EXTZ_ONLY; break;
+		case 4: p->flag = KSW_EZ_EXTZ_ONLY | KSW_EZ_RIGHT | KSW_EZ_REV_CIGAR; break;
+		case 5: p->flag = KSW_EZ_GENERIC_SC; break;
+	}
+}
+
+static int same_ez(const ksw_extz_t *a, const ksw_extz_t *b)
+{
+	if (a->score != b->score || a->max != b->max || a->max_q != b->max_q || a->max_t != b->max_t) return 0;
+	if (a->mqe != b->mqe || a->mqe_t != b->mqe_t || a->mte != b->mte || a->mte_q != b->mte_q) return 0;
+	if (a->zdropped != b->zdropped || a->reach_end != b->reach_end || a->n_cigar != b->n_cigar) return 0;
+	return a->n_cigar == 0 || memcmp(a->cigar, b->cigar, a->n_cigar * 4) == 0;
+}
+
+static void run(const kernel_t *k, int is_extd, int n, const pair_t *a, const int8_t *mat, ksw_extz_t *ez)
+{
+	int i;
+	for (i = 0; i < n; ++i) {
+		memset(&ez[i], 0, sizeof(ksw_extz_t));
+		if (is_extd) k->extd2(0, a[i].qlen, a[i].q, a[i].tlen, a[i].t, 5, mat, 4, 2, 24, 1, a[i].w, 400, -1, a[i].flag, &ez[i]);
+		else k->extz2(0, a[i].qlen, a[i].q, a[i].tlen, a[i].t, 5, mat, 4, 2, a[i].w, 400, -1, a[i].flag, &ez[i]);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int i, j, c, n = 200, len = 10000, is_extd, n_err = 0;
+	uint64_t x = 11;
+	int8_t mat[25];
+	pair_t *a;
+	ksw_extz_t *ref, *ez;
+	double cells = 0.0;
+
+	while ((c = getopt(argc, argv, "n:l:s:")) >= 0) {
+		if (c == 'n') n = atoi(optarg);
+		else if (c == 'l') len = atoi(optarg);
+		else if (c == 's') x = strtoull(optarg, 0, 10);
+	}
+	for (i = 0; i < 5; ++i) // map-ont scoring: a=2, b=4, sc_ambi=1
+		for (j = 0; j < 5; ++j)
+			mat[i * 5 + j] = i == 4 || j == 4? -1 : i == j? 2 : -4;
+	a = (pair_t*)calloc(n, sizeof(pair_t));
+	for (i = 0; i < n; ++i) {
+		gen_pair(&x, 100 + bench_rand(&x) % len, &a[i]);
+		cells += (double)a[i].qlen * (a[i].w < 0? a[i].tlen : a[i].w * 2 + 1);
+	}
+	ref = (ksw_extz_t*)calloc(n, sizeof(ksw_extz_t));
+	ez = (ksw_extz_t*)calloc(n, sizeof(ksw_extz_t));
+	__builtin_cpu_init();
+	for (is_extd = 1; is_extd >= 0; --is_extd) {
+		double t_ref = 1.0;
+		run(&kernels[0], is_extd, n, a, mat, ref); // this also warms up the caches
+		for (j = 0; j < (int)(sizeof(kernels) / sizeof(kernel_t)); ++j) {
+			const kernel_t *k = &kernels[j];
+			double t;
+			int n_diff = 0;
+			if ((j == 2 && !__builtin_cpu_supports("avx2")) || (j == 3 && !__builtin_cpu_supports("avx512bw"))) {
+				printf("%s\t%s\tskipped (not supported by this CPU)\n", is_extd? "extd2" : "extz2", k->name);
+				continue;
+			}
+			t = cputime();
+			run(k, is_extd, n, a, mat, ez);
+			t = cputime() - t;
+			if (j == 0) t_ref = t;
+			for (i = 0; i < n; ++i) {
+				if (!same_ez(&ref[i], &ez[i])) ++n_diff;
+				free(ez[i].cigar);
+			}
+			n_err += n_diff;
+			printf("%s\t%s\t%.3f sec\t%.3f GCUPS\t%.2fx\t%d/%d different\n", is_extd? "extd2" : "extz2", k->name,
+				   t, cells / t * 1e-9, t_ref / t, n_diff, n);
+		}
+		for (i = 0; i < n; ++i) free(ref[i].cigar);
+	}
+	for (i = 0; i < n; ++i) free(a[i].q), free(a[i].t);
+	free(a); free(ref); free(ez);
+	return n_err? 1 : 0;
+}
+#else
+int main(void)
+{
+	fprintf(stderr, "ksw2-bench requires the CPU-dispatched x86 build\n");
+	return 1;
+}
+#endif
@@ -11,6 +11,7 @@
 #define SIMD_AVX     0x40
 #define SIMD_AVX2    0x80
 #define SIMD_AVX512F 0x100
+#define SIMD_AVX512BW 0x200
 
 #ifndef _MSC_VER
 // adapted from https://github.com/01org/linux-sgx/blob/master/common/inc/internal/linux/cpuid_gnu.h
@@ -30,9 +31,20 @@ void __cpuidex(int cpuid[4], int func_id, int subfunc_id)
 
 static int ksw_simd = -1;
 
+static uint64_t x86_xgetbv(void) // OS support of the extended register states
+{
+#ifndef _MSC_VER
+	uint32_t eax, edx;
+	__asm__ volatile (".byte 0x0f, 0x01, 0xd0" : "=a" (eax), "=d" (edx) : "c" (0)); // xgetbv
+	return (uint64_t)edx << 32 | eax;
+#else
+	return _xgetbv(0);
+#endif
+}
+
 static int x86_simd(void)
 {
-	int flag = 0, cpuid[4], max_id;
+	int flag = 0, cpuid[4], max_id, os_avx = 0, os_avx512 = 0;
 	__cpuidex(cpuid, 0, 0);
 	max_id = cpuid[0];
 	if (max_id == 0) return 0;
@@ -43,11 +55,17 @@ static int x86_simd(void)
 	if (cpuid[2]>>9 &1) flag |= SIMD_SSSE3;
 	if (cpuid[2]>>19&1) flag |= SIMD_SSE4_1;
 	if (cpuid[2]>>20&1) flag |= SIMD_SSE4_2;
-	if (cpuid[2]>>28&1) flag |= SIMD_AVX;
+	if (cpuid[2]>>27&1) { // OSXSAVE; otherwise the OS doesn't save the YMM/ZMM registers
+		uint64_t xcr0 = x86_xgetbv();
+		os_avx = (xcr0 & 0x6) == 0x6;
+		os_avx512 = (xcr0 & 0xe6) == 0xe6;
+	}
+	if ((cpuid[2]>>28&1) && os_avx) flag |= SIMD_AVX;
 	if (max_id >= 7) {
 		__cpuidex(cpuid, 7, 0);
-		if (cpuid[1]>>5 &1) flag |= SIMD_AVX2;
-		if (cpuid[1]>>16&1) flag |= SIMD_AVX512F;
+		if ((cpuid[1]>>5 &1) && os_avx) flag |= SIMD_AVX2;
+		if ((cpuid[1]>>16&1) && os_avx512) flag |= SIMD_AVX512F;
+		if ((cpuid[1]>>30&1) && os_avx512) flag |= SIMD_AVX512BW;
 	}
 	return flag;
 }
@@ -56,8 +74,14 @@ void ksw_extz2_sse(void *km, int qlen, const uint8_t *query, int tlen, const uin
 {
 	extern void ksw_extz2_sse2(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat, int8_t q, int8_t e, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
 	extern void ksw_extz2_sse41(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat, int8_t q, int8_t e, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
+	extern void ksw_extz2_avx2(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat, int8_t q, int8_t e, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
+	extern void ksw_extz2_avx512(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat, int8_t q, int8_t e, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
 	if (ksw_simd < 0) ksw_simd = x86_simd();
-	if (ksw_simd & SIMD_SSE4_1)
+	if ((ksw_simd & SIMD_AVX512F) && (ksw_simd & SIMD_AVX512BW))
+		ksw_extz2_avx512(km, qlen, query, tlen, target, m, mat, q, e, w, zdrop, end_bonus, flag, ez);
+	else if (ksw_simd & SIMD_AVX2)
+		ksw_extz2_avx2(km, qlen, query, tlen, target, m, mat, q, e, w, zdrop, end_bonus, flag, ez);
+	else if (ksw_simd & SIMD_SSE4_1)
 		ksw_extz2_sse41(km, qlen, query, tlen, target, m, mat, q, e, w, zdrop, end_bonus, flag, ez);
 	else if (ksw_simd & SIMD_SSE2)
 		ksw_extz2_sse2(km, qlen, query, tlen, target, m, mat, q, e, w, zdrop, end_bonus, flag, ez);
@@ -71,8 +95,16 @@ void ksw_extd2_sse(void *km, int qlen, const uint8_t *query, int tlen, const uin
 				   int8_t q, int8_t e, int8_t q2, int8_t e2, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
 	extern void ksw_extd2_sse41(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat,
 				   int8_t q, int8_t e, int8_t q2, int8_t e2, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
+	extern void ksw_extd2_avx2(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat,
+				   int8_t q, int8_t e, int8_t q2, int8_t e2, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
+	extern void ksw_extd2_avx512(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat,
+				   int8_t q, int8_t e, int8_t q2, int8_t e2, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez);
 	if (ksw_simd < 0) ksw_simd = x86_simd();
-	if (ksw_simd & SIMD_SSE4_1)
+	if ((ksw_simd & SIMD_AVX512F) && (ksw_simd & SIMD_AVX512BW))
+		ksw_extd2_avx512(km, qlen, query, tlen, target, m, mat, q, e, q2, e2, w, zdrop, end_bonus, flag, ez);
+	else if (ksw_simd & SIMD_AVX2)
+		ksw_extd2_avx2(km, qlen, query, tlen, target, m, mat, q, e, q2, e2, w, zdrop, end_bonus, flag, ez);
+	else if (ksw_simd & SIMD_SSE4_1)
 		ksw_extd2_sse41(km, qlen, query, tlen, target, m, mat, q, e, q2, e2, w, zdrop, end_bonus, flag, ez);
 	else if (ksw_simd & SIMD_SSE2)
 		ksw_extd2_sse2(km, qlen, query, tlen, target, m, mat, q, e, q2, e2, w, zdrop, end_bonus, flag, ez);
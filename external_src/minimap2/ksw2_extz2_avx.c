@@ -0,0 +1,255 @@
+#include <string.h>
+#include <assert.h>
+#include "ksw2.h"
+
+#if defined(__AVX2__) && defined(KSW_CPU_DISPATCH)
+#include "ksw2_avx.h"
+
+#ifdef __AVX512BW__
+void ksw_extz2_avx512(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat, int8_t q, int8_t e, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez)
+#else
+void ksw_extz2_avx2(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat, int8_t q, int8_t e, int w, int zdrop, int end_bonus, int flag, ksw_extz_t *ez)
+#endif
+{ // see ksw2_extz2_sse.c for the comments on the DP; P is k1 (128-bit) or kw (wide)
+#define __dp_code_block1(P) \
+	z = P##_add(P##_load(&s[t]), P##_set1((q + e) * 2)); \
+	xt1 = P##_load(&x[t]);                           /* xt1 <- x[r-1][t..t+W-1] */ \
+	tmp = P##_last(xt1);                             /* tmp <- x[r-1][t+W-1] */ \
+	xt1 = P##_shl1(xt1, P##x1_);                     /* xt1 <- x[r-1][t-1..t+W-2] */ \
+	P##x1_ = tmp; \
+	vt1 = P##_load(&v[t]);                           /* vt1 <- v[r-1][t..t+W-1] */ \
+	tmp = P##_last(vt1);                             /* tmp <- v[r-1][t+W-1] */ \
+	vt1 = P##_shl1(vt1, P##v1_);                     /* vt1 <- v[r-1][t-1..t+W-2] */ \
+	P##v1_ = tmp; \
+	a = P##_add(xt1, vt1);                           /* a <- x[r-1][t-1..t+W-2] + v[r-1][t-1..t+W-2] */ \
+	ut = P##_load(&u[t]);                            /* ut <- u[t..t+W-1] */ \
+	b = P##_add(P##_load(&y[t]), ut);                /* b <- y[r-1][t..t+W-1] + u[r-1][t..t+W-1] */
+
+#define __dp_code_block2(P) \
+	z = P##_maxu(z, b);                              /* z = max(z, b); this works because both are non-negative */ \
+	z = P##_minu(z, P##_set1(mat[0] + (q + e) * 2)); \
+	P##_store(&u[t], P##_sub(z, vt1));               /* u[r][t..t+W-1] <- z - v[r-1][t-1..t+W-2] */ \
+	P##_store(&v[t], P##_sub(z, ut));                /* v[r][t..t+W-1] <- z - u[r-1][t..t+W-1] */ \
+	z = P##_sub(z, P##_set1(q)); \
+	a = P##_sub(a, z); \
+	b = P##_sub(b, z);
+
+#define __dp_score_only(P) do { \
+	P##_t z, a, b, xt1, vt1, ut, tmp; \
+	__dp_code_block1(P); \
+	z = P##_max(z, a);                                           /* z = z > a? z : a (signed) */ \
+	__dp_code_block2(P); \
+	P##_store(&x[t], P##_max(a, P##_set1(0))); \
+	P##_store(&y[t], P##_max(b, P##_set1(0))); \
+} while (0)
+
+#define __dp_left(P) do { \
+	P##_t d, z, a, b, xt1, vt1, ut, tmp; \
+	__dp_code_block1(P); \
+	d = P##_and(P##_cmpgt(a, z), P##_set1(1));                  /* d = a > z? 1 : 0 */ \
+	z = P##_max(z, a);                                           /* z = z > a? z : a (signed) */ \
+	tmp = P##_cmpgt(b, z); \
+	d = P##_blendv(d, P##_set1(2), tmp);                         /* d = b > z? 2 : d */ \
+	__dp_code_block2(P); \
+	tmp = P##_cmpgt(a, P##_set1(0)); \
+	P##_store(&x[t], P##_and(tmp, a)); \
+	d = P##_or(d, P##_and(tmp, P##_set1(0x08)));                 /* d = a > 0? 0x08 : 0 */ \
+	tmp = P##_cmpgt(b, P##_set1(0)); \
+	P##_store(&y[t], P##_and(tmp, b)); \
+	d = P##_or(d, P##_and(tmp, P##_set1(0x10)));                 /* d = b > 0? 0x10 : 0 */ \
+	P##_store(&pr[t], d); \
+} while (0)
+
+#define __dp_right(P) do { \
+	P##_t d, z, a, b, xt1, vt1, ut, tmp; \
+	__dp_code_block1(P); \
+	d = P##_andnot(P##_cmpgt(z, a), P##_set1(1));               /* d = z > a? 0 : 1 */ \
+	z = P##_max(z, a);                                           /* z = z > a? z : a (signed) */ \
+	tmp = P##_cmpgt(z, b); \
+	d = P##_blendv(P##_set1(2), d, tmp);                         /* d = z > b? d : 2 */ \
+	__dp_code_block2(P); \
+	tmp = P##_cmpgt(P##_set1(0), a); \
+	P##_store(&x[t], P##_andnot(tmp, a)); \
+	d = P##_or(d, P##_andnot(tmp, P##_set1(0x08)));              /* d = 0 > a? 0 : 0x08 */ \
+	tmp = P##_cmpgt(P##_set1(0), b); \
+	P##_store(&y[t], P##_andnot(tmp, b)); \
+	d = P##_or(d, P##_andnot(tmp, P##_set1(0x10)));              /* d = 0 > b? 0 : 0x10 */ \
+	P##_store(&pr[t], d); \
+} while (0)
+
+#define __dp_set_score(P) do { \
+	P##_t sq, st, tmp, mask; \
+	sq = P##_load(&sf[t]); \
+	st = P##_load(&qrr[t]); \
+	mask = P##_or(P##_cmpeq(sq, P##_set1(m - 1)), P##_cmpeq(st, P##_set1(m - 1))); \
+	tmp = P##_cmpeq(sq, st); \
+	tmp = P##_blendv(P##_set1(mat[1]), P##_set1(mat[0]), tmp); \
+	tmp = P##_blendv(tmp, P##_set1(sc_N), mask); \
+	P##_store((uint8_t*)s + t, tmp); \
+} while (0)
+
+	int r, t, qe = q + e, n_col_, *off = 0, *off_end = 0, tlen_, qlen_, last_st, last_en, wl, wr, max_sc, min_sc;
+	int with_cigar = !(flag&KSW_EZ_SCORE_ONLY), approx_max = !!(flag&KSW_EZ_APPROX_MAX);
+	int32_t *H = 0, H0 = 0, last_H0_t = 0;
+	int8_t sc_N;
+	uint8_t *qr, *sf, *mem, *mem2 = 0;
+	__m128i *u, *v, *x, *y, *s, *p = 0;
+
+	ksw_reset_extz(ez);
+	if (m <= 0 || qlen <= 0 || tlen <= 0) return;
+
+	sc_N = mat[m*m-1] == 0? -e : mat[m*m-1];
+
+	if (w < 0) w = tlen > qlen? tlen : qlen;
+	wl = wr = w;
+	tlen_ = (tlen + 15) / 16;
+	n_col_ = qlen < tlen? qlen : tlen;
+	n_col_ = ((n_col_ < w + 1? n_col_ : w + 1) + 15) / 16 + 1;
+	qlen_ = (qlen + 15) / 16;
+	for (t = 1, max_sc = mat[0], min_sc = mat[1]; t < m * m; ++t) {
+		max_sc = max_sc > mat[t]? max_sc : mat[t];
+		min_sc = min_sc < mat[t]? min_sc : mat[t];
+	}
+	if (-min_sc > 2 * (q + e)) return; // otherwise, we won't see any mismatches
+
+	mem = (uint8_t*)kcalloc(km, tlen_ * 6 + qlen_ + 1, 16);
+	u = (__m128i*)(((size_t)mem + 15) >> 4 << 4); // 16-byte aligned
+	v = u + tlen_, x = v + tlen_, y = x + tlen_, s = y + tlen_, sf = (uint8_t*)(s + tlen_), qr = sf + tlen_ * 16;
+	if (!approx_max) {
+		H = (int32_t*)kmalloc(km, tlen_ * 16 * 4);
+		for (t = 0; t < tlen_ * 16; ++t) H[t] = KSW_NEG_INF;
+	}
+	if (with_cigar) {
+		mem2 = (uint8_t*)kmalloc(km, ((size_t)(qlen + tlen - 1) * n_col_ + 1) * 16);
+		p = (__m128i*)(((size_t)mem2 + 15) >> 4 << 4);
+		off = (int*)kmalloc(km, (qlen + tlen - 1) * sizeof(int) * 2);
+		off_end = off + qlen + tlen - 1;
+	}
+
+	for (t = 0; t < qlen; ++t) qr[t] = query[qlen - 1 - t];
+	memcpy(sf, target, tlen);
+
+	for (r = 0, last_st = last_en = -1; r < qlen + tlen - 1; ++r) {
+		int st = 0, en = tlen - 1, st0, en0, st_, en_;
+		int8_t x1, v1;
+		uint8_t *qrr = qr + (qlen - 1 - r), *u8 = (uint8_t*)u, *v8 = (uint8_t*)v;
+		k1_t k1x1_, k1v1_;
+		kw_t kwx1_, kwv1_;
+		// find the boundaries
+		if (st < r - qlen + 1) st = r - qlen + 1;
+		if (en > r) en = r;
+		if (st < (r-wr+1)>>1) st = (r-wr+1)>>1; // take the ceil
+		if (en > (r+wl)>>1) en = (r+wl)>>1; // take the floor
+		if (st > en) {
+			ez->zdropped = 1;
+			break;
+		}
+		st0 = st, en0 = en;
+		st = st / 16 * 16, en = (en + 16) / 16 * 16 - 1;
+		// set boundary conditions
+		if (st > 0) {
+			if (st - 1 >= last_st && st - 1 <= last_en)
+				x1 = ((uint8_t*)x)[st - 1], v1 = v8[st - 1]; // (r-1,s-1) calculated in the last round
+			else x1 = v1 = 0; // not calculated; set to zeros
+		} else x1 = 0, v1 = r? q : 0;
+		if (en >= r) ((uint8_t*)y)[r] = 0, u8[r] = r? q : 0;
+		// loop fission: set scores first; the last 16 bytes are written by the 128-bit code as in the SSE kernel
+		if (!(flag & KSW_EZ_GENERIC_SC)) {
+			int last16 = st0 + (en0 - st0) / 16 * 16;
+			for (t = st0; t + KSW_NB * 16 <= last16; t += KSW_NB * 16)
+				__dp_set_score(kw);
+			for (; t <= en0; t += 16)
+				__dp_set_score(k1);
+		} else {
+			for (t = st0; t <= en0; ++t)
+				((uint8_t*)s)[t] = mat[sf[t] * m + qrr[t]];
+		}
+		// core loop
+		k1x1_ = _mm_cvtsi32_si128(x1);
+		k1v1_ = _mm_cvtsi32_si128(v1);
+		kwx1_ = kw_from1(k1x1_);
+		kwv1_ = kw_from1(k1v1_);
+		st_ = st / 16, en_ = en / 16;
+		assert(en_ - st_ + 1 <= n_col_);
+		if (!with_cigar) { // score only
+			for (t = st_; t + KSW_NB - 1 <= en_; t += KSW_NB)
+				__dp_score_only(kw);
+			k1x1_ = kw_to1(kwx1_), k1v1_ = kw_to1(kwv1_);
+			for (; t <= en_; ++t)
+				__dp_score_only(k1);
+		} else if (!(flag&KSW_EZ_RIGHT)) { // gap left-alignment
+			__m128i *pr = p + (size_t)r * n_col_ - st_;
+			off[r] = st, off_end[r] = en;
+			for (t = st_; t + KSW_NB - 1 <= en_; t += KSW_NB)
+				__dp_left(kw);
+			k1x1_ = kw_to1(kwx1_), k1v1_ = kw_to1(kwv1_);
+			for (; t <= en_; ++t)
+				__dp_left(k1);
+		} else { // gap right-alignment
+			__m128i *pr = p + (size_t)r * n_col_ - st_;
+			off[r] = st, off_end[r] = en;
+			for (t = st_; t + KSW_NB - 1 <= en_; t += KSW_NB)
+				__dp_right(kw);
+			k1x1_ = kw_to1(kwx1_), k1v1_ = kw_to1(kwv1_);
+			for (; t <= en_; ++t)
+				__dp_right(k1);
+		}
+		if (!approx_max) { // find the exact max with a 32-bit score array
+			int32_t max_H, max_t;
+			// compute H[], max_H and max_t
+			if (r > 0) {
+				int32_t HH[4], tt[4], en1 = st0 + (en0 - st0) / 4 * 4, i;
+				max_H = H[en0] = en0 > 0? H[en0-1] + u8[en0] - qe : H[en0] + v8[en0] - qe; // special casing the last element
+				max_t = en0;
+				ksw_wide_hmax(H, v8, 0, qe, st0, en1, max_H, max_t, HH, tt);
+				for (i = 0; i < 4; ++i)
+					if (max_H < HH[i]) max_H = HH[i], max_t = tt[i];
+				for (t = en1; t < en0; ++t) { // for the rest of values that haven't been computed with SIMD
+					H[t] += (int32_t)v8[t] - qe;
+					if (H[t] > max_H)
+						max_H = H[t], max_t = t;
+				}
+			} else H[0] = v8[0] - qe - qe, max_H = H[0], max_t = 0; // special casing r==0
+			// update ez
+			if (en0 == tlen - 1 && H[en0] > ez->mte)
+				ez->mte = H[en0], ez->mte_q = r - en0;
+			if (r - st0 == qlen - 1 && H[st0] > ez->mqe)
+				ez->mqe = H[st0], ez->mqe_t = st0;
+			if (ksw_apply_zdrop(ez, 1, max_H, r, max_t, zdrop, e)) break;
+			if (r == qlen + tlen - 2 && en0 == tlen - 1)
+				ez->score = H[tlen - 1];
+		} else { // find approximate max; Z-drop might be inaccurate, too.
+			if (r > 0) {
+				if (last_H0_t >= st0 && last_H0_t <= en0 && last_H0_t + 1 >= st0 && last_H0_t + 1 <= en0) {
+					int32_t d0 = v8[last_H0_t] - qe;
+					int32_t d1 = u8[last_H0_t + 1] - qe;
+					if (d0 > d1) H0 += d0;
+					else H0 += d1, ++last_H0_t;
+				} else if (last_H0_t >= st0 && last_H0_t <= en0) {
+					H0 += v8[last_H0_t] - qe;
+				} else {
+					++last_H0_t, H0 += u8[last_H0_t] - qe;
+				}
+				if ((flag & KSW_EZ_APPROX_DROP) && ksw_apply_zdrop(ez, 1, H0, r, last_H0_t, zdrop, e)) break;
+			} else H0 = v8[0] - qe - qe, last_H0_t = 0;
+			if (r == qlen + tlen - 2 && en0 == tlen - 1)
+				ez->score = H0;
+		}
+		last_st = st, last_en = en;
+	}
+	kfree(km, mem);
+	if (!approx_max) kfree(km, H);
+	if (with_cigar) { // backtrack
+		int rev_cigar = !!(flag & KSW_EZ_REV_CIGAR);
+		if (!ez->zdropped && !(flag&KSW_EZ_EXTZ_ONLY)) {
+			ksw_backtrack(km, 1, rev_cigar, 0, (uint8_t*)p, off, off_end, n_col_*16, tlen-1, qlen-1, &ez->m_cigar, &ez->n_cigar, &ez->cigar);
+		} else if (!ez->zdropped && (flag&KSW_EZ_EXTZ_ONLY) && ez->mqe + end_bonus > (int)ez->max) {
+			ez->reach_end = 1;
+			ksw_backtrack(km, 1, rev_cigar, 0, (uint8_t*)p, off, off_end, n_col_*16, ez->mqe_t, qlen-1, &ez->m_cigar, &ez->n_cigar, &ez->cigar);
+		} else if (ez->max_t >= 0 && ez->max_q >= 0) {
+			ksw_backtrack(km, 1, rev_cigar, 0, (uint8_t*)p, off, off_end, n_col_*16, ez->max_t, ez->max_q, &ez->m_cigar, &ez->n_cigar, &ez->cigar);
+		}
+		kfree(km, mem2); kfree(km, off);
+	}
+}
+#endif // __AVX2__ && KSW_CPU_DISPATCH
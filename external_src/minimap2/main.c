@@ -5,6 +5,7 @@
 #include "bseq.h"
 #include "minimap.h"
 #include "mmpriv.h"
+#include "bamsort.h"
 #include "ketopt.h"
 
 #ifdef __linux__
@@ -77,6 +78,20 @@ static ko_longopt_t long_options[] = {
 	{ "print-chains",   ko_no_argument,       352 },
 	{ "no-hash-name",   ko_no_argument,       353 },
 	{ "secondary-seq",  ko_no_argument,       354 },
+	{ "idx-mmap",       ko_no_argument,       355 },
+	{ "sort-bam",       ko_no_argument,       356 },
+	{ "sort-mem",       ko_required_argument, 357 },
+	{ "read-stats",     ko_required_argument, 358 },
+	{ "sv-sig",         ko_required_argument, 359 },
+	{ "sv-min-len",     ko_required_argument, 360 },
+	{ "max-mem",        ko_required_argument, 361 },
+	{ "checkpoint",     ko_required_argument, 362 },
+	{ "resume",         ko_no_argument,       363 },
+	{ "target-bed",     ko_required_argument, 364 },
+	{ "target-flank",   ko_required_argument, 365 },
+	{ "target-prescreen", ko_required_argument, 366 },
+	{ "idx-serve",      ko_required_argument, 367 },
+	{ "idx-socket",     ko_required_argument, 368 },
 	{ "help",           ko_no_argument,       'h' },
 	{ "max-intron-len", ko_required_argument, 'G' },
 	{ "version",        ko_no_argument,       'V' },
@@ -125,7 +140,9 @@ int main(int argc, char *argv[])
 	mm_mapopt_t opt;
 	mm_idxopt_t ipt;
 	int i, c, n_threads = 3, n_parts, old_best_n = -1;
-	char *fnw = 0, *rg = 0, *junc_bed = 0, *s, *alt_list = 0;
+	char *fnw = 0, *rg = 0, *junc_bed = 0, *s, *alt_list = 0, *fn_out = 0, *fn_rstat = 0, *fn_svsig = 0, *fn_ckpt = 0, *fn_tgt = 0, *fn_serve = 0, *fn_socket = 0;
+	int sort_bam = 0, resume = 0;
+	int64_t sort_mem = 768000000, tgt_flank = 50000;
 	FILE *fp_help = stderr;
 	mm_idx_reader_t *idx_rdr;
 	mm_idx_t *mi;
@@ -192,12 +209,7 @@ int main(int argc, char *argv[])
 			if (t == 0) opt.flag |= MM_F_SPLICE_OLD;
 			else if (t == 1) opt.flag &= ~MM_F_SPLICE_OLD;
 		} else if (c == 'o') {
-			if (strcmp(o.arg, "-") != 0) {
-				if (freopen(o.arg, "wb", stdout) == NULL) {
-					fprintf(stderr, "[ERROR]\033[1;31m failed to write the output to file '%s'\033[0m: %s\n", o.arg, strerror(errno));
-					exit(1);
-				}
-			}
+			fn_out = strcmp(o.arg, "-") != 0? o.arg : 0; // opened after all options are parsed; see below
 		}
 		else if (c == 300) ipt.bucket_bits = atoi(o.arg); // --bucket-bits
 		else if (c == 302) opt.seed = atoi(o.arg); // --seed
@@ -242,6 +254,20 @@ int main(int argc, char *argv[])
 		else if (c == 352) mm_dbg_flag |= MM_DBG_PRINT_CHAIN; // --print-chains
 		else if (c == 353) opt.flag |= MM_F_NO_HASH_NAME; // --no-hash-name
 		else if (c == 354) opt.flag |= MM_F_SECONDARY_SEQ; // --secondary-seq
+		else if (c == 355) ipt.flag |= MM_I_FLAT; // --idx-mmap
+		else if (c == 356) sort_bam = 1, opt.flag |= MM_F_OUT_SAM | MM_F_CIGAR; // --sort-bam
+		else if (c == 357) sort_mem = mm_parse_num(o.arg); // --sort-mem
+		else if (c == 358) fn_rstat = o.arg; // --read-stats
+		else if (c == 359) fn_svsig = o.arg; // --sv-sig
+		else if (c == 360) mm_svsig_min_len = mm_parse_num(o.arg); // --sv-min-len
+		else if (c == 361) opt.max_mem = mm_parse_num(o.arg); // --max-mem
+		else if (c == 362) fn_ckpt = o.arg; // --checkpoint
+		else if (c == 363) resume = 1; // --resume
+		else if (c == 364) fn_tgt = o.arg; // --target-bed
+		else if (c == 365) tgt_flank = mm_parse_num(o.arg); // --target-flank
+		else if (c == 366) opt.min_hit_frac = atof(o.arg); // --target-prescreen
+		else if (c == 367) fn_serve = o.arg; // --idx-serve
+		else if (c == 368) fn_socket = o.arg; // --idx-socket
 		else if (c == 330) {
 			fprintf(stderr, "[WARNING] \033[1;31m --lj-min-ratio has been deprecated.\033[0m\n");
 		} else if (c == 314) { // --frag
@@ -308,11 +334,25 @@ int main(int argc, char *argv[])
 			if (*s == ',') opt.e2 = strtol(s + 1, &s, 10);
 		}
 	}
+	if (fn_ckpt && (sort_bam || opt.split_prefix)) {
+		fprintf(stderr, "[ERROR]\033[1;31m --checkpoint can't be used with --sort-bam or --split-prefix\033[0m\n");
+		return 1;
+	}
+	if (fn_ckpt) {
+		const char *fn_side[2];
+		fn_side[0] = fn_svsig, fn_side[1] = fn_rstat;
+		if (mm_ckpt_init(fn_ckpt, fn_out, fn_side, argc, argv, o.ind, resume) < 0)
+			return 1;
+	}
+	if (fn_out && freopen(fn_out, mm_ckpt_n_skip() > 0? "ab" : "wb", stdout) == NULL) { // append when resuming
+		fprintf(stderr, "[ERROR]\033[1;31m failed to write the output to file '%s'\033[0m: %s\n", fn_out, strerror(errno));
+		exit(1);
+	}
 	if ((opt.flag & MM_F_SPLICE) && (opt.flag & MM_F_FRAG_MODE)) {
 		fprintf(stderr, "[ERROR]\033[1;31m --splice and --frag should not be specified at the same time.\033[0m\n");
 		return 1;
 	}
-	if (!fnw && !(opt.flag&MM_F_CIGAR))
+	if (!fnw && !fn_serve && !(opt.flag&MM_F_CIGAR))
 		ipt.flag |= MM_I_NO_SEQ;
 	if (mm_check_opt(&ipt, &opt) < 0)
 		return 1;
@@ -330,6 +370,10 @@ int main(int argc, char *argv[])
 		fprintf(fp_help, "    -w INT       minimizer window size [%d]\n", ipt.w);
 		fprintf(fp_help, "    -I NUM       split index for every ~NUM input bases [8G]\n");
 		fprintf(fp_help, "    -d FILE      dump index to FILE []\n");
+		fprintf(fp_help, "    --idx-mmap   with -d, dump an index that is memory-mapped instead of loaded\n");
+		fprintf(fp_help, "    --idx-serve SOCK   serve the index in shared memory to --idx-socket SOCK until killed\n");
+		fprintf(fp_help, "    --idx-socket SOCK  attach the index from server SOCK if it has the same target file\n");
+		fprintf(fp_help, "    --target-bed FILE  only index regions in BED FILE, extended by --target-flank [50k] bases\n");
 		fprintf(fp_help, "  Mapping:\n");
 		fprintf(fp_help, "    -f FLOAT     filter out top FLOAT fraction of repetitive minimizers [%g]\n", opt.mid_occ_frac);
 		fprintf(fp_help, "    -g NUM       stop chain enlongation if there are no minimizers in INT-bp [%d]\n", opt.max_gap);
@@ -354,6 +398,11 @@ int main(int argc, char *argv[])
 		fprintf(fp_help, "  Input/Output:\n");
 		fprintf(fp_help, "    -a           output in the SAM format (PAF by default)\n");
 		fprintf(fp_help, "    -o FILE      output alignments to FILE [stdout]\n");
+		fprintf(fp_help, "    --sort-bam   output coordinate-sorted BAM, indexed if -o is given (implies -a)\n");
+		fprintf(fp_help, "    --sort-mem NUM  max memory per sorting chunk with --sort-bam [768M]\n");
+		fprintf(fp_help, "    --read-stats FILE  write per-read stage timing and work counters to FILE\n");
+		fprintf(fp_help, "    --sv-sig FILE  write long indels and clips and split-alignment breakpoints to FILE\n");
+		fprintf(fp_help, "    --sv-min-len INT  min length of an indel or clip written by --sv-sig [%d]\n", mm_svsig_min_len);
 		fprintf(fp_help, "    -L           write CIGAR with >65535 ops at the CG tag\n");
 		fprintf(fp_help, "    -R STR       SAM read group line in a format like '@RG\\tID:foo\\tSM:bar' []\n");
 		fprintf(fp_help, "    -c           output CIGAR in PAF\n");
@@ -363,6 +412,8 @@ int main(int argc, char *argv[])
 		fprintf(fp_help, "    -Y           use soft clipping for supplementary alignments\n");
 		fprintf(fp_help, "    -t INT       number of threads [%d]\n", n_threads);
 		fprintf(fp_help, "    -K NUM       minibatch size for mapping [500M]\n");
+		fprintf(fp_help, "    --max-mem NUM  adapt the minibatch size to keep memory below NUM; -K sets the first batch []\n");
+		fprintf(fp_help, "    --checkpoint FILE  record progress in FILE after each minibatch; --resume to continue\n");
 //		fprintf(fp_help, "    -v INT       verbose level [%d]\n", mm_verbose);
 		fprintf(fp_help, "    --version    show version number\n");
 		fprintf(fp_help, "  Preset:\n");
@@ -381,27 +432,72 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "[ERROR] incorrect input: in the sr mode, please specify no more than two query files.\n");
 		return 1;
 	}
+	if (fn_serve) {
+		if (fnw || fn_tgt) {
+			fprintf(stderr, "[ERROR] --idx-serve doesn't work with -d or --target-bed\n");
+			return 1;
+		}
+		return mm_idx_serve(fn_serve, argv[o.ind], &ipt, n_threads);
+	}
 	idx_rdr = mm_idx_reader_open(argv[o.ind], &ipt, fnw);
 	if (idx_rdr == 0) {
 		fprintf(stderr, "[ERROR] failed to open file '%s': %s\n", argv[o.ind], strerror(errno));
 		return 1;
 	}
+	if (fn_tgt) {
+		int ret = mm_idx_reader_set_target(idx_rdr, fn_tgt, tgt_flank);
+		if (ret < 0) {
+			if (ret == -2) fprintf(stderr, "[ERROR] --target-bed only works when the index is built from sequences\n");
+			else fprintf(stderr, "[ERROR] failed to open file '%s': %s\n", fn_tgt, strerror(errno));
+			mm_idx_reader_close(idx_rdr);
+			return 1;
+		}
+	}
+	if (fn_socket) {
+		if (fnw || fn_tgt) {
+			if (mm_verbose >= 2)
+				fprintf(stderr, "[WARNING]\033[1;31m --idx-socket is ignored with -d or --target-bed\033[0m\n");
+		} else if (mm_idx_reader_attach(idx_rdr, argv[o.ind], fn_socket) == 0 && mm_verbose >= 3)
+			fprintf(stderr, "[M::%s::%.3f*%.2f] attached the index from server '%s'\n", __func__, realtime() - mm_realtime0, cputime() / (realtime() - mm_realtime0), fn_socket);
+	}
 	if (!idx_rdr->is_idx && fnw == 0 && argc - o.ind < 2) {
 		fprintf(stderr, "[ERROR] missing input: please specify a query file to map or option -d to keep the index\n");
 		mm_idx_reader_close(idx_rdr);
 		return 1;
 	}
+	if (sort_bam && argc - o.ind >= 2)
+		mm_bsort_out = mm_bsort_init(stdout, fn_out, 0, n_threads, sort_mem);
+	if (fn_rstat && mm_rstat_open(fn_rstat, mm_ckpt_n_skip() > 0) < 0) {
+		fprintf(stderr, "[ERROR] failed to open file '%s': %s\n", fn_rstat, strerror(errno));
+		mm_idx_reader_close(idx_rdr);
+		return 1;
+	}
+	if (fn_svsig) {
+		if ((mm_svsig_fp = fopen(fn_svsig, mm_ckpt_n_skip() > 0? "a" : "w")) == 0) { // append when resuming
+			fprintf(stderr, "[ERROR] failed to open file '%s': %s\n", fn_svsig, strerror(errno));
+			mm_idx_reader_close(idx_rdr);
+			return 1;
+		}
+		if (mm_ckpt_n_skip() == 0)
+			fputs("#qname\ttype\tctg\tpos\tlen\tstrand\tmapq\tqpos\tmate\n", mm_svsig_fp);
+	}
 	if (opt.best_n == 0 && (opt.flag&MM_F_CIGAR) && mm_verbose >= 2)
 		fprintf(stderr, "[WARNING]\033[1;31m `-N 0' reduces alignment accuracy. Please use --secondary=no to suppress secondary alignments.\033[0m\n");
 	while ((mi = mm_idx_reader_read(idx_rdr, n_threads)) != 0) {
 		int ret;
+		if (fn_ckpt && !mm_idx_reader_eof(idx_rdr)) {
+			fprintf(stderr, "[ERROR] --checkpoint doesn't work with a multi-part index\n");
+			mm_idx_destroy(mi);
+			mm_idx_reader_close(idx_rdr);
+			return 1;
+		}
 		if ((opt.flag & MM_F_CIGAR) && (mi->flag & MM_I_NO_SEQ)) {
 			fprintf(stderr, "[ERROR] the prebuilt index doesn't contain sequences.\n");
 			mm_idx_destroy(mi);
 			mm_idx_reader_close(idx_rdr);
 			return 1;
 		}
-		if ((opt.flag & MM_F_OUT_SAM) && idx_rdr->n_parts == 1) {
+		if ((opt.flag & MM_F_OUT_SAM) && idx_rdr->n_parts == 1 && mm_ckpt_n_skip() == 0) { // the header is already in the output when resuming
 			if (mm_idx_reader_eof(idx_rdr)) {
 				if (opt.split_prefix == 0)
 					ret = mm_write_sam_hdr(mi, rg, MM_VERSION, argc, argv);
@@ -409,7 +505,10 @@ int main(int argc, char *argv[])
 					ret = mm_write_sam_hdr(0, rg, MM_VERSION, argc, argv);
 			} else {
 				ret = mm_write_sam_hdr(0, rg, MM_VERSION, argc, argv);
-				if (opt.split_prefix == 0 && mm_verbose >= 2)
+				if (opt.split_prefix == 0 && mm_bsort_out) {
+					fprintf(stderr, "[ERROR] --sort-bam requires --split-prefix for a multi-part index\n");
+					ret = -1;
+				} else if (opt.split_prefix == 0 && mm_verbose >= 2)
 					fprintf(stderr, "[WARNING]\033[1;31m For a multi-part index, no @SQ lines will be outputted. Please use --split-prefix.\033[0m\n");
 			}
 			if (ret != 0) {
@@ -448,7 +547,22 @@ int main(int argc, char *argv[])
 	mm_idx_reader_close(idx_rdr);
 
 	if (opt.split_prefix)
-		mm_split_merge(argc - (o.ind + 1), (const char**)&argv[o.ind + 1], &opt, n_parts);
+		mm_split_merge(argc - (o.ind + 1), (const char**)&argv[o.ind + 1], &opt, n_parts, n_threads);
+	mm_rstat_close();
+	mm_ckpt_destroy();
+	if (mm_svsig_fp && fclose(mm_svsig_fp) == EOF) {
+		perror("[ERROR] failed to write SV signatures");
+		exit(EXIT_FAILURE);
+	}
+
+	if (mm_bsort_out) {
+		int ret = mm_bsort_finish(mm_bsort_out);
+		mm_bsort_out = 0;
+		if (ret < 0) {
+			fprintf(stderr, "[ERROR] failed to write the sorted BAM\n");
+			exit(EXIT_FAILURE);
+		}
+	}
 
 	if (fflush(stdout) == EOF) {
 		perror("[ERROR] failed to write the results");
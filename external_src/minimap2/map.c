@@ -2,12 +2,15 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "kthread.h"
 #include "kvec.h"
 #include "kalloc.h"
 #include "sdust.h"
 #include "mmpriv.h"
 #include "bseq.h"
+#include "bamsort.h"
 #include "khash.h"
 
 mm_tbuf_t *mm_tbuf_init(void)
@@ -212,10 +215,10 @@ static void chain_post(const mm_mapopt_t *opt, int max_chain_gap_ref, const mm_i
 	}
 }
 
-static mm_reg1_t *align_regs(const mm_mapopt_t *opt, const mm_idx_t *mi, void *km, int qlen, const char *seq, int *n_regs, mm_reg1_t *regs, mm128_t *a)
+static mm_reg1_t *align_regs(const mm_mapopt_t *opt, const mm_idx_t *mi, void *km, int qlen, const char *seq, int *n_regs, mm_reg1_t *regs, mm128_t *a, int64_t *n_cell)
 {
 	if (!(opt->flag & MM_F_CIGAR)) return regs;
-	regs = mm_align_skeleton(km, opt, mi, qlen, seq, n_regs, regs, a); // this calls mm_filter_regs()
+	regs = mm_align_skeleton(km, opt, mi, qlen, seq, n_regs, regs, a, n_cell); // this calls mm_filter_regs()
 	if (!(opt->flag & MM_F_ALL_CHAINS)) { // don't choose primary mapping(s)
 		mm_set_parent(km, opt->mask_level, opt->mask_len, *n_regs, regs, opt->a * 2 + opt->b, opt->flag&MM_F_HARD_MLEVEL, opt->alt_drop);
 		mm_select_sub(km, opt->pri_ratio, mi->k*2, opt->best_n, 0, opt->max_gap * 0.8, n_regs, regs);
@@ -226,7 +229,7 @@ static mm_reg1_t *align_regs(const mm_mapopt_t *opt, const mm_idx_t *mi, void *k
 
 void mm_map_frag(const mm_idx_t *mi, int n_segs, const int *qlens, const char **seqs, int *n_regs, mm_reg1_t **regs, mm_tbuf_t *b, const mm_mapopt_t *opt, const char *qname)
 {
-	int i, j, rep_len, qlen_sum, n_regs0, n_mini_pos;
+	int i, j, rep_len, qlen_sum, n_regs0, n_mini_pos, off_target = 0;
 	int max_chain_gap_qry, max_chain_gap_ref, is_splice = !!(opt->flag & MM_F_SPLICE), is_sr = !!(opt->flag & MM_F_SR);
 	uint32_t hash;
 	int64_t n_a;
@@ -236,6 +239,8 @@ void mm_map_frag(const mm_idx_t *mi, int n_segs, const int *qlens, const char **
 	mm_reg1_t *regs0;
 	km_stat_t kmst;
 	float chn_pen_gap, chn_pen_skip;
+	mm_rstat_t *rs = b->rs;
+	double t0 = 0.0, t1;
 
 	for (i = 0, qlen_sum = 0; i < n_segs; ++i)
 		qlen_sum += qlens[i], n_regs[i] = 0, regs[i] = 0;
@@ -247,10 +252,17 @@ void mm_map_frag(const mm_idx_t *mi, int n_segs, const int *qlens, const char **
 	hash ^= __ac_Wang_hash(qlen_sum) + __ac_Wang_hash(opt->seed);
 	hash  = __ac_Wang_hash(hash);
 
+	if (rs) t0 = realtime();
 	collect_minimizers(b->km, opt, mi, n_segs, qlens, seqs, &mv);
 	if (opt->q_occ_frac > 0.0f) mm_seed_mz_flt(b->km, &mv, opt->mid_occ, opt->q_occ_frac);
 	if (opt->flag & MM_F_HEAP_SORT) a = collect_seed_hits_heap(b->km, opt, opt->mid_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
 	else a = collect_seed_hits(b->km, opt, opt->mid_occ, mi, qname, &mv, qlen_sum, &n_a, &rep_len, &n_mini_pos, &mini_pos);
+	if (opt->min_hit_frac > 0.0f && n_mini_pos < mv.n * opt->min_hit_frac) // few minimizers hit the (targeted) index; skip chaining
+		n_a = 0, off_target = 1;
+	if (rs) {
+		t1 = realtime(), rs->t[0] += t1 - t0, t0 = t1;
+		rs->n_mini += mv.n, rs->n_seed += n_a;
+	}
 
 	if (mm_dbg_flag & MM_DBG_PRINT_SEED) {
 		fprintf(stderr, "RS\t%d\n", rep_len);
@@ -290,7 +302,7 @@ void mm_map_frag(const mm_idx_t *mi, int n_segs, const int *qlens, const char **
 			a = mg_lchain_rmq(opt->max_gap, opt->rmq_inner_dist, opt->bw_long, opt->max_chain_skip, opt->rmq_size_cap, opt->min_cnt, opt->min_chain_score,
 							  chn_pen_gap, chn_pen_skip, n_a, a, &n_regs0, &u, b->km);
 		}
-	} else if (opt->max_occ > opt->mid_occ && rep_len > 0 && !(opt->flag & MM_F_RMQ)) { // re-chain, mostly for short reads
+	} else if (opt->max_occ > opt->mid_occ && rep_len > 0 && !(opt->flag & MM_F_RMQ) && !off_target) { // re-chain, mostly for short reads
 		int rechain = 0;
 		if (n_regs0 > 0) { // test if the best chain has all the segments
 			int n_chained_segs = 1, max = 0, max_i = -1, max_off = -1, off = 0;
@@ -334,9 +346,14 @@ void mm_map_frag(const mm_idx_t *mi, int n_segs, const int *qlens, const char **
 		mm_est_err(mi, qlen_sum, n_regs0, regs0, a, n_mini_pos, mini_pos);
 		n_regs0 = mm_filter_strand_retained(n_regs0, regs0);
 	}
+	if (rs) {
+		t1 = realtime(), rs->t[1] += t1 - t0, t0 = t1;
+		rs->n_chain += n_regs0;
+		for (i = 0; i < n_regs0; ++i) rs->n_anchor += regs0[i].cnt;
+	}
 
 	if (n_segs == 1) { // uni-segment
-		regs0 = align_regs(opt, mi, b->km, qlens[0], seqs[0], &n_regs0, regs0, a);
+		regs0 = align_regs(opt, mi, b->km, qlens[0], seqs[0], &n_regs0, regs0, a, rs? &rs->n_cell : 0);
 		regs0 = (mm_reg1_t*)realloc(regs0, sizeof(*regs0) * n_regs0);
 		mm_set_mapq(b->km, n_regs0, regs0, opt->min_chain_score, opt->a, rep_len, is_sr);
 		n_regs[0] = n_regs0, regs[0] = regs0;
@@ -346,13 +363,14 @@ void mm_map_frag(const mm_idx_t *mi, int n_segs, const int *qlens, const char **
 		free(regs0);
 		for (i = 0; i < n_segs; ++i) {
 			mm_set_parent(b->km, opt->mask_level, opt->mask_len, n_regs[i], regs[i], opt->a * 2 + opt->b, opt->flag&MM_F_HARD_MLEVEL, opt->alt_drop); // update mm_reg1_t::parent
-			regs[i] = align_regs(opt, mi, b->km, qlens[i], seqs[i], &n_regs[i], regs[i], seg[i].a);
+			regs[i] = align_regs(opt, mi, b->km, qlens[i], seqs[i], &n_regs[i], regs[i], seg[i].a, rs? &rs->n_cell : 0);
 			mm_set_mapq(b->km, n_regs[i], regs[i], opt->min_chain_score, opt->a, rep_len, is_sr);
 		}
 		mm_seg_free(b->km, n_segs, seg);
 		if (n_segs == 2 && opt->pe_ori >= 0 && (opt->flag&MM_F_CIGAR))
 			mm_pair(b->km, max_chain_gap_ref, opt->pe_bonus, opt->a * 2 + opt->b, opt->a, qlens, n_regs, regs); // pairing
 	}
+	if (rs) rs->t[2] += realtime() - t0;
 
 	kfree(b->km, mv.a);
 	kfree(b->km, a);
@@ -390,11 +408,16 @@ typedef struct {
 	const mm_mapopt_t *opt;
 	mm_bseq_file_t **fp;
 	const mm_idx_t *mi;
-	kstring_t str;
 
 	int n_parts;
 	uint32_t *rid_shift;
 	FILE *fp_split, **fp_parts;
+
+	// adaptive mini-batch sizing with --max-mem; measured on the previous batches and guarded by mt
+	int n_inflight, n_batch, n_cpu, warned;
+	int64_t max_mem, mem0, km_peak, last_size;
+	double bpb, util;
+	pthread_mutex_t mt;
 } pipeline_t;
 
 typedef struct {
@@ -404,8 +427,56 @@ typedef struct {
 	int *n_reg, *seg_off, *n_seg, *rep_len, *frag_gap;
 	mm_reg1_t **reg;
 	mm_tbuf_t **buf;
+	kstring_t *out; // SAM/PAF lines of each fragment, formatted by the mapping threads
+	mm_rstat_t *rs; // per-fragment stage statistics, indexed by the first segment; only with --read-stats
+	kstring_t *sv; // SV signatures of each fragment; only with --sv-sig
 } step_t;
 
+static inline void str_append(kstring_t *s, const kstring_t *t) // append t and a newline to s
+{
+	if (s->l + t->l + 2 > s->m) {
+		s->m = s->l + t->l + 2;
+		s->m += s->m >> 1;
+		s->s = (char*)realloc(s->s, s->m);
+	}
+	memcpy(s->s + s->l, t->s, t->l);
+	s->l += t->l;
+	s->s[s->l++] = '\n';
+	s->s[s->l] = 0;
+}
+
+static void format_frag(step_t *s, int k, void *km) // format the output of the k-th fragment into s->out[k]
+{
+	const pipeline_t *p = s->p;
+	const mm_idx_t *mi = p->mi;
+	int i, j, seg_st = s->seg_off[k], seg_en = s->seg_off[k] + s->n_seg[k];
+	kstring_t str = {0,0,0};
+	for (i = seg_st; i < seg_en; ++i) {
+		mm_bseq1_t *t = &s->seq[i];
+		if (s->n_reg[i] > 0) { // the query has at least one hit
+			for (j = 0; j < s->n_reg[i]; ++j) {
+				mm_reg1_t *r = &s->reg[i][j];
+				assert(!r->sam_pri || r->id == r->parent);
+				if ((p->opt->flag & MM_F_NO_PRINT_2ND) && r->id != r->parent)
+					continue;
+				if (p->opt->flag & MM_F_OUT_SAM)
+					mm_write_sam3(&str, mi, t, i - seg_st, j, s->n_seg[k], &s->n_reg[seg_st], (const mm_reg1_t*const*)&s->reg[seg_st], km, p->opt->flag, s->rep_len[i]);
+				else
+					mm_write_paf3(&str, mi, t, r, km, p->opt->flag, s->rep_len[i]);
+				str_append(&s->out[k], &str);
+			}
+		} else if ((p->opt->flag & MM_F_PAF_NO_HIT) || ((p->opt->flag & MM_F_OUT_SAM) && !(p->opt->flag & MM_F_SAM_HIT_ONLY))) { // output an empty hit, if requested
+			if (p->opt->flag & MM_F_OUT_SAM)
+				mm_write_sam3(&str, mi, t, i - seg_st, -1, s->n_seg[k], &s->n_reg[seg_st], (const mm_reg1_t*const*)&s->reg[seg_st], km, p->opt->flag, s->rep_len[i]);
+			else
+				mm_write_paf3(&str, mi, t, 0, 0, p->opt->flag, s->rep_len[i]);
+			str_append(&s->out[k], &str);
+		}
+		if (s->sv) mm_write_svsig(&s->sv[k], mi, t, s->n_reg[i], s->reg[i], km);
+	}
+	free(str.s);
+}
+
 static void worker_for(void *_data, long i, int tid) // kt_for() callback
 {
     step_t *s = (step_t*)_data;
@@ -414,6 +485,7 @@ static void worker_for(void *_data, long i, int tid) // kt_for() callback
 	double t = 0.0;
 	mm_tbuf_t *b = s->buf[tid];
 	assert(s->n_seg[i] <= MM_MAX_SEG);
+	b->rs = s->rs? &s->rs[off] : 0;
 	if (mm_dbg_flag & MM_DBG_PRINT_QNAME) {
 		fprintf(stderr, "QR\t%s\t%d\t%d\n", s->seq[off].name, tid, s->seq[off].l_seq);
 		t = realtime();
@@ -449,10 +521,20 @@ static void worker_for(void *_data, long i, int tid) // kt_for() callback
 				r->rev = !r->rev;
 			}
 		}
+	if (s->out) {
+		double t_out = b->rs? realtime() : 0.0;
+		format_frag(s, i, b->km);
+		if (b->rs) b->rs->t[3] += realtime() - t_out;
+	}
 	if (mm_dbg_flag & MM_DBG_PRINT_QNAME)
 		fprintf(stderr, "QT\t%s\t%d\t%.6f\n", s->seq[off].name, tid, realtime() - t);
 }
 
+static void worker_format(void *_data, long i, int tid) // kt_for() callback
+{
+	format_frag((step_t*)_data, i, 0);
+}
+
 static void merge_hits(step_t *s)
 {
 	int f, i, k0, k, max_seg = 0, *n_reg_part, *rep_len_part, *frag_gap_part, *qlens;
@@ -518,6 +600,66 @@ static void merge_hits(step_t *s)
 	km_destroy(km);
 }
 
+#define MM_BATCH_MIN   1000000 // smallest adaptive mini-batch
+#define MM_BATCH_BPB0  8.0     // bytes per query base assumed before the first batch is measured
+
+static int64_t batch_size(pipeline_t *p) // size of the next mini-batch, derived from the memory budget
+{
+	int64_t size, cap, km_peak;
+	int n_batch;
+	double bpb, util;
+	if (p->max_mem <= 0) return p->mini_batch_size;
+	pthread_mutex_lock(&p->mt);
+	bpb = p->bpb > 0.0? p->bpb : MM_BATCH_BPB0;
+	km_peak = p->km_peak, util = p->util, n_batch = p->n_batch;
+	cap = (int64_t)((p->max_mem - p->mem0 - km_peak) / p->n_inflight / bpb); // up to n_inflight batches live at the same time
+	if (p->last_size == 0) size = p->mini_batch_size; // the first batch
+	else if (n_batch > 0 && util < 0.9) size = p->last_size * 2; // threads idle at batch boundaries; try a larger batch
+	else size = p->last_size;
+	if (size > cap) size = cap;
+	if (size < MM_BATCH_MIN) {
+		if (n_batch > 0 && !p->warned && mm_verbose >= 2)
+			fprintf(stderr, "[WARNING]\033[1;31m --max-mem is too small for the index and the thread-local buffers (%.1fMB); using %d-base mini-batches\033[0m\n",
+					(p->mem0 + km_peak) / 1048576.0, MM_BATCH_MIN);
+		p->warned |= n_batch > 0;
+		size = MM_BATCH_MIN;
+	}
+	p->last_size = size;
+	pthread_mutex_unlock(&p->mt);
+	if (mm_verbose >= 3)
+		fprintf(stderr, "[M::%s::%.3f*%.2f] next mini-batch: %lld bases (%d measured; %.2f bytes/base, %.1fMB thread-local memory, %.0f%% CPU utilization)\n", __func__,
+				realtime() - mm_realtime0, cputime() / (realtime() - mm_realtime0), (long long)size, n_batch, bpb, km_peak / 1048576.0, util * 100.0);
+	return size;
+}
+
+static void batch_measure(pipeline_t *p, const step_t *s, double rt, double ct) // record the memory and thread utilization of a mapped batch
+{
+	int64_t i, j, n_bases = 0, bytes = 0, km = 0;
+	km_stat_t kmst;
+	for (i = 0; i < s->n_seq; ++i) {
+		const mm_bseq1_t *t = &s->seq[i];
+		n_bases += t->l_seq;
+		bytes += t->l_seq * (t->qual? 2 : 1) + strlen(t->name) + (t->comment? strlen(t->comment) : 0) + sizeof(mm_bseq1_t);
+		bytes += s->n_reg[i] * sizeof(mm_reg1_t);
+		for (j = 0; j < s->n_reg[i]; ++j)
+			if (s->reg[i][j].p) bytes += s->reg[i][j].p->capacity * 4;
+	}
+	if (s->out)
+		for (i = 0; i < s->n_frag; ++i)
+			bytes += s->out[i].m;
+	for (i = 0; i < p->n_threads; ++i)
+		if (s->buf[i]->km) {
+			km_stat(s->buf[i]->km, &kmst);
+			km += kmst.capacity;
+		}
+	pthread_mutex_lock(&p->mt);
+	if (n_bases > 0) p->bpb = (double)bytes / n_bases;
+	if (p->km_peak < km) p->km_peak = km;
+	p->util = rt > 0.0? ct / (rt * (p->n_threads < p->n_cpu? p->n_threads : p->n_cpu)) : 1.0;
+	++p->n_batch;
+	pthread_mutex_unlock(&p->mt);
+}
+
 static void *worker_pipeline(void *shared, int step, void *in)
 {
 	int i, j, k;
@@ -528,8 +670,9 @@ static void *worker_pipeline(void *shared, int step, void *in)
 		int frag_mode = (p->n_fp > 1 || !!(p->opt->flag & MM_F_FRAG_MODE));
         step_t *s;
         s = (step_t*)calloc(1, sizeof(step_t));
-		if (p->n_fp > 1) s->seq = mm_bseq_read_frag2(p->n_fp, p->fp, p->mini_batch_size, with_qual, with_comment, &s->n_seq);
-		else s->seq = mm_bseq_read3(p->fp[0], p->mini_batch_size, with_qual, with_comment, frag_mode, &s->n_seq);
+		int64_t size = batch_size(p);
+		if (p->n_fp > 1) s->seq = mm_bseq_read_frag2(p->n_fp, p->fp, size, with_qual, with_comment, &s->n_seq);
+		else s->seq = mm_bseq_read3(p->fp[0], size, with_qual, with_comment, frag_mode, &s->n_seq);
 		if (s->seq) {
 			s->p = p;
 			for (i = 0; i < s->n_seq; ++i)
@@ -543,6 +686,12 @@ static void *worker_pipeline(void *shared, int step, void *in)
 			s->rep_len = s->n_seg + s->n_seq;
 			s->frag_gap = s->rep_len + s->n_seq;
 			s->reg = (mm_reg1_t**)calloc(s->n_seq, sizeof(mm_reg1_t*));
+			if (!(p->opt->split_prefix && p->n_parts == 0)) // not writing to temporary files
+				s->out = (kstring_t*)calloc(s->n_seq, sizeof(kstring_t));
+			if (mm_svsig_fp && s->out)
+				s->sv = (kstring_t*)calloc(s->n_seq, sizeof(kstring_t));
+			if (mm_rstat_fp && p->n_parts == 0) // not merging
+				s->rs = (mm_rstat_t*)calloc(s->n_seq, sizeof(mm_rstat_t));
 			for (i = 1, j = 0; i <= s->n_seq; ++i)
 				if (i == s->n_seq || !frag_mode || !mm_qname_same(s->seq[i-1].name, s->seq[i].name)) {
 					s->n_seg[s->n_frag] = i - j;
@@ -552,21 +701,29 @@ static void *worker_pipeline(void *shared, int step, void *in)
 			return s;
 		} else free(s);
     } else if (step == 1) { // step 1: map
-		if (p->n_parts > 0) merge_hits((step_t*)in);
-		else kt_for(p->n_threads, worker_for, in, ((step_t*)in)->n_frag);
+		if (p->n_parts > 0) {
+			merge_hits((step_t*)in);
+			kt_for(p->n_threads, worker_format, in, ((step_t*)in)->n_frag);
+		} else if (p->max_mem > 0) {
+			double rt = realtime(), ct = cputime();
+			kt_for(p->n_threads, worker_for, in, ((step_t*)in)->n_frag);
+			batch_measure(p, (step_t*)in, realtime() - rt, cputime() - ct);
+		} else kt_for(p->n_threads, worker_for, in, ((step_t*)in)->n_frag);
 		return in;
     } else if (step == 2) { // step 2: output
-		void *km = 0;
         step_t *s = (step_t*)in;
-		const mm_idx_t *mi = p->mi;
 		for (i = 0; i < p->n_threads; ++i) mm_tbuf_destroy(s->buf[i]);
 		free(s->buf);
-		if ((p->opt->flag & MM_F_OUT_CS) && !(mm_dbg_flag & MM_DBG_NO_KALLOC)) km = km_init();
 		for (k = 0; k < s->n_frag; ++k) {
 			int seg_st = s->seg_off[k], seg_en = s->seg_off[k] + s->n_seg[k];
-			for (i = seg_st; i < seg_en; ++i) {
-				mm_bseq1_t *t = &s->seq[i];
-				if (p->opt->split_prefix && p->n_parts == 0) { // then write to temporary files
+			if (s->rs) {
+				int qlen = 0, n_reg = 0;
+				for (i = seg_st; i < seg_en; ++i)
+					qlen += s->seq[i].l_seq, n_reg += s->n_reg[i];
+				mm_rstat_add(s->seq[seg_st].name, qlen, s->n_seg[k], n_reg, &s->rs[seg_st]);
+			}
+			if (s->out == 0) { // then write to temporary files
+				for (i = seg_st; i < seg_en; ++i) {
 					mm_err_fwrite(&s->n_reg[i],    sizeof(int), 1, p->fp_split);
 					mm_err_fwrite(&s->rep_len[i],  sizeof(int), 1, p->fp_split);
 					mm_err_fwrite(&s->frag_gap[i], sizeof(int), 1, p->fp_split);
@@ -578,25 +735,21 @@ static void *worker_pipeline(void *shared, int step, void *in)
 							mm_err_fwrite(r->p, r->p->capacity, 4, p->fp_split);
 						}
 					}
-				} else if (s->n_reg[i] > 0) { // the query has at least one hit
-					for (j = 0; j < s->n_reg[i]; ++j) {
-						mm_reg1_t *r = &s->reg[i][j];
-						assert(!r->sam_pri || r->id == r->parent);
-						if ((p->opt->flag & MM_F_NO_PRINT_2ND) && r->id != r->parent)
-							continue;
-						if (p->opt->flag & MM_F_OUT_SAM)
-							mm_write_sam3(&p->str, mi, t, i - seg_st, j, s->n_seg[k], &s->n_reg[seg_st], (const mm_reg1_t*const*)&s->reg[seg_st], km, p->opt->flag, s->rep_len[i]);
-						else
-							mm_write_paf3(&p->str, mi, t, r, km, p->opt->flag, s->rep_len[i]);
-						mm_err_puts(p->str.s);
-					}
-				} else if ((p->opt->flag & MM_F_PAF_NO_HIT) || ((p->opt->flag & MM_F_OUT_SAM) && !(p->opt->flag & MM_F_SAM_HIT_ONLY))) { // output an empty hit, if requested
-					if (p->opt->flag & MM_F_OUT_SAM)
-						mm_write_sam3(&p->str, mi, t, i - seg_st, -1, s->n_seg[k], &s->n_reg[seg_st], (const mm_reg1_t*const*)&s->reg[seg_st], km, p->opt->flag, s->rep_len[i]);
-					else
-						mm_write_paf3(&p->str, mi, t, 0, 0, p->opt->flag, s->rep_len[i]);
-					mm_err_puts(p->str.s);
 				}
+			} else if (s->out[k].l > 0) {
+				if (mm_bsort_out) {
+					char *q, *r;
+					for (q = s->out[k].s; *q; q = r + 1) {
+						r = strchr(q, '\n');
+						*r = 0;
+						mm_bsort_add(mm_bsort_out, q);
+					}
+				} else mm_err_fwrite(s->out[k].s, 1, s->out[k].l, stdout);
+				free(s->out[k].s);
+			}
+			if (s->sv && s->sv[k].l > 0) {
+				mm_err_fwrite(s->sv[k].s, 1, s->sv[k].l, mm_svsig_fp);
+				free(s->sv[k].s);
 			}
 			for (i = seg_st; i < seg_en; ++i) {
 				for (j = 0; j < s->n_reg[i]; ++j) free(s->reg[i][j].p);
@@ -606,8 +759,9 @@ static void *worker_pipeline(void *shared, int step, void *in)
 				if (s->seq[i].comment) free(s->seq[i].comment);
 			}
 		}
+		free(s->out); free(s->rs); free(s->sv);
+		if (mm_ckpt_fn) mm_ckpt_save(s->n_seq); // all output of this batch has been written
 		free(s->reg); free(s->n_reg); free(s->seq); // seg_off, n_seg, rep_len and frag_gap were allocated with reg; no memory leak here
-		km_destroy(km);
 		if (mm_verbose >= 3)
 			fprintf(stderr, "[M::%s::%.3f*%.2f] mapped %d sequences\n", __func__, realtime() - mm_realtime0, cputime() / (realtime() - mm_realtime0), s->n_seq);
 		free(s);
@@ -642,15 +796,23 @@ int mm_map_file_frag(const mm_idx_t *idx, int n_segs, const char **fn, const mm_
 	pl.n_fp = n_segs;
 	pl.fp = open_bseqs(pl.n_fp, fn);
 	if (pl.fp == 0) return -1;
+	if (mm_ckpt_fn) pl.n_processed = mm_ckpt_skip(pl.n_fp, pl.fp); // resuming
 	pl.opt = opt, pl.mi = idx;
 	pl.n_threads = n_threads > 1? n_threads : 1;
 	pl.mini_batch_size = opt->mini_batch_size;
 	if (opt->split_prefix)
 		pl.fp_split = mm_split_init(opt->split_prefix, idx);
 	pl_threads = n_threads == 1? 1 : (opt->flag&MM_F_2_IO_THREADS)? 3 : 2;
+	if (opt->max_mem > 0) {
+		pl.max_mem = opt->max_mem;
+		pl.mem0 = peakrss(); // mostly the index
+		pl.n_inflight = pl_threads;
+		pl.n_cpu = sysconf(_SC_NPROCESSORS_ONLN) > 0? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+		pthread_mutex_init(&pl.mt, 0);
+	}
 	kt_pipeline(pl_threads, worker_pipeline, &pl, 3);
+	if (opt->max_mem > 0) pthread_mutex_destroy(&pl.mt);
 
-	free(pl.str.s);
 	if (pl.fp_split) fclose(pl.fp_split);
 	for (i = 0; i < pl.n_fp; ++i)
 		mm_bseq_close(pl.fp[i]);
@@ -663,7 +825,7 @@ int mm_map_file(const mm_idx_t *idx, const char *fn, const mm_mapopt_t *opt, int
 	return mm_map_file_frag(idx, 1, &fn, opt, n_threads);
 }
 
-int mm_split_merge(int n_segs, const char **fn, const mm_mapopt_t *opt, int n_split_idx)
+int mm_split_merge(int n_segs, const char **fn, const mm_mapopt_t *opt, int n_split_idx, int n_threads)
 {
 	int i;
 	pipeline_t pl;
@@ -675,6 +837,7 @@ int mm_split_merge(int n_segs, const char **fn, const mm_mapopt_t *opt, int n_sp
 	if (pl.fp == 0) return -1;
 	pl.opt = opt;
 	pl.mini_batch_size = opt->mini_batch_size;
+	pl.n_threads = n_threads > 1? n_threads : 1;
 
 	pl.n_parts = n_split_idx;
 	pl.fp_parts  = CALLOC(FILE*, pl.n_parts);
@@ -690,12 +853,17 @@ int mm_split_merge(int n_segs, const char **fn, const mm_mapopt_t *opt, int n_sp
 	for (pl.rid_shift[0] = 0, i = 1; i < n_split_idx; ++i)
 		pl.rid_shift[i] += pl.rid_shift[i - 1];
 	if (opt->flag & MM_F_OUT_SAM)
-		for (i = 0; i < (int32_t)pl.mi->n_seq; ++i)
-			printf("@SQ\tSN:%s\tLN:%d\n", pl.mi->seq[i].name, pl.mi->seq[i].len);
+		for (i = 0; i < (int32_t)pl.mi->n_seq; ++i) {
+			if (mm_bsort_out) {
+				char *buf = (char*)malloc(strlen(pl.mi->seq[i].name) + 32);
+				sprintf(buf, "@SQ\tSN:%s\tLN:%d", pl.mi->seq[i].name, pl.mi->seq[i].len);
+				mm_bsort_hdr(mm_bsort_out, buf);
+				free(buf);
+			} else printf("@SQ\tSN:%s\tLN:%d\n", pl.mi->seq[i].name, pl.mi->seq[i].len);
+		}
 
 	kt_pipeline(2, worker_pipeline, &pl, 3);
 
-	free(pl.str.s);
 	mm_idx_destroy(mi);
 	free(pl.rid_shift);
 	for (i = 0; i < n_split_idx; ++i)
@@ -48,8 +48,11 @@
 #define MM_I_HPC          0x1
 #define MM_I_NO_SEQ       0x2
 #define MM_I_NO_NAME      0x4
+#define MM_I_FLAT         0x8 // reader option: dump the index in the memory-mappable layout
 
 #define MM_IDX_MAGIC   "MMI\2"
+#define MM_IDX_FLAT_MAGIC "MMI\3" // memory-mappable index; see mm_idx_dump_flat()
+#define MM_IDX_FLAT_ALIGN 0x10000  // alignment of flat index parts and of the packed sequence in them
 
 #define MM_MAX_SEG       255
 
@@ -91,6 +94,8 @@ typedef struct {
 	struct mm_idx_bucket_s *B; // index (hidden)
 	struct mm_idx_intv_s *I;   // intervals (hidden)
 	void *km, *h;
+	void *map;                 // memory mapping backing B[]->p and S for a flat index (hidden)
+	uint64_t map_len;
 } mm_idx_t;
 
 // minimap2 alignment
@@ -176,6 +181,8 @@ typedef struct {
 	int64_t mini_batch_size; // size of a batch of query bases to process in parallel
 	int64_t max_sw_mat;
 	int64_t cap_kalloc;
+	int64_t max_mem;         // if positive, adapt the mini-batch size to keep the memory below this
+	float min_hit_frac;      // skip queries with a smaller fraction of minimizers hitting the index
 
 	const char *split_prefix;
 } mm_mapopt_t;
@@ -190,12 +197,16 @@ typedef struct {
 		struct mm_bseq_file_s *seq;
 		FILE *idx;
 	} fp;
+	struct mm_idx_tgt_s *tgt; // regions to index (hidden)
+	int is_srv;               // the index is attached from an index server (hidden)
+	mm_idx_t *srv;            // the attached index, until returned by mm_idx_reader_read() (hidden)
 } mm_idx_reader_t;
 
 // memory buffer for thread-local storage during mapping
 struct mm_tbuf_s {
 	void *km;
 	int rep_len, frag_gap;
+	struct mm_rstat_s *rs; // if not NULL, mm_map_frag() adds per-stage timing and work counters here
 };
 
 typedef struct mm_tbuf_s mm_tbuf_t;
@@ -258,6 +269,21 @@ mm_idx_reader_t *mm_idx_reader_open(const char *fn, const mm_idxopt_t *opt, cons
  */
 mm_idx_t *mm_idx_reader_read(mm_idx_reader_t *r, int n_threads);
 
+/**
+ * Only index the given regions (plus flanks) of the sequences
+ *
+ * Sequences are kept in full so that coordinates are not changed, but only
+ * minimizers in the regions are added to the index. Call this function before
+ * mm_idx_reader_read().
+ *
+ * @param r          index reader
+ * @param fn         BED file of regions
+ * @param flank      extend each region by this many bases on both sides
+ *
+ * @return 0 on success; -1 if _fn_ can't be opened; -2 if reading a prebuilt index
+ */
+int mm_idx_reader_set_target(mm_idx_reader_t *r, const char *fn, int64_t flank);
+
 /**
  * Destroy/deallocate an index reader
  *
@@ -281,7 +307,8 @@ int64_t mm_idx_is_idx(const char *fn);
  *
  * Given a uni-part index, this function loads the entire index into memory.
  * Given a multi-part index, it loads one part only and places the file pointer
- * at the end of that part.
+ * at the end of that part. A part in the flat layout (see mm_idx_dump_flat())
+ * is memory-mapped read-only instead of being read.
  *
  * @param fp         pointer to FILE object
  *
@@ -297,6 +324,19 @@ mm_idx_t *mm_idx_load(FILE *fp);
  */
 void mm_idx_dump(FILE *fp, const mm_idx_t *mi);
 
+/**
+ * Append an index (or one part) to file in the flat memory-mappable layout
+ *
+ * The minimizer table is written as sorted arrays and the packed sequence is
+ * page aligned, so that mm_idx_load() can mmap() a part instead of reading it
+ * and rebuilding the hash tables. Each part is padded to MM_IDX_FLAT_ALIGN
+ * bytes; fp must be positioned at a multiple of MM_IDX_FLAT_ALIGN.
+ *
+ * @param fp         pointer to FILE object
+ * @param mi         minimap2 index
+ */
+void mm_idx_dump_flat(FILE *fp, const mm_idx_t *mi);
+
 /**
  * Create an index from strings in memory
  *
@@ -51,6 +51,31 @@ typedef struct {
 	mm128_t *a;
 } mm_seg_t;
 
+#define MM_RSTAT_N_STAGE 4
+
+typedef struct mm_rstat_s { // per-read wall time and work of each mapping stage (--read-stats)
+	double t[MM_RSTAT_N_STAGE]; // seconds spent on seeding, chaining, base-level alignment and output formatting
+	int64_t n_mini, n_seed, n_chain, n_anchor, n_cell; // minimizers, seed hits, chains, anchors on chains and DP cells
+} mm_rstat_t;
+
+extern FILE *mm_rstat_fp;
+
+int mm_rstat_open(const char *fn, int append);
+void mm_rstat_add(const char *qname, int qlen, int n_seg, int n_reg, const mm_rstat_t *r);
+void mm_rstat_close(void);
+
+extern char *mm_ckpt_fn;
+
+int mm_ckpt_init(const char *fn, const char *fn_out, const char *fn_side[2], int argc, char *argv[], int ind, int resume); // fn_side: --sv-sig and --read-stats files, or NULL
+int64_t mm_ckpt_n_skip(void);
+int64_t mm_ckpt_skip(int n_fp, mm_bseq_file_t **fp);
+void mm_ckpt_save(int64_t n_seq);
+void mm_ckpt_destroy(void);
+
+mm_idx_t *mm_idx_map_flat(int fd);
+int mm_idx_serve(const char *sock_fn, const char *fn, const mm_idxopt_t *opt, int n_threads);
+int mm_idx_reader_attach(mm_idx_reader_t *r, const char *fn, const char *sock_fn);
+
 double cputime(void);
 double realtime(void);
 long peakrss(void);
@@ -60,6 +85,7 @@ void radix_sort_64(uint64_t *beg, uint64_t *end);
 uint32_t ks_ksmall_uint32_t(size_t n, uint32_t arr[], size_t kk);
 
 void mm_sketch(void *km, const char *str, int len, int w, int k, uint32_t rid, int is_hpc, mm128_v *p);
+int mm_sketch_set_simd(int simd); // hashing kernel: 0 for scalar, 1 for AVX2, 2 for AVX-512, -1 for the best available; returns the kernel in use; not thread-safe, call before sketching
 
 mm_seed_t *mm_collect_matches(void *km, int *_n_m, int qlen, int max_occ, int max_max_occ, int dist, const mm_idx_t *mi, const mm128_v *mv, int64_t *n_a, int *rep_len, int *n_mini_pos, uint64_t **mini_pos);
 void mm_seed_mz_flt(void *km, mm128_v *mv, int32_t q_occ_max, float q_occ_frac);
@@ -72,11 +98,15 @@ void mm_write_sam(kstring_t *s, const mm_idx_t *mi, const mm_bseq1_t *t, const m
 void mm_write_sam2(kstring_t *s, const mm_idx_t *mi, const mm_bseq1_t *t, int seg_idx, int reg_idx, int n_seg, const int *n_regs, const mm_reg1_t *const* regs, void *km, int64_t opt_flag);
 void mm_write_sam3(kstring_t *s, const mm_idx_t *mi, const mm_bseq1_t *t, int seg_idx, int reg_idx, int n_seg, const int *n_regss, const mm_reg1_t *const* regss, void *km, int64_t opt_flag, int rep_len);
 
+extern FILE *mm_svsig_fp;
+extern int mm_svsig_min_len;
+void mm_write_svsig(kstring_t *s, const mm_idx_t *mi, const mm_bseq1_t *t, int n_regs, const mm_reg1_t *regs, void *km);
+
 void mm_idxopt_init(mm_idxopt_t *opt);
 const uint64_t *mm_idx_get(const mm_idx_t *mi, uint64_t minier, int *n);
 int32_t mm_idx_cal_max_occ(const mm_idx_t *mi, float f);
 int mm_idx_getseq2(const mm_idx_t *mi, int is_rev, uint32_t rid, uint32_t st, uint32_t en, uint8_t *seq);
-mm_reg1_t *mm_align_skeleton(void *km, const mm_mapopt_t *opt, const mm_idx_t *mi, int qlen, const char *qstr, int *n_regs_, mm_reg1_t *regs, mm128_t *a);
+mm_reg1_t *mm_align_skeleton(void *km, const mm_mapopt_t *opt, const mm_idx_t *mi, int qlen, const char *qstr, int *n_regs_, mm_reg1_t *regs, mm128_t *a, int64_t *n_cell);
 mm_reg1_t *mm_gen_regs(void *km, uint32_t hash, int qlen, int n_u, uint64_t *u, mm128_t *a, int is_qstrand);
 
 mm128_t *mm_chain_dp(int max_dist_x, int max_dist_y, int bw, int max_skip, int max_iter, int min_cnt, int min_sc, float gap_scale,
@@ -108,7 +138,7 @@ void mm_pair(void *km, int max_gap_ref, int dp_bonus, int sub_diff, int match_sc
 
 FILE *mm_split_init(const char *prefix, const mm_idx_t *mi);
 mm_idx_t *mm_split_merge_prep(const char *prefix, int n_splits, FILE **fp, uint32_t *n_seq_part);
-int mm_split_merge(int n_segs, const char **fn, const mm_mapopt_t *opt, int n_split_idx);
+int mm_split_merge(int n_segs, const char **fn, const mm_mapopt_t *opt, int n_split_idx, int n_threads);
 void mm_split_rm_tmp(const char *prefix, int n_splits);
 
 void mm_err_puts(const char *str);
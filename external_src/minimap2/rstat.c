@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mmpriv.h"
+
+/*
+ * Per-read stage timing (--read-stats). For each query (or fragment), the
+ * mapping threads record the wall time of seeding, chaining, base-level
+ * alignment and output formatting together with the amount of work done in
+ * each stage; the output step writes one TSV line per query in the input
+ * order and accumulates log2-binned histograms that are printed on close.
+ */
+
+#define RS_N_COL  (MM_RSTAT_N_STAGE + 1) // the stages plus the total
+#define RS_N_BIN  24 // bin 0 for <1/16 ms; bin i for [2^(i-5), 2^(i-4)) ms
+#define RS_N_TOP  10
+
+FILE *mm_rstat_fp = 0;
+
+static const char *rs_name[RS_N_COL] = { "seed", "chain", "align", "output", "total" };
+
+static struct {
+	int64_t n_read, n_bp, n_mini, n_seed, n_anchor, n_cell;
+	int64_t hist[RS_N_COL][RS_N_BIN];
+	double t[RS_N_COL];
+	int n_top;
+	struct { double t; char *name; } top[RS_N_TOP]; // the slowest queries in the descending order
+} rs_agg;
+
+static inline int rs_bin(double t)
+{
+	int b;
+	double x = t * 16e3; // in 1/16 ms
+	for (b = 0; x >= 1.0 && b < RS_N_BIN - 1; ++b) x *= 0.5;
+	return b;
+}
+
+int mm_rstat_open(const char *fn, int append) // append: continue a file written before a checkpoint
+{
+	memset(&rs_agg, 0, sizeof(rs_agg));
+	if ((mm_rstat_fp = fopen(fn, append? "a" : "w")) == 0) return -1;
+	if (!append) fputs("#qname\tqlen\tn_seg\tn_reg\tt_total\tt_seed\tt_chain\tt_align\tt_output\tn_mini\tn_seed\tn_chain\tn_anchor\tn_cell\n", mm_rstat_fp);
+	return 0;
+}
+
+void mm_rstat_add(const char *qname, int qlen, int n_seg, int n_reg, const mm_rstat_t *r)
+{
+	int i;
+	double t = 0.0;
+	for (i = 0; i < MM_RSTAT_N_STAGE; ++i) {
+		t += r->t[i], rs_agg.t[i] += r->t[i];
+		++rs_agg.hist[i][rs_bin(r->t[i])];
+	}
+	rs_agg.t[i] += t;
+	++rs_agg.hist[i][rs_bin(t)];
+	++rs_agg.n_read, rs_agg.n_bp += qlen;
+	rs_agg.n_mini += r->n_mini, rs_agg.n_seed += r->n_seed, rs_agg.n_anchor += r->n_anchor, rs_agg.n_cell += r->n_cell;
+	if (rs_agg.n_top < RS_N_TOP || t > rs_agg.top[RS_N_TOP - 1].t) { // insert into the list of the slowest queries
+		if (rs_agg.n_top == RS_N_TOP) free(rs_agg.top[RS_N_TOP - 1].name);
+		else ++rs_agg.n_top;
+		for (i = rs_agg.n_top - 1; i > 0 && rs_agg.top[i-1].t < t; --i)
+			rs_agg.top[i] = rs_agg.top[i-1];
+		rs_agg.top[i].t = t, rs_agg.top[i].name = strdup(qname);
+	}
+	fprintf(mm_rstat_fp, "%s\t%d\t%d\t%d\t%.6f\t%.6f\t%.6f\t%.6f\t%.6f\t%lld\t%lld\t%lld\t%lld\t%lld\n", qname, qlen, n_seg, n_reg,
+			t, r->t[0], r->t[1], r->t[2], r->t[3], (long long)r->n_mini, (long long)r->n_seed, (long long)r->n_chain, (long long)r->n_anchor, (long long)r->n_cell);
+}
+
+void mm_rstat_close(void)
+{
+	int i, j, b0, b1;
+	double tot;
+	if (mm_rstat_fp == 0) return;
+	fclose(mm_rstat_fp);
+	mm_rstat_fp = 0;
+	if (mm_verbose >= 3 && rs_agg.n_read > 0) {
+		tot = rs_agg.t[MM_RSTAT_N_STAGE] > 0.0? rs_agg.t[MM_RSTAT_N_STAGE] : 1.0;
+		fprintf(stderr, "[M::%s] %lld queries, %lld bases; %.3f thread-seconds:", __func__, (long long)rs_agg.n_read, (long long)rs_agg.n_bp, rs_agg.t[MM_RSTAT_N_STAGE]);
+		for (i = 0; i < MM_RSTAT_N_STAGE; ++i)
+			fprintf(stderr, " %s %.3f (%.1f%%)%c", rs_name[i], rs_agg.t[i], 100.0 * rs_agg.t[i] / tot, i == MM_RSTAT_N_STAGE - 1? '\n' : ',');
+		fprintf(stderr, "[M::%s] per query: %.1f minimizers, %.1f seed hits, %.1f anchors on chains, %.3g DP cells\n", __func__,
+				(double)rs_agg.n_mini / rs_agg.n_read, (double)rs_agg.n_seed / rs_agg.n_read, (double)rs_agg.n_anchor / rs_agg.n_read, (double)rs_agg.n_cell / rs_agg.n_read);
+		for (b0 = RS_N_BIN, b1 = -1, i = 0; i < RS_N_COL; ++i)
+			for (j = 0; j < RS_N_BIN; ++j)
+				if (rs_agg.hist[i][j]) {
+					if (b0 > j) b0 = j;
+					if (b1 < j) b1 = j;
+				}
+		fprintf(stderr, "[M::%s] histogram of per-query time:\n[M::%s]   time\t", __func__, __func__);
+		for (i = 0; i < RS_N_COL; ++i)
+			fprintf(stderr, "%s%c", rs_name[i], i == RS_N_COL - 1? '\n' : '\t');
+		for (j = b0; j <= b1; ++j) {
+			if (j == RS_N_BIN - 1) fprintf(stderr, "[M::%s]   >=%gms\t", __func__, (double)(1LL<<(j-1)) / 16.0);
+			else fprintf(stderr, "[M::%s]   <%gms\t", __func__, (double)(1LL<<j) / 16.0);
+			for (i = 0; i < RS_N_COL; ++i)
+				fprintf(stderr, "%lld%c", (long long)rs_agg.hist[i][j], i == RS_N_COL - 1? '\n' : '\t');
+		}
+		fprintf(stderr, "[M::%s] slowest queries:", __func__);
+		for (i = 0; i < rs_agg.n_top; ++i)
+			fprintf(stderr, " %s (%.3fs)%c", rs_agg.top[i].name, rs_agg.top[i].t, i == rs_agg.n_top - 1? '\n' : ',');
+	}
+	for (i = 0; i < rs_agg.n_top; ++i) free(rs_agg.top[i].name);
+	rs_agg.n_top = 0;
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
 #define __STDC_LIMIT_MACROS
 #include "kvec.h"
 #include "mmpriv.h"
@@ -37,6 +38,75 @@ static inline uint64_t hash64(uint64_t key, uint64_t mask)
 	return key;
 }
 
+/*
+ * Sketching is done in blocks of up to MM_SKETCH_BLOCK k-mers. A scalar pass
+ * extracts the canonical k-mers of a block (this is where homopolymers are
+ * compressed and ambiguous bases reset the k-mer); the k-mers of the block are
+ * then hashed together by a SIMD kernel; finally the block is fed to the
+ * window logic. When the minimum leaves the window, the new minimum of the
+ * window buffer is found by a second SIMD kernel that also returns the bit
+ * mask of the buffer slots holding it (for w <= 64). Both kernels compute
+ * exactly what the scalar code does, so the minimizers are identical.
+ */
+
+#define MM_SKETCH_BLOCK 256
+#define MM_SKETCH_PAD   8 // the window buffer is padded with UINT64_MAX to a multiple of the vector width
+
+static void sk_hash_scalar(uint64_t *a, int n, uint64_t mask)
+{
+	int i;
+	for (i = 0; i < n; ++i)
+		a[i] = hash64(a[i], mask);
+}
+
+static uint64_t sk_wmin_scalar(const uint64_t *x, int w, uint64_t *eq) // minimum of x[0..w) and the mask of its positions; w <= 64
+{
+	int j;
+	uint64_t m = UINT64_MAX, e = 0;
+	for (j = 0; j < w; ++j)
+		m = x[j] < m? x[j] : m;
+	for (j = 0; j < w; ++j)
+		e |= (uint64_t)(x[j] == m) << j;
+	*eq = e;
+	return m;
+}
+
+#ifdef MM_SKETCH_DISPATCH
+extern void mm_sketch_hash_avx2(uint64_t *a, int n, uint64_t mask);
+extern void mm_sketch_hash_avx512(uint64_t *a, int n, uint64_t mask);
+extern uint64_t mm_sketch_wmin_avx2(const uint64_t *x, int w, uint64_t *eq);
+extern uint64_t mm_sketch_wmin_avx512(const uint64_t *x, int w, uint64_t *eq);
+#endif
+
+static void (*sk_hash)(uint64_t *a, int n, uint64_t mask) = 0;
+static uint64_t (*sk_wmin)(const uint64_t *x, int w, uint64_t *eq) = 0;
+static pthread_once_t sk_once = PTHREAD_ONCE_INIT;
+
+int mm_sketch_set_simd(int simd)
+{
+	if (simd < 0) { // the best available
+#ifdef MM_SKETCH_DISPATCH
+		__builtin_cpu_init();
+		simd = __builtin_cpu_supports("avx512f")? 2 : __builtin_cpu_supports("avx2")? 1 : 0;
+#else
+		simd = 0;
+#endif
+	}
+#ifdef MM_SKETCH_DISPATCH
+	if (simd == 2) sk_wmin = mm_sketch_wmin_avx512, sk_hash = mm_sketch_hash_avx512;
+	else if (simd == 1) sk_wmin = mm_sketch_wmin_avx2, sk_hash = mm_sketch_hash_avx2;
+	else simd = 0, sk_wmin = sk_wmin_scalar, sk_hash = sk_hash_scalar;
+#else
+	simd = 0, sk_wmin = sk_wmin_scalar, sk_hash = sk_hash_scalar;
+#endif
+	return simd;
+}
+
+static void sk_init(void) // the best kernels, unless mm_sketch_set_simd() has been called
+{
+	if (sk_hash == 0) mm_sketch_set_simd(-1);
+}
+
 typedef struct { // a simplified version of kdq
 	int front, count;
 	int a[32];
@@ -57,6 +127,13 @@ static inline int tq_shift(tiny_queue_t *q)
 	return x;
 }
 
+static inline void sk_push(void *km, mm128_v *p, uint64_t x, uint64_t y)
+{
+	mm128_t t;
+	t.x = x, t.y = y;
+	kv_push(mm128_t, km, *p, t);
+}
+
 /**
  * Find symmetric (w,k)-minimizers on a DNA sequence
  *
@@ -77,66 +154,91 @@ static inline int tq_shift(tiny_queue_t *q)
 void mm_sketch(void *km, const char *str, int len, int w, int k, uint32_t rid, int is_hpc, mm128_v *p)
 {
 	uint64_t shift1 = 2 * (k - 1), mask = (1ULL<<2*k) - 1, kmer[2] = {0,0};
-	int i, j, l, buf_pos, min_pos, kmer_span = 0;
-	mm128_t buf[256], min = { UINT64_MAX, UINT64_MAX };
+	int i, j, l, e, n_blk, buf_pos, min_pos, kmer_span = 0;
+	uint64_t buf_x[256 + MM_SKETCH_PAD], buf_y[256]; // the window buffer; buf_x[w..] stay UINT64_MAX
+	mm128_t min = { UINT64_MAX, UINT64_MAX };
+	uint64_t blk_x[MM_SKETCH_BLOCK], blk_y[MM_SKETCH_BLOCK]; // k-mers (hashes after sk_hash()) and positions of a block
+	int blk_l[MM_SKETCH_BLOCK]; // $l at each k-mer
+	uint8_t blk_span[MM_SKETCH_BLOCK];
 	tiny_queue_t tq;
 
 	assert(len > 0 && (w > 0 && w < 256) && (k > 0 && k <= 28)); // 56 bits for k-mer; could use long k-mers, but 28 enough in practice
-	memset(buf, 0xff, w * 16);
+	pthread_once(&sk_once, sk_init); // orders the kernel pointers before their use in every thread
+	memset(buf_x, 0xff, sizeof(buf_x));
+	memset(buf_y, 0xff, w * 8);
 	memset(&tq, 0, sizeof(tiny_queue_t));
 	kv_resize(mm128_t, km, *p, p->n + len/w);
 
-	for (i = l = buf_pos = min_pos = 0; i < len; ++i) {
-		int c = seq_nt4_table[(uint8_t)str[i]];
-		mm128_t info = { UINT64_MAX, UINT64_MAX };
-		if (c < 4) { // not an ambiguous base
-			int z;
-			if (is_hpc) {
-				int skip_len = 1;
-				if (i + 1 < len && seq_nt4_table[(uint8_t)str[i + 1]] == c) {
-					for (skip_len = 2; i + skip_len < len; ++skip_len)
-						if (seq_nt4_table[(uint8_t)str[i + skip_len]] != c)
-							break;
-					i += skip_len - 1; // put $i at the end of the current homopolymer run
+	for (i = l = buf_pos = min_pos = 0; i < len;) {
+		for (n_blk = 0; i < len && n_blk < MM_SKETCH_BLOCK; ++i) { // collect the next block of k-mers
+			int c = seq_nt4_table[(uint8_t)str[i]];
+			blk_x[n_blk] = 0, blk_y[n_blk] = UINT64_MAX; // no k-mer at this position
+			if (c < 4) { // not an ambiguous base
+				int z;
+				if (is_hpc) {
+					int skip_len = 1;
+					if (i + 1 < len && seq_nt4_table[(uint8_t)str[i + 1]] == c) {
+						for (skip_len = 2; i + skip_len < len; ++skip_len)
+							if (seq_nt4_table[(uint8_t)str[i + skip_len]] != c)
+								break;
+						i += skip_len - 1; // put $i at the end of the current homopolymer run
+					}
+					tq_push(&tq, skip_len);
+					kmer_span += skip_len;
+					if (tq.count > k) kmer_span -= tq_shift(&tq);
+				} else kmer_span = l + 1 < k? l + 1 : k;
+				kmer[0] = (kmer[0] << 2 | c) & mask;           // forward k-mer
+				kmer[1] = (kmer[1] >> 2) | (3ULL^c) << shift1; // reverse k-mer
+				if (kmer[0] == kmer[1]) continue; // skip "symmetric k-mers" as we don't know it strand
+				z = kmer[0] < kmer[1]? 0 : 1; // strand
+				++l;
+				if (l >= k && kmer_span < 256) {
+					blk_x[n_blk] = kmer[z], blk_span[n_blk] = kmer_span;
+					blk_y[n_blk] = (uint64_t)rid<<32 | (uint32_t)i<<1 | z;
 				}
-				tq_push(&tq, skip_len);
-				kmer_span += skip_len;
-				if (tq.count > k) kmer_span -= tq_shift(&tq);
-			} else kmer_span = l + 1 < k? l + 1 : k;
-			kmer[0] = (kmer[0] << 2 | c) & mask;           // forward k-mer
-			kmer[1] = (kmer[1] >> 2) | (3ULL^c) << shift1; // reverse k-mer
-			if (kmer[0] == kmer[1]) continue; // skip "symmetric k-mers" as we don't know it strand
-			z = kmer[0] < kmer[1]? 0 : 1; // strand
-			++l;
-			if (l >= k && kmer_span < 256) {
-				info.x = hash64(kmer[z], mask) << 8 | kmer_span;
-				info.y = (uint64_t)rid<<32 | (uint32_t)i<<1 | z;
-			}
-		} else l = 0, tq.count = tq.front = 0, kmer_span = 0;
-		buf[buf_pos] = info; // need to do this here as appropriate buf_pos and buf[buf_pos] are needed below
-		if (l == w + k - 1 && min.x != UINT64_MAX) { // special case for the first window - because identical k-mers are not stored yet
-			for (j = buf_pos + 1; j < w; ++j)
-				if (min.x == buf[j].x && buf[j].y != min.y) kv_push(mm128_t, km, *p, buf[j]);
-			for (j = 0; j < buf_pos; ++j)
-				if (min.x == buf[j].x && buf[j].y != min.y) kv_push(mm128_t, km, *p, buf[j]);
+			} else l = 0, tq.count = tq.front = 0, kmer_span = 0;
+			blk_l[n_blk++] = l;
 		}
-		if (info.x <= min.x) { // a new minimum; then write the old min
-			if (l >= w + k && min.x != UINT64_MAX) kv_push(mm128_t, km, *p, min);
-			min = info, min_pos = buf_pos;
-		} else if (buf_pos == min_pos) { // old min has moved outside the window
-			if (l >= w + k - 1 && min.x != UINT64_MAX) kv_push(mm128_t, km, *p, min);
-			for (j = buf_pos + 1, min.x = UINT64_MAX; j < w; ++j) // the two loops are necessary when there are identical k-mers
-				if (min.x >= buf[j].x) min = buf[j], min_pos = j; // >= is important s.t. min is always the closest k-mer
-			for (j = 0; j <= buf_pos; ++j)
-				if (min.x >= buf[j].x) min = buf[j], min_pos = j;
-			if (l >= w + k - 1 && min.x != UINT64_MAX) { // write identical k-mers
-				for (j = buf_pos + 1; j < w; ++j) // these two loops make sure the output is sorted
-					if (min.x == buf[j].x && min.y != buf[j].y) kv_push(mm128_t, km, *p, buf[j]);
-				for (j = 0; j <= buf_pos; ++j)
-					if (min.x == buf[j].x && min.y != buf[j].y) kv_push(mm128_t, km, *p, buf[j]);
+		sk_hash(blk_x, n_blk, mask);
+		for (e = 0; e < n_blk; ++e) { // find minimizers in the block
+			int le = blk_l[e]; // $l when the k-mer was added
+			mm128_t info = { UINT64_MAX, UINT64_MAX };
+			if (blk_y[e] != UINT64_MAX)
+				info.x = blk_x[e] << 8 | blk_span[e], info.y = blk_y[e];
+			buf_x[buf_pos] = info.x, buf_y[buf_pos] = info.y; // need to do this here as appropriate buf_pos and buf[buf_pos] are needed below
+			if (le == w + k - 1 && min.x != UINT64_MAX) { // special case for the first window - because identical k-mers are not stored yet
+				for (j = buf_pos + 1; j < w; ++j)
+					if (min.x == buf_x[j] && buf_y[j] != min.y) sk_push(km, p, buf_x[j], buf_y[j]);
+				for (j = 0; j < buf_pos; ++j)
+					if (min.x == buf_x[j] && buf_y[j] != min.y) sk_push(km, p, buf_x[j], buf_y[j]);
+			}
+			if (info.x <= min.x) { // a new minimum; then write the old min
+				if (le >= w + k && min.x != UINT64_MAX) kv_push(mm128_t, km, *p, min);
+				min = info, min_pos = buf_pos;
+			} else if (buf_pos == min_pos) { // old min has moved outside the window
+				uint64_t eq = 3; // more than one bit set: there may be identical k-mers
+				if (le >= w + k - 1 && min.x != UINT64_MAX) kv_push(mm128_t, km, *p, min);
+				if (w <= 64) {
+					uint64_t lo;
+					min.x = sk_wmin(buf_x, w, &eq);
+					lo = eq & ((2ULL << buf_pos) - 1); // the slots up to buf_pos are newer than those after it
+					min_pos = lo? 63 - __builtin_clzll(lo) : 63 - __builtin_clzll(eq); // the closest k-mer, as with ">=" below
+					min.y = buf_y[min_pos];
+				} else {
+					for (j = buf_pos + 1, min.x = UINT64_MAX; j < w; ++j) // the two loops are necessary when there are identical k-mers
+						if (min.x >= buf_x[j]) min.x = buf_x[j], min.y = buf_y[j], min_pos = j; // >= is important s.t. min is always the closest k-mer
+					for (j = 0; j <= buf_pos; ++j)
+						if (min.x >= buf_x[j]) min.x = buf_x[j], min.y = buf_y[j], min_pos = j;
+				}
+				if (le >= w + k - 1 && min.x != UINT64_MAX && (eq & (eq - 1))) { // write identical k-mers
+					for (j = buf_pos + 1; j < w; ++j) // these two loops make sure the output is sorted
+						if (min.x == buf_x[j] && min.y != buf_y[j]) sk_push(km, p, buf_x[j], buf_y[j]);
+					for (j = 0; j <= buf_pos; ++j)
+						if (min.x == buf_x[j] && min.y != buf_y[j]) sk_push(km, p, buf_x[j], buf_y[j]);
+				}
 			}
+			if (++buf_pos == w) buf_pos = 0;
 		}
-		if (++buf_pos == w) buf_pos = 0;
 	}
 	if (min.x != UINT64_MAX)
 		kv_push(mm128_t, km, *p, min);
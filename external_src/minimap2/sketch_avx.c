@@ -0,0 +1,108 @@
+#include <stdint.h>
+
+#if defined(__AVX2__) && defined(MM_SKETCH_DISPATCH)
+#include <immintrin.h>
+
+/*
+ * The SIMD kernels of mm_sketch(), on 4 (AVX2) or 8 (AVX-512) 64-bit lanes.
+ * The hash only uses shifts, additions, XORs and ANDs, so every lane computes
+ * exactly the scalar hash64(). The window minimum reads x[0..w) rounded up to
+ * the vector width; the caller pads x with UINT64_MAX.
+ */
+
+#ifdef __AVX512F__
+typedef __m512i sk_t;
+#define SK_N            8
+#define sk_load(p)      _mm512_loadu_si512((const void*)(p))
+#define sk_store(p, a)  _mm512_storeu_si512((void*)(p), (a))
+#define sk_set1(x)      _mm512_set1_epi64(x)
+#define sk_add(a, b)    _mm512_add_epi64((a), (b))
+#define sk_and(a, b)    _mm512_and_si512((a), (b))
+#define sk_xor(a, b)    _mm512_xor_si512((a), (b))
+#define sk_shl(a, n)    _mm512_slli_epi64((a), (n))
+#define sk_shr(a, n)    _mm512_srli_epi64((a), (n))
+#define sk_eq(a, b)     ((uint64_t)_mm512_cmpeq_epu64_mask((a), (b)))
+#define SK_HASH         mm_sketch_hash_avx512
+#define SK_WMIN         mm_sketch_wmin_avx512
+
+static inline sk_t sk_minu(sk_t a, sk_t b) { return _mm512_min_epu64(a, b); }
+static inline uint64_t sk_hmin(sk_t a) { return _mm512_reduce_min_epu64(a); }
+#else
+typedef __m256i sk_t;
+#define SK_N            4
+#define sk_load(p)      _mm256_loadu_si256((const __m256i*)(p))
+#define sk_store(p, a)  _mm256_storeu_si256((__m256i*)(p), (a))
+#define sk_set1(x)      _mm256_set1_epi64x(x)
+#define sk_add(a, b)    _mm256_add_epi64((a), (b))
+#define sk_and(a, b)    _mm256_and_si256((a), (b))
+#define sk_xor(a, b)    _mm256_xor_si256((a), (b))
+#define sk_shl(a, n)    _mm256_slli_epi64((a), (n))
+#define sk_shr(a, n)    _mm256_srli_epi64((a), (n))
+#define sk_eq(a, b)     ((uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64((a), (b)))))
+#define SK_HASH         mm_sketch_hash_avx2
+#define SK_WMIN         mm_sketch_wmin_avx2
+
+static inline sk_t sk_minu(sk_t a, sk_t b) // AVX2 only has signed 64-bit comparisons
+{
+	sk_t s = _mm256_set1_epi64x((int64_t)0x8000000000000000ULL);
+	sk_t gt = _mm256_cmpgt_epi64(_mm256_xor_si256(a, s), _mm256_xor_si256(b, s));
+	return _mm256_blendv_epi8(a, b, gt);
+}
+
+static inline uint64_t sk_hmin(sk_t a)
+{
+	uint64_t x[4], m;
+	int i;
+	_mm256_storeu_si256((__m256i*)x, a);
+	for (i = 1, m = x[0]; i < 4; ++i)
+		m = x[i] < m? x[i] : m;
+	return m;
+}
+#endif
+
+static inline uint64_t hash64(uint64_t key, uint64_t mask) // identical to the one in sketch.c
+{
+	key = (~key + (key << 21)) & mask;
+	key = key ^ key >> 24;
+	key = ((key + (key << 3)) + (key << 8)) & mask;
+	key = key ^ key >> 14;
+	key = ((key + (key << 2)) + (key << 4)) & mask;
+	key = key ^ key >> 28;
+	key = (key + (key << 31)) & mask;
+	return key;
+}
+
+void SK_HASH(uint64_t *a, int n, uint64_t mask)
+{
+	int i;
+	sk_t m = sk_set1(mask), ones = sk_set1(-1);
+	for (i = 0; i + SK_N <= n; i += SK_N) {
+		sk_t key = sk_load(&a[i]);
+		key = sk_and(sk_add(sk_xor(key, ones), sk_shl(key, 21)), m);
+		key = sk_xor(key, sk_shr(key, 24));
+		key = sk_and(sk_add(sk_add(key, sk_shl(key, 3)), sk_shl(key, 8)), m);
+		key = sk_xor(key, sk_shr(key, 14));
+		key = sk_and(sk_add(sk_add(key, sk_shl(key, 2)), sk_shl(key, 4)), m);
+		key = sk_xor(key, sk_shr(key, 28));
+		key = sk_and(sk_add(key, sk_shl(key, 31)), m);
+		sk_store(&a[i], key);
+	}
+	for (; i < n; ++i)
+		a[i] = hash64(a[i], mask);
+}
+
+uint64_t SK_WMIN(const uint64_t *x, int w, uint64_t *eq) // w <= 64
+{
+	int i;
+	uint64_t m, e = 0;
+	sk_t v = sk_load(x), mv;
+	for (i = SK_N; i < w; i += SK_N)
+		v = sk_minu(v, sk_load(&x[i]));
+	m = sk_hmin(v);
+	mv = sk_set1(m);
+	for (i = 0; i < w; i += SK_N)
+		e |= sk_eq(sk_load(&x[i]), mv) << i;
+	*eq = w < 64? e & ((1ULL << w) - 1) : e;
+	return m;
+}
+#endif
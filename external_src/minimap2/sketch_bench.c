@@ -0,0 +1,116 @@
+// Benchmark and cross-check of the minimizer sketching kernels.
+//
+// A fixed set of sequences is generated from a seeded PRNG: random bases with
+// homopolymer runs, tandem repeats and stretches of N. Every hashing kernel
+// available on this CPU is used to sketch them, with and without homopolymer
+// compression, and the minimizers are compared against the scalar kernel.
+// Usage: sketch-bench [-n seqs] [-l len] [-w w] [-k k] [-r rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "mmpriv.h"
+
+static const char *kernel_name[] = { "scalar", "avx2", "avx512" };
+
+static uint64_t bench_rand(uint64_t *x) // splitmix64
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static double realtime_now(void)
+{
+	struct timeval tp;
+	gettimeofday(&tp, 0);
+	return tp.tv_sec + tp.tv_usec * 1e-6;
+}
+
+static char *gen_seq(uint64_t *x, int len)
+{
+	int i = 0, j;
+	char *s = (char*)malloc(len + 1);
+	while (i < len) {
+		uint64_t r = bench_rand(x) % 1000;
+		if (r < 5) { // a homopolymer run
+			int l = 2 + bench_rand(x) % 15, c = "ACGT"[bench_rand(x) & 3];
+			for (j = 0; j < l && i < len; ++j) s[i++] = c;
+		} else if (r < 7) { // a tandem repeat
+			int p = 1 + bench_rand(x) % 6, l = 20 + bench_rand(x) % 200;
+			for (j = 0; j < p && i < len; ++j) s[i++] = "ACGT"[bench_rand(x) & 3];
+			for (j = 0; j < l && i < len; ++j, ++i) s[i] = s[i - p];
+		} else if (r < 8) { // ambiguous bases
+			int l = 1 + bench_rand(x) % 50;
+			for (j = 0; j < l && i < len; ++j) s[i++] = 'N';
+		} else s[i++] = "ACGTacgt"[bench_rand(x) & 7];
+	}
+	s[len] = 0;
+	return s;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, j, c, n = 100, len = 100000, w = 10, k = 15, n_round = 5, is_hpc, simd, n_err = 0;
+	uint64_t x = 11;
+	char **seq;
+	mm128_v *ref, *mv;
+	double n_bases;
+
+	while ((c = getopt(argc, argv, "n:l:w:k:r:s:")) >= 0) {
+		if (c == 'n') n = atoi(optarg);
+		else if (c == 'l') len = atoi(optarg);
+		else if (c == 'w') w = atoi(optarg);
+		else if (c == 'k') k = atoi(optarg);
+		else if (c == 'r') n_round = atoi(optarg);
+		else if (c == 's') x = strtoull(optarg, 0, 10);
+	}
+	seq = (char**)calloc(n, sizeof(char*));
+	for (i = 0; i < n; ++i)
+		seq[i] = gen_seq(&x, 1 + bench_rand(&x) % len);
+	for (i = 0, n_bases = 0.0; i < n; ++i)
+		n_bases += strlen(seq[i]);
+	n_bases *= n_round;
+	ref = (mm128_v*)calloc(n, sizeof(mm128_v));
+	mv = (mm128_v*)calloc(n, sizeof(mm128_v));
+	for (is_hpc = 0; is_hpc <= 1; ++is_hpc) {
+		double t_ref = 1.0;
+		for (simd = 0; simd <= 2; ++simd) {
+			double t;
+			int r, n_diff = 0;
+			if (mm_sketch_set_simd(simd) != simd) {
+				printf("%s\t%s\tskipped (not available)\n", is_hpc? "hpc" : "plain", kernel_name[simd]);
+				continue;
+			}
+			for (i = 0; i < n; ++i) // warm up the caches
+				mv[i].n = 0, mm_sketch(0, seq[i], strlen(seq[i]), w, k, i, is_hpc, &mv[i]);
+			t = realtime_now();
+			for (r = 0; r < n_round; ++r)
+				for (i = 0; i < n; ++i)
+					mv[i].n = 0, mm_sketch(0, seq[i], strlen(seq[i]), w, k, i, is_hpc, &mv[i]);
+			t = realtime_now() - t;
+			if (simd == 0) {
+				t_ref = t;
+				for (i = 0; i < n; ++i) {
+					mm128_v tmp = ref[i];
+					ref[i] = mv[i], mv[i] = tmp;
+				}
+			} else {
+				for (i = 0; i < n; ++i)
+					if (ref[i].n != mv[i].n || memcmp(ref[i].a, mv[i].a, ref[i].n * sizeof(mm128_t)) != 0)
+						++n_diff;
+			}
+			n_err += n_diff;
+			printf("%s\t%s\t%.3f sec\t%.1f Mbases/s\t%.2fx\t%d/%d different\n", is_hpc? "hpc" : "plain", kernel_name[simd],
+				   t, n_bases / t * 1e-6, t_ref / t, n_diff, n);
+		}
+	}
+	for (j = 0; j < n; ++j) {
+		free(seq[j]); free(ref[j].a); free(mv[j].a);
+	}
+	free(seq); free(ref); free(mv);
+	return n_err? 1 : 0;
+}
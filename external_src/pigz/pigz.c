@@ -237,6 +237,33 @@
    circumstances. Parallel decompression can be turned off by specifying one
    process (-dp 1 or -tp 1).
 
+   The --index or -X option (which implies -i) prepares such a stream. After
+   the gzip trailer, it appends a block index as further gzip members that
+   decompress to nothing, so that the output remains a valid gzip file for any
+   gzip decoder. Each index member has an extra field with the subfield 'PX',
+   whose data is a list of eight-byte entries, one per independent block: the
+   compressed and the uncompressed length of the block, each four bytes in
+   little-endian order. At most 8190 entries fit in a member, so a large
+   stream's index spans several members. The last member, 42 bytes long, has
+   only the subfield 'PT' with sixteen bytes of data: the length of the whole
+   index including that member, and the number of entries, each eight bytes in
+   little-endian order. Given a gzip file that ends with such a member and
+   whose blocks sum up to the deflate stream after the first gzip header,
+   pigz -d or -t inflates the blocks in parallel in up to 'procs' threads with
+   pread(), and the main thread writes them in order and combines their check
+   values. The index also permits random access to any uncompressed offset by
+   inflating a single block.
+
+   The --bgzf or -B option writes the blocked gzip format of htslib (BGZF)
+   instead, which tools such as samtools, tabix, and bgzip decode in parallel
+   and index for random access. Each BGZF block is a complete gzip member of at
+   most 64K, holding at most 65280 bytes of input, whose gzip header has the
+   subfield 'BC' with the length of the member, and an empty member ends the
+   stream. The blocks are compressed in the compress threads as for any other
+   output, several per input buffer. Where the lines of the input permit, both
+   the input buffers and the blocks end after a newline, so that records of
+   FASTQ, SAM, or VCF text are not split across blocks.
+
    pigz requires zlib 1.2.1 or later to allow setting the dictionary when doing
    raw deflate. Since zlib 1.2.3 corrects security vulnerabilities in zlib
    version 1.2.1 and 1.2.2, conditionals check for zlib 1.2.3 or later during
@@ -343,12 +370,12 @@
                         // S_IFDIR, S_IFLNK, S_IFMT, S_IFREG
 #include <sys/time.h>   // utimes(), gettimeofday(), struct timeval
 #include <unistd.h>     // unlink(), _exit(), read(), write(), close(),
-                        // lseek(), isatty(), chown(), fsync()
+                        // lseek(), isatty(), chown(), fsync(), pread()
 #include <fcntl.h>      // open(), O_CREAT, O_EXCL, O_RDONLY, O_TRUNC,
                         // O_WRONLY, fcntl(), F_FULLFSYNC
 #include <dirent.h>     // opendir(), readdir(), closedir(), DIR,
                         // struct dirent
-#include <limits.h>     // UINT_MAX, INT_MAX
+#include <limits.h>     // UINT_MAX, INT_MAX, LONG_MAX
 #if __STDC_VERSION__-0 >= 199901L || __GNUC__-0 >= 3
 #  include <inttypes.h> // intmax_t, uintmax_t
    typedef uintmax_t length_t;
@@ -527,7 +554,12 @@ local struct {
     int rsync;              // true for rsync blocking
     int procs;              // maximum number of compression threads (>= 1)
     int setdict;            // true to initialize dictionary in each thread
+    int index;              // true to append a block index (see put_index())
+    int bgzf;               // true to write BGZF blocks (see bgzf_member())
     size_t block;           // uncompressed input size per thread (>= 32K)
+    char *ix;               // block index entries of the output (allocated)
+    size_t ixz;             // block index allocated size
+    size_t ixlen;           // block index length in bytes
 
     // saved gzip/zip header data for decompression, testing, and listing
     time_t stamp;           // time stamp from gzip header
@@ -1074,6 +1106,8 @@ local length_t put_header(void) {
             -2, (val_t)head,        // zlib format uses big-endian order
             0);
     }
+    else if (g.bgzf)                // each BGZF member has its own header
+        len = 0;
     else {                          // gzip
         len = put(g.outd,
             1, (val_t)31,
@@ -1090,6 +1124,101 @@ local length_t put_header(void) {
     return len;
 }
 
+// BGZF header up to the block size, and the empty block that ends a stream.
+local const unsigned char bgzf_head[16] = {
+    31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0};
+local const unsigned char bgzf_eof[28] = {
+    31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 27, 0,
+    3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+// Maximum input and output sizes of a BGZF block.
+#define BGZF_IN 0xff00
+#define BGZF_OUT 0x10000
+
+// Return the length of the next BGZF block from the len bytes at buf: up to
+// the last newline that fits, or as much as fits if there is no newline.
+local size_t bgzf_cut(unsigned char *buf, size_t len) {
+    size_t lim, n;
+
+    lim = len < BGZF_IN ? len : BGZF_IN;
+    for (n = lim; n; n--)
+        if (buf[n - 1] == '\n')
+            return n;
+    return lim;
+}
+
+// Return the length of the blocks that bgzf_cut() makes from the start of the
+// len bytes at buf, as many as len has room for (at least one).
+local size_t bgzf_end(unsigned char *buf, size_t len) {
+    size_t k, n;
+
+    n = 0;
+    for (k = len < BGZF_IN << 1 ? 1 : len / BGZF_IN; k && n < len; k--)
+        n += bgzf_cut(buf + n, len - n);
+    return n;
+}
+
+// Compress the len <= BGZF_IN bytes at in to a complete BGZF block at out,
+// which must have room for BGZF_OUT bytes, using strm for deflate or zopfli
+// for level 11. Store the data instead if it doesn't compress enough to fit.
+// Return the length of the block.
+local size_t bgzf_member(z_stream *strm, unsigned char *in, size_t len,
+                         unsigned char *out) {
+    size_t clen;
+    unsigned long check;
+
+#ifndef NOZOPFLI
+    if (g.level > 9) {
+        unsigned char bits, *def;
+        size_t size;
+
+        def = NULL;
+        size = 0;
+        bits = 0;
+        ZopfliDeflatePart(&g.zopts, 2, 1, in, 0, len, &bits, &def, &size);
+        clen = size <= BGZF_OUT - 26 ? size : 0;
+        if (clen)
+            memcpy(out + 18, def, clen);
+        free(def);
+    }
+    else
+#endif
+    {
+        (void)deflateReset(strm);
+        strm->next_in = in;
+        strm->avail_in = (unsigned)len;
+        strm->next_out = out + 18;
+        strm->avail_out = BGZF_OUT - 26;
+        clen = deflate(strm, Z_FINISH) == Z_STREAM_END ?
+               BGZF_OUT - 26 - strm->avail_out : 0;
+    }
+    if (clen == 0) {                // a single stored block
+        out[18] = 1;
+        out[19] = (unsigned char)len;
+        out[20] = (unsigned char)(len >> 8);
+        out[21] = (unsigned char)~len;
+        out[22] = (unsigned char)(~len >> 8);
+        memcpy(out + 23, in, len);
+        clen = len + 5;
+    }
+
+    // header with the block size less one, trailer
+    memcpy(out, bgzf_head, 16);
+    out[16] = (unsigned char)(clen + 25);
+    out[17] = (unsigned char)((clen + 25) >> 8);
+    check = crc32(0L, in, (unsigned)len);
+    out += 18 + clen;
+    out[0] = (unsigned char)check;
+    out[1] = (unsigned char)(check >> 8);
+    out[2] = (unsigned char)(check >> 16);
+    out[3] = (unsigned char)(check >> 24);
+    out[4] = (unsigned char)len;
+    out[5] = (unsigned char)(len >> 8);
+    out[6] = 0;
+    out[7] = 0;
+    return clen + 26;
+}
+
 // Write a gzip, zlib, or zip trailer.
 local void put_trailer(length_t ulen, length_t clen,
                        unsigned long check, length_t head) {
@@ -1189,6 +1318,8 @@ local void put_trailer(length_t ulen, length_t clen,
         put(g.outd,
             -4, (val_t)check,       // zlib format uses big-endian order
             0);
+    else if (g.bgzf)                // BGZF end-of-file marker
+        writen(g.outd, bgzf_eof, sizeof(bgzf_eof));
     else                            // gzip
         put(g.outd,
             4, (val_t)check,
@@ -1196,6 +1327,70 @@ local void put_trailer(length_t ulen, length_t clen,
             0);
 }
 
+// Block index subfield entries per gzip member (limited by the extra field).
+#define IXMAX 8190
+
+// Append the compressed and uncompressed lengths of an independent block to
+// the block index.
+local void index_add(length_t clen, length_t ulen) {
+    unsigned char ent[8];
+    int n;
+
+    for (n = 0; n < 4; n++) {
+        ent[n] = (unsigned char)(clen >> (n << 3));
+        ent[n + 4] = (unsigned char)(ulen >> (n << 3));
+    }
+    g.ixlen = vmemcpy(&g.ix, &g.ixz, g.ixlen, ent, 8);
+}
+
+// Write the block index after the gzip trailer as empty gzip members (see the
+// --index description at the top).
+local void put_index(void) {
+    size_t off, len;
+    length_t tot = 0;
+
+    for (off = 0; off < g.ixlen; off += len) {
+        len = g.ixlen - off < IXMAX * 8 ? g.ixlen - off : IXMAX * 8;
+        tot += put(g.outd,
+            1, (val_t)31,
+            1, (val_t)139,
+            1, (val_t)8,            // deflate
+            1, (val_t)4,            // extra field
+            4, (val_t)0,            // no time stamp
+            1, (val_t)0,
+            1, (val_t)3,            // unix
+            2, (val_t)(len + 4),    // extra field length
+            1, (val_t)'P',
+            1, (val_t)'X',
+            2, (val_t)len,          // subfield length
+            0);
+        tot += writen(g.outd, g.ix + off, len);
+        tot += put(g.outd,
+            2, (val_t)3,            // empty final static block
+            4, (val_t)0,            // crc of nothing
+            4, (val_t)0,            // length of nothing
+            0);
+    }
+    put(g.outd,
+        1, (val_t)31,
+        1, (val_t)139,
+        1, (val_t)8,
+        1, (val_t)4,
+        4, (val_t)0,
+        1, (val_t)0,
+        1, (val_t)3,
+        2, (val_t)20,
+        1, (val_t)'P',
+        1, (val_t)'T',
+        2, (val_t)16,
+        8, (val_t)(tot + 42),       // length of the index
+        8, (val_t)(g.ixlen >> 3),   // number of entries
+        2, (val_t)3,
+        4, (val_t)0,
+        4, (val_t)0,
+        0);
+}
+
 // Compute an Adler-32, allowing a size_t length.
 local unsigned long adler32z(unsigned long adler,
                            unsigned char const *buf, size_t len) {
@@ -1710,6 +1905,20 @@ local void compress_thread(void *dummy) {
             left = job->in->len;
             job->out->len = 0;
             do {
+                // compress the next lines as a complete BGZF block
+                if (g.bgzf) {
+                    if (left) {
+                        next = job->in->buf + (job->in->len - left);
+                        len = left <= BGZF_IN ? left : bgzf_cut(next, left);
+                        while (job->out->size - job->out->len < BGZF_OUT)
+                            grow_space(job->out);
+                        job->out->len += bgzf_member(&strm, next, len,
+                                            job->out->buf + job->out->len);
+                        left -= len;
+                    }
+                    continue;
+                }
+
                 // decode next block length from blocks list
                 len = next == NULL ? 128 : *next++;
                 if (len < 128)                  // 64..32831
@@ -1843,8 +2052,8 @@ local void compress_thread(void *dummy) {
 
             // calculate the check value in parallel with writing, alert the
             // write thread that the calculation is complete, and drop this
-            // usage of the input buffer
-            len = job->in->len;
+            // usage of the input buffer (BGZF blocks have their own)
+            len = g.bgzf ? 0 : job->in->len;
             next = job->in->buf;
             check = CHECK(0L, Z_NULL, 0);
             while (len > MAXP2) {
@@ -1917,6 +2126,8 @@ local void write_thread(void *dummy) {
             // write the compressed data and drop the output buffer
             Trace(("-- writing #%ld", seq));
             writen(g.outd, job->out->buf, job->out->len);
+            if (g.index)
+                index_add(job->out->len, len);
             drop_space(job->out);
             Trace(("-- wrote #%ld%s", seq, more ? "" : " (last)"));
 
@@ -1937,6 +2148,8 @@ local void write_thread(void *dummy) {
 
         // write trailer
         put_trailer(ulen, clen, check, head);
+        if (g.index && g.form == 0)
+            put_index();
 
         // verify no more jobs, prepare for next use
         possess(compress_have);
@@ -2037,7 +2250,36 @@ local void parallel_compress(void) {
         // if rsyncable, generate block lengths and prepare curr for job to
         // likely have less than size bytes (up to the last hash hit)
         job->lens = NULL;
-        if (g.rsync && curr->len) {
+        if (g.bgzf) {
+            // fill curr from next after a partial line was carried over, and
+            // keep next full unless at the end of the input
+            len = curr->size - curr->len;
+            if (len > next->len)
+                len = next->len;
+            if (len) {
+                memcpy(curr->buf + curr->len, next->buf, len);
+                curr->len += len;
+                memmove(next->buf, next->buf + len, next->len - len);
+                next->len -= len;
+                next->len += readn(g.ind, next->buf + next->len,
+                                   next->size - next->len);
+            }
+
+            // end curr after the whole BGZF blocks of lines it has room for,
+            // and carry the rest over to the next job
+            if (next->len) {
+                scan = curr->buf + bgzf_end(curr->buf, curr->len);
+                len = (size_t)(curr->buf + curr->len - scan);
+                if (len) {
+                    hold = next;
+                    next = get_space(&in_pool);
+                    memcpy(next->buf, scan, len);
+                    next->len = len;
+                    curr->len -= len;
+                }
+            }
+        }
+        else if (g.rsync && curr->len) {
             // compute the hash function starting where we last left off to
             // cover either size bytes or to EOF, whichever is less, through
             // the data in curr (and in the next loop, through next) -- save
@@ -2120,7 +2362,7 @@ local void parallel_compress(void) {
 
         // provide dictionary for this job, prepare dictionary for next job
         job->out = dict;
-        if (more && g.setdict) {
+        if (more && g.setdict && !g.bgzf) {
             if (curr->len >= DICT || job->out == NULL) {
                 dict = curr;
                 use_space(dict);
@@ -2184,6 +2426,7 @@ local void single_compress(int reset) {
     size_t more;                    // amount of data in next[] (0 if eof)
     size_t start;                   // start of data in next[]
     size_t have;                    // bytes in current block for -i
+    length_t ixc, ixu;              // lengths since the last index entry
     size_t hist;                    // offset of permitted history
     int fresh;                      // if true, reset compression history
     unsigned hash;                  // hash for rsyncable
@@ -2242,6 +2485,33 @@ local void single_compress(int reset) {
     }
 #endif
 
+    // for BGZF, compress whole blocks of lines from in[], keeping the rest
+    // there until more input is read
+    if (g.bgzf) {
+        int eof;
+
+        if (out_size < BGZF_OUT)
+            out = alloc(out, out_size = BGZF_OUT);
+        ulen = clen = 0;
+        got = 0;
+        do {
+            more = readn(g.ind, in + got, g.block + DICT - got);
+            ulen += more;
+            got += more;
+            eof = got < g.block + DICT;
+            have = eof ? got : bgzf_end(in, got);
+            for (scan = in; have; scan += left, have -= left) {
+                left = have <= BGZF_IN ? have : bgzf_cut(scan, have);
+                clen += writen(g.outd, out,
+                               bgzf_member(strm, scan, left, out));
+            }
+            got -= (size_t)(scan - in);
+            memmove(in, scan, got);
+        } while (!eof);
+        put_trailer(ulen, clen, 0, head);
+        return;
+    }
+
     // do raw deflate and calculate check value
     got = 0;
     more = readn(g.ind, next, g.block);
@@ -2250,6 +2520,7 @@ local void single_compress(int reset) {
     hist = 0;
     clen = 0;
     have = 0;
+    ixc = ixu = 0;
     check = CHECK(0L, Z_NULL, 0);
     hash = RSYNCHIT;
     do {
@@ -2324,6 +2595,14 @@ local void single_compress(int reset) {
             }
         }
 
+        // an independent block ends where the history is cleared
+        if (fresh && g.index) {
+            index_add(clen - ixc, ixu);
+            ixc = clen;
+            ixu = 0;
+        }
+        ixu += got;
+
 #ifndef NOZOPFLI
         if (g.level <= 9) {
 #endif
@@ -2393,28 +2672,28 @@ local void single_compress(int reset) {
             bits &= 7;
             if (more || left) {
                 if ((bits & 1) || !g.setdict) {
-                    writen(g.outd, def, size);
+                    clen += writen(g.outd, def, size);
                     if (bits == 0 || bits > 5)
-                        writen(g.outd, (unsigned char *)"\0", 1);
-                    writen(g.outd, (unsigned char *)"\0\0\xff\xff", 4);
+                        clen += writen(g.outd, (unsigned char *)"\0", 1);
+                    clen += writen(g.outd, (unsigned char *)"\0\0\xff\xff", 4);
                 }
                 else {
                     assert(size > 0);
-                    writen(g.outd, def, size - 1);
+                    clen += writen(g.outd, def, size - 1);
                     if (bits)
                         do {
                             def[size - 1] += 2 << bits;
-                            writen(g.outd, def + size - 1, 1);
+                            clen += writen(g.outd, def + size - 1, 1);
                             def[size - 1] = 0;
                             bits += 2;
                         } while (bits < 8);
-                    writen(g.outd, def + size - 1, 1);
+                    clen += writen(g.outd, def + size - 1, 1);
                 }
                 if (!g.setdict)             // two markers when independent
-                    writen(g.outd, (unsigned char *)"\0\0\0\xff\xff", 5);
+                    clen += writen(g.outd, (unsigned char *)"\0\0\0\xff\xff", 5);
             }
             else
-                writen(g.outd, def, size);
+                clen += writen(g.outd, def, size);
             free(def);
             while (got > MAXP2) {
                 check = CHECK(check, strm->next_in, MAXP2);
@@ -2432,6 +2711,10 @@ local void single_compress(int reset) {
 
     // write trailer
     put_trailer(ulen, clen, check, head);
+    if (g.index && g.form == 0) {
+        index_add(clen - ixc, ixu);
+        put_index();
+    }
 }
 
 // --- decompression ---
@@ -2623,6 +2906,25 @@ local void in_init(void) {
 #define PULL4L(p) (PULL2L(p) + ((unsigned long)(PULL2L((p) + 2)) << 16))
 #define PULL2M(p) (((unsigned)((p)[0]) << 8) + (p)[1])
 #define PULL4M(p) (((unsigned long)(PULL2M(p)) << 16) + PULL2M((p) + 2))
+#define PULL8L(p) (PULL4L(p) + ((length_t)(PULL4L((p) + 4)) << 16 << 16))
+
+// Length of the gzip member that ends a block index (see put_index()).
+#define IXTAIL 42
+
+// If the IXTAIL bytes at tail are the end of a block index, then return true,
+// and set *len to the length of the whole index and *num to its number of
+// entries. Otherwise return false.
+local int index_tail(unsigned char *tail, length_t *len, length_t *num) {
+    static const unsigned char head[16] = {
+        31, 139, 8, 4, 0, 0, 0, 0, 0, 3, 20, 0, 'P', 'T', 16, 0};
+    static const unsigned char empty[10] = {3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+    if (memcmp(tail, head, 16) || memcmp(tail + 32, empty, 10))
+        return 0;
+    *len = PULL8L(tail + 16);
+    *num = PULL8L(tail + 24);
+    return *len >= IXTAIL;
+}
 
 // Convert MS-DOS date and time to a Unix time, assuming current timezone.
 // (You got a better idea?)
@@ -2973,6 +3275,7 @@ local void list_info(void) {
     unsigned char tail[8];  // trailer containing check and length
     unsigned long check;    // check value
     length_t len;           // length from trailer
+    length_t ixn;           // number of block index entries (unused)
 
     // initialize input buffer
     in_init();
@@ -3036,8 +3339,13 @@ local void list_info(void) {
         return;
     }
 
-    // skip to end to get trailer (8 bytes), compute compressed length
+    // skip to end to get trailer (8 bytes), compute compressed length -- if
+    // the stream ends with a block index, then the trailer precedes it
     if (g.in_short) {                   // whole thing already read
+        if (g.in_left >= IXTAIL + 8 &&
+            index_tail(g.in_next + (g.in_left - IXTAIL), &len, &ixn) &&
+            len <= g.in_left - 8)
+            g.in_left -= len;
         if (g.in_left < 8) {
             complain("skipping: %s not a valid gzip file", g.inf);
             return;
@@ -3046,6 +3354,15 @@ local void list_info(void) {
         memcpy(tail, g.in_next + (g.in_left - 8), 8);
     }
     else if ((at = lseek(g.ind, -8, SEEK_END)) != -1) {
+        unsigned char ixt[IXTAIL];
+
+        if (at >= IXTAIL &&
+            lseek(g.ind, -IXTAIL, SEEK_END) != -1 &&
+            readn(g.ind, ixt, IXTAIL) == IXTAIL &&
+            index_tail(ixt, &len, &ixn) && len <= (length_t)at)
+            at = lseek(g.ind, at - (off_t)len, SEEK_SET);
+        else
+            lseek(g.ind, at, SEEK_SET);
         g.in_tot = (length_t)at - g.in_tot + g.in_left; // compressed size
         readn(g.ind, tail, 8);          // get trailer
     }
@@ -3237,6 +3554,252 @@ local int outb(void *desc, unsigned char *buf, unsigned len) {
     return 0;
 }
 
+#ifndef NOTHREAD
+// An independent deflate block listed in a block index.
+struct iblock {
+    length_t off;               // offset of the block in the input
+    size_t clen;                // compressed length
+    size_t ulen;                // uncompressed length
+    unsigned char *out;         // inflated data, until written
+    unsigned long check;        // check value of the inflated data
+    int bad;                    // true if the block did not inflate exactly
+    int done;                   // true once inflated
+};
+
+// Parallel inflation state. The inflate threads take blocks in order from
+// inf_next and mark them done under inf_done, while inf_room counts the blocks
+// written, which keeps the threads at most INBUFS(g.procs) blocks ahead of
+// the writing.
+local struct iblock *inf_blk;   // the blocks from the index
+local long inf_num;             // number of blocks
+local lock *inf_next;           // next block to inflate
+local lock *inf_done;           // number of blocks inflated
+local lock *inf_room;           // number of blocks written
+
+// Inflate blocks from the input with pread() into the output buffers until
+// there are no more blocks. This is kept out of inflate_thread() so that the
+// input buffer, which grows as needed, isn't a local of the try block.
+local void inflate_blocks(z_stream *strm) {
+    long n;
+    int ret;
+    struct iblock *blk;
+    unsigned char *in = NULL;
+    size_t size = 0;
+
+    for (;;) {
+        // get the next block, wait for room to inflate it
+        possess(inf_next);
+        n = peek_lock(inf_next);
+        if (n >= inf_num) {
+            release(inf_next);
+            break;
+        }
+        twist(inf_next, BY, +1);
+        possess(inf_room);
+        wait_for(inf_room, TO_BE_MORE_THAN, n - INBUFS(g.procs));
+        release(inf_room);
+        blk = inf_blk + n;
+
+        // read and inflate the block, which must end exactly at the end of
+        // its input and output, and end the stream only if it's last
+        if (size < blk->clen)
+            in = alloc(in, size = blk->clen);
+        blk->out = alloc(NULL, blk->ulen + 1);
+        if (pread(g.ind, in, blk->clen, (off_t)blk->off) !=
+            (ssize_t)blk->clen)
+            blk->bad = 1;
+        else {
+            (void)inflateReset(strm);
+            strm->next_in = in;
+            strm->avail_in = (unsigned)blk->clen;
+            strm->next_out = blk->out;
+            strm->avail_out = (unsigned)blk->ulen + 1;
+            ret = inflate(strm, Z_SYNC_FLUSH);
+            blk->bad = (ret != Z_OK && ret != Z_STREAM_END) ||
+                       (ret == Z_STREAM_END) != (n == inf_num - 1) ||
+                       strm->avail_in != 0 || strm->avail_out != 1;
+        }
+        if (!blk->bad)
+            blk->check = CHECK(CHECK(0L, Z_NULL, 0), blk->out, blk->ulen);
+        Trace(("-- inflated block #%ld", n));
+
+        // let the main thread know
+        possess(inf_done);
+        blk->done = 1;
+        twist(inf_done, BY, +1);
+    }
+    free(in);
+}
+
+// Inflate thread: inflate blocks until there are no more blocks.
+local void inflate_thread(void *dummy) {
+    int ret;
+    z_stream strm;
+    ball_t err;                     // error information from throw()
+
+    (void)dummy;
+
+    Trace(("-- launched inflate thread"));
+    try {
+        strm.zfree = ZFREE;
+        strm.zalloc = ZALLOC;
+        strm.opaque = OPAQUE;
+        strm.avail_in = 0;
+        strm.next_in = Z_NULL;
+        ret = inflateInit2(&strm, -15);
+        if (ret == Z_MEM_ERROR)
+            throw(ENOMEM, "not enough memory");
+        if (ret != Z_OK)
+            throw(EINVAL, "internal error");
+        inflate_blocks(&strm);
+        (void)inflateEnd(&strm);
+    }
+    catch (err) {
+        THREADABORT(err);
+    }
+    Trace(("-- exited inflate thread"));
+}
+
+// Read the block index of a gzip stream whose deflate data starts at offset
+// head in the regular file g.ind of length size, and fill in inf_blk[] and
+// inf_num. Return the offset of the gzip trailer, or 0 if there's no usable
+// index.
+local length_t get_index(length_t head, length_t size) {
+    unsigned char tail[IXTAIL], *ix, *p, *end;
+    length_t len, num, at;
+    size_t sub;
+    long n;
+
+    // get and check the index, from which any parallel decoding would follow
+    if (size < head + IXTAIL + 8 ||
+        pread(g.ind, tail, IXTAIL, (off_t)(size - IXTAIL)) != IXTAIL ||
+        !index_tail(tail, &len, &num) || num == 0 || num > LONG_MAX / 2 ||
+        len > size - head - 8 || num > (len - IXTAIL) >> 3)
+        return 0;
+    len -= IXTAIL;
+    ix = alloc(NULL, len + 1);
+    if (pread(g.ind, ix, len, (off_t)(size - IXTAIL - len)) != (ssize_t)len) {
+        free(ix);
+        return 0;
+    }
+    inf_blk = alloc(NULL, num * sizeof(struct iblock));
+    inf_num = 0;
+    at = head;
+    p = ix;
+    end = ix + len;
+    while (p < end) {
+        // check the member header with the PX subfield, the entries, the
+        // empty deflate data, and the trailer
+        if (end - p < 26 || p[0] != 31 || p[1] != 139 || p[2] != 8 ||
+            p[3] != 4 || p[12] != 'P' || p[13] != 'X' ||
+            (sub = PULL2L(p + 14)) != PULL2L(p + 10) - 4 || (sub & 7) ||
+            (size_t)(end - p) < 26 + sub ||
+            (length_t)inf_num + (sub >> 3) > num ||
+            memcmp(p + 16 + sub, "\3\0\0\0\0\0\0\0\0\0", 10))
+            break;
+        for (p += 16, n = 0; n < (long)(sub >> 3); n++, p += 8) {
+            inf_blk[inf_num].off = at;
+            inf_blk[inf_num].clen = PULL4L(p);
+            inf_blk[inf_num].ulen = PULL4L(p + 4);
+            inf_blk[inf_num].out = NULL;
+            inf_blk[inf_num].bad = 0;
+            inf_blk[inf_num].done = 0;
+            if (inf_blk[inf_num].ulen > (1UL << 29) + DICT)
+                break;                      // more than pigz would make
+            at += inf_blk[inf_num++].clen;
+        }
+        if (n < (long)(sub >> 3))
+            break;
+        p += 10;
+    }
+    free(ix);
+
+    // the blocks must cover the deflate data exactly
+    if (p != end || (length_t)inf_num != num || at + 8 + IXTAIL + len != size) {
+        RELEASE(inf_blk);
+        return 0;
+    }
+    return at;
+}
+
+// If g.ind is a regular file that ends with a block index, and if there are
+// threads to spare, then inflate the blocks in parallel, write them in order,
+// and check the trailer of the gzip stream. Return true if done, false if
+// infchk() should inflate the input serially as usual.
+local int parallel_infchk(void) {
+    struct stat st;
+    length_t at;
+    long n, k, procs;
+    unsigned char tail[8];
+    struct iblock *blk;
+    thread **inf;
+
+    // see if there's an index to use
+    if (g.procs < 2 || g.form != 0 || g.list || g.ind == 0 ||
+        fstat(g.ind, &st) || (st.st_mode & S_IFMT) != S_IFREG ||
+        (at = get_index(g.in_tot - g.in_left, (length_t)st.st_size)) == 0)
+        return 0;
+    Trace(("-- inflating %ld indexed blocks in parallel", inf_num));
+
+    // launch the inflate threads
+    inf_next = new_lock(0);
+    inf_done = new_lock(0);
+    inf_room = new_lock(0);
+    procs = g.procs < inf_num ? g.procs : inf_num;
+    inf = alloc(NULL, procs * sizeof(thread *));
+    for (k = 0; k < procs; k++)
+        inf[k] = launch(inflate_thread, NULL);
+
+    // write and check the blocks in order as they are inflated
+    g.out_tot = 0;
+    g.out_check = CHECK(0L, Z_NULL, 0);
+    for (n = 0; n < inf_num; n++) {
+        blk = inf_blk + n;
+        possess(inf_done);
+        while (!blk->done)
+            wait_for(inf_done, TO_BE_MORE_THAN, peek_lock(inf_done));
+        release(inf_done);
+        if (blk->bad)
+            break;
+        if (g.decode == 1)
+            writen(g.outd, blk->out, blk->ulen);
+        g.out_tot += blk->ulen;
+        g.out_check = COMB(g.out_check, blk->check, blk->ulen);
+        RELEASE(blk->out);
+        possess(inf_room);
+        twist(inf_room, BY, +1);
+    }
+
+    // stop and join the inflate threads -- the read thread for the serial
+    // input may still be running, so join them one by one
+    possess(inf_next);
+    twist(inf_next, TO, inf_num);
+    possess(inf_room);
+    twist(inf_room, TO, inf_num);
+    for (k = 0; k < procs; k++)
+        join(inf[k]);
+    free(inf);
+    free_lock(inf_room);
+    free_lock(inf_done);
+    free_lock(inf_next);
+    for (k = 0; k < inf_num; k++)
+        free(inf_blk[k].out);
+    RELEASE(inf_blk);
+    if (n < inf_num)
+        throw(EDOM, "%s: corrupted -- invalid deflate data in block %ld",
+              g.inf, n);
+
+    // check the gzip trailer
+    if (pread(g.ind, tail, 8, (off_t)at) != 8)
+        throw(EDOM, "%s: corrupted -- missing trailer", g.inf);
+    if (PULL4L(tail) != g.out_check)
+        throw(EDOM, "%s: corrupted -- crc32 mismatch", g.inf);
+    if (PULL4L(tail + 4) != (g.out_tot & LOW32))
+        throw(EDOM, "%s: corrupted -- length mismatch", g.inf);
+    return 1;
+}
+#endif
+
 // Inflate for decompression or testing. Decompress from ind to outd unless
 // decode != 1, in which case just test ind, and then also list if list != 0;
 // look for and decode multiple, concatenated gzip and/or zlib streams; read
@@ -3249,6 +3812,12 @@ local void infchk(void) {
     unsigned long tmp4;
     length_t clen;
 
+#ifndef NOTHREAD
+    // inflate indexed input in parallel (see the --index option)
+    if (parallel_infchk())
+        return;
+#endif
+
     cont = 0;
     do {
         // header already read -- set up for decompression
@@ -3927,12 +4496,15 @@ local void process(char *path) {
             }
         }
     }
+    else {
+        g.ixlen = 0;
 #ifndef NOTHREAD
-    else if (g.procs > 1)
-        parallel_compress();
+        if (g.procs > 1)
+            parallel_compress();
+        else
 #endif
-    else
-        single_compress(0);
+            single_compress(0);
+    }
     if (g.verbosity > 1) {
         putc('\n', stderr);
         fflush(stderr);
@@ -3975,6 +4547,7 @@ local char *helptext[] = {
 #endif
 "  --fast, --best       Compression levels 1 and 9 respectively",
 "  -b, --blocksize mmm  Set compression block size to mmmK (default 128K)",
+"  -B, --bgzf           Compress to BGZF blocks of lines, as bgzip does",
 "  -c, --stdout         Write all processed output to stdout (won't delete)",
 "  -d, --decompress     Decompress the compressed input",
 "  -f, --force          Force overwrite, compress .gz, links, and to terminal",
@@ -3983,6 +4556,7 @@ local char *helptext[] = {
 #endif
 "  -h, --help           Display a help screen and quit",
 "  -i, --independent    Compress blocks independently for damage recovery",
+"  -X, --index          Same as -i, and append an index for parallel inflation",
 #ifndef NOZOPFLI
 "  -I, --iterations n   Number of iterations for -11 optimization",
 "  -J, --maxsplits n    Maximum number of split blocks for -11",
@@ -4073,6 +4647,8 @@ local void defaults(void) {
     g.block = 131072UL;             // 128K
     g.rsync = 0;                    // don't do rsync blocking
     g.setdict = 1;                  // initialize dictionary each thread
+    g.index = 0;                    // don't append a block index
+    g.bgzf = 0;                     // don't write BGZF blocks
     g.verbosity = 1;                // normal message level
     g.headis = 3;                   // store name and time (low bits == 11),
                                     // restore neither (next bits == 00),
@@ -4091,11 +4667,11 @@ local void defaults(void) {
 // Long options conversion to short options.
 local char *longopts[][2] = {
     {"LZW", "Z"}, {"lzw", "Z"}, {"ascii", "a"}, {"best", "9"}, {"bits", "Z"},
-    {"blocksize", "b"}, {"decompress", "d"}, {"fast", "1"}, {"force", "f"},
+    {"bgzf", "B"}, {"blocksize", "b"}, {"decompress", "d"}, {"fast", "1"}, {"force", "f"},
 #ifndef NOZOPFLI
     {"first", "F"}, {"iterations", "I"}, {"maxsplits", "J"}, {"oneblock", "O"},
 #endif
-    {"help", "h"}, {"independent", "i"}, {"keep", "k"}, {"license", "L"},
+    {"help", "h"}, {"independent", "i"}, {"index", "X"}, {"keep", "k"}, {"license", "L"},
     {"list", "l"}, {"name", "N"}, {"no-name", "n"}, {"no-time", "m"},
     {"processes", "p"}, {"quiet", "q"}, {"recursive", "r"}, {"rsyncable", "R"},
     {"silent", "q"}, {"stdout", "c"}, {"suffix", "S"}, {"synchronous", "Y"},
@@ -4192,7 +4768,7 @@ local int option(char *arg) {
             case 'I':  get = 4;  break;
             case 'J':  get = 5;  break;
 #endif
-            case 'K':  g.form = 2;  g.sufx = ".zip";  break;
+            case 'K':  g.form = 2;  g.sufx = ".zip";  g.bgzf = 0;  break;
             case 'L':
                 fputs(VERSION, stderr);
                 fputs("Copyright (C) 2007-2017 Mark Adler\n", stderr);
@@ -4213,6 +4789,7 @@ local int option(char *arg) {
                 if (g.verbosity > 1)
                     fprintf(stderr, "zlib %s\n", zlibVersion());
                 exit(0);
+            case 'X':  g.index = 1;  g.setdict = 0;  g.bgzf = 0;  break;
             case 'Y':  g.sync = 1;  break;
             case 'Z':
                 throw(EINVAL, "invalid option: LZW output not supported: %s",
@@ -4220,6 +4797,9 @@ local int option(char *arg) {
             case 'a':
                 throw(EINVAL, "invalid option: no ascii conversion: %s",
                       bad);
+            case 'B':
+                g.bgzf = 1;  g.form = 0;  g.sufx = ".gz";  g.index = 0;
+                break;
             case 'b':  get = 1;  break;
             case 'c':  g.pipeout = 1;  break;
             case 'd':  if (!g.decode) g.headis >>= 2;  g.decode = 1;  break;
@@ -4236,7 +4816,7 @@ local int option(char *arg) {
             case 'r':  g.recurse = 1;  break;
             case 't':  g.decode = 2;  break;
             case 'v':  g.verbosity++;  break;
-            case 'z':  g.form = 1;  g.sufx = ".zz";  break;
+            case 'z':  g.form = 1;  g.sufx = ".zz";  g.bgzf = 0;  break;
             default:
                 throw(EINVAL, "invalid option: %s", bad);
             }
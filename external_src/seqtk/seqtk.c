@@ -36,6 +36,7 @@
 #include <assert.h>
 #include <math.h>
 
+#include "kthread.h"
 #include "kseq.h"
 KSEQ_INIT(gzFile, gzread)
 
@@ -1343,41 +1344,311 @@ void stk_mask(kseq_t *seq, const khash_t(reg) *h, int is_complement, int mask_ch
 	}
 }
 
+typedef struct {
+	int qual_thres, flag, qual_shift, mask_chr, max_q, fake_qual;
+	const khash_t(reg) *h;
+} stk_seqopt_t;
+
+static int stk_seq_trans(kseq_t *seq, const stk_seqopt_t *o) // transform one sequence in place; return 0 if it is to be dropped
+{
+	int flag = o->flag, mask_chr = o->mask_chr;
+	unsigned i;
+	if (flag & 512) { // option -S: squeeze out white spaces
+		int k;
+		if (seq->qual.l) {
+			for (i = k = 0; i < seq->seq.l; ++i)
+				if (!isspace(seq->seq.s[i]))
+					seq->qual.s[k++] = seq->qual.s[i];
+			seq->qual.l = k, seq->qual.s[k] = 0;
+		}
+		for (i = k = 0; i < seq->seq.l; ++i)
+			if (!isspace(seq->seq.s[i]))
+				seq->seq.s[k++] = seq->seq.s[i];
+		seq->seq.l = k, seq->seq.s[k] = 0;
+	}
+	if (seq->qual.l && o->qual_thres > o->qual_shift) {
+		if (mask_chr) {
+			for (i = 0; i < seq->seq.l; ++i)
+				if (seq->qual.s[i] < o->qual_thres || seq->qual.s[i] > o->max_q)
+					seq->seq.s[i] = mask_chr;
+		} else {
+			for (i = 0; i < seq->seq.l; ++i)
+				if (seq->qual.s[i] < o->qual_thres || seq->qual.s[i] > o->max_q)
+					seq->seq.s[i] = tolower(seq->seq.s[i]);
+		}
+	}
+	if (flag & 256) // option -U: convert to uppercases
+		for (i = 0; i < seq->seq.l; ++i)
+			seq->seq.s[i] = toupper(seq->seq.s[i]);
+	else if ((flag & 1024) && mask_chr > 0)
+		for (i = 0; i < seq->seq.l; ++i)
+			seq->seq.s[i] = islower(seq->seq.s[i])? mask_chr : seq->seq.s[i];
+	if (flag & 1) seq->qual.l = 0; // option -a: fastq -> fasta
+	else if (o->fake_qual >= 33 && o->fake_qual <= 127) {
+		if (seq->qual.m < seq->seq.m) {
+			seq->qual.m = seq->seq.m;
+			seq->qual.s = (char*)realloc(seq->qual.s, seq->qual.m);
+		}
+		seq->qual.l = seq->seq.l;
+		memset(seq->qual.s, o->fake_qual, seq->qual.l);
+		seq->qual.s[seq->qual.l] = 0;
+	}
+	if (flag & 2) seq->comment.l = 0; // option -C: drop fasta/q comments
+	if (o->h) stk_mask(seq, o->h, flag&8, mask_chr); // masking
+	if (flag & 4) { // option -r: reverse complement
+		int c0, c1;
+		for (i = 0; i < seq->seq.l>>1; ++i) { // reverse complement sequence
+			c0 = comp_tab[(int)seq->seq.s[i]];
+			c1 = comp_tab[(int)seq->seq.s[seq->seq.l - 1 - i]];
+			seq->seq.s[i] = c1;
+			seq->seq.s[seq->seq.l - 1 - i] = c0;
+		}
+		if (seq->seq.l & 1) // complement the remaining base
+			seq->seq.s[seq->seq.l>>1] = comp_tab[(int)seq->seq.s[seq->seq.l>>1]];
+		if (seq->qual.l) {
+			for (i = 0; i < seq->seq.l>>1; ++i) // reverse quality
+				c0 = seq->qual.s[i], seq->qual.s[i] = seq->qual.s[seq->qual.l - 1 - i], seq->qual.s[seq->qual.l - 1 - i] = c0;
+		}
+	}
+	if ((flag & 64) && seq->qual.l && o->qual_shift != 33)
+		for (i = 0; i < seq->qual.l; ++i)
+			seq->qual.s[i] -= o->qual_shift - 33;
+	if (flag & 128) { // option -N: drop sequences containing ambiguous bases - Note: this is the last step!
+		for (i = 0; i < seq->seq.l; ++i)
+			if (seq_nt16to4_table[seq_nt16_table[(int)seq->seq.s[i]]] > 3) break;
+		if (i < seq->seq.l) return 0;
+	}
+	return 1;
+}
+
+static inline void stk_kputsn(kstring_t *s, const char *p, size_t l)
+{
+	if (s->l + l + 1 > s->m) {
+		s->m = s->l + l + 1;
+		kroundup32(s->m);
+		s->s = (char*)realloc(s->s, s->m);
+	}
+	memcpy(s->s + s->l, p, l);
+	s->l += l;
+	s->s[s->l] = 0;
+}
+
+static void stk_sprintstr(kstring_t *out, const kstring_t *s, unsigned line_len) // same as stk_printstr(), to a string
+{
+	size_t i;
+	if (line_len != UINT_MAX && line_len != 0) {
+		for (i = 0; i < s->l; i += line_len) {
+			stk_kputsn(out, "\n", 1);
+			stk_kputsn(out, s->s + i, s->l - i > line_len? line_len : s->l - i);
+		}
+		stk_kputsn(out, "\n", 1);
+	} else {
+		stk_kputsn(out, "\n", 1);
+		stk_kputsn(out, s->s, s->l);
+		stk_kputsn(out, "\n", 1);
+	}
+}
+
+static void stk_sprintseq(kstring_t *out, const kseq_t *s, unsigned line_len) // same as stk_printseq(), to a string
+{
+	stk_kputsn(out, s->qual.l? "@" : ">", 1);
+	stk_kputsn(out, s->name.s, s->name.l);
+	if (s->comment.l) {
+		stk_kputsn(out, " ", 1);
+		stk_kputsn(out, s->comment.s, s->comment.l);
+	}
+	stk_sprintstr(out, &s->seq, line_len);
+	if (s->qual.l) {
+		stk_kputsn(out, "+", 1);
+		stk_sprintstr(out, &s->qual, line_len);
+	}
+}
+
+static void stk_gzip(kstring_t *out, const kstring_t *in, int level) // compress in as a gzip member to out
+{
+	z_stream z;
+	memset(&z, 0, sizeof(z_stream));
+	deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+	out->l = deflateBound(&z, in->l);
+	if (out->l + 1 > out->m) {
+		out->m = out->l + 1;
+		kroundup32(out->m);
+		out->s = (char*)realloc(out->s, out->m);
+	}
+	z.next_in = (Bytef*)in->s, z.avail_in = in->l;
+	z.next_out = (Bytef*)out->s, z.avail_out = out->l;
+	deflate(&z, Z_FINISH);
+	out->l = z.total_out;
+	deflateEnd(&z);
+}
+
+/*
+ * seq runs as a three-step pipeline when it has threads (-t): one thread reads
+ * a batch of sequences and applies the filters that depend on their order (-L,
+ * -f, -1 and -2), the worker threads transform and format ranges of the batch
+ * and, with -z, compress each range to a gzip member, and the batches are
+ * written in order. Concatenated gzip members form a valid gzip file.
+ */
+
+#define STK_SEQ_BATCH 0x1000000 // bases per batch
+
+typedef struct {
+	int n_threads, level; // level < 0 for no compression
+	unsigned line_len;
+	int min_len;
+	double frac;
+	int64_t n_seqs, n_out;
+	kseq_t *ks;
+	krand_t *kr;
+	const stk_seqopt_t *opt;
+	FILE *fp;
+} stk_seqpl_t;
+
+typedef struct {
+	const stk_seqpl_t *p;
+	int n, m, n_chunk;
+	kseq_t *a;
+	int *chunk; // the first sequence of each range
+	kstring_t *out, *tmp;
+} stk_seqstep_t;
+
+static void stk_seq_worker(void *data, long i, int tid)
+{
+	stk_seqstep_t *s = (stk_seqstep_t*)data;
+	const stk_seqpl_t *p = s->p;
+	int j;
+	s->out[i].l = 0;
+	for (j = s->chunk[i]; j < s->chunk[i+1]; ++j)
+		if (stk_seq_trans(&s->a[j], p->opt))
+			stk_sprintseq(&s->out[i], &s->a[j], p->line_len);
+	if (p->level >= 0 && s->out[i].l > 0) {
+		kstring_t t = s->out[i];
+		s->out[i] = s->tmp[i], s->tmp[i] = t;
+		stk_gzip(&s->out[i], &s->tmp[i], p->level);
+	}
+}
+
+static void stk_seqstep_destroy(stk_seqstep_t *s)
+{
+	int i;
+	for (i = 0; i < s->m; ++i) {
+		free(s->a[i].name.s); free(s->a[i].comment.s);
+		free(s->a[i].seq.s); free(s->a[i].qual.s);
+	}
+	for (i = 0; i < s->n_chunk; ++i) {
+		free(s->out[i].s); free(s->tmp[i].s);
+	}
+	free(s->a); free(s->chunk); free(s->out); free(s->tmp);
+	free(s);
+}
+
+static void *stk_seq_pipeline(void *shared, int step, void *in)
+{
+	stk_seqpl_t *p = (stk_seqpl_t*)shared;
+	if (step == 0) { // read a batch, applying the filters that depend on the order
+		stk_seqstep_t *s;
+		int64_t l = 0;
+		kseq_t *seq = p->ks;
+		s = (stk_seqstep_t*)calloc(1, sizeof(stk_seqstep_t));
+		s->p = p;
+		while (l < STK_SEQ_BATCH && kseq_read(seq) >= 0) {
+			kseq_t *r;
+			++p->n_seqs;
+			if (seq->seq.l < p->min_len) continue; // NB: length filter before taking random
+			if (p->frac < 1. && kr_drand(p->kr) >= p->frac) continue;
+			if (p->opt->flag & 48) { // then choose odd/even reads only
+				if ((p->opt->flag&16) && (p->n_seqs&1) == 0) continue;
+				if ((p->opt->flag&32) && (p->n_seqs&1) == 1) continue;
+			}
+			if (s->n == s->m) {
+				s->m = s->m? s->m<<1 : 256;
+				s->a = (kseq_t*)realloc(s->a, s->m * sizeof(kseq_t));
+				memset(&s->a[s->n], 0, (s->m - s->n) * sizeof(kseq_t));
+			}
+			r = &s->a[s->n++];
+			r->name.l = r->comment.l = r->seq.l = r->qual.l = 0;
+			cpy_kseq(r, seq);
+			if (r->seq.s == 0) r->seq.m = 1, r->seq.s = (char*)calloc(1, 1); // empty sequence
+			l += seq->seq.l;
+		}
+		if (s->n == 0) {
+			stk_seqstep_destroy(s);
+			return 0;
+		}
+		return s;
+	} else if (step == 1) { // transform, format and compress ranges of about the same number of bases
+		stk_seqstep_t *s = (stk_seqstep_t*)in;
+		int64_t l = 0, sum = 0;
+		int i, k;
+		for (i = 0; i < s->n; ++i) sum += s->a[i].seq.l;
+		s->n_chunk = p->n_threads * 4 < s->n? p->n_threads * 4 : s->n;
+		s->chunk = (int*)calloc(s->n_chunk + 1, sizeof(int));
+		s->out = (kstring_t*)calloc(s->n_chunk, sizeof(kstring_t));
+		s->tmp = (kstring_t*)calloc(s->n_chunk, sizeof(kstring_t));
+		for (i = 0, k = 1; i < s->n && k < s->n_chunk; ++i) {
+			l += s->a[i].seq.l;
+			if (l * s->n_chunk >= sum * k && i + 1 > s->chunk[k-1]) s->chunk[k++] = i + 1;
+		}
+		for (; k <= s->n_chunk; ++k) s->chunk[k] = s->n;
+		kt_for(p->n_threads, stk_seq_worker, s, s->n_chunk);
+		return s;
+	} else if (step == 2) { // write in order
+		stk_seqstep_t *s = (stk_seqstep_t*)in;
+		int i;
+		for (i = 0; i < s->n_chunk; ++i)
+			if (s->out[i].l > 0) {
+				if (fwrite(s->out[i].s, 1, s->out[i].l, p->fp) != s->out[i].l) {
+					fprintf(stderr, "[E::%s] failed to write the output.\n", __func__);
+					exit(1);
+				}
+				p->n_out += s->out[i].l;
+			}
+		stk_seqstep_destroy(s);
+	}
+	return 0;
+}
+
 int stk_seq(int argc, char *argv[])
 {
 	gzFile fp;
-	kseq_t *seq;
-	int c, qual_thres = 0, flag = 0, qual_shift = 33, mask_chr = 0, min_len = 0, max_q = 255, fake_qual = -1;
-	unsigned i, line_len = 0;
-	int64_t n_seqs = 0;
+	int c, min_len = 0, n_threads = 1, level = -1, ret = 0;
+	unsigned line_len = 0;
 	double frac = 1.;
+	char *fn_out = 0;
 	khash_t(reg) *h = 0;
 	krand_t *kr = 0;
+	stk_seqopt_t opt;
+	stk_seqpl_t pl;
 
-	while ((c = getopt(argc, argv, "N12q:l:Q:aACrn:s:f:M:L:cVUX:SF:x")) >= 0) {
+	memset(&opt, 0, sizeof(stk_seqopt_t));
+	opt.qual_shift = 33, opt.max_q = 255, opt.fake_qual = -1;
+	while ((c = getopt(argc, argv, "N12q:l:Q:aACrn:s:f:M:L:cVUX:SF:xt:o:z")) >= 0) {
 		switch (c) {
 			case 'a':
-			case 'A': flag |= 1; break;
-			case 'C': flag |= 2; break;
-			case 'r': flag |= 4; break;
-			case 'c': flag |= 8; break;
-			case '1': flag |= 16; break;
-			case '2': flag |= 32; break;
-			case 'V': flag |= 64; break;
-			case 'N': flag |= 128; break;
-			case 'U': flag |= 256; break;
-			case 'S': flag |= 512; break;
-			case 'x': flag |= 1024; break;
+			case 'A': opt.flag |= 1; break;
+			case 'C': opt.flag |= 2; break;
+			case 'r': opt.flag |= 4; break;
+			case 'c': opt.flag |= 8; break;
+			case '1': opt.flag |= 16; break;
+			case '2': opt.flag |= 32; break;
+			case 'V': opt.flag |= 64; break;
+			case 'N': opt.flag |= 128; break;
+			case 'U': opt.flag |= 256; break;
+			case 'S': opt.flag |= 512; break;
+			case 'x': opt.flag |= 1024; break;
 			case 'M': h = stk_reg_read(optarg); break;
-			case 'n': mask_chr = *optarg; break;
-			case 'Q': qual_shift = atoi(optarg); break;
-			case 'q': qual_thres = atoi(optarg); break;
-			case 'X': max_q = atoi(optarg); break;
+			case 'n': opt.mask_chr = *optarg; break;
+			case 'Q': opt.qual_shift = atoi(optarg); break;
+			case 'q': opt.qual_thres = atoi(optarg); break;
+			case 'X': opt.max_q = atoi(optarg); break;
 			case 'l': line_len = atoi(optarg); break;
 			case 'L': min_len = atoi(optarg); break;
 			case 's': kr = kr_srand(atol(optarg)); break;
 			case 'f': frac = atof(optarg); break;
-			case 'F': fake_qual = *optarg; break;
+			case 'F': opt.fake_qual = *optarg; break;
+			case 't': n_threads = atoi(optarg); break;
+			case 'o': fn_out = optarg; break;
+			case 'z': level = 6; break; // the default of gzip
 		}
 	}
 	if (kr == 0) kr = kr_srand(11);
@@ -1388,12 +1659,15 @@ int stk_seq(int argc, char *argv[])
 		fprintf(stderr, "         -X INT    mask bases with quality higher than INT [255]\n");
 		fprintf(stderr, "         -n CHAR   masked bases converted to CHAR; 0 for lowercase [0]\n");
 		fprintf(stderr, "         -l INT    number of residues per line; 0 for 2^32-1 [%d]\n", line_len);
-		fprintf(stderr, "         -Q INT    quality shift: ASCII-INT gives base quality [%d]\n", qual_shift);
+		fprintf(stderr, "         -Q INT    quality shift: ASCII-INT gives base quality [%d]\n", opt.qual_shift);
 		fprintf(stderr, "         -s INT    random seed (effective with -f) [11]\n");
 		fprintf(stderr, "         -f FLOAT  sample FLOAT fraction of sequences [1]\n");
 		fprintf(stderr, "         -M FILE   mask regions in BED or name list FILE [null]\n");
 		fprintf(stderr, "         -L INT    drop sequences with length shorter than INT [0]\n");
 		fprintf(stderr, "         -F CHAR   fake FASTQ quality []\n");
+		fprintf(stderr, "         -t INT    number of threads [%d]\n", n_threads);
+		fprintf(stderr, "         -o FILE   output file [stdout]\n");
+		fprintf(stderr, "         -z        gzip the output\n");
 		fprintf(stderr, "         -c        mask complement region (effective with -M)\n");
 		fprintf(stderr, "         -r        reverse complement\n");
 		fprintf(stderr, "         -A        force FASTA output (discard quality)\n");
@@ -1410,93 +1684,40 @@ int stk_seq(int argc, char *argv[])
 		return 1;
 	}
 	if (line_len == 0) line_len = UINT_MAX;
+	if (n_threads < 1) n_threads = 1;
 	fp = optind < argc && strcmp(argv[optind], "-")? gzopen(argv[optind], "r") : gzdopen(fileno(stdin), "r");
 	if (fp == 0) {
 		fprintf(stderr, "[E::%s] failed to open the input file/stream.\n", __func__);
 		return 1;
 	}
-	seq = kseq_init(fp);
-	qual_thres += qual_shift;
-	while (kseq_read(seq) >= 0) {
-		++n_seqs;
-		if (seq->seq.l < min_len) continue; // NB: length filter before taking random
-		if (frac < 1. && kr_drand(kr) >= frac) continue;
-		if (flag & 48) { // then choose odd/even reads only
-			if ((flag&16) && (n_seqs&1) == 0) continue;
-			if ((flag&32) && (n_seqs&1) == 1) continue;
-		}
-		if (flag & 512) { // option -S: squeeze out white spaces
-			int k;
-			if (seq->qual.l) {
-				for (i = k = 0; i < seq->seq.l; ++i)
-					if (!isspace(seq->seq.s[i]))
-						seq->qual.s[k++] = seq->qual.s[i];
-				seq->qual.l = k;
-			}
-			for (i = k = 0; i < seq->seq.l; ++i)
-				if (!isspace(seq->seq.s[i]))
-					seq->seq.s[k++] = seq->seq.s[i];
-			seq->seq.l = k;
-		}
-		if (seq->qual.l && qual_thres > qual_shift) {
-			if (mask_chr) {
-				for (i = 0; i < seq->seq.l; ++i)
-					if (seq->qual.s[i] < qual_thres || seq->qual.s[i] > max_q)
-						seq->seq.s[i] = mask_chr;
-			} else {
-				for (i = 0; i < seq->seq.l; ++i)
-					if (seq->qual.s[i] < qual_thres || seq->qual.s[i] > max_q)
-						seq->seq.s[i] = tolower(seq->seq.s[i]);
-			}
-		}
-		if (flag & 256) // option -U: convert to uppercases
-			for (i = 0; i < seq->seq.l; ++i)
-				seq->seq.s[i] = toupper(seq->seq.s[i]);
-		else if ((flag & 1024) && mask_chr > 0)
-			for (i = 0; i < seq->seq.l; ++i)
-				seq->seq.s[i] = islower(seq->seq.s[i])? mask_chr : seq->seq.s[i];
-		if (flag & 1) seq->qual.l = 0; // option -a: fastq -> fasta
-		else if (fake_qual >= 33 && fake_qual <= 127) {
-			if (seq->qual.m < seq->seq.m) {
-				seq->qual.m = seq->seq.m;
-				seq->qual.s = (char*)realloc(seq->qual.s, seq->qual.m);
-			}
-			seq->qual.l = seq->seq.l;
-			memset(seq->qual.s, fake_qual, seq->qual.l);
-			seq->qual.s[seq->qual.l] = 0;
-		}
-		if (flag & 2) seq->comment.l = 0; // option -C: drop fasta/q comments
-		if (h) stk_mask(seq, h, flag&8, mask_chr); // masking
-		if (flag & 4) { // option -r: reverse complement
-			int c0, c1;
-			for (i = 0; i < seq->seq.l>>1; ++i) { // reverse complement sequence
-				c0 = comp_tab[(int)seq->seq.s[i]];
-				c1 = comp_tab[(int)seq->seq.s[seq->seq.l - 1 - i]];
-				seq->seq.s[i] = c1;
-				seq->seq.s[seq->seq.l - 1 - i] = c0;
-			}
-			if (seq->seq.l & 1) // complement the remaining base
-				seq->seq.s[seq->seq.l>>1] = comp_tab[(int)seq->seq.s[seq->seq.l>>1]];
-			if (seq->qual.l) {
-				for (i = 0; i < seq->seq.l>>1; ++i) // reverse quality
-					c0 = seq->qual.s[i], seq->qual.s[i] = seq->qual.s[seq->qual.l - 1 - i], seq->qual.s[seq->qual.l - 1 - i] = c0;
-			}
-		}
-		if ((flag & 64) && seq->qual.l && qual_shift != 33)
-			for (i = 0; i < seq->qual.l; ++i)
-				seq->qual.s[i] -= qual_shift - 33;
-		if (flag & 128) { // option -N: drop sequences containing ambiguous bases - Note: this is the last step!
-			for (i = 0; i < seq->seq.l; ++i)
-				if (seq_nt16to4_table[seq_nt16_table[(int)seq->seq.s[i]]] > 3) break;
-			if (i < seq->seq.l) continue;
-		}
-		stk_printseq(stdout, seq, line_len);
+	memset(&pl, 0, sizeof(stk_seqpl_t));
+	pl.fp = fn_out && strcmp(fn_out, "-")? fopen(fn_out, "wb") : stdout;
+	if (pl.fp == 0) {
+		fprintf(stderr, "[E::%s] failed to open the output file '%s'.\n", __func__, fn_out);
+		gzclose(fp);
+		return 1;
 	}
-	kseq_destroy(seq);
+	opt.qual_thres += opt.qual_shift;
+	opt.h = h;
+	pl.n_threads = n_threads, pl.level = level, pl.line_len = line_len;
+	pl.min_len = min_len, pl.frac = frac, pl.kr = kr, pl.opt = &opt;
+	pl.ks = kseq_init(fp);
+	kt_pipeline(n_threads > 1? 2 : 1, stk_seq_pipeline, &pl, 3);
+	if (level >= 0 && pl.n_out == 0) { // still a valid gzip file
+		kstring_t in = {0,0,0}, out = {0,0,0};
+		stk_gzip(&out, &in, level);
+		fwrite(out.s, 1, out.l, pl.fp);
+		free(out.s);
+	}
+	kseq_destroy(pl.ks);
 	gzclose(fp);
+	if (pl.fp != stdout && fclose(pl.fp) != 0) {
+		fprintf(stderr, "[E::%s] failed to write the output file '%s'.\n", __func__, fn_out);
+		ret = 1;
+	}
 	stk_reg_destroy(h);
 	free(kr);
-	return 0;
+	return ret;
 }
 
 int stk_gc(int argc, char *argv[])
@@ -6,9 +6,15 @@ from datetime import datetime
 import argparse
 import glob
 import subprocess
+import hashlib
+import shutil
 
 TimeFormat = '%m/%d/%Y %H:%M:%S'
 
+sv_shard_padding = 1000000 # alignments within this distance of a shard region are given to its SV callers
+
+combined_aligner_name = 'minimap2+winnowmap' # minimap2 and winnowmap sharing one decoded input stream
+
 class Setting:
     def __init__(self, nextsv_root_dir):
 
@@ -21,6 +27,8 @@ class Setting:
         self.meryl                     = os.path.join(self.root_dir, 'bin/meryl')
         self.winnowmap                 = os.path.join(self.root_dir, 'bin/winnowmap')
         self.check_bam_and_remove_file = os.path.join(self.root_dir, 'bin/check_bam_and_remove_file.py')
+        self.run_stages                = os.path.join(self.root_dir, 'bin/run_stages.py')
+        self.sv_scatter_gather         = os.path.join(self.root_dir, 'bin/sv_scatter_gather.py')
 
         ## required arguments
         self.in_dir      = None
@@ -36,6 +44,13 @@ class Setting:
         self.sniffles  = ''
         self.cuteSV    = ''
         self.threads   = 4
+        self.memory    = 0
+        self.sv_shards = 1
+        self.index_cache_dir = ''
+        self.index_socket_dir = ''
+        self.reference_md5   = None
+        self.stream_reads     = False
+        self.keep_clean_reads = False
 
         self.input_fastq_list = []
         self.input_fasta_list = []
@@ -58,12 +73,38 @@ class Setting:
         return os.path.join(self.bam_dir, f'{self.sample_name}.{aligner_name}.bam')
     def sorted_bam_file(self, aligner_name):
         return os.path.join(self.bam_dir, f'{self.sample_name}.{aligner_name}.sorted.bam')
+    def shared_input_aligners(self):
+        if 'minimap2' in self.aligner_list and 'winnowmap' in self.aligner_list:
+            return ['minimap2', 'winnowmap']
+        return []
+    def streamed_aligners(self):
+        if self.stream_reads == False:
+            return []
+        return [aligner for aligner in ['minimap2', 'winnowmap'] if aligner in self.aligner_list]
+    def clean_reads_fifo(self, aligner_name):
+        return os.path.join(self.bam_dir, f'{self.sample_name}.clean.fastq.fifo.{aligner_name}')
     def aligner_shell_file(self, aligner_name):
         return os.path.join(self.bam_dir, f'run_{aligner_name}.{self.sample_name}.sh')
+    def streamed_alignment_shell_file(self):
+        return os.path.join(self.bam_dir, f'run_streamed_alignment.{self.sample_name}.sh')
+    def clean_reads_qc_file(self):
+        return os.path.join(self.clean_reads_dir, f'{self.sample_name}_basic_info.txt')
+    def stage_table_file(self):
+        return os.path.join(self.out_dir, 'stages.tsv')
     def sv_detection_shell_file(self, aligner_name, svcaller_name):
         return os.path.join(self.sv_calls_dir, f'run_{svcaller_name}_for_{aligner_name}.{self.sample_name}.sh')
     def sv_vcf_file(self, aligner_name, svcaller_name):
         return os.path.join(self.sv_calls_dir, f'{self.sample_name}.{aligner_name}.{svcaller_name}.vcf')
+    def sv_shard_dir(self, aligner_name):
+        return os.path.join(self.sv_calls_dir, f'{self.sample_name}.{aligner_name}.shards')
+    def sv_shard_prefix(self, aligner_name, shard_idx):
+        return os.path.join(self.sv_shard_dir(aligner_name), f'shard_{shard_idx}')
+    def sv_scatter_shell_file(self, aligner_name):
+        return os.path.join(self.sv_calls_dir, f'run_sv_scatter_for_{aligner_name}.{self.sample_name}.sh')
+    def sv_shard_shell_file(self, aligner_name, shard_idx):
+        return os.path.join(self.sv_calls_dir, f'run_sv_calling_for_{aligner_name}.{shard_idx}.{self.sample_name}.sh')
+    def sv_gather_shell_file(self, aligner_name, svcaller_name):
+        return os.path.join(self.sv_calls_dir, f'run_{svcaller_name}_gather_for_{aligner_name}.{self.sample_name}.sh')
     
 def main():
 
@@ -80,7 +121,13 @@ def main():
     # optional
     parser.add_argument('-a', '--aligners',    required = True, metavar = 'aligners_to_use', type = str, default = 'minimap2', help = '(optional) which aligner(s) to use. Three supported aligners: minimap2, ngmlr, winnowmap. Use "+" to combine multiple aligners. Examples: minimap2+ngmlr, winnowmap+minimap2, minimap2+ngmlr+winnowmap, minimap2, ngmlr, winnowmap')
     
-    parser.add_argument('-t', '--threads',     required = False, metavar = 'INT',   type = int, default = 4,  help = '(optional) number of threads (default: 4)')
+    parser.add_argument('-t', '--threads',     required = False, metavar = 'INT',   type = int, default = 4,  help = '(optional) number of threads, shared by the stages that run at the same time (default: 4)')
+    parser.add_argument('-m', '--memory',      required = False, metavar = 'INT',   type = int, default = 0,  help = '(optional) memory in GB that the stages running at the same time may use (default: total memory of the node running work.sh)')
+    parser.add_argument('-c', '--index_cache', required = False, metavar = 'path/to/index_cache', type = str, default = '', help = '(optional) directory where reference indexes are built once and shared by all runs using the same reference (default: no cache)')
+    parser.add_argument('--index_socket', required = False, metavar = 'path/to/socket_dir', type = str, default = '', help = '(optional) directory with minimap2.sock and winnowmap.sock of index servers (started with --idx-serve on the same reference) that aligners attach to instead of loading the index (default: no server)')
+    parser.add_argument('--stream_reads', required = False, action = 'store_true', help = '(optional) stream clean reads from FASTA conversion and filtering into minimap2/winnowmap through FIFOs instead of writing and re-reading intermediate FASTQ files (default: off)')
+    parser.add_argument('--keep_clean_reads', required = False, action = 'store_true', help = '(optional) with --stream_reads, also write the compressed clean reads (always written if ngmlr is used) (default: off)')
+    parser.add_argument('--sv_shards', required = False, metavar = 'INT', type = int, default = 1, help = '(optional) split SV calling of each BAM into INT genomic regions with balanced read counts, called as separate stages and merged afterwards (default: 1, no split)')
     parser.add_argument('-e', '--conda_env',   required = False, metavar = 'conda_env',  type = str, default = '', help = '(optional) conda environment name (default: NULL)')
 
     parser.add_argument('--samtools', required = False, metavar = 'path/to/samtools',  type = str, default = 'samtools', help = '(optional) path to samtools (default: using environment default)')
@@ -128,7 +175,15 @@ def generate_scripts(input_args):
     settings.sniffles             = input_args.sniffles
     settings.cuteSV               = input_args.cuteSV
     settings.threads              = input_args.threads
+    settings.memory               = input_args.memory
+    settings.sv_shards            = max(1, input_args.sv_shards)
     settings.aligners             = input_args.aligners.strip()
+    settings.stream_reads         = input_args.stream_reads
+    settings.keep_clean_reads     = input_args.keep_clean_reads
+    if input_args.index_cache != '':
+        settings.index_cache_dir  = os.path.abspath(input_args.index_cache)
+    if input_args.index_socket != '':
+        settings.index_socket_dir = os.path.abspath(input_args.index_socket)
 
     settings.clean_reads_dir      = os.path.join(settings.out_dir, '1_clean_reads')
     settings.bam_dir              = os.path.join(settings.out_dir, '2_aligned_bam')
@@ -140,6 +195,8 @@ def generate_scripts(input_args):
         sys.exit(1)
 
     generate_aligner_list(settings)
+    if 'ngmlr' in settings.aligner_list:
+        settings.keep_clean_reads = True # ngmlr reads a file
     
     myprint('NOTICE: checking external tools')
     get_full_path_of_tools(settings)
@@ -150,6 +207,10 @@ def generate_scripts(input_args):
     os.makedirs(settings.bam_dir, exist_ok=True)
     os.makedirs(settings.sv_calls_dir, exist_ok=True)
 
+    if settings.index_cache_dir != '':
+        myprint(f'NOTICE: preparing the reference index cache: {settings.index_cache_dir}')
+        prepare_index_cache(settings)
+
     myprint('NOTICE: generating shell scripts')
 
     list_input_files(settings)
@@ -163,15 +224,23 @@ def generate_scripts(input_args):
         ngmlr_align(settings)
     if 'winnowmap' in settings.aligner_list:
         winnowmap_align(settings)
+    if settings.shared_input_aligners():
+        minimap2_winnowmap_align(settings)
         
     myprint(f'NOTICE: aligned bam files will be here: {settings.bam_dir}')
 
     for aligner in settings.aligner_list:
         sniffles_detection(settings, aligner)
         cuteSV_detection(settings, aligner)
+        if settings.sv_shards > 1:
+            sv_scatter_gather_detection(settings, aligner)
     
     myprint(f'NOTICE: SV calls will be here: {settings.sv_calls_dir}')
 
+    if settings.streamed_aligners():
+        streamed_alignment(settings)
+    write_stage_table(settings)
+
     work_sh_file = os.path.join(settings.out_dir, 'work.sh')
     work_sh_f = open(work_sh_file, 'w')
     work_sh_f.write('#!/bin/bash\n\n')
@@ -179,16 +248,7 @@ def generate_scripts(input_args):
         work_sh_f.write('eval \"$(conda shell.bash hook)\"\n')
         work_sh_f.write(f'conda activate {settings.conda_env}\n\n')
 
-    work_sh_f.write(f'sh {settings.get_clean_reads_sh_file}\n\n')
-
-    for aligner in settings.aligner_list:
-        aligner_shell_file = settings.aligner_shell_file(aligner)
-        work_sh_f.write(f'sh {aligner_shell_file}\n\n')
-
-        for sv_caller in ['sniffles', 'cuteSV']:
-            sv_detection_shell_file = settings.sv_detection_shell_file(aligner, sv_caller)
-            work_sh_f.write(f'sh {sv_detection_shell_file}\n\n')
-    
+    work_sh_f.write(f'{settings.run_stages} {settings.stage_table_file()} {settings.threads} {settings.memory} {settings.clean_reads_qc_file()}\n')
     work_sh_f.close()
     
     print('\n################################')
@@ -196,6 +256,96 @@ def generate_scripts(input_args):
 
     return
 
+# Thread and memory profile of each stage for bin/run_stages.py: the fewest and the
+# most threads worth giving it (0: no limit), and its memory in GB per Gb of
+# reference and per thread. The memory figures are rough estimates for long reads.
+stage_profile_dict = {
+    'clean_reads': (1, 4,  0,   0.5),
+    'minimap2':    (2, 0,  4,   0.5),
+    'winnowmap':   (2, 0,  6,   0.5),
+    'ngmlr':       (2, 0,  4,   1),
+    'sniffles':    (1, 16, 0.5, 0.5),
+    'cuteSV':      (1, 16, 0.5, 1),
+    'sv_scatter':  (1, 1,  0,   0.1),
+    'sv_gather':   (1, 1,  0,   0.5),
+}
+
+def stage_profile(settings:Setting, tool_name_list):
+
+    # a stage running several tools at once (streamed or shared-input alignment) adds up their needs
+    ref_size_gb = os.path.getsize(settings.ref_fasta) / 1e9
+    min_threads = sum([stage_profile_dict[tool_name][0] for tool_name in tool_name_list])
+    max_threads = sum([stage_profile_dict[tool_name][1] for tool_name in tool_name_list])
+    if 0 in [stage_profile_dict[tool_name][1] for tool_name in tool_name_list]:
+        max_threads = 0
+    memory_gb   = max(1.0, sum([stage_profile_dict[tool_name][2] for tool_name in tool_name_list]) * ref_size_gb)
+    memory_gb_per_thread = max([stage_profile_dict[tool_name][3] for tool_name in tool_name_list])
+
+    return [str(min_threads), str(max_threads), f'{memory_gb:.1f}', f'{memory_gb_per_thread:.1f}']
+
+def write_stage_table(settings:Setting):
+
+    # One line per stage, in the order of the former serial work.sh: a stage runs
+    # once the stages it depends on are done, and is skipped on a rerun if its
+    # outputs are unchanged since it last succeeded.
+    stage_list = []
+    alignment_stage_dict = {}
+
+    if settings.streamed_aligners():
+        clean_reads_stage = 'streamed_alignment'
+        output_list = [settings.clean_reads_qc_file()]
+        if settings.keep_clean_reads:
+            output_list.append(settings.clean_input_fastq)
+        for aligner in settings.streamed_aligners():
+            output_list += [settings.sorted_bam_file(aligner), settings.sorted_bam_file(aligner) + '.bai']
+            alignment_stage_dict[aligner] = clean_reads_stage
+        stage_list.append([clean_reads_stage, settings.streamed_alignment_shell_file(), [], output_list, ['clean_reads'] + settings.streamed_aligners()])
+    else:
+        clean_reads_stage = 'clean_reads'
+        output_list = [settings.clean_input_fastq, settings.clean_reads_qc_file()]
+        stage_list.append([clean_reads_stage, settings.get_clean_reads_sh_file, [], output_list, ['clean_reads']])
+        if settings.shared_input_aligners():
+            output_list = []
+            for aligner in settings.shared_input_aligners():
+                output_list += [settings.sorted_bam_file(aligner), settings.sorted_bam_file(aligner) + '.bai']
+                alignment_stage_dict[aligner] = combined_aligner_name
+            stage_list.append([combined_aligner_name, settings.aligner_shell_file(combined_aligner_name), [clean_reads_stage], output_list, settings.shared_input_aligners()])
+
+    for aligner in settings.aligner_list:
+        if aligner not in alignment_stage_dict:
+            output_list = [settings.sorted_bam_file(aligner), settings.sorted_bam_file(aligner) + '.bai']
+            alignment_stage_dict[aligner] = aligner
+            stage_list.append([aligner, settings.aligner_shell_file(aligner), [clean_reads_stage], output_list, [aligner]])
+
+    for aligner in settings.aligner_list:
+        if settings.sv_shards > 1:
+            scatter_stage = f'sv_scatter_for_{aligner}'
+            output_list = []
+            for shard_idx in range(0, settings.sv_shards):
+                shard_prefix = settings.sv_shard_prefix(aligner, shard_idx)
+                output_list += [f'{shard_prefix}.bed', f'{shard_prefix}.padded.bed']
+            stage_list.append([scatter_stage, settings.sv_scatter_shell_file(aligner), [alignment_stage_dict[aligner]], output_list, ['sv_scatter']])
+            shard_stage_list = []
+            for shard_idx in range(0, settings.sv_shards):
+                shard_prefix = settings.sv_shard_prefix(aligner, shard_idx)
+                shard_stage_list.append(f'sv_calling_for_{aligner}.{shard_idx}')
+                output_list = [f'{shard_prefix}.sniffles.vcf', f'{shard_prefix}.cuteSV.vcf']
+                stage_list.append([shard_stage_list[-1], settings.sv_shard_shell_file(aligner, shard_idx), [scatter_stage], output_list, ['sniffles', 'cuteSV']])
+            for sv_caller in ['sniffles', 'cuteSV']:
+                stage_list.append([f'{sv_caller}_for_{aligner}', settings.sv_gather_shell_file(aligner, sv_caller), shard_stage_list, [settings.sv_vcf_file(aligner, sv_caller)], ['sv_gather']])
+            continue
+        for sv_caller in ['sniffles', 'cuteSV']:
+            stage_list.append([f'{sv_caller}_for_{aligner}', settings.sv_detection_shell_file(aligner, sv_caller), [alignment_stage_dict[aligner]], [settings.sv_vcf_file(aligner, sv_caller)], [sv_caller]])
+
+    stage_table_f = open(settings.stage_table_file(), 'w')
+    stage_table_f.write('#name\tshell_file\tdependencies\toutputs\tmin_threads\tmax_threads\tmemory_gb\tmemory_gb_per_thread\n')
+    for name, shell_file, dependency_list, output_list, tool_name_list in stage_list:
+        fields = [name, shell_file, ','.join(dependency_list) if dependency_list else '.', ','.join(output_list)] + stage_profile(settings, tool_name_list)
+        stage_table_f.write('\t'.join(fields) + '\n')
+    stage_table_f.close()
+
+    return
+
 def get_full_path_of_tools(settings:Setting):
 
     tool_name = settings.minimap2
@@ -297,10 +447,244 @@ def list_input_files(settings:Setting):
     
     return
 
+def prepare_index_cache(settings:Setting):
+
+    # Cached indexes live in <cache>/<reference md5>/<tool>.<key>, where key covers
+    # the tool binary and the indexing parameters. The md5 of a reference is
+    # memoized by path, size and mtime, so it is only computed for a new or
+    # modified FASTA; entries of an older version of the same FASTA are removed.
+    os.makedirs(settings.index_cache_dir, exist_ok=True)
+    ref_path = os.path.realpath(settings.ref_fasta)
+    ref_stat = os.stat(ref_path)
+    ref_version = f'{ref_path}\t{ref_stat.st_size}\t{ref_stat.st_mtime_ns}'
+
+    md5_list_file = os.path.join(settings.index_cache_dir, 'reference_md5.tsv')
+    if os.path.exists(md5_list_file):
+        for line in open(md5_list_file):
+            fields = line.rstrip('\n').split('\t')
+            if len(fields) == 4 and '\t'.join(fields[0:3]) == ref_version:
+                settings.reference_md5 = fields[3]
+
+    if settings.reference_md5 == None:
+        myprint(f'NOTICE: computing the checksum of {ref_path}')
+        md5 = hashlib.md5()
+        with open(ref_path, 'rb') as ref_f:
+            for block in iter(lambda: ref_f.read(1<<20), b''):
+                md5.update(block)
+        settings.reference_md5 = md5.hexdigest()
+        md5_list_f = open(md5_list_file, 'a')
+        md5_list_f.write(f'{ref_version}\t{settings.reference_md5}\n')
+        md5_list_f.close()
+
+    for ref_dir in glob.glob(os.path.join(settings.index_cache_dir, '*', 'reference.path')):
+        ref_dir = os.path.split(ref_dir)[0]
+        if os.path.split(ref_dir)[1] != settings.reference_md5 and open(os.path.join(ref_dir, 'reference.path')).read().strip() == ref_path:
+            myprint(f'NOTICE: removing stale indexes of a previous version of {ref_path}: {ref_dir}')
+            shutil.rmtree(ref_dir, ignore_errors=True)
+
+    ref_dir = os.path.join(settings.index_cache_dir, settings.reference_md5)
+    os.makedirs(ref_dir, exist_ok=True)
+    ref_path_f = open(os.path.join(ref_dir, 'reference.path'), 'w')
+    ref_path_f.write(f'{ref_path}\n')
+    ref_path_f.close()
+
+    return
+
+def index_cache_entry(settings:Setting, tool_name, tool_path, index_arguments):
+
+    tool_stat = os.stat(tool_path)
+    key = hashlib.md5(f'{tool_name}\t{tool_stat.st_size}\t{tool_stat.st_mtime_ns}\t{index_arguments}'.encode()).hexdigest()[0:12]
+    return os.path.join(settings.index_cache_dir, settings.reference_md5, f'{tool_name}.{key}')
+
+def index_cache_build_cmd(entry_dir, build_cmd_list, index_arguments):
+
+    # the first run holding the lock builds the entry; other runs wait and reuse it.
+    # "complete" is written last, so an interrupted build is redone from scratch.
+    cmd  = f'mkdir -p {entry_dir}\n'
+    cmd += '(\n'
+    cmd += '    flock 9\n'
+    cmd += f'    if [ ! -e {entry_dir}/complete ]; then\n'
+    cmd += f'        rm -rf {entry_dir}/*\n'
+    for build_cmd in build_cmd_list:
+        cmd += f'        {build_cmd} || exit 1\n'
+    cmd += f"        echo '{index_arguments}' > {entry_dir}/complete\n"
+    cmd += '    fi\n'
+    cmd += f') 9> {entry_dir}.lock || exit 1\n\n'
+
+    return cmd
+
+def stage_shell_header(settings:Setting):
+
+    # the stage runner sets NEXTSV_THREADS to the number of cores it gives the stage
+    return f'#!/bin/bash\n\nthreads=${{NEXTSV_THREADS:-{settings.threads}}}\n\n'
+
+def release_fifos_function():
+
+    # Opening a FIFO read-write never blocks, which wakes up a process waiting to
+    # open the other end; the FIFO is then replaced by a directory, which a process
+    # that opens it later fails on instead of waiting for a peer that has died.
+    cmd  = 'release_fifos() {\n'
+    cmd += '    for fifo in "$@"; do\n'
+    cmd += '        : <> $fifo 2> /dev/null\n'
+    cmd += '        rm -rf $fifo\n'
+    cmd += '        mkdir -p $fifo\n'
+    cmd += '    done\n'
+    cmd += '}\n\n'
+
+    return cmd
+
+def job_control_functions(cleanup_cmd):
+
+    # The processes of a script linked by FIFOs run as background jobs, each in
+    # its own process group, and pipefail makes a job fail if any command of its
+    # pipeline does. A job that fails releases the FIFOs, so that no peer
+    # stays blocked in open(). wait_jobs waits for all jobs and, once one has
+    # failed, kills the others, so that none keeps running on partial input. On
+    # exit, the jobs still running are killed and cleanup_cmd is run.
+    cmd  = 'set -o pipefail\n\n'
+    cmd += release_fifos_function()
+    cmd += 'job_pids=""\n\n'
+    cmd += 'kill_jobs() {\n'
+    cmd += '    for pid in $job_pids; do\n'
+    cmd += '        kill -- -$pid 2> /dev/null\n'
+    cmd += '    done\n'
+    cmd += '}\n\n'
+    cmd += 'wait_jobs() {\n'
+    cmd += '    local pid running status=0\n'
+    cmd += '    while [ -n "$job_pids" ]; do\n'
+    cmd += '        running=""\n'
+    cmd += '        for pid in $job_pids; do\n'
+    cmd += '            if kill -0 $pid 2> /dev/null; then\n'
+    cmd += '                running="$running $pid"\n'
+    cmd += '            elif ! wait $pid; then\n'
+    cmd += '                status=1\n'
+    cmd += '            fi\n'
+    cmd += '        done\n'
+    cmd += '        job_pids=$running\n'
+    cmd += '        [ $status -eq 0 ] || kill_jobs\n'
+    cmd += '        [ -z "$job_pids" ] || sleep 1\n'
+    cmd += '    done\n'
+    cmd += '    return $status\n'
+    cmd += '}\n\n'
+    cmd += f"trap 'kill_jobs; {cleanup_cmd}' EXIT\n"
+    cmd += "trap 'exit 1' INT TERM\n\n"
+
+    return cmd
+
+def background_jobs(job_cmd_list, fifo_list):
+
+    # job control (set -m) puts each job in a process group that kill_jobs can kill
+    cmd = 'set -m\n'
+    for job_cmd in job_cmd_list:
+        cmd += f'({job_cmd} || {{ release_fifos {fifo_list}; exit 1; }}) &\n'
+        cmd += 'job_pids="$job_pids $!"\n'
+    cmd += 'set +m\n'
+
+    return cmd
+
+def streamed_alignment(settings:Setting):
+
+    # get_clean_reads.sh writes the clean reads into one FIFO per streamed aligner,
+    # so the streamed aligners run at the same time as it instead of after it
+    if settings.shared_input_aligners():
+        aligner_shell_file = settings.aligner_shell_file(combined_aligner_name)
+    else:
+        aligner_shell_file = settings.aligner_shell_file(settings.streamed_aligners()[0])
+    fifo_list = ' '.join([settings.clean_reads_fifo(aligner) for aligner in settings.streamed_aligners()])
+
+    # Each script runs its own processes as jobs; killing one of the two scripts
+    # makes its EXIT trap kill its jobs in turn.
+    cmd  = stage_shell_header(settings)
+    cmd += job_control_functions('rm -rf $aligner_fifos')
+    cmd += f'aligner_fifos="{fifo_list}"\n'
+    cmd += 'rm -rf $aligner_fifos\n'
+    cmd += 'mkfifo $aligner_fifos\n\n'
+    cmd += background_jobs([f'bash {settings.get_clean_reads_sh_file}', f'bash {aligner_shell_file}'], '$aligner_fifos') + '\n'
+    cmd += 'if ! wait_jobs; then\n'
+    cmd += '    echo "ERROR: streaming clean reads into the aligners failed" >&2\n'
+    cmd += '    exit 1\n'
+    cmd += 'fi\n'
+
+    sh_fp = open(settings.streamed_alignment_shell_file(), 'w')
+    sh_fp.write(cmd)
+    sh_fp.close()
+
+    return
+
+def stream_clean_input_files(settings:Setting):
+
+    # The FASTA conversion, the filtering, the QC and the aligners are linked by
+    # FIFOs and run concurrently, so no intermediate FASTQ is written and read
+    # back. The filtered reads are teed into the QC, the aligner FIFOs (created
+    # by the streamed alignment script) and, if they are kept, pigz. Every stage
+    # runs as a job that releases all FIFOs, including those of the aligners, if
+    # it fails.
+    cmd  = stage_shell_header(settings)
+
+    fake_fastq_dir = os.path.join(settings.clean_reads_dir, 'FA_to_FQ')
+    fake_fastq_list = []
+    for fa_file in settings.input_fasta_list:
+        fa_filename = os.path.split(fa_file)[1]
+        fake_fastq_list.append(os.path.join(fake_fastq_dir, f'{fa_filename}.converted.fastq'))
+
+    input_fastq_list_file = os.path.join(settings.clean_reads_dir, 'raw_input_fastq.list')
+    input_fastq_list_f    = open(input_fastq_list_file, 'w')
+    for fastq in settings.input_fastq_list + fake_fastq_list:
+        input_fastq_list_f.write(f'{fastq}\n')
+    input_fastq_list_f.close()
+
+    clean_fastq = settings.clean_input_prefix() + '.clean.fastq' # written by filterfq
+    qc_fifo     = f'{clean_fastq}.fifo.qc'
+    pigz_fifo   = f'{clean_fastq}.fifo.pigz'
+    settings.clean_input_fastq = clean_fastq + '.gz'
+
+    fifo_list = fake_fastq_list + [clean_fastq, qc_fifo]
+    tee_output_list = [qc_fifo] + [settings.clean_reads_fifo(aligner) for aligner in settings.streamed_aligners()]
+    if settings.keep_clean_reads:
+        fifo_list.append(pigz_fifo)
+        tee_output_list.append(pigz_fifo)
+    aligner_fifo_list = [settings.clean_reads_fifo(aligner) for aligner in settings.streamed_aligners()]
+
+    cmd += job_control_functions(f'rm -rf $fifos {fake_fastq_dir}')
+    cmd += f'fifos="{" ".join(fifo_list)}"\n'
+    cmd += f'aligner_fifos="{" ".join(aligner_fifo_list)}"\n'
+    cmd += f'rm -rf {fake_fastq_dir} {clean_fastq}*\n'
+    if len(fake_fastq_list) > 0:
+        cmd += f'mkdir -p {fake_fastq_dir}\n'
+    cmd += 'mkfifo $fifos\n\n'
+
+    cmd += 'stream_threads=$(( threads / 4 ))\n'
+    cmd += '[ $stream_threads -ge 1 ] || stream_threads=1\n\n'
+    job_cmd_list = []
+    # convert fasta to fastq as NGMLR has bugs for input fasta files
+    for fa_file, fake_fastq in zip(settings.input_fasta_list, fake_fastq_list):
+        job_cmd_list.append(f'{settings.seqtk} seq -F . -o {fake_fastq} {fa_file}')
+    job_cmd_list.append(f'{settings.longreadqc} filterfq --input_list_file {input_fastq_list_file} -p {settings.clean_input_prefix()} -n 1')
+    job_cmd_list.append(f'tee {" ".join(tee_output_list)} < {clean_fastq} > /dev/null')
+    job_cmd_list.append(f'{settings.longreadqc} fq -i {qc_fifo} -d {settings.clean_reads_dir} -p {settings.sample_name}')
+    if settings.keep_clean_reads:
+        job_cmd_list.append(f'{settings.pigz} -X --processes $stream_threads -c < {pigz_fifo} > {settings.clean_input_fastq}')
+    cmd += background_jobs(job_cmd_list, '$fifos $aligner_fifos') + '\n'
+
+    cmd += 'if ! wait_jobs; then\n'
+    cmd += '    echo "ERROR: getting clean reads failed" >&2\n'
+    cmd += '    exit 1\n'
+    cmd += 'fi\n'
+
+    get_clean_reads_sh_f = open(settings.get_clean_reads_sh_file, 'w')
+    get_clean_reads_sh_f.write(cmd)
+    get_clean_reads_sh_f.close()
+
+    return
+
 def clean_input_files(settings:Setting):
 
     settings.get_clean_reads_sh_file = os.path.join(settings.clean_reads_dir, 'get_clean_reads.sh')
-    cmd  = '#!/bin/bash\n\n'
+    if settings.streamed_aligners():
+        stream_clean_input_files(settings)
+        return
+
+    cmd  = stage_shell_header(settings)
 
     fake_fastq_list = []
     fake_fastq_dir = None
@@ -313,7 +697,7 @@ def clean_input_files(settings:Setting):
         for fa_file in settings.input_fasta_list:
             fa_filename = os.path.split(fa_file)[1]
             fake_fastq = os.path.join(fake_fastq_dir, f'{fa_filename}.converted.fastq.gz')
-            cmd += f'{settings.seqtk} seq -F . {fa_file} | {settings.pigz} - > {fake_fastq}\n\n'
+            cmd += f'{settings.seqtk} seq -t $threads -z -F . -o {fake_fastq} {fa_file}\n\n'
             fake_fastq_list.append(fake_fastq)
 
     # clean FASTQ
@@ -330,7 +714,8 @@ def clean_input_files(settings:Setting):
     cmd += f'rm -f {settings.clean_input_fastq}*\n\n'
 
     cmd += f'{settings.longreadqc} filterfq --input_list_file {input_fastq_list_file} -p {settings.clean_input_prefix()} -n 1 \n\n'
-    cmd += f'{settings.pigz} --processes {settings.threads} {settings.clean_input_fastq}\n\n'
+    # -X appends a block index, so that the clean reads are decompressed in parallel by pigz -dc
+    cmd += f'{settings.pigz} -X --processes $threads {settings.clean_input_fastq}\n\n'
     cmd += f'{settings.longreadqc} fq -i {settings.clean_input_fastq}.gz -d {settings.clean_reads_dir} -p {settings.sample_name}\n\n'
     
     if fake_fastq_dir:
@@ -344,13 +729,7 @@ def clean_input_files(settings:Setting):
 
     return
 
-def cuteSV_detection(settings:Setting, aligner_name):
-
-    svcaller_name = 'cuteSV'
-    sv_detection_shell_file = settings.sv_detection_shell_file(aligner_name, svcaller_name)
-    input_bam = settings.sorted_bam_file(aligner_name)
-    out_vcf = settings.sv_vcf_file(aligner_name, svcaller_name)
-    cuteSV_workdir = os.path.join(settings.sv_calls_dir, 'cuteSV_temp')
+def cuteSV_cmd(settings:Setting, input_bam, out_vcf, cuteSV_workdir):
 
     if settings.platform == 'ont':
         platform_arguments = ' --max_cluster_bias_INS 100  --diff_ratio_merging_INS 0.3 --max_cluster_bias_DEL 100  --diff_ratio_merging_DEL 0.3 '
@@ -362,11 +741,23 @@ def cuteSV_detection(settings:Setting, aligner_name):
         myprint(f'ERROR: unknown platform: {settings.platform}')
         sys.exit(1)
 
-    cmd  = '#!/bin/bash\n\n'
-    cmd += f'mkdir -p {cuteSV_workdir} \n'
-    cmd += f'{settings.cuteSV} {platform_arguments} --report_readid --genotype --min_support 5 --threads {settings.threads} --sample {settings.sample_name} {input_bam} {settings.ref_fasta} {out_vcf} {cuteSV_workdir} \n'
+    cmd  = f'mkdir -p {cuteSV_workdir} \n'
+    cmd += f'{settings.cuteSV} {platform_arguments} --report_readid --genotype --min_support 5 --threads $threads --sample {settings.sample_name} {input_bam} {settings.ref_fasta} {out_vcf} {cuteSV_workdir} \n'
     cmd += f'rm -r {cuteSV_workdir} \n'
 
+    return cmd
+
+def cuteSV_detection(settings:Setting, aligner_name):
+
+    svcaller_name = 'cuteSV'
+    sv_detection_shell_file = settings.sv_detection_shell_file(aligner_name, svcaller_name)
+    input_bam = settings.sorted_bam_file(aligner_name)
+    out_vcf = settings.sv_vcf_file(aligner_name, svcaller_name)
+    cuteSV_workdir = os.path.join(settings.sv_calls_dir, f'cuteSV_temp.{aligner_name}') # callers of different aligners may run at the same time
+
+    cmd  = stage_shell_header(settings)
+    cmd += cuteSV_cmd(settings, input_bam, out_vcf, cuteSV_workdir)
+
     sh_fp = open(sv_detection_shell_file, 'w')
     sh_fp.write(cmd)
     sh_fp.close()
@@ -378,8 +769,8 @@ def sniffles_detection(settings:Setting, aligner_name):
     input_bam = settings.sorted_bam_file(aligner_name)
     out_vcf = settings.sv_vcf_file(aligner_name, svcaller_name)
 
-    cmd  = '#!/bin/bash\n\n'
-    cmd += f'{settings.sniffles} --output-rnames --allow-overwrite --input {input_bam} --vcf {out_vcf} --reference {settings.ref_fasta} --threads {settings.threads} \n'
+    cmd  = stage_shell_header(settings)
+    cmd += sniffles_cmd(settings, input_bam, out_vcf)
 
     sh_fp = open(sv_detection_shell_file, 'w')
     sh_fp.write(cmd)
@@ -387,8 +778,53 @@ def sniffles_detection(settings:Setting, aligner_name):
 
     return
 
-def ngmlr_align_for1input(settings:Setting, input_file, aligned_sam_file, sorted_bam_file):
-    
+def sniffles_cmd(settings:Setting, input_bam, out_vcf):
+
+    return f'{settings.sniffles} --output-rnames --allow-overwrite --input {input_bam} --vcf {out_vcf} --reference {settings.ref_fasta} --threads $threads \n'
+
+def sv_scatter_gather_detection(settings:Setting, aligner_name):
+
+    # The genome is cut into settings.sv_shards regions with about the same
+    # number of mapped reads (from the BAM index). Each shard stage extracts the
+    # alignments overlapping its region plus sv_shard_padding on either side and
+    # runs both callers on them; the gather stage of each caller keeps the calls
+    # that start in the region of the shard reporting them and, for breakends
+    # whose two ends are in different shards, one copy of each pair.
+    input_bam = settings.sorted_bam_file(aligner_name)
+    shard_dir = settings.sv_shard_dir(aligner_name)
+
+    cmd  = stage_shell_header(settings)
+    cmd += f'rm -rf {shard_dir}\n'
+    cmd += f'mkdir -p {shard_dir}\n'
+    cmd += f'{settings.sv_scatter_gather} scatter {input_bam} {settings.samtools} {settings.sv_shards} {sv_shard_padding} {shard_dir}/shard\n'
+    sh_fp = open(settings.sv_scatter_shell_file(aligner_name), 'w')
+    sh_fp.write(cmd)
+    sh_fp.close()
+
+    for shard_idx in range(0, settings.sv_shards):
+        shard_prefix = settings.sv_shard_prefix(aligner_name, shard_idx)
+        cmd  = stage_shell_header(settings)
+        cmd += 'set -e\n\n'
+        cmd += f'{settings.samtools} view -@ $threads -b -M -L {shard_prefix}.padded.bed -o {shard_prefix}.bam {input_bam}\n'
+        cmd += f'{settings.samtools} index -@ $threads {shard_prefix}.bam\n\n'
+        cmd += sniffles_cmd(settings, f'{shard_prefix}.bam', f'{shard_prefix}.sniffles.vcf') + '\n'
+        cmd += cuteSV_cmd(settings, f'{shard_prefix}.bam', f'{shard_prefix}.cuteSV.vcf', f'{shard_prefix}.cuteSV_temp') + '\n'
+        cmd += f'rm -f {shard_prefix}.bam {shard_prefix}.bam.bai\n'
+        sh_fp = open(settings.sv_shard_shell_file(aligner_name, shard_idx), 'w')
+        sh_fp.write(cmd)
+        sh_fp.close()
+
+    for svcaller_name in ['sniffles', 'cuteSV']:
+        cmd  = stage_shell_header(settings)
+        cmd += f'{settings.sv_scatter_gather} gather {settings.sv_shards} {shard_dir}/shard {svcaller_name} {settings.sv_vcf_file(aligner_name, svcaller_name)}\n'
+        sh_fp = open(settings.sv_gather_shell_file(aligner_name, svcaller_name), 'w')
+        sh_fp.write(cmd)
+        sh_fp.close()
+
+    return
+
+def ngmlr_platform_arguments(settings:Setting):
+
     if settings.platform == 'ont':
         platform_arguments = ' -x ont '
     elif settings.platform == 'hifi' or 'cls':
@@ -396,10 +832,43 @@ def ngmlr_align_for1input(settings:Setting, input_file, aligned_sam_file, sorted
     else:
         myprint(f'ERROR: unknown platform: {settings.platform}')
         sys.exit(1)
+
+    return platform_arguments
+
+def ngmlr_index_entry(settings:Setting):
+
+    return index_cache_entry(settings, 'ngmlr', settings.ngmlr, ngmlr_platform_arguments(settings).strip())
+
+def ngmlr_reference(settings:Setting):
+
+    # ngmlr writes its .ngm tables next to the reference, so the cached entry holds a link to the FASTA
+    if settings.index_cache_dir == '':
+        return settings.ref_fasta
+    return os.path.join(ngmlr_index_entry(settings), os.path.split(settings.ref_fasta)[1])
+
+def ngmlr_index_cmd(settings:Setting):
+
+    if settings.index_cache_dir == '':
+        return ''
+
+    entry_dir = ngmlr_index_entry(settings)
+    reference = ngmlr_reference(settings)
+    index_build_fastq = os.path.join(entry_dir, 'index_build.fastq')
+    build_cmd_list = [
+        f'ln -s {os.path.realpath(settings.ref_fasta)} {reference}',
+        f"printf '@nextsv_index_build\\n{'ACGT' * 50}\\n+\\n{'I' * 200}\\n' > {index_build_fastq}",
+        f'{settings.ngmlr} -t $threads -r {reference} -q {index_build_fastq} {ngmlr_platform_arguments(settings)} -o /dev/null',
+    ]
+
+    return index_cache_build_cmd(entry_dir, build_cmd_list, ngmlr_platform_arguments(settings).strip())
+
+def ngmlr_align_for1input(settings:Setting, input_file, aligned_sam_file, sorted_bam_file):
+    
+    platform_arguments = ngmlr_platform_arguments(settings)
         
-    cmd = f'{settings.ngmlr} -t {settings.threads} -r {settings.ref_fasta} -q {input_file} {platform_arguments} -o {aligned_sam_file}\n\n'
-    cmd += f'{settings.samtools} sort -@ {settings.threads} -o {sorted_bam_file} {aligned_sam_file}\n\n'
-    cmd += f'{settings.samtools} index -@ {settings.threads} {sorted_bam_file}\n\n'
+    cmd = f'{settings.ngmlr} -t $threads -r {ngmlr_reference(settings)} -q {input_file} {platform_arguments} -o {aligned_sam_file}\n\n'
+    cmd += f'{settings.samtools} sort -@ $threads -o {sorted_bam_file} {aligned_sam_file}\n\n'
+    cmd += f'{settings.samtools} index -@ $threads {sorted_bam_file}\n\n'
     cmd += f'{settings.check_bam_and_remove_file} {sorted_bam_file} {aligned_sam_file} {settings.samtools}\n\n'
     
     return cmd
@@ -411,8 +880,8 @@ def ngmlr_align(settings:Setting):
     sorted_bam_file    = settings.sorted_bam_file(aligner_name)
     aligner_shell_file = settings.aligner_shell_file(aligner_name)
         
-    cmd = '#!/bin/bash\n\n'
-    
+    cmd = stage_shell_header(settings)
+    cmd += ngmlr_index_cmd(settings)
     cmd += ngmlr_align_for1input(settings, settings.clean_input_fastq, aligned_sam_file, sorted_bam_file)
 
     sh_fp = open(aligner_shell_file, 'w')
@@ -422,12 +891,7 @@ def ngmlr_align(settings:Setting):
     return
 
 
-def minimap2_align(settings:Setting):
-
-    aligner_name = 'minimap2'
-    aligned_bam_file   = settings.aligned_bam_file(aligner_name)
-    sorted_bam_file    = settings.sorted_bam_file(aligner_name)
-    aligner_shell_file = settings.aligner_shell_file(aligner_name)
+def minimap2_platform_arguments(settings:Setting):
 
     if settings.platform == 'ont':
         platform_arguments = '-x map-ont'
@@ -438,12 +902,56 @@ def minimap2_align(settings:Setting):
     else:
         myprint(f'ERROR: unknown platform: {settings.platform}')
         sys.exit(1)
-    
-    cmd = '#!/bin/bash\n\n'
-    cmd += f'{settings.minimap2} --MD -t {settings.threads} -a {platform_arguments} -N 10 {settings.ref_fasta} {settings.clean_input_fastq} | {settings.samtools} view -@ 2 -bS - > {aligned_bam_file}\n\n'
-    cmd += f'{settings.samtools} sort -@ {settings.threads} -o {sorted_bam_file} {aligned_bam_file}\n\n'
-    cmd += f'{settings.samtools} index -@ {settings.threads} {sorted_bam_file} \n\n'
-    cmd += f'{settings.check_bam_and_remove_file} {sorted_bam_file} {aligned_bam_file} {settings.samtools}\n\n'
+
+    return platform_arguments
+
+def minimap2_index(settings:Setting):
+
+    if settings.index_cache_dir == '':
+        return settings.ref_fasta
+    return os.path.join(index_cache_entry(settings, 'minimap2', settings.minimap2, minimap2_platform_arguments(settings)), 'ref.mmi')
+
+def minimap2_index_cmd(settings:Setting):
+
+    if settings.index_cache_dir == '':
+        return ''
+
+    platform_arguments = minimap2_platform_arguments(settings)
+    entry_dir = index_cache_entry(settings, 'minimap2', settings.minimap2, platform_arguments)
+    build_cmd_list = [f'{settings.minimap2} -t $threads {platform_arguments} -d {minimap2_index(settings)} {settings.ref_fasta}']
+
+    return index_cache_build_cmd(entry_dir, build_cmd_list, platform_arguments)
+
+def index_socket_arguments(settings:Setting, aligner_name):
+
+    # the aligner loads the index itself if no server with the same target is listening
+    if settings.index_socket_dir == '':
+        return ''
+    return f' --idx-socket {os.path.join(settings.index_socket_dir, aligner_name + ".sock")}'
+
+def minimap2_align_cmd(settings:Setting, input_fastq, threads):
+
+    aligner_name = 'minimap2'
+    sorted_bam_file = settings.sorted_bam_file(aligner_name)
+    platform_arguments = minimap2_platform_arguments(settings)
+
+    # the bundled minimap2 sorts, compresses and indexes the alignments itself
+    return f'{settings.minimap2} --MD -t {threads} -a {platform_arguments}{index_socket_arguments(settings, aligner_name)} -N 10 --sort-bam -o {sorted_bam_file} {minimap2_index(settings)} {input_fastq}'
+
+def aligner_input_fastq(settings:Setting, aligner_name):
+
+    if aligner_name in settings.streamed_aligners():
+        return settings.clean_reads_fifo(aligner_name)
+    return settings.clean_input_fastq
+
+def minimap2_align(settings:Setting):
+
+    aligner_name = 'minimap2'
+    aligner_shell_file = settings.aligner_shell_file(aligner_name)
+
+    cmd = stage_shell_header(settings)
+    cmd += minimap2_index_cmd(settings)
+    cmd += minimap2_align_cmd(settings, aligner_input_fastq(settings, aligner_name), '$threads') + '\n\n'
 
     sh_fp = open(aligner_shell_file, 'w')
     sh_fp.write(cmd)
@@ -451,12 +959,56 @@ def minimap2_align(settings:Setting):
 
     return
 
-def winnowmap_align(settings:Setting):
+def winnowmap_index_entry(settings:Setting):
+
+    return index_cache_entry(settings, 'meryl', settings.meryl, 'k=15 distinct=0.9998 kmb one-pass')
+
+def winnowmap_repetitive_k15_file(settings:Setting):
+
+    # the meryl repetitive k-mer list for winnowmap -W: in the index cache if there is one,
+    # otherwise next to the reference FASTA
+    if settings.index_cache_dir != '':
+        return os.path.join(winnowmap_index_entry(settings), 'repetitive_k15.kmb')
+    ref_dir, ref_name = os.path.split(settings.ref_fasta)
+    return os.path.join(ref_dir, ref_name + '.repetitive_k15.kmb')
+
+def winnowmap_prepare_cmd(settings:Setting):
+
+    # winnowmap cannot save its index (-d is disabled); with a cache, the meryl
+    # repetitive k-mer list, which takes most of the preparation time, is cached instead;
+    # meryl counts in memory and exports the list in one pass, without a merylDB, as a
+    # sorted binary list that winnowmap -W loads without parsing
+    if settings.index_cache_dir != '':
+        entry_dir = winnowmap_index_entry(settings)
+        build_cmd_list = [
+            f'{settings.meryl} count k=15 distinct=0.9998 export {entry_dir}/repetitive_k15.kmb {settings.ref_fasta}',
+        ]
+        return index_cache_build_cmd(entry_dir, build_cmd_list, 'k=15 distinct=0.9998 kmb one-pass')
+
+    ref_dir             = os.path.split(settings.ref_fasta)[0]
+    repetitive_k15_file = winnowmap_repetitive_k15_file(settings)
     
+    repetitive_k15_file_is_valid = False
+    if os.path.exists(repetitive_k15_file) and os.path.getsize(repetitive_k15_file) > 0:
+        repetitive_k15_file_is_valid = True
+        
+    if repetitive_k15_file_is_valid == False and os.access(ref_dir, os.W_OK) == False:
+        myprint(f'ERROR! Failed to create the meryl repetitive k-mer list, which is needed by winnowmap alignment. Please make sure you have written permission in the reference FASTA folder: \n{ref_dir}\nIf you are unable to get written permission in this folder, you can create a new reference FASTA folder in your own space, soft link the FASTA files inside the new folder, and supply NextSV with the path to the new FASTA folder.')
+        sys.exit(1)
+    
+    # the list is exported to a temporary file and renamed, so an interrupted meryl
+    # run doesn't leave a partial list that the next run takes as valid
+    cmd = ''
+    if repetitive_k15_file_is_valid == False:
+        cmd += f'{settings.meryl} count k=15 distinct=0.9998 export {repetitive_k15_file}.tmp {settings.ref_fasta} || exit 1\n'
+        cmd += f'mv -f {repetitive_k15_file}.tmp {repetitive_k15_file} || exit 1\n\n'
+
+    return cmd
+
+def winnowmap_align_cmd(settings:Setting, input_fastq, threads):
+
     aligner_name = 'winnowmap'
-    aligned_bam_file   = settings.aligned_bam_file(aligner_name)
-    sorted_bam_file    = settings.sorted_bam_file(aligner_name)
-    aligner_shell_file = settings.aligner_shell_file(aligner_name)
+    aligned_bam_file = settings.aligned_bam_file(aligner_name)
 
     if settings.platform == 'ont':
         platform_arguments = '-x map-ont'
@@ -467,29 +1019,77 @@ def winnowmap_align(settings:Setting):
     else:
         myprint(f'ERROR: unknown platform: {settings.platform}')
         sys.exit(1)
-    
-    ref_dir             = os.path.split(settings.ref_fasta)[0]
-    merylDB_dir         = os.path.join(settings.ref_fasta, '.merylDB') 
-    repetitive_k15_file = os.path.join(settings.ref_fasta, '.repetitive_k15.txt')
-    
-    repetitive_k15_file_is_valid = False
-    if os.path.exists(repetitive_k15_file) and os.path.getsize(repetitive_k15_file) > 0:
-        repetitive_k15_file_is_valid = True
-        
-    if repetitive_k15_file_is_valid == False and os.access(ref_dir, os.W_OK) == False:
-        myprint(f'ERROR! Failed to create a folder for storing meryl output, which is needed by winnowmap alignment. Please make sure you have written permission in the reference FASTA folder: \n{ref_dir}\nIf you are unable to get written permission in this folder, you can create a new reference FASTA folder in your own space, soft link the FASTA files inside the new folder, and supply NextSV with the path to the new FASTA folder.')
-        sys.exit(1)
-    
-    cmd = '#!/bin/bash\n\n'
-    if repetitive_k15_file_is_valid == False:
-        cmd += f'{settings.meryl} count k=15 output {merylDB_dir} {settings.ref_fasta}\n\n'
-        cmd += f'{settings.meryl} print greater-than distinct=0.9998 {merylDB_dir} > {repetitive_k15_file}\n\n'
-    
-    cmd += f'{settings.winnowmap} --MD -t {settings.threads} -a {platform_arguments} {settings.ref_fasta} {settings.clean_input_fastq} | {settings.samtools} view -@ 2 -bS - > {aligned_bam_file}\n\n'
-    cmd += f'{settings.samtools} sort -@ {settings.threads} -o {sorted_bam_file} {aligned_bam_file}\n\n'
-    cmd += f'{settings.samtools} index -@ {settings.threads} {sorted_bam_file} \n\n'
+
+    platform_arguments += f' -W {winnowmap_repetitive_k15_file(settings)}'
+
+    return f'{settings.winnowmap} --MD -t {threads} -a {platform_arguments}{index_socket_arguments(settings, aligner_name)} {settings.ref_fasta} {input_fastq} | {settings.samtools} view -@ 2 -bS - > {aligned_bam_file}'
+
+def winnowmap_sort_cmd(settings:Setting):
+
+    aligner_name = 'winnowmap'
+    aligned_bam_file = settings.aligned_bam_file(aligner_name)
+    sorted_bam_file  = settings.sorted_bam_file(aligner_name)
+
+    cmd  = f'{settings.samtools} sort -@ $threads -o {sorted_bam_file} {aligned_bam_file}\n\n'
+    cmd += f'{settings.samtools} index -@ $threads {sorted_bam_file} \n\n'
     cmd += f'{settings.check_bam_and_remove_file} {sorted_bam_file} {aligned_bam_file} {settings.samtools}\n\n'
 
+    return cmd
+
+def winnowmap_align(settings:Setting):
+    
+    aligner_name = 'winnowmap'
+    aligner_shell_file = settings.aligner_shell_file(aligner_name)
+
+    cmd = stage_shell_header(settings)
+    cmd += winnowmap_prepare_cmd(settings)
+    cmd += winnowmap_align_cmd(settings, aligner_input_fastq(settings, aligner_name), '$threads') + '\n\n'
+    cmd += winnowmap_sort_cmd(settings)
+
+    sh_fp = open(aligner_shell_file, 'w')
+    sh_fp.write(cmd)
+    sh_fp.close()
+
+    return
+
+def minimap2_winnowmap_align(settings:Setting):
+
+    # With both minimap2 and winnowmap, the clean reads are decompressed once and
+    # teed into one FIFO per aligner; the two aligners build their indexes and map
+    # concurrently, each writing its own BAM. Both read their query file in a
+    # single pass (the index of each fits in one part), so a FIFO can replace it.
+    # With --stream_reads, get_clean_reads.sh feeds the FIFOs directly.
+    aligner_name = combined_aligner_name
+    aligner_shell_file = settings.aligner_shell_file(aligner_name)
+    minimap2_fifo  = settings.clean_reads_fifo('minimap2')
+    winnowmap_fifo = settings.clean_reads_fifo('winnowmap')
+    is_streamed = len(settings.streamed_aligners()) > 0
+
+    cmd = stage_shell_header(settings)
+    # minimap2 is usually the faster of the two; the slower one paces the shared input
+    cmd += 'minimap2_threads=$(( threads / 3 ))\n'
+    cmd += '[ $minimap2_threads -ge 1 ] || minimap2_threads=1\n'
+    cmd += 'winnowmap_threads=$(( threads - minimap2_threads ))\n'
+    cmd += '[ $winnowmap_threads -ge 1 ] || winnowmap_threads=1\n\n'
+    cmd += minimap2_index_cmd(settings)
+    cmd += winnowmap_prepare_cmd(settings)
+    # with --stream_reads, the FIFOs belong to the streamed alignment script
+    cmd += job_control_functions(':' if is_streamed else 'rm -rf $fifos')
+    cmd += f'fifos="{minimap2_fifo} {winnowmap_fifo}"\n'
+    job_cmd_list = []
+    if not is_streamed:
+        cmd += 'rm -rf $fifos\n'
+        cmd += 'mkfifo $fifos\n'
+        job_cmd_list.append(f'{settings.pigz} -dc {settings.clean_input_fastq} | tee {minimap2_fifo} > {winnowmap_fifo}')
+    job_cmd_list.append(minimap2_align_cmd(settings, minimap2_fifo, '$minimap2_threads'))
+    job_cmd_list.append(winnowmap_align_cmd(settings, winnowmap_fifo, '$winnowmap_threads'))
+    cmd += '\n' + background_jobs(job_cmd_list, '$fifos') + '\n'
+    cmd += 'if ! wait_jobs; then\n'
+    cmd += '    echo "ERROR: minimap2/winnowmap alignment failed" >&2\n'
+    cmd += '    exit 1\n'
+    cmd += 'fi\n\n'
+    cmd += winnowmap_sort_cmd(settings)
+
     sh_fp = open(aligner_shell_file, 'w')
     sh_fp.write(cmd)
     sh_fp.close()
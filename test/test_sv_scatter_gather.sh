@@ -0,0 +1,19 @@
+#!/bin/bash
+
+# gather of two shards whose caller IDs collide: breakend pairs within a shard
+# are renamed together, and a pair across the shards is kept once
+
+NAME="sv_scatter_gather.py gather"
+DIR=$(cd $(dirname $0) && pwd)
+DATA=$DIR/data/sv_scatter_gather
+
+echo "Test: $NAME"
+
+python3 $DIR/../bin/sv_scatter_gather.py gather 2 $DATA/shard sniffles $DATA/found.vcf 2> /dev/null || exit 1
+
+diff $DATA/expected.vcf $DATA/found.vcf > /dev/null
+ret=$?
+rm $DATA/found.vcf
+[ $ret -eq 0 ] && echo "Success"
+
+exit $ret